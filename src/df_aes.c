@@ -0,0 +1,546 @@
+/*
+ * df_aes.c
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <wmmintrin.h>
+#define HAVE_AESNI 1
+#endif
+
+#include <sim_avr.h>
+#include <sim_interrupts.h>
+#include <sim_io.h>
+#include <sim_regbit.h>
+
+#include "df_aes.h"
+#include "df_board.h"
+#include "df_clock.h"
+#include "df_log.h"
+
+/* Engine registers, as data addresses */
+#define AES_CTRL 0x13C
+#define AES_STATUS 0x13D
+#define AES_STATE 0x13E
+#define AES_KEY 0x13F
+
+/* AES_CTRL */
+#define AES_IM 2
+#define AES_DIR 3
+#define AES_MODE 5
+#define AES_REQUEST 7
+
+/* AES_STATUS */
+#define AES_DONE 0
+#define AES_ER 7
+
+/* AES_READY_vect */
+#define AES_VECTOR 70
+
+/* How long a block takes on the real thing */
+#define AES_BLOCK_USEC 24
+
+#define AES_ROUNDS 10
+
+typedef void (*aes_block_fn)(const uint8_t rk[AES_ROUNDS + 1][16],
+        const uint8_t in[16], uint8_t out[16]);
+
+struct df_aes {
+    /* First, so simavr's reset and dealloc hand us back to ourselves */
+    avr_io_t io;
+    avr_t *avr;
+    struct df_clock *clk;
+    avr_int_vector_t vec;
+    struct df_clock_event done_ev;
+
+    uint8_t key[16];
+    uint8_t state[16];
+    uint8_t result[16];
+    unsigned int key_pos;
+    unsigned int state_pos;
+
+    /* What AES_KEY reads back, the last round key of the last
+     * encryption which firmware needs to decrypt.
+     */
+    uint8_t last_rk[16];
+
+    aes_block_fn encrypt;
+    aes_block_fn decrypt;
+};
+
+static const uint8_t aes_sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5,
+    0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0,
+    0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc,
+    0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a,
+    0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0,
+    0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b,
+    0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85,
+    0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5,
+    0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17,
+    0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88,
+    0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c,
+    0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9,
+    0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6,
+    0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e,
+    0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94,
+    0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68,
+    0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+/* Filled in from aes_sbox */
+static uint8_t aes_inv_sbox[256];
+
+static const uint8_t aes_rcon[AES_ROUNDS] = {
+    0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36,
+};
+
+static uint8_t
+aes_xtime(uint8_t x)
+{
+    return (x << 1) ^ (x & 0x80 ? 0x1b : 0);
+}
+
+static uint8_t
+aes_mul(uint8_t x, uint8_t y)
+{
+    uint8_t r = 0;
+
+    while (y) {
+        if (y & 1)
+            r ^= x;
+        x = aes_xtime(x);
+        y >>= 1;
+    }
+
+    return r;
+}
+
+static void
+aes_expand(const uint8_t key[16], uint8_t rk[AES_ROUNDS + 1][16])
+{
+    uint8_t t[4];
+    int r;
+    int i;
+
+    memcpy(rk[0], key, 16);
+
+    for (r = 1; r <= AES_ROUNDS; r++) {
+        t[0] = aes_sbox[rk[r - 1][13]] ^ aes_rcon[r - 1];
+        t[1] = aes_sbox[rk[r - 1][14]];
+        t[2] = aes_sbox[rk[r - 1][15]];
+        t[3] = aes_sbox[rk[r - 1][12]];
+
+        for (i = 0; i < 16; i++) {
+            rk[r][i] = rk[r - 1][i] ^ t[i & 3];
+            t[i & 3] = rk[r][i];
+        }
+    }
+}
+
+/* Runs the key schedule backwards from the last round key, which is
+ * what firmware hands the engine to decrypt with.
+ */
+static void
+aes_unexpand(const uint8_t last[16], uint8_t key[16])
+{
+    uint8_t w[16];
+    uint8_t prev[16];
+    int r;
+    int i;
+
+    memcpy(w, last, 16);
+
+    for (r = AES_ROUNDS; r > 0; r--) {
+        for (i = 15; i >= 4; i--)
+            prev[i] = w[i] ^ w[i - 4];
+
+        prev[0] = w[0] ^ aes_sbox[prev[13]] ^ aes_rcon[r - 1];
+        prev[1] = w[1] ^ aes_sbox[prev[14]];
+        prev[2] = w[2] ^ aes_sbox[prev[15]];
+        prev[3] = w[3] ^ aes_sbox[prev[12]];
+
+        memcpy(w, prev, 16);
+    }
+
+    memcpy(key, w, 16);
+}
+
+static void
+aes_add_round_key(uint8_t s[16], const uint8_t rk[16])
+{
+    int i;
+
+    for (i = 0; i < 16; i++)
+        s[i] ^= rk[i];
+}
+
+static void
+aes_sw_encrypt(const uint8_t rk[AES_ROUNDS + 1][16], const uint8_t in[16],
+        uint8_t out[16])
+{
+    uint8_t s[16];
+    uint8_t t[16];
+    uint8_t a, b, c, d;
+    int r;
+    int i;
+
+    memcpy(s, in, 16);
+    aes_add_round_key(s, rk[0]);
+
+    for (r = 1; r <= AES_ROUNDS; r++) {
+        /* SubBytes and ShiftRows */
+        for (i = 0; i < 16; i++)
+            t[i] = aes_sbox[s[(i + 4 * (i & 3)) & 15]];
+
+        /* MixColumns, except in the last round */
+        if (r != AES_ROUNDS) {
+            for (i = 0; i < 16; i += 4) {
+                a = t[i];
+                b = t[i + 1];
+                c = t[i + 2];
+                d = t[i + 3];
+                t[i] = aes_xtime(a ^ b) ^ b ^ c ^ d;
+                t[i + 1] = aes_xtime(b ^ c) ^ a ^ c ^ d;
+                t[i + 2] = aes_xtime(c ^ d) ^ a ^ b ^ d;
+                t[i + 3] = aes_xtime(d ^ a) ^ a ^ b ^ c;
+            }
+        }
+
+        memcpy(s, t, 16);
+        aes_add_round_key(s, rk[r]);
+    }
+
+    memcpy(out, s, 16);
+}
+
+static void
+aes_sw_decrypt(const uint8_t rk[AES_ROUNDS + 1][16], const uint8_t in[16],
+        uint8_t out[16])
+{
+    uint8_t s[16];
+    uint8_t t[16];
+    uint8_t a, b, c, d;
+    int r;
+    int i;
+
+    memcpy(s, in, 16);
+    aes_add_round_key(s, rk[AES_ROUNDS]);
+
+    for (r = AES_ROUNDS - 1; r >= 0; r--) {
+        /* InvShiftRows and InvSubBytes */
+        for (i = 0; i < 16; i++)
+            t[(i + 4 * (i & 3)) & 15] = aes_inv_sbox[s[i]];
+
+        aes_add_round_key(t, rk[r]);
+
+        /* InvMixColumns, except after the last round */
+        if (r) {
+            for (i = 0; i < 16; i += 4) {
+                a = t[i];
+                b = t[i + 1];
+                c = t[i + 2];
+                d = t[i + 3];
+                t[i] = aes_mul(a, 14) ^ aes_mul(b, 11) ^ aes_mul(c, 13) ^
+                    aes_mul(d, 9);
+                t[i + 1] = aes_mul(a, 9) ^ aes_mul(b, 14) ^ aes_mul(c, 11) ^
+                    aes_mul(d, 13);
+                t[i + 2] = aes_mul(a, 13) ^ aes_mul(b, 9) ^ aes_mul(c, 14) ^
+                    aes_mul(d, 11);
+                t[i + 3] = aes_mul(a, 11) ^ aes_mul(b, 13) ^ aes_mul(c, 9) ^
+                    aes_mul(d, 14);
+            }
+        }
+
+        memcpy(s, t, 16);
+    }
+
+    memcpy(out, s, 16);
+}
+
+#ifdef HAVE_AESNI
+__attribute__((target("aes,sse2")))
+static void
+aes_ni_encrypt(const uint8_t rk[AES_ROUNDS + 1][16], const uint8_t in[16],
+        uint8_t out[16])
+{
+    __m128i s;
+    int r;
+
+    s = _mm_loadu_si128((const __m128i *)in);
+    s = _mm_xor_si128(s, _mm_loadu_si128((const __m128i *)rk[0]));
+    for (r = 1; r < AES_ROUNDS; r++)
+        s = _mm_aesenc_si128(s, _mm_loadu_si128((const __m128i *)rk[r]));
+    s = _mm_aesenclast_si128(s,
+            _mm_loadu_si128((const __m128i *)rk[AES_ROUNDS]));
+    _mm_storeu_si128((__m128i *)out, s);
+}
+
+__attribute__((target("aes,sse2")))
+static void
+aes_ni_decrypt(const uint8_t rk[AES_ROUNDS + 1][16], const uint8_t in[16],
+        uint8_t out[16])
+{
+    __m128i s;
+    int r;
+
+    s = _mm_loadu_si128((const __m128i *)in);
+    s = _mm_xor_si128(s,
+            _mm_loadu_si128((const __m128i *)rk[AES_ROUNDS]));
+    for (r = AES_ROUNDS - 1; r > 0; r--)
+        s = _mm_aesdec_si128(s,
+                _mm_aesimc_si128(_mm_loadu_si128((const __m128i *)rk[r])));
+    s = _mm_aesdeclast_si128(s, _mm_loadu_si128((const __m128i *)rk[0]));
+    _mm_storeu_si128((__m128i *)out, s);
+}
+#endif
+
+static void
+aes_done(avr_t *avr, uint64_t when, void *opaque)
+{
+    struct df_aes *a = opaque;
+
+    (void)when;
+
+    memcpy(a->state, a->result, sizeof(a->state));
+    a->state_pos = 0;
+
+    avr->data[AES_CTRL] &= ~(1 << AES_REQUEST);
+    avr_raise_interrupt(avr, &a->vec);
+}
+
+static void
+aes_start(struct df_aes *a, avr_t *avr, uint8_t ctrl)
+{
+    uint8_t rk[AES_ROUNDS + 1][16];
+    uint8_t key[16];
+
+    /* Firmware decrypts with the last round key it read back */
+    if (ctrl & (1 << AES_DIR)) {
+        if (ctrl & (1 << AES_MODE)) {
+            /* The engine can't do CBC decryption */
+            avr->data[AES_STATUS] |= 1 << AES_ER;
+            return;
+        }
+
+        aes_unexpand(a->key, key);
+        aes_expand(key, rk);
+        a->decrypt((const uint8_t (*)[16])rk, a->state, a->result);
+    } else {
+        aes_expand(a->key, rk);
+        a->encrypt((const uint8_t (*)[16])rk, a->state, a->result);
+        memcpy(a->last_rk, rk[AES_ROUNDS], sizeof(a->last_rk));
+    }
+
+    /* The answer only shows up once the real engine would be done */
+    df_clock_schedule_usec(a->clk, &a->done_ev, AES_BLOCK_USEC);
+}
+
+static void
+aes_ctrl_write(struct avr_t *avr, avr_io_addr_t addr, uint8_t v,
+        void *param)
+{
+    struct df_aes *a = param;
+
+    avr->data[addr] = v;
+
+    /* Any write starts the state and key over from their first byte */
+    a->state_pos = 0;
+    a->key_pos = 0;
+
+    if (!(v & (1 << AES_REQUEST)))
+        return;
+
+    if (df_clock_pending(&a->done_ev)) {
+        avr->data[AES_STATUS] |= 1 << AES_ER;
+        return;
+    }
+
+    avr_clear_interrupt(avr, &a->vec);
+    avr->data[AES_STATUS] &= ~(1 << AES_ER);
+
+    aes_start(a, avr, v);
+}
+
+static void
+aes_state_write(struct avr_t *avr, avr_io_addr_t addr, uint8_t v,
+        void *param)
+{
+    struct df_aes *a = param;
+
+    (void)addr;
+
+    /* In CBC mode what's written is chained onto the last result */
+    if (avr->data[AES_CTRL] & (1 << AES_MODE))
+        a->state[a->state_pos] ^= v;
+    else
+        a->state[a->state_pos] = v;
+
+    a->state_pos = (a->state_pos + 1) & 15;
+}
+
+static uint8_t
+aes_state_read(struct avr_t *avr, avr_io_addr_t addr, void *param)
+{
+    struct df_aes *a = param;
+    uint8_t v = a->state[a->state_pos];
+
+    (void)avr;
+    (void)addr;
+
+    a->state_pos = (a->state_pos + 1) & 15;
+
+    return v;
+}
+
+static void
+aes_key_write(struct avr_t *avr, avr_io_addr_t addr, uint8_t v,
+        void *param)
+{
+    struct df_aes *a = param;
+
+    (void)avr;
+    (void)addr;
+
+    a->key[a->key_pos] = v;
+    a->key_pos = (a->key_pos + 1) & 15;
+}
+
+static uint8_t
+aes_key_read(struct avr_t *avr, avr_io_addr_t addr, void *param)
+{
+    struct df_aes *a = param;
+    uint8_t v = a->last_rk[a->key_pos];
+
+    (void)avr;
+    (void)addr;
+
+    a->key_pos = (a->key_pos + 1) & 15;
+
+    return v;
+}
+
+static void
+aes_io_reset(avr_io_t *io)
+{
+    struct df_aes *a = (struct df_aes *)io;
+
+    df_clock_cancel(a->clk, &a->done_ev);
+    memset(a->key, 0, sizeof(a->key));
+    memset(a->state, 0, sizeof(a->state));
+    memset(a->last_rk, 0, sizeof(a->last_rk));
+    a->key_pos = 0;
+    a->state_pos = 0;
+}
+
+static void
+aes_io_dealloc(avr_io_t *io)
+{
+    free(io);
+}
+
+int
+df_aes_init(avr_t *avr)
+{
+    struct df_aes *a;
+    int i;
+
+    /* Like the radio's, these registers are past the end of simavr's IO
+     * table unless it was built with room for them.
+     */
+    if (AVR_DATA_TO_IO(AES_KEY) >= MAX_IOs) {
+        fprintf(stderr, "simavr is unable to reach the AES engine's "
+                "registers (MAX_IOs is %d), running without it.\n",
+                MAX_IOs);
+        return 0;
+    }
+
+    a = calloc(1, sizeof(*a));
+    if (!a) {
+        fprintf(stderr, "Failed to allocate memory for the AES engine.\n");
+        return -1;
+    }
+    df_board_get(avr)->aes = a;
+
+    a->avr = avr;
+    a->clk = df_clock_get(avr);
+
+    for (i = 0; i < 256; i++)
+        aes_inv_sbox[aes_sbox[i]] = i;
+
+    a->encrypt = aes_sw_encrypt;
+    a->decrypt = aes_sw_decrypt;
+#ifdef HAVE_AESNI
+    if (__builtin_cpu_supports("aes")) {
+        a->encrypt = aes_ni_encrypt;
+        a->decrypt = aes_ni_decrypt;
+    }
+#endif
+
+    df_clock_event_init(&a->done_ev, aes_done, a);
+
+    a->io.kind = "aes";
+    a->io.reset = aes_io_reset;
+    a->io.dealloc = aes_io_dealloc;
+    avr_register_io(avr, &a->io);
+
+    a->vec.vector = AES_VECTOR;
+    a->vec.enable = (avr_regbit_t)AVR_IO_REGBIT(AES_CTRL, AES_IM);
+    a->vec.raised = (avr_regbit_t)AVR_IO_REGBIT(AES_STATUS, AES_DONE);
+    avr_register_vector(avr, &a->vec);
+
+    avr_register_io_write(avr, AES_CTRL, aes_ctrl_write, a);
+    avr_register_io_write(avr, AES_STATE, aes_state_write, a);
+    avr_register_io_read(avr, AES_STATE, aes_state_read, a);
+    avr_register_io_write(avr, AES_KEY, aes_key_write, a);
+    avr_register_io_read(avr, AES_KEY, aes_key_read, a);
+
+    return 0;
+}
+
+void
+df_aes_stop(avr_t *avr)
+{
+    struct df_aes *a = df_board_get(avr)->aes;
+
+    if (!a)
+        return;
+
+    df_clock_cancel(a->clk, &a->done_ev);
+}
@@ -0,0 +1,35 @@
+/*
+ * df_aes.h
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_AES_H__
+#define __DF_AES_H__
+
+/* The atmega128rfa1's AES-128 engine: ECB encryption and decryption
+ * and CBC encryption, finishing 24us after it's kicked off like the
+ * real one. The work itself is done with AES-NI when the host has it.
+ * Like the radio, it's left out if simavr has no room for its registers.
+ */
+int df_aes_init(avr_t *avr);
+
+void df_aes_stop(avr_t *avr);
+
+#endif /* __DF_AES_H__ */
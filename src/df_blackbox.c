@@ -0,0 +1,299 @@
+/*
+ * df_blackbox.c
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sim_avr.h>
+#include <sim_io.h>
+
+#include "drumfish.h"
+#include "df_blackbox.h"
+#include "df_board.h"
+#include "df_hook.h"
+#include "df_log.h"
+
+/* As many as simavr's interrupt table holds */
+#define BLACKBOX_VECTORS 64
+
+volatile sig_atomic_t df_blackbox_pending = 0;
+
+struct blackbox_vec {
+    struct df_blackbox *bb;
+    uint8_t vector;
+};
+
+struct df_blackbox {
+    /* First, so simavr's reset and dealloc hand us back to ourselves */
+    avr_io_t io;
+    avr_t *avr;
+    const char *dir;
+
+    struct df_blackbox_rec *ring;
+    uint64_t mask;
+    uint64_t head;
+
+    unsigned int dumps;
+    int reset_expected;
+
+    struct blackbox_vec vec[BLACKBOX_VECTORS];
+};
+
+static inline struct df_blackbox_rec *
+blackbox_rec(struct df_blackbox *bb, uint8_t type, uint32_t pc)
+{
+    struct df_blackbox_rec *r = &bb->ring[bb->head++ & bb->mask];
+
+    r->cycle = bb->avr->cycle;
+    r->pc = pc;
+    r->type = type;
+
+    return r;
+}
+
+static void
+blackbox_insn_hook(avr_t *avr, avr_flashaddr_t pc, avr_flashaddr_t new_pc,
+        void *opaque)
+{
+    struct df_blackbox_rec *r;
+
+    /* Falling through to the next instruction is implied */
+    if (new_pc - pc == 2 || new_pc - pc == 4 ||
+            df_board_get(avr)->replaying)
+        return;
+
+    r = blackbox_rec(opaque, DF_BLACKBOX_JUMP, pc);
+    r->val = 0;
+    r->addr = new_pc >> 1;
+}
+
+static void
+blackbox_iow_hook(avr_t *avr, avr_flashaddr_t pc, avr_io_addr_t addr,
+        uint8_t v, void *opaque)
+{
+    struct df_blackbox_rec *r;
+
+    if (df_board_get(avr)->replaying)
+        return;
+
+    r = blackbox_rec(opaque, DF_BLACKBOX_IOW, pc);
+    r->val = v;
+    r->addr = addr;
+}
+
+static void
+blackbox_irq_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+    struct blackbox_vec *vec = param;
+    struct df_blackbox_rec *r;
+
+    (void)irq;
+
+    if (df_board_get(vec->bb->avr)->replaying)
+        return;
+
+    r = blackbox_rec(vec->bb, value ? DF_BLACKBOX_IRQ_ENTER :
+            DF_BLACKBOX_IRQ_EXIT, vec->bb->avr->pc);
+    r->val = vec->vector;
+    r->addr = 0;
+}
+
+static void
+blackbox_io_reset(avr_io_t *io)
+{
+    struct df_blackbox *bb = (struct df_blackbox *)io;
+
+    if (bb->reset_expected) {
+        bb->reset_expected = 0;
+        return;
+    }
+
+    /* Nothing else resets the core behind our back. It's too late for
+     * the registers, but SRAM and how we got here are still around.
+     */
+    df_blackbox_dump(bb->avr, "watchdog reset");
+}
+
+static void
+blackbox_io_dealloc(avr_io_t *io)
+{
+    struct df_blackbox *bb = (struct df_blackbox *)io;
+
+    free(bb->ring);
+    free(bb);
+}
+
+static int
+blackbox_write(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    ssize_t r;
+
+    while (len) {
+        r = write(fd, p, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+
+    return 0;
+}
+
+int
+df_blackbox_init(const struct drumfish_cfg *config, avr_t *avr)
+{
+    struct df_blackbox *bb;
+    avr_int_vector_t *vector;
+    int i;
+
+    if (!config->blackbox)
+        return 0;
+
+    bb = calloc(1, sizeof(*bb));
+    if (bb)
+        bb->ring = calloc(config->blackbox, sizeof(*bb->ring));
+    if (!bb || !bb->ring) {
+        fprintf(stderr, "Failed to allocate memory for the post-mortem "
+                "ring.\n");
+        free(bb);
+        return -1;
+    }
+
+    bb->avr = avr;
+    bb->dir = config->blackbox_dir ? config->blackbox_dir : "/tmp";
+    bb->mask = config->blackbox - 1;
+
+    bb->io.kind = "blackbox";
+    bb->io.reset = blackbox_io_reset;
+    bb->io.dealloc = blackbox_io_dealloc;
+    avr_register_io(avr, &bb->io);
+    df_board_get(avr)->blackbox = bb;
+
+    if (df_hook_insn_add(avr, blackbox_insn_hook, bb) ||
+            df_hook_iow_add(avr, blackbox_iow_hook, bb))
+        return -1;
+
+    for (i = 0; i < avr->interrupts.vector_count && i < BLACKBOX_VECTORS;
+            i++) {
+        vector = avr->interrupts.vector[i];
+        bb->vec[i].bb = bb;
+        bb->vec[i].vector = vector->vector;
+        avr_irq_register_notify(vector->irq + AVR_INT_IRQ_RUNNING,
+                blackbox_irq_hook, &bb->vec[i]);
+    }
+
+    return 0;
+}
+
+void
+df_blackbox_expect_reset(avr_t *avr)
+{
+    struct df_blackbox *bb = df_board_get(avr)->blackbox;
+
+    if (bb)
+        bb->reset_expected = 1;
+}
+
+int
+df_blackbox_dump(avr_t *avr, const char *reason)
+{
+    struct df_board *board = df_board_get(avr);
+    struct df_blackbox *bb = board->blackbox;
+    struct df_blackbox_hdr hdr;
+    uint64_t count;
+    uint64_t first;
+    uint64_t split;
+    char *path;
+    int ret = -1;
+    int fd;
+    int i;
+
+    if (!bb)
+        return 0;
+
+    if (asprintf(&path, "%s/drumfish-%d.%d.%u.bb", bb->dir, getpid(),
+                board->index, bb->dumps++) < 0) {
+        df_log_msg(DF_LOG_ERR, "Out of memory for a post-mortem dump\n");
+        return -1;
+    }
+
+    count = bb->head < bb->mask + 1 ? bb->head : bb->mask + 1;
+    first = (bb->head - count) & bb->mask;
+    split = first + count > bb->mask + 1 ? bb->mask + 1 - first : count;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = DF_BLACKBOX_MAGIC;
+    hdr.version = DF_BLACKBOX_VERSION;
+    snprintf(hdr.reason, sizeof(hdr.reason), "%s", reason);
+    hdr.frequency = avr->frequency;
+    hdr.pc = avr->pc;
+    hdr.cycle = avr->cycle;
+    hdr.records = count;
+    hdr.data_len = avr->ramend + 1;
+    hdr.sp = avr->data[R_SPL] | avr->data[R_SPH] << 8;
+    for (i = 0; i < 8; i++)
+        if (avr->sreg[i])
+            hdr.sreg |= 1 << i;
+    hdr.state = avr->state;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        df_log_msg(DF_LOG_ERR, "Unable to create post-mortem dump '%s': "
+                "%s\n", path, strerror(errno));
+        goto out;
+    }
+
+    /* Oldest first, which may mean wrapping around the end of the ring */
+    if (blackbox_write(fd, &hdr, sizeof(hdr)) ||
+            blackbox_write(fd, bb->ring + first,
+                split * sizeof(*bb->ring)) ||
+            blackbox_write(fd, bb->ring, (count - split) * sizeof(*bb->ring)) ||
+            blackbox_write(fd, avr->data, hdr.data_len)) {
+        df_log_msg(DF_LOG_ERR, "Failed to write post-mortem dump '%s': "
+                "%s\n", path, strerror(errno));
+        close(fd);
+        goto out;
+    }
+
+    close(fd);
+    df_log_msg(DF_LOG_WARN, "Post-mortem dump (%s) written to %s\n",
+            reason, path);
+    ret = 0;
+
+out:
+    free(path);
+
+    return ret;
+}
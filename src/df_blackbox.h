@@ -0,0 +1,83 @@
+/*
+ * df_blackbox.h
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_BLACKBOX_H__
+#define __DF_BLACKBOX_H__
+
+#include <signal.h>
+#include <stdint.h>
+
+#define DF_BLACKBOX_MAGIC 0x42424644 /* "DFBB" */
+#define DF_BLACKBOX_VERSION 1
+
+/* Records kept unless '--blackbox' says otherwise, must be a power of 2 */
+#define DF_BLACKBOX_DEFAULT 4096
+
+/* What a record is. Straight line code isn't recorded, only where the
+ * PC jumped, so the path in between can be filled in from flash.
+ */
+#define DF_BLACKBOX_JUMP 0      /* pc jumped to word 'addr' */
+#define DF_BLACKBOX_IOW 1       /* pc wrote 'val' to data address 'addr' */
+#define DF_BLACKBOX_IRQ_ENTER 2 /* vector 'val' started running at pc */
+#define DF_BLACKBOX_IRQ_EXIT 3  /* vector 'val' returned at pc */
+
+struct df_blackbox_rec {
+    uint64_t cycle;
+    uint32_t pc;
+    uint8_t type;
+    uint8_t val;
+    uint16_t addr;
+};
+
+/* A dump is this header, then 'records' records oldest first, then
+ * 'data_len' bytes of the core's data space: registers, IO and SRAM.
+ */
+struct df_blackbox_hdr {
+    uint32_t magic;
+    uint32_t version;
+    char reason[32];
+    uint32_t frequency;
+    uint32_t pc;
+    uint64_t cycle;
+    uint32_t records;
+    uint32_t data_len;
+    uint16_t sp;
+    uint8_t sreg;
+    uint8_t state;
+    uint32_t pad;
+};
+
+/* Forward declarations, so tools can read the file without simavr */
+struct avr_t;
+struct drumfish_cfg;
+
+/* Set by SIGUSR1, the run loop dumps every board */
+extern volatile sig_atomic_t df_blackbox_pending;
+
+int df_blackbox_init(const struct drumfish_cfg *config, struct avr_t *avr);
+
+/* The next reset was asked for, so it isn't worth a dump */
+void df_blackbox_expect_reset(struct avr_t *avr);
+
+int df_blackbox_dump(struct avr_t *avr, const char *reason);
+
+#endif /* __DF_BLACKBOX_H__ */
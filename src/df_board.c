@@ -0,0 +1,253 @@
+/*
+ * df_board.c
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sim_avr.h>
+
+#include "drumfish.h"
+#include "df_board.h"
+#include "df_gdb.h"
+
+/* How far the boards of a batch may drift apart, 64us at 16MHz. Long
+ * enough for a board's state to stay in cache while it runs, short
+ * enough that radio frames between them arrive about on time.
+ */
+#define BOARD_QUANTUM 1024
+
+#define BOARD_MAX_MAC 8
+
+static uint64_t horizon;
+
+/* "<path>.<index>", or NULL if 'path' is */
+static char *
+board_path(const char *path, int index)
+{
+    char *ret;
+
+    if (!path)
+        return NULL;
+
+    if (asprintf(&ret, "%s.%d", path, index) < 0)
+        return NULL;
+
+    return ret;
+}
+
+/* Board 'index' gets its MAC by adding 'index' to the one given */
+static char *
+board_mac(const char *mac, int index)
+{
+    unsigned int octet[BOARD_MAX_MAC];
+    unsigned long long val = 0;
+    char *ret;
+    size_t len = 0;
+    int n;
+    int i;
+
+    while (len < BOARD_MAX_MAC &&
+            sscanf(mac, "%2x%n", &octet[len], &n) == 1) {
+        val = (val << 8) | octet[len++];
+        mac += n;
+        if (*mac != ':')
+            break;
+        mac++;
+    }
+
+    if (!len || *mac)
+        return NULL;
+
+    val += index;
+
+    ret = malloc(len * 3);
+    if (!ret)
+        return NULL;
+
+    for (i = len - 1; i >= 0; i--) {
+        snprintf(ret + i * 3, 3, "%02X", (unsigned int)(val & 0xFF));
+        ret[i * 3 + 2] = i == (int)len - 1 ? '\0' : ':';
+        val >>= 8;
+    }
+
+    return ret;
+}
+
+struct drumfish_cfg *
+df_board_config(const struct drumfish_cfg *config, int index)
+{
+    struct drumfish_cfg *cfg;
+
+    cfg = malloc(sizeof(*cfg));
+    if (!cfg) {
+        fprintf(stderr, "Failed to allocate memory for board %d.\n", index);
+        return NULL;
+    }
+
+    *cfg = *config;
+    cfg->mac = NULL;
+    cfg->pflash = NULL;
+    cfg->eeprom = NULL;
+    cfg->pflash_wear = NULL;
+    cfg->pcap = NULL;
+
+    if (config->mac) {
+        cfg->mac = board_mac(config->mac, index);
+        if (!cfg->mac) {
+            fprintf(stderr, "Unable to give board %d a MAC from '%s'.\n",
+                    index, config->mac);
+            goto err;
+        }
+    }
+
+    /* Copy-on-write images are only ever read, so everyone shares them */
+    if (config->pflash_cow) {
+        cfg->pflash = strdup(config->pflash);
+        cfg->eeprom = strdup(config->eeprom);
+    } else {
+        cfg->pflash = board_path(config->pflash, index);
+        cfg->eeprom = board_path(config->eeprom, index);
+    }
+    if (!cfg->pflash || !cfg->eeprom)
+        goto nomem;
+
+    if (config->pflash_wear) {
+        cfg->pflash_wear = board_path(config->pflash_wear, index);
+        if (!cfg->pflash_wear)
+            goto nomem;
+    }
+
+    /* A "%m" in the name already tells the boards apart */
+    if (config->pcap) {
+        if (config->mac && strstr(config->pcap, "%m"))
+            cfg->pcap = strdup(config->pcap);
+        else
+            cfg->pcap = board_path(config->pcap, index);
+        if (!cfg->pcap)
+            goto nomem;
+    }
+
+    return cfg;
+
+nomem:
+    fprintf(stderr, "Failed to allocate memory for board %d.\n", index);
+err:
+    df_board_config_free(cfg);
+    return NULL;
+}
+
+void
+df_board_config_free(struct drumfish_cfg *config)
+{
+    if (!config)
+        return;
+
+    free(config->mac);
+    free(config->pflash);
+    free(config->eeprom);
+    free(config->pflash_wear);
+    free(config->pcap);
+    free(config);
+}
+
+int
+df_board_start_uarts(const struct drumfish_cfg *config,
+        struct df_board **boards, size_t len)
+{
+    uart_pty_t **ports;
+    size_t i;
+    int ret;
+
+    /* Headless runs have nobody to talk to on a pty */
+    if (config->run)
+        return 0;
+
+    ports = malloc(len * 2 * sizeof(*ports));
+    if (!ports) {
+        fprintf(stderr, "Failed to allocate memory for the UARTs.\n");
+        return -1;
+    }
+
+    for (i = 0; i < len; i++) {
+        ports[i * 2] = &boards[i]->uart[0];
+        ports[i * 2 + 1] = &boards[i]->uart[1];
+    }
+
+    ret = uart_pty_start(ports, len * 2);
+    free(ports);
+    if (ret)
+        return -1;
+
+    for (i = 0; i < len; i++)
+        boards[i]->mem[DF_MEM_UART] += 2 * sizeof(uart_pty_port_t);
+
+    return 0;
+}
+
+int
+df_board_run(struct df_board **boards, size_t len)
+{
+    uint64_t next = horizon + BOARD_QUANTUM;
+    avr_t *avr;
+    int running = 0;
+    int runnable = 0;
+    int state;
+    size_t i;
+
+    /* Each board runs its whole quantum before the next one starts */
+    for (i = 0; i < len; i++) {
+        avr = boards[i]->avr;
+        state = avr->state;
+
+        if (state != cpu_Done && state != cpu_Crashed &&
+                state != cpu_Stopped)
+            runnable = 1;
+
+        while (avr->cycle < next) {
+            if (state == cpu_Done || state == cpu_Crashed ||
+                    state == cpu_Stopped)
+                break;
+            state = avr_run(avr);
+
+            if (state == cpu_Crashed) {
+                df_gdb_crashed(avr);
+                state = avr->state;
+            }
+        }
+
+        /* A stopped board falls behind and catches up once it's let go */
+        if (state != cpu_Done && state != cpu_Crashed)
+            running++;
+    }
+
+    /* With every board held by the debugger time stands still, or the
+     * first one let go would have a long way to catch up.
+     */
+    if (runnable)
+        horizon = next;
+
+    return running ? cpu_Running : cpu_Done;
+}
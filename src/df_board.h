@@ -0,0 +1,90 @@
+/*
+ * df_board.h
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_BOARD_H__
+#define __DF_BOARD_H__
+
+#include <stddef.h>
+
+#include "uart_pty.h"
+#include "df_hook.h"
+#include "df_mem.h"
+
+struct df_radio;
+struct df_aes;
+struct df_pflash;
+struct df_blackbox;
+struct df_isr;
+
+/* Everything that makes up one emulated board besides its simavr core.
+ * Hangs off the core's special_data so peripherals can find their own
+ * state from the avr_t they are handed.
+ */
+struct df_board {
+    avr_t *avr;
+    struct drumfish_cfg *config;
+    int index;
+
+    uart_pty_t uart[2];
+    struct df_hooks hooks;
+    struct df_radio *radio;
+    struct df_aes *aes;
+    struct df_pflash *pflash;
+    struct df_blackbox *blackbox;
+    struct df_isr *isr;
+
+    /* Set while the debugger replays history. What the board does then
+     * already happened once, so instrumentation leaves it out.
+     */
+    int replaying;
+
+    /* What each part of the board took, for --mem-audit */
+    size_t mem[DF_MEM_KINDS];
+};
+
+static inline struct df_board *
+df_board_get(avr_t *avr)
+{
+    return (struct df_board *)avr->special_data;
+}
+
+/* Gives board 'index' of a batch its own copy of 'config', with the
+ * files it writes to named after it. Board 0 keeps the names as given.
+ */
+struct drumfish_cfg *df_board_config(const struct drumfish_cfg *config,
+        int index);
+
+void df_board_config_free(struct drumfish_cfg *config);
+
+/* Gives every board's UARTs their ptys, unless 'config' is a headless
+ * run.
+ */
+int df_board_start_uarts(const struct drumfish_cfg *config,
+        struct df_board **boards, size_t len);
+
+/* Runs every board up to the same cycle, one quantum at a time, so they
+ * stay within a quantum of each other. Returns cpu_Done once none of
+ * them are left running.
+ */
+int df_board_run(struct df_board **boards, size_t len);
+
+#endif /* __DF_BOARD_H__ */
@@ -0,0 +1,197 @@
+/*
+ * df_chunkq.c
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "df_chunkq.h"
+#include "df_mem.h"
+
+struct df_chunkq {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int running;
+    int failed;
+
+    size_t size;
+    unsigned int count;
+    struct df_chunkq_buf *bufs;
+    struct df_chunkq_buf *free;
+    struct df_chunkq_buf *full;
+    struct df_chunkq_buf **full_tail;
+
+    df_chunkq_write_cb cb;
+    void *opaque;
+};
+
+static void *
+chunkq_thread(void *param)
+{
+    struct df_chunkq *q = param;
+    struct df_chunkq_buf *buf;
+
+    pthread_mutex_lock(&q->lock);
+
+    for (;;) {
+        while (!q->full && q->running)
+            pthread_cond_wait(&q->cond, &q->lock);
+
+        buf = q->full;
+        if (!buf)
+            break;
+
+        q->full = buf->next;
+        if (!q->full)
+            q->full_tail = &q->full;
+
+        pthread_mutex_unlock(&q->lock);
+        if (!q->failed && buf->len && q->cb(q->opaque, buf->data, buf->len))
+            q->failed = 1;
+        pthread_mutex_lock(&q->lock);
+
+        buf->next = q->free;
+        q->free = buf;
+        pthread_cond_broadcast(&q->cond);
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    return NULL;
+}
+
+struct df_chunkq *
+df_chunkq_new(size_t size, unsigned int count, df_chunkq_write_cb cb,
+        void *opaque)
+{
+    struct df_chunkq *q;
+    unsigned int i;
+    int ret;
+
+    q = calloc(1, sizeof(*q));
+    if (!q)
+        goto nomem;
+
+    q->bufs = calloc(count, sizeof(*q->bufs));
+    if (!q->bufs)
+        goto nomem;
+
+    for (i = 0; i < count; i++) {
+        q->bufs[i].data = malloc(size);
+        if (!q->bufs[i].data)
+            goto nomem;
+        q->bufs[i].next = q->free;
+        q->free = &q->bufs[i];
+    }
+
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    q->size = size;
+    q->count = count;
+    q->full_tail = &q->full;
+    q->cb = cb;
+    q->opaque = opaque;
+    q->running = 1;
+
+    ret = df_mem_thread_create(&q->thread, chunkq_thread, q);
+    if (ret) {
+        fprintf(stderr, "Failed to create writer thread: %s\n",
+                strerror(ret));
+        q->running = 0;
+        goto err;
+    }
+
+    return q;
+
+nomem:
+    fprintf(stderr, "Failed to allocate memory for write buffers.\n");
+err:
+    if (q && q->bufs)
+        for (i = 0; i < count; i++)
+            free(q->bufs[i].data);
+    if (q)
+        free(q->bufs);
+    free(q);
+
+    return NULL;
+}
+
+struct df_chunkq_buf *
+df_chunkq_get(struct df_chunkq *q)
+{
+    struct df_chunkq_buf *buf;
+
+    pthread_mutex_lock(&q->lock);
+    while (!q->free)
+        pthread_cond_wait(&q->cond, &q->lock);
+    buf = q->free;
+    q->free = buf->next;
+    pthread_mutex_unlock(&q->lock);
+
+    buf->len = 0;
+    buf->next = NULL;
+
+    return buf;
+}
+
+void
+df_chunkq_put(struct df_chunkq *q, struct df_chunkq_buf *buf)
+{
+    pthread_mutex_lock(&q->lock);
+    buf->next = NULL;
+    *q->full_tail = buf;
+    q->full_tail = &buf->next;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+size_t
+df_chunkq_size(const struct df_chunkq *q)
+{
+    return q->size;
+}
+
+void
+df_chunkq_free(struct df_chunkq *q)
+{
+    unsigned int i;
+
+    if (!q)
+        return;
+
+    pthread_mutex_lock(&q->lock);
+    q->running = 0;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_join(q->thread, NULL);
+
+    for (i = 0; i < q->count; i++)
+        free(q->bufs[i].data);
+    free(q->bufs);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->cond);
+    free(q);
+}
@@ -0,0 +1,60 @@
+/*
+ * df_chunkq.h
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_CHUNKQ_H__
+#define __DF_CHUNKQ_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A fixed pool of buffers that one producer fills and a background
+ * thread drains, so the emulation thread never waits on a disk unless
+ * the disk has fallen a whole pool behind.
+ */
+struct df_chunkq;
+
+struct df_chunkq_buf {
+    uint8_t *data;
+    size_t len;
+    struct df_chunkq_buf *next;
+};
+
+/* Called on the writer thread for each full buffer, in order. Returning
+ * non-zero stops any further calls and later buffers are thrown away.
+ */
+typedef int (*df_chunkq_write_cb)(void *opaque, const uint8_t *data,
+        size_t len);
+
+struct df_chunkq *df_chunkq_new(size_t size, unsigned int count,
+        df_chunkq_write_cb cb, void *opaque);
+
+/* Waits for a free buffer if there are none */
+struct df_chunkq_buf *df_chunkq_get(struct df_chunkq *q);
+
+void df_chunkq_put(struct df_chunkq *q, struct df_chunkq_buf *buf);
+
+size_t df_chunkq_size(const struct df_chunkq *q);
+
+/* Writes out everything that was put and stops the writer thread */
+void df_chunkq_free(struct df_chunkq *q);
+
+#endif /* __DF_CHUNKQ_H__ */
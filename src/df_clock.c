@@ -0,0 +1,568 @@
+/*
+ * df_clock.c
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sim_avr.h>
+
+#include "df_clock.h"
+
+/* A hierarchical timing wheel. Level 0 has a slot for each of the next
+ * 256 cycles, and each level above covers 256 times as much time with
+ * the same number of slots. Events in the upper levels are cascaded
+ * down as the clock reaches their slot, and anything more than 2^32
+ * cycles out waits on the overflow list.
+ */
+#define WHEEL_BITS 8
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_WORDS (WHEEL_SIZE / 64)
+
+struct df_clock {
+    avr_t *avr;
+    struct df_clock *next;
+
+    /* Every event before this cycle has run */
+    uint64_t now;
+
+    /* The cycle our simavr timer will fire at, 0 if it isn't armed */
+    uint64_t armed;
+    int running;
+
+    struct df_clock_event *slot[WHEEL_LEVELS][WHEEL_SIZE];
+    uint64_t occupied[WHEEL_LEVELS][WHEEL_WORDS];
+    struct df_clock_event *overflow;
+};
+
+static struct df_clock *clocks = NULL;
+
+static avr_cycle_count_t clock_timer(avr_t *avr, avr_cycle_count_t when,
+        void *param);
+
+static uint64_t clock_next(const struct df_clock *clk);
+
+static int
+clock_find(const uint64_t *bits, unsigned int from)
+{
+    unsigned int w = from / 64;
+    uint64_t word;
+
+    if (from >= WHEEL_SIZE)
+        return -1;
+
+    word = bits[w] & (~0ULL << (from % 64));
+    for (;;) {
+        if (word)
+            return w * 64 + __builtin_ctzll(word);
+        if (++w == WHEEL_WORDS)
+            return -1;
+        word = bits[w];
+    }
+}
+
+static void
+clock_link(struct df_clock_event **head, struct df_clock_event *ev)
+{
+    ev->next = *head;
+    if (ev->next)
+        ev->next->pprev = &ev->next;
+    ev->pprev = head;
+    *head = ev;
+}
+
+static void
+clock_unlink(struct df_clock *clk, struct df_clock_event *ev)
+{
+    *ev->pprev = ev->next;
+    if (ev->next)
+        ev->next->pprev = ev->pprev;
+
+    if (ev->level < WHEEL_LEVELS && !clk->slot[ev->level][ev->slot])
+        clk->occupied[ev->level][ev->slot / 64] &= ~(1ULL << (ev->slot % 64));
+
+    ev->next = NULL;
+    ev->pprev = NULL;
+}
+
+static void
+clock_place(struct df_clock *clk, struct df_clock_event *ev)
+{
+    uint64_t when = ev->when < clk->now ? clk->now : ev->when;
+    unsigned int shift = 0;
+    int level;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        shift = level * WHEEL_BITS;
+        if ((when >> shift) - (clk->now >> shift) < WHEEL_SIZE)
+            break;
+    }
+
+    ev->level = level;
+    if (level == WHEEL_LEVELS) {
+        clock_link(&clk->overflow, ev);
+        return;
+    }
+
+    ev->slot = (when >> shift) & WHEEL_MASK;
+    clock_link(&clk->slot[level][ev->slot], ev);
+    clk->occupied[level][ev->slot / 64] |= 1ULL << (ev->slot % 64);
+}
+
+/* Moves everything in 'head' back onto the wheel relative to now */
+static void
+clock_replace(struct df_clock *clk, struct df_clock_event *head)
+{
+    struct df_clock_event *ev;
+
+    while ((ev = head)) {
+        head = ev->next;
+        ev->next = NULL;
+        ev->pprev = NULL;
+        clock_place(clk, ev);
+    }
+}
+
+/* Empties a slot onto 'list', which events can still be cancelled from */
+static void
+clock_detach(struct df_clock *clk, int level, unsigned int slot,
+        struct df_clock_event **list)
+{
+    *list = clk->slot[level][slot];
+    if (*list)
+        (*list)->pprev = list;
+
+    clk->slot[level][slot] = NULL;
+    clk->occupied[level][slot / 64] &= ~(1ULL << (slot % 64));
+}
+
+static void
+clock_cascade(struct df_clock *clk)
+{
+    struct df_clock_event *head;
+    unsigned int shift;
+    int level;
+
+    if (!(clk->now & 0xffffffffULL) && clk->overflow) {
+        head = clk->overflow;
+        clk->overflow = NULL;
+        clock_replace(clk, head);
+    }
+
+    /* From the top down so events can fall more than one level */
+    for (level = WHEEL_LEVELS - 1; level > 0; level--) {
+        shift = level * WHEEL_BITS;
+        if (clk->now & ((1ULL << shift) - 1))
+            continue;
+
+        clock_detach(clk, level, (clk->now >> shift) & WHEEL_MASK, &head);
+        clock_replace(clk, head);
+    }
+}
+
+static void
+clock_advance(struct df_clock *clk, uint64_t target)
+{
+    struct df_clock_event *list;
+    struct df_clock_event *ev;
+    uint64_t next;
+    int slot;
+
+    while (clk->now <= target) {
+        if (!(clk->now & WHEEL_MASK))
+            clock_cascade(clk);
+
+        /* Jump straight to whatever needs doing next, which might be a
+         * cascade rather than an event.
+         */
+        slot = clock_find(clk->occupied[0], clk->now & WHEEL_MASK);
+        if (slot < 0) {
+            next = clock_next(clk);
+            if (next > target) {
+                clk->now = target + 1;
+                break;
+            }
+            clk->now = next;
+            continue;
+        }
+
+        next = (clk->now & ~(uint64_t)WHEEL_MASK) + slot;
+        if (next > target) {
+            clk->now = target + 1;
+            break;
+        }
+        clk->now = next;
+
+        /* Callbacks are free to cancel anything still on this list */
+        clock_detach(clk, 0, slot, &list);
+        while ((ev = list)) {
+            list = ev->next;
+            if (list)
+                list->pprev = &list;
+            ev->next = NULL;
+            ev->pprev = NULL;
+
+            ev->cb(clk->avr, ev->when, ev->opaque);
+        }
+
+        /* Unless something was rescheduled for this very cycle */
+        if (!clk->slot[0][slot])
+            clk->now = next + 1;
+    }
+}
+
+static uint64_t
+clock_next(const struct df_clock *clk)
+{
+    uint64_t best = UINT64_MAX;
+    uint64_t base;
+    uint64_t cand;
+    unsigned int shift;
+    unsigned int cur;
+    unsigned int from;
+    int level;
+    int slot;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        shift = level * WHEEL_BITS;
+        base = clk->now >> shift;
+        cur = base & WHEEL_MASK;
+
+        /* Only level 0 and a cascade that's due right now can be in the
+         * current slot.
+         */
+        from = (!level || !(clk->now & ((1ULL << shift) - 1))) ? cur : cur + 1;
+
+        slot = clock_find(clk->occupied[level], from);
+        if (slot >= 0) {
+            cand = ((base & ~(uint64_t)WHEEL_MASK) + slot) << shift;
+        } else {
+            slot = clock_find(clk->occupied[level], 0);
+            if (slot < 0 || (unsigned int)slot >= from)
+                continue;
+            cand = ((base & ~(uint64_t)WHEEL_MASK) + WHEEL_SIZE + slot) <<
+                shift;
+        }
+
+        if (cand < best)
+            best = cand;
+    }
+
+    if (clk->overflow) {
+        cand = ((clk->now >> 32) + 1) << 32;
+        if (cand < best)
+            best = cand;
+    }
+
+    return best;
+}
+
+static void
+clock_arm(struct df_clock *clk)
+{
+    uint64_t next;
+
+    /* clock_timer() takes care of this when it's done */
+    if (clk->running)
+        return;
+
+    next = clock_next(clk);
+    if (next == UINT64_MAX || (clk->armed && clk->armed <= next))
+        return;
+
+    if (clk->armed)
+        avr_cycle_timer_cancel(clk->avr, clock_timer, clk);
+
+    clk->armed = next;
+    avr_cycle_timer_register(clk->avr,
+            next > clk->avr->cycle ? next - clk->avr->cycle : 0,
+            clock_timer, clk);
+}
+
+static avr_cycle_count_t
+clock_timer(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    struct df_clock *clk = param;
+    uint64_t next;
+
+    (void)when;
+
+    clk->armed = 0;
+    clk->running = 1;
+    clock_advance(clk, avr->cycle);
+    clk->running = 0;
+
+    next = clock_next(clk);
+    if (next == UINT64_MAX)
+        return 0;
+
+    clk->armed = next;
+
+    return next;
+}
+
+struct df_clock *
+df_clock_new(avr_t *avr)
+{
+    struct df_clock *clk;
+
+    clk = calloc(1, sizeof(*clk));
+    if (!clk) {
+        fprintf(stderr, "Failed to allocate memory for clock.\n");
+        return NULL;
+    }
+
+    clk->avr = avr;
+    clk->now = avr->cycle;
+
+    clk->next = clocks;
+    clocks = clk;
+
+    return clk;
+}
+
+void
+df_clock_free(struct df_clock *clk)
+{
+    struct df_clock **link;
+
+    if (!clk)
+        return;
+
+    if (clk->armed)
+        avr_cycle_timer_cancel(clk->avr, clock_timer, clk);
+
+    for (link = &clocks; *link; link = &(*link)->next) {
+        if (*link == clk) {
+            *link = clk->next;
+            break;
+        }
+    }
+
+    free(clk);
+}
+
+struct df_clock *
+df_clock_get(avr_t *avr)
+{
+    struct df_clock *clk;
+
+    for (clk = clocks; clk; clk = clk->next)
+        if (clk->avr == avr)
+            return clk;
+
+    return NULL;
+}
+
+uint64_t
+df_clock_now(const struct df_clock *clk)
+{
+    return clk->avr->cycle;
+}
+
+uint64_t
+df_clock_usec(const struct df_clock *clk)
+{
+    return clk->avr->cycle * 1000000ULL / clk->avr->frequency;
+}
+
+uint64_t
+df_clock_usec_to_cycles(const struct df_clock *clk, uint64_t usec)
+{
+    return usec * clk->avr->frequency / 1000000ULL;
+}
+
+void
+df_clock_event_init(struct df_clock_event *ev, df_clock_cb cb, void *opaque)
+{
+    memset(ev, 0, sizeof(*ev));
+    ev->cb = cb;
+    ev->opaque = opaque;
+}
+
+void
+df_clock_schedule_at(struct df_clock *clk, struct df_clock_event *ev,
+        uint64_t when)
+{
+    if (df_clock_pending(ev))
+        clock_unlink(clk, ev);
+
+    /* Catch up if we've been idle, so the event lands in the finest
+     * level it can.
+     */
+    if (!clk->running && clk->now < clk->avr->cycle &&
+            clock_next(clk) > clk->avr->cycle)
+        clk->now = clk->avr->cycle;
+
+    ev->when = when;
+    clock_place(clk, ev);
+    clock_arm(clk);
+}
+
+void
+df_clock_schedule(struct df_clock *clk, struct df_clock_event *ev,
+        uint64_t cycles)
+{
+    df_clock_schedule_at(clk, ev, clk->avr->cycle + cycles);
+}
+
+void
+df_clock_schedule_usec(struct df_clock *clk, struct df_clock_event *ev,
+        uint64_t usec)
+{
+    df_clock_schedule(clk, ev, df_clock_usec_to_cycles(clk, usec));
+}
+
+/* Takes every pending event off the wheel, still linked through 'next' */
+static struct df_clock_event *
+clock_gather(struct df_clock *clk)
+{
+    struct df_clock_event *all = NULL;
+    struct df_clock_event *list;
+    struct df_clock_event *ev;
+    unsigned int slot;
+    int level;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        for (slot = 0; slot < WHEEL_SIZE; slot++) {
+            clock_detach(clk, level, slot, &list);
+            while ((ev = list)) {
+                list = ev->next;
+                ev->next = all;
+                all = ev;
+            }
+        }
+    }
+
+    while ((ev = clk->overflow)) {
+        clk->overflow = ev->next;
+        ev->next = all;
+        all = ev;
+    }
+
+    return all;
+}
+
+/* Picks up whatever simavr's timer table now says about ours */
+static void
+clock_rearm(struct df_clock *clk)
+{
+    avr_cycle_count_t left;
+
+    left = avr_cycle_timer_status(clk->avr, clock_timer, clk);
+    clk->armed = left ? clk->avr->cycle + left : 0;
+    clock_arm(clk);
+}
+
+void
+df_clock_resync(struct df_clock *clk)
+{
+    struct df_clock_event *all;
+
+    /* Gather everything up and put it back relative to the core's idea
+     * of the time, which may well be in our past now.
+     */
+    all = clock_gather(clk);
+    clk->now = clk->avr->cycle;
+    clock_replace(clk, all);
+    clock_rearm(clk);
+}
+
+int
+df_clock_save(struct df_clock *clk, struct df_clock_saved **saved,
+        size_t *len)
+{
+    struct df_clock_event *ev;
+    size_t count = 0;
+    size_t n = 0;
+    unsigned int slot;
+    int level;
+
+    for (level = 0; level < WHEEL_LEVELS; level++)
+        for (slot = 0; slot < WHEEL_SIZE; slot++)
+            for (ev = clk->slot[level][slot]; ev; ev = ev->next)
+                count++;
+    for (ev = clk->overflow; ev; ev = ev->next)
+        count++;
+
+    *saved = NULL;
+    *len = 0;
+    if (!count)
+        return 0;
+
+    *saved = malloc(count * sizeof(**saved));
+    if (!*saved)
+        return -1;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        for (slot = 0; slot < WHEEL_SIZE; slot++) {
+            for (ev = clk->slot[level][slot]; ev; ev = ev->next) {
+                (*saved)[n].ev = ev;
+                (*saved)[n++].when = ev->when;
+            }
+        }
+    }
+    for (ev = clk->overflow; ev; ev = ev->next) {
+        (*saved)[n].ev = ev;
+        (*saved)[n++].when = ev->when;
+    }
+    *len = n;
+
+    return 0;
+}
+
+void
+df_clock_restore(struct df_clock *clk, const struct df_clock_saved *saved,
+        size_t len)
+{
+    struct df_clock_event *all;
+    struct df_clock_event *ev;
+    size_t i;
+
+    /* Whatever was scheduled since is forgotten */
+    all = clock_gather(clk);
+    while ((ev = all)) {
+        all = ev->next;
+        ev->next = NULL;
+        ev->pprev = NULL;
+    }
+
+    clk->now = clk->avr->cycle;
+    for (i = 0; i < len; i++) {
+        saved[i].ev->when = saved[i].when;
+        clock_place(clk, saved[i].ev);
+    }
+    clock_rearm(clk);
+}
+
+void
+df_clock_cancel(struct df_clock *clk, struct df_clock_event *ev)
+{
+    if (!df_clock_pending(ev))
+        return;
+
+    /* Leave the simavr timer be, it'll just find nothing to do */
+    clock_unlink(clk, ev);
+}
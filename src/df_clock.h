@@ -0,0 +1,110 @@
+/*
+ * df_clock.h
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_CLOCK_H__
+#define __DF_CLOCK_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Each board has one virtual clock which runs off of the core's cycle
+ * counter. Components schedule their work on it instead of taking one
+ * of simavr's few cycle timer slots each, and it only ever uses one.
+ */
+struct df_clock;
+
+typedef void (*df_clock_cb)(avr_t *avr, uint64_t when, void *opaque);
+
+/* Owned by whoever schedules it, set cb and opaque with
+ * df_clock_event_init() and leave the rest alone.
+ */
+struct df_clock_event {
+    df_clock_cb cb;
+    void *opaque;
+    uint64_t when;
+    int level;
+    unsigned int slot;
+    struct df_clock_event *next;
+    struct df_clock_event **pprev;
+};
+
+struct df_clock *df_clock_new(avr_t *avr);
+
+void df_clock_free(struct df_clock *clk);
+
+/* The clock driving 'avr', if one was created */
+struct df_clock *df_clock_get(avr_t *avr);
+
+uint64_t df_clock_now(const struct df_clock *clk);
+
+uint64_t df_clock_usec(const struct df_clock *clk);
+
+uint64_t df_clock_usec_to_cycles(const struct df_clock *clk, uint64_t usec);
+
+void df_clock_event_init(struct df_clock_event *ev, df_clock_cb cb,
+        void *opaque);
+
+/* Runs 'ev' once the core reaches cycle 'when', or as soon as possible
+ * if that has already passed. Reschedules it if it was already pending.
+ */
+void df_clock_schedule_at(struct df_clock *clk, struct df_clock_event *ev,
+        uint64_t when);
+
+void df_clock_schedule(struct df_clock *clk, struct df_clock_event *ev,
+        uint64_t cycles);
+
+void df_clock_schedule_usec(struct df_clock *clk, struct df_clock_event *ev,
+        uint64_t usec);
+
+void df_clock_cancel(struct df_clock *clk, struct df_clock_event *ev);
+
+/* Call after the core's cycle counter or cycle timers were changed
+ * behind our back, like restoring a snapshot.
+ */
+void df_clock_resync(struct df_clock *clk);
+
+/* An event that was pending when df_clock_save() looked */
+struct df_clock_saved {
+    struct df_clock_event *ev;
+    uint64_t when;
+};
+
+/* Lists every pending event in a new array, for a snapshot. Returns -1
+ * if there's no memory for it.
+ */
+int df_clock_save(struct df_clock *clk, struct df_clock_saved **saved,
+        size_t *len);
+
+/* Cancels everything pending and schedules what was saved instead, on
+ * the clock it was saved from. Like df_clock_resync() it goes by the
+ * core's cycle counter and timers, so restore those first.
+ */
+void df_clock_restore(struct df_clock *clk, const struct df_clock_saved *saved,
+        size_t len);
+
+static inline int
+df_clock_pending(const struct df_clock_event *ev)
+{
+    return ev->pprev != NULL;
+}
+
+#endif /* __DF_CLOCK_H__ */
@@ -22,7 +22,14 @@
 #ifndef __DF_CORES_H__
 #define __DF_CORES_H__
 
+struct uart_pty_t;
+
 /* Cores */
-avr_t *m128rfa1_create(struct drumfish_cfg *config);
+/* 'index' tells the boards of a batch apart, 0 when there's only one */
+avr_t *m128rfa1_create(struct drumfish_cfg *config, int index);
+void m128rfa1_reset(avr_t *avr);
+int m128rfa1_make_private(avr_t *avr);
+int m128rfa1_after_fork(avr_t *avr);
+struct uart_pty_t *m128rfa1_uart(avr_t *avr, char uart);
 
 #endif /* __DF_CORES_H__ */
@@ -0,0 +1,324 @@
+/*
+ * df_ctl.c
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sim_avr.h>
+
+#include "drumfish.h"
+#include "flash.h"
+#include "df_cores.h"
+#include "df_ctl.h"
+#include "df_fork.h"
+#include "df_log.h"
+#include "df_reactor.h"
+
+#define CTL_MAX_CMD 1024
+
+volatile sig_atomic_t df_ctl_pending = 0;
+
+static struct {
+    struct df_reactor_src src;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+    /* Written by the reactor, consumed by the run loop */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int have_cmd;
+    char cmd[CTL_MAX_CMD];
+    struct sockaddr_un peer;
+    socklen_t peer_len;
+
+    volatile sig_atomic_t reset;
+} ctl = {
+    .src = { .fd = -1 },
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void
+ctl_event(struct df_reactor_src *src, uint32_t revents)
+{
+    ssize_t len;
+
+    pthread_mutex_lock(&ctl.lock);
+
+    /* Leave anything else queued in the socket until the run loop has
+     * dealt with the command it already has.
+     */
+    if (ctl.have_cmd) {
+        df_reactor_set_events(src, 0);
+        goto out;
+    }
+
+    if (revents & EPOLLIN) {
+        ctl.peer_len = sizeof(ctl.peer);
+        len = recvfrom(src->fd, ctl.cmd, sizeof(ctl.cmd) - 1, 0,
+                (struct sockaddr *)&ctl.peer, &ctl.peer_len);
+        if (len > 0) {
+            ctl.cmd[len] = '\0';
+            ctl.cmd[strcspn(ctl.cmd, "\r\n")] = '\0';
+            ctl.have_cmd = 1;
+            df_ctl_pending = 1;
+            pthread_cond_signal(&ctl.cond);
+            df_reactor_set_events(src, 0);
+            goto out;
+        }
+    }
+
+    df_reactor_set_events(src, EPOLLIN);
+
+out:
+    pthread_mutex_unlock(&ctl.lock);
+}
+
+static void
+ctl_cleanup(void)
+{
+    if (ctl.path[0])
+        unlink(ctl.path);
+}
+
+static int
+ctl_open(void)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        fprintf(stderr, "Unable to create control socket: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/drumfish-%d-ctl",
+            getpid());
+
+    /* Unconditionally attempt to remove the old one */
+    unlink(addr.sun_path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        fprintf(stderr, "Unable to bind control socket '%s': %s\n",
+                addr.sun_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    strcpy(ctl.path, addr.sun_path);
+
+    ctl.src.fd = fd;
+    ctl.src.events = EPOLLIN;
+    ctl.src.cb = ctl_event;
+    if (df_reactor_add(&ctl.src)) {
+        fprintf(stderr, "Failed to hook up the control socket to the "
+                "I/O reactor\n");
+        df_ctl_stop();
+        return -1;
+    }
+
+    printf("Control channel available at %s\n", ctl.path);
+
+    return 0;
+}
+
+int
+df_ctl_init(void)
+{
+    atexit(ctl_cleanup);
+
+    return ctl_open();
+}
+
+int
+df_ctl_after_fork(void)
+{
+    /* The socket we inherited belongs to our parent, as does whoever
+     * sent the command we are in the middle of.
+     */
+    close(ctl.src.fd);
+    memset(&ctl.src, 0, sizeof(ctl.src));
+    ctl.src.fd = -1;
+    ctl.path[0] = '\0';
+    ctl.have_cmd = 0;
+    ctl.peer_len = 0;
+
+    pthread_mutex_init(&ctl.lock, NULL);
+    pthread_cond_init(&ctl.cond, NULL);
+
+    return ctl_open();
+}
+
+void
+df_ctl_wait(void)
+{
+    pthread_mutex_lock(&ctl.lock);
+    while (!ctl.have_cmd)
+        pthread_cond_wait(&ctl.cond, &ctl.lock);
+    pthread_mutex_unlock(&ctl.lock);
+}
+
+void
+df_ctl_stop(void)
+{
+    if (ctl.src.fd == -1)
+        return;
+
+    df_reactor_del(&ctl.src);
+    close(ctl.src.fd);
+    ctl.src.fd = -1;
+
+    ctl_cleanup();
+    ctl.path[0] = '\0';
+}
+
+void
+df_ctl_request_reset(void)
+{
+    ctl.reset = 1;
+    df_ctl_pending = 1;
+}
+
+static int
+ctl_load(avr_t *avr, char *args, const char **err)
+{
+    char *save = NULL;
+    char *file;
+    int loaded = 0;
+
+    for (file = strtok_r(args, " \t", &save); file;
+            file = strtok_r(NULL, " \t", &save)) {
+        if (flash_load(file, avr->flash, avr->flashend + 1)) {
+            *err = "unable to load firmware";
+            return -1;
+        }
+        loaded++;
+    }
+
+    if (!loaded) {
+        *err = "no firmware given";
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+ctl_reply(const char *msg)
+{
+    /* Unbound senders can't be answered */
+    if (ctl.peer_len <= sizeof(sa_family_t))
+        return;
+
+    sendto(ctl.src.fd, msg, strlen(msg), MSG_DONTWAIT,
+            (struct sockaddr *)&ctl.peer, ctl.peer_len);
+}
+
+void
+df_ctl_process(avr_t *avr)
+{
+    char cmd[CTL_MAX_CMD];
+    char *args;
+    const char *err = NULL;
+    char reply[CTL_MAX_CMD + 8];
+    pid_t pid;
+
+    df_ctl_pending = 0;
+    reply[0] = '\0';
+
+    if (ctl.reset) {
+        ctl.reset = 0;
+        df_log_msg(DF_LOG_INFO, "Resetting CPU.\n");
+        m128rfa1_reset(avr);
+    }
+
+    /* A fork server that has finished booting stops here and only
+     * comes back out as a freshly forked child.
+     */
+    if (df_fork_should_serve()) {
+        df_fork_serve(avr);
+        return;
+    }
+
+    pthread_mutex_lock(&ctl.lock);
+    if (!ctl.have_cmd) {
+        pthread_mutex_unlock(&ctl.lock);
+        return;
+    }
+    memcpy(cmd, ctl.cmd, sizeof(cmd));
+    pthread_mutex_unlock(&ctl.lock);
+
+    args = cmd + strcspn(cmd, " \t");
+    if (*args)
+        *args++ = '\0';
+
+    df_log_msg(DF_LOG_INFO, "Control command '%s'\n", cmd);
+
+    if (!strcmp(cmd, "reset")) {
+        m128rfa1_reset(avr);
+    } else if (!strcmp(cmd, "erase")) {
+        memset(avr->flash, 0xFF, avr->flashend + 1);
+    } else if (!strcmp(cmd, "load")) {
+        /* Warm reset into whatever we just loaded */
+        if (!ctl_load(avr, args, &err))
+            m128rfa1_reset(avr);
+    } else if (!strcmp(cmd, "fork")) {
+        pid = df_fork_spawn(avr, *args ? args : NULL, &err);
+
+        /* The child has a control channel of its own now */
+        if (pid == 0)
+            return;
+
+        snprintf(reply, sizeof(reply), "OK %d\n", pid);
+    } else {
+        err = "unknown command";
+    }
+
+    if (err) {
+        df_log_msg(DF_LOG_WARN, "Control command '%s' failed: %s\n",
+                cmd, err);
+        snprintf(reply, sizeof(reply), "ERR %s\n", err);
+    } else if (!reply[0]) {
+        snprintf(reply, sizeof(reply), "OK\n");
+    }
+
+    pthread_mutex_lock(&ctl.lock);
+    ctl_reply(reply);
+    ctl.have_cmd = 0;
+    pthread_mutex_unlock(&ctl.lock);
+
+    /* Let the reactor pick up the next command */
+    df_reactor_kick(&ctl.src);
+}
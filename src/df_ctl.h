@@ -0,0 +1,48 @@
+/*
+ * df_ctl.h
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_CTL_H__
+#define __DF_CTL_H__
+
+#include <signal.h>
+
+/* Set whenever the run loop has control work to do. Checked on every
+ * pass through the run loop so it must stay cheap to read.
+ */
+extern volatile sig_atomic_t df_ctl_pending;
+
+int df_ctl_init(void);
+
+void df_ctl_stop(void);
+
+/* Replaces the inherited control channel with one of our own */
+int df_ctl_after_fork(void);
+
+/* Blocks until there is a command waiting to be processed */
+void df_ctl_wait(void);
+
+/* Safe to call from a signal handler */
+void df_ctl_request_reset(void);
+
+/* Must be called from the thread running the AVR */
+void df_ctl_process(avr_t *avr);
+
+#endif /* __DF_CTL_H__ */
@@ -0,0 +1,240 @@
+/*
+ * df_fork.c
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/types.h>
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sim_avr.h>
+#include <avr_uart.h>
+
+#include "drumfish.h"
+#include "df_clock.h"
+#include "df_cores.h"
+#include "df_ctl.h"
+#include "df_fork.h"
+#include "df_fuzz.h"
+#include "df_log.h"
+#include "df_stats.h"
+
+static struct {
+    struct drumfish_cfg *config;
+    volatile sig_atomic_t ready;
+    int serving;
+    int child;
+    struct df_clock_event boot_ev;
+
+    /* The last marker_len bytes the AVR sent out of any UART */
+    uint8_t *window;
+    size_t window_pos;
+    size_t marker_len;
+} fork_srv;
+
+static void
+fork_ready(avr_t *avr, const char *why)
+{
+    if (fork_srv.ready)
+        return;
+
+    df_log_msg(DF_LOG_INFO, "Fork server booted (%s) at cycle %llu\n",
+            why, (unsigned long long)avr->cycle);
+
+    /* Picked up by the run loop after this instruction */
+    fork_srv.ready = 1;
+    df_ctl_pending = 1;
+}
+
+static void
+fork_boot_tick(avr_t *avr, uint64_t when, void *opaque)
+{
+    (void)when;
+    (void)opaque;
+
+    fork_ready(avr, "cycle count");
+}
+
+static void
+fork_uart_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+    avr_t *avr = (avr_t *)param;
+    const char *marker = fork_srv.config->fork_marker;
+    size_t len = fork_srv.marker_len;
+    size_t start;
+    size_t i;
+
+    (void)irq;
+
+    if (fork_srv.ready)
+        return;
+
+    fork_srv.window[fork_srv.window_pos++ % len] = value;
+    if (fork_srv.window_pos < len)
+        return;
+
+    start = fork_srv.window_pos % len;
+    for (i = 0; i < len; i++)
+        if (fork_srv.window[(start + i) % len] != (uint8_t)marker[i])
+            return;
+
+    fork_ready(avr, "UART marker");
+}
+
+int
+df_fork_init(struct drumfish_cfg *config, avr_t *avr)
+{
+    avr_irq_t *irq;
+    char uart;
+
+    if (!config->fork_cycle && !config->fork_marker)
+        return 0;
+
+    fork_srv.config = config;
+
+    if (config->fork_cycle) {
+        df_clock_event_init(&fork_srv.boot_ev, fork_boot_tick, NULL);
+        df_clock_schedule_at(df_clock_get(avr), &fork_srv.boot_ev,
+                config->fork_cycle);
+    }
+
+    if (config->fork_marker) {
+        fork_srv.marker_len = strlen(config->fork_marker);
+        fork_srv.window = calloc(fork_srv.marker_len, 1);
+        if (!fork_srv.window) {
+            fprintf(stderr, "Failed to allocate memory for fork marker.\n");
+            return -1;
+        }
+
+        for (uart = '0'; uart <= '1'; uart++) {
+            irq = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ(uart),
+                    UART_IRQ_OUTPUT);
+            if (irq)
+                avr_irq_register_notify(irq, fork_uart_hook, avr);
+        }
+    }
+
+    return 0;
+}
+
+int
+df_fork_should_serve(void)
+{
+    return fork_srv.ready && !fork_srv.serving && !fork_srv.child;
+}
+
+void
+df_fork_serve(avr_t *avr)
+{
+    struct sigaction act;
+
+    fork_srv.serving = 1;
+
+    /* Children must not write through to our pflash or EEPROM, and with
+     * private copies they share their pages until they write to them.
+     */
+    if (m128rfa1_make_private(avr)) {
+        fprintf(stderr, "Unable to make flash private for forking.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (fork_srv.config->fuzz)
+        df_fuzz_serve(fork_srv.config, avr);
+
+    /* Nobody is going to wait() for the children */
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = SIG_DFL;
+    act.sa_flags = SA_NOCLDWAIT;
+    sigaction(SIGCHLD, &act, NULL);
+
+    printf("Fork server ready at cycle %llu, send 'fork [MAC]' to the "
+            "control channel to start a node\n",
+            (unsigned long long)avr->cycle);
+    fflush(stdout);
+
+    while (!fork_srv.child) {
+        df_ctl_wait();
+        df_ctl_process(avr);
+    }
+}
+
+pid_t
+df_fork_spawn(avr_t *avr, const char *mac, const char **err)
+{
+    struct sigaction act;
+    char *new_mac = NULL;
+    pid_t pid;
+
+    if (!fork_srv.serving) {
+        *err = "not a fork server or still booting";
+        return -1;
+    }
+
+    if (mac) {
+        new_mac = strdup(mac);
+        if (!new_mac) {
+            *err = "out of memory";
+            return -1;
+        }
+    }
+
+    /* Don't hand our buffered output to the child as well */
+    fflush(NULL);
+
+    pid = fork();
+    if (pid < 0) {
+        free(new_mac);
+        *err = "fork failed";
+        return -1;
+    }
+
+    if (pid > 0) {
+        free(new_mac);
+        df_log_msg(DF_LOG_INFO, "Forked node %d\n", pid);
+        return pid;
+    }
+
+    fork_srv.child = 1;
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = SIG_DFL;
+    sigaction(SIGCHLD, &act, NULL);
+
+    if (new_mac) {
+        free(fork_srv.config->mac);
+        fork_srv.config->mac = new_mac;
+    }
+
+    /* Everything that points outside of this process gets recreated */
+    if (df_ctl_after_fork() || m128rfa1_after_fork(avr) ||
+            df_stats_after_fork(avr)) {
+        fprintf(stderr, "Forked node %d failed to start.\n", getpid());
+        _exit(EXIT_FAILURE);
+    }
+
+    printf("Node %d forked from %d at cycle %llu\n", getpid(), getppid(),
+            (unsigned long long)avr->cycle);
+
+    return 0;
+}
@@ -0,0 +1,42 @@
+/*
+ * df_fork.h
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_FORK_H__
+#define __DF_FORK_H__
+
+#include <sys/types.h>
+
+struct drumfish_cfg;
+
+int df_fork_init(struct drumfish_cfg *config, avr_t *avr);
+
+/* True once the fork server has booted and should start serving */
+int df_fork_should_serve(void);
+
+/* Only returns in a newly forked child */
+void df_fork_serve(avr_t *avr);
+
+/* Returns the child's pid in the server, 0 in the child and -1 with
+ * 'err' set on failure. 'mac' replaces the child's MAC if given.
+ */
+pid_t df_fork_spawn(avr_t *avr, const char *mac, const char **err);
+
+#endif /* __DF_FORK_H__ */
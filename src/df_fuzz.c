@@ -0,0 +1,318 @@
+/*
+ * df_fuzz.c
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/types.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sim_avr.h>
+
+#include "drumfish.h"
+#include "uart_pty.h"
+#include "df_cores.h"
+#include "df_fuzz.h"
+#include "df_hook.h"
+#include "df_log.h"
+#include "df_snapshot.h"
+
+/* afl-fuzz talks to its fork server over these, the status pipe is the
+ * next one up.
+ */
+#define FUZZ_FORKSRV_FD 198
+
+#define FUZZ_MAP_BITS 16
+#define FUZZ_MAP_SIZE (1 << FUZZ_MAP_BITS)
+
+/* Test cases run by a worker before it's replaced with a fresh fork */
+#define FUZZ_PERSIST_MAX 10000
+
+#define FUZZ_INPUT_MAX (64 * 1024)
+
+/* afl-fuzz scans the binary for these to decide how to drive us */
+static const char fuzz_shm_env[] = "__AFL_SHM_ID";
+static const char fuzz_persist_sig[] __attribute__((used)) =
+    "##SIG_AFL_PERSISTENT##";
+
+static struct {
+    struct drumfish_cfg *config;
+    uint8_t *map;
+    uint32_t prev;
+    uart_pty_t *uart;
+    struct df_snapshot *snap;
+    uint8_t input[FUZZ_INPUT_MAX];
+} fuzz;
+
+static inline int
+fuzz_insn_is_32bit(uint16_t op)
+{
+    /* LDS, STS, JMP and CALL */
+    return (op & 0xfc0f) == 0x9000 || (op & 0xfe0c) == 0x940c;
+}
+
+static inline int
+fuzz_insn_is_cond(uint16_t op)
+{
+    /* BRBS/BRBC, CPSE, SBRC/SBRS and SBIC/SBIS */
+    return (op & 0xf800) == 0xf000 || (op & 0xfc00) == 0x1000 ||
+        (op & 0xfc08) == 0xfc00 || (op & 0xfd00) == 0x9900;
+}
+
+static void
+fuzz_cov_hook(avr_t *avr, avr_flashaddr_t pc, avr_flashaddr_t new_pc,
+        void *opaque)
+{
+    uint16_t op = avr->flash[pc] | (avr->flash[pc + 1] << 8);
+    uint32_t cur;
+
+    (void)opaque;
+
+    /* Falling through to the next instruction is only an edge when the
+     * instruction could have gone somewhere else.
+     */
+    if (new_pc == pc + (fuzz_insn_is_32bit(op) ? 4 : 2) &&
+            !fuzz_insn_is_cond(op))
+        return;
+
+    cur = ((new_pc >> 1) * 2654435761u) >> (32 - FUZZ_MAP_BITS);
+    fuzz.map[cur ^ fuzz.prev]++;
+    fuzz.prev = cur >> 1;
+}
+
+static int
+fuzz_map_init(void)
+{
+    const char *env = getenv(fuzz_shm_env);
+
+    if (!env) {
+        fuzz.map = calloc(FUZZ_MAP_SIZE, 1);
+        if (!fuzz.map) {
+            fprintf(stderr, "Failed to allocate memory for coverage map.\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    fuzz.map = shmat(atoi(env), NULL, 0);
+    if (fuzz.map == (void *)-1) {
+        fprintf(stderr, "Unable to attach coverage map %s: %s\n", env,
+                strerror(errno));
+        fuzz.map = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static ssize_t
+fuzz_read_input(void)
+{
+    size_t len = 0;
+    ssize_t r;
+    int fd = STDIN_FILENO;
+
+    if (fuzz.config->fuzz_input) {
+        fd = open(fuzz.config->fuzz_input, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "Unable to open test case '%s': %s\n",
+                    fuzz.config->fuzz_input, strerror(errno));
+            return -1;
+        }
+    }
+
+    while (len < sizeof(fuzz.input)) {
+        r = read(fd, fuzz.input + len, sizeof(fuzz.input) - len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            break;
+        len += r;
+    }
+
+    if (fd != STDIN_FILENO)
+        close(fd);
+
+    return len;
+}
+
+static void
+fuzz_run_one(avr_t *avr)
+{
+    avr_cycle_count_t end;
+    ssize_t len;
+    int state;
+
+    len = fuzz_read_input();
+    if (len < 0)
+        _exit(EXIT_FAILURE);
+
+    df_snapshot_restore(avr, fuzz.snap);
+    fuzz.prev = 0;
+
+    uart_pty_rx_reset(fuzz.uart);
+    uart_pty_feed(fuzz.uart, fuzz.input, len);
+
+    end = avr->cycle + fuzz.config->fuzz_cycles;
+    while (avr->cycle < end) {
+        state = avr_run(avr);
+
+        /* Make sure afl-fuzz sees this as a crash */
+        if (state == cpu_Crashed) {
+            df_log_msg(DF_LOG_ERR, "CPU crashed at 0x%x\n", avr->pc);
+            df_log_flush();
+            abort();
+        }
+
+        if (state == cpu_Done)
+            break;
+    }
+}
+
+static void
+fuzz_worker(avr_t *avr)
+{
+    unsigned int runs = 0;
+
+    close(FUZZ_FORKSRV_FD);
+    close(FUZZ_FORKSRV_FD + 1);
+
+    /* Stopping ourselves tells the fork server this test case is done
+     * and it continues us once the next one is ready.
+     */
+    for (;;) {
+        fuzz_run_one(avr);
+        if (++runs == FUZZ_PERSIST_MAX)
+            _exit(EXIT_SUCCESS);
+        raise(SIGSTOP);
+    }
+}
+
+static void
+fuzz_forkserver(avr_t *avr)
+{
+    uint32_t was_killed;
+    int stopped = 0;
+    int status;
+    pid_t pid = -1;
+
+    for (;;) {
+        if (read(FUZZ_FORKSRV_FD, &was_killed, sizeof(was_killed)) !=
+                sizeof(was_killed))
+            break;
+
+        /* afl-fuzz killed a stopped worker after a timeout */
+        if (stopped && was_killed) {
+            stopped = 0;
+            waitpid(pid, &status, 0);
+        }
+
+        if (!stopped) {
+            pid = fork();
+            if (pid < 0) {
+                df_log_msg(DF_LOG_ERR, "Unable to fork fuzz worker: %s\n",
+                        strerror(errno));
+                break;
+            }
+            if (!pid)
+                fuzz_worker(avr);
+        } else {
+            kill(pid, SIGCONT);
+            stopped = 0;
+        }
+
+        if (write(FUZZ_FORKSRV_FD + 1, &pid, sizeof(pid)) != sizeof(pid))
+            break;
+
+        if (waitpid(pid, &status, WUNTRACED) < 0)
+            break;
+
+        if (WIFSTOPPED(status))
+            stopped = 1;
+
+        if (write(FUZZ_FORKSRV_FD + 1, &status, sizeof(status)) !=
+                sizeof(status))
+            break;
+    }
+
+    /* afl-fuzz has gone away */
+    if (stopped)
+        kill(pid, SIGKILL);
+
+    exit(EXIT_SUCCESS);
+}
+
+void
+df_fuzz_serve(struct drumfish_cfg *config, avr_t *avr)
+{
+    uint32_t hello = 0;
+    size_t edges = 0;
+    size_t i;
+
+    fuzz.config = config;
+
+    fuzz.uart = m128rfa1_uart(avr, config->fuzz_uart);
+    if (!fuzz.uart) {
+        fprintf(stderr, "No UART%c to fuzz.\n", config->fuzz_uart);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Test cases are all the UART hears from now on. The reactor would
+     * otherwise keep filling the ring we empty before each one, from a
+     * thread of its own.
+     */
+    uart_pty_stop(fuzz.uart);
+
+    if (fuzz_map_init() || df_hook_insn_add(avr, fuzz_cov_hook, NULL))
+        exit(EXIT_FAILURE);
+
+    /* Every test case starts from exactly where boot left us */
+    fuzz.snap = df_snapshot_take(avr);
+    if (!fuzz.snap)
+        exit(EXIT_FAILURE);
+
+    /* We need to reap our workers ourselves */
+    signal(SIGCHLD, SIG_DFL);
+
+    if (write(FUZZ_FORKSRV_FD + 1, &hello, sizeof(hello)) == sizeof(hello))
+        fuzz_forkserver(avr);
+
+    /* Not started by afl-fuzz, so just run the one test case. Handy for
+     * reproducing a crash.
+     */
+    fuzz_run_one(avr);
+
+    for (i = 0; i < FUZZ_MAP_SIZE; i++)
+        if (fuzz.map[i])
+            edges++;
+
+    printf("Test case ran to cycle %llu, %zu edges hit\n",
+            (unsigned long long)avr->cycle, edges);
+
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,36 @@
+/*
+ * df_fuzz.h
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_FUZZ_H__
+#define __DF_FUZZ_H__
+
+struct drumfish_cfg;
+
+/* Default cycle budget for each test case, 100ms at 16MHz */
+#define DF_FUZZ_DEFAULT_CYCLES 1600000ULL
+
+/* Called once the node has booted. Speaks the afl-fuzz fork server
+ * protocol if we were started by it, otherwise runs a single test case.
+ * Never returns.
+ */
+void df_fuzz_serve(struct drumfish_cfg *config, avr_t *avr);
+
+#endif /* __DF_FUZZ_H__ */
@@ -0,0 +1,1929 @@
+/*
+ * df_gdb.c
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sim_avr.h>
+#include <avr_eeprom.h>
+
+#include "drumfish.h"
+#include "df_board.h"
+#include "df_clock.h"
+#include "df_gdb.h"
+#include "df_hook.h"
+#include "df_log.h"
+#include "df_reactor.h"
+#include "df_snapshot.h"
+
+/* Where avr-gdb expects each address space */
+#define GDB_SRAM_BASE 0x800000
+#define GDB_EEPROM_BASE 0x810000
+#define GDB_EEPROM_END 0x820000
+
+/* Registers as avr-gdb numbers them: r0-r31, SREG, SP and PC */
+#define GDB_REG_SREG 32
+#define GDB_REG_SP 33
+#define GDB_REG_PC 34
+#define GDB_REGS_LEN 39
+
+/* Largest packet either side sends, also what we tell GDB */
+#define GDB_MAX_PACKET 0x4000
+
+/* Thread ids handed out per qfThreadInfo/qsThreadInfo reply */
+#define GDB_THREADS_PER_REPLY 256
+
+#define GDB_SIGINT 2
+#define GDB_SIGTRAP 5
+#define GDB_SIGSEGV 11
+
+/* Watchpoints, shared by every board like breakpoints. Their kinds are
+ * numbered as in the Z packets that set them.
+ */
+#define GDB_MAX_WATCH 4
+#define GDB_WATCH_LEN 16
+#define GDB_WATCH_WRITE 2
+#define GDB_WATCH_READ 3
+#define GDB_WATCH_ACCESS 4
+
+/* How long df_gdb_wait() sleeps before giving the run loop a turn */
+#define GDB_WAIT_MSEC 100
+
+volatile sig_atomic_t df_gdb_pending = 0;
+
+struct gdb_board {
+    avr_t *avr;
+    size_t index;
+
+    /* Held by the debugger, and what to go back to when let go */
+    int stopped;
+    int resume_state;
+
+    int step;
+
+    /* Stopped with 'signal' and GDB hasn't been told yet */
+    int pending;
+    int signal;
+    /* What it stopped on: a watchpoint's GDB address, or running out of
+     * history going backwards
+     */
+    unsigned long stop_watch;
+    int stop_watch_type;
+    int stop_begin;
+
+    /* A read or access watchpoint the last instruction touched */
+    unsigned long mem_hit;
+    int mem_hit_type;
+
+    /* What was under each watchpoint when this board last looked */
+    uint8_t watch_val[GDB_MAX_WATCH][GDB_WATCH_LEN];
+
+    /* Checkpoints to go backwards from, oldest first. Each one shares
+     * its unchanged pages with the one before.
+     */
+    struct df_snapshot **ckpt;
+    size_t ckpt_len;
+    size_t ckpt_alloc;
+    size_t history;
+    struct df_clock_event ckpt_ev;
+    int ckpt_due;
+};
+
+static struct {
+    struct df_reactor_src listen;
+    struct df_reactor_src client;
+
+    /* Set by the reactor, the run loop does the reading itself */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int ready;
+
+    struct gdb_board *b;
+    size_t len;
+
+    int no_ack;
+    int non_stop;
+    /* All-stop: GDB is waiting for a stop reply to its resume */
+    int resumed;
+    /* Non-stop: a %Stop notification is waiting on vStopped */
+    int notified;
+    size_t g_thread;
+    size_t c_thread;
+    size_t thread_info;
+
+    /* Breakpoints apply to every board, one bit per flash word */
+    uint8_t *bp;
+    size_t bp_words;
+    unsigned int bp_count;
+    int hooked;
+
+    /* An empty slot has a len of 0 */
+    struct {
+        uint16_t addr;
+        uint8_t len;
+        uint8_t type;
+    } watch[GDB_MAX_WATCH];
+    unsigned int watch_count;
+    /* Read and access watchpoints, which need every load decoded */
+    unsigned int access_count;
+    int mem_hooked;
+
+    /* Reverse execution, off when ckpt_interval is 0 */
+    unsigned long long ckpt_interval;
+    size_t history_max;
+    int replaying;
+
+    char in[GDB_MAX_PACKET + 4];
+    size_t in_len;
+    char pkt[GDB_MAX_PACKET + 1];
+    char out[GDB_MAX_PACKET * 2 + 8];
+    char wire[GDB_MAX_PACKET * 2 + 12];
+} gdb = {
+    .listen = { .fd = -1 },
+    .client = { .fd = -1 },
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static const char gdb_hex[] = "0123456789abcdef";
+
+static int
+gdb_unhex(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+
+    return -1;
+}
+
+static size_t
+gdb_tohex(char *dst, const uint8_t *src, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        dst[i * 2] = gdb_hex[src[i] >> 4];
+        dst[i * 2 + 1] = gdb_hex[src[i] & 0xF];
+    }
+
+    return len * 2;
+}
+
+/* Returns how many bytes were decoded before running out of digits */
+static size_t
+gdb_fromhex(uint8_t *dst, const char *src, size_t len)
+{
+    size_t i;
+    int hi;
+    int lo;
+
+    for (i = 0; i < len; i++) {
+        hi = gdb_unhex(src[i * 2]);
+        lo = hi < 0 ? -1 : gdb_unhex(src[i * 2 + 1]);
+        if (lo < 0)
+            break;
+        dst[i] = hi << 4 | lo;
+    }
+
+    return i;
+}
+
+static unsigned long
+gdb_parse_hex(const char *s, const char **end)
+{
+    unsigned long v = 0;
+    int d;
+
+    while ((d = gdb_unhex(*s)) >= 0) {
+        v = v << 4 | d;
+        s++;
+    }
+
+    *end = s;
+
+    return v;
+}
+
+/* Thread ids are board index + 1, with -1 for all and 0 for any */
+static long
+gdb_parse_tid(const char *s, const char **end)
+{
+    if (s[0] == '-' && s[1] == '1') {
+        *end = s + 2;
+        return -1;
+    }
+
+    return gdb_parse_hex(s, end);
+}
+
+static struct gdb_board *
+gdb_board_of(long tid)
+{
+    if (tid <= 0 || (size_t)tid > gdb.len)
+        return NULL;
+
+    return &gdb.b[tid - 1];
+}
+
+static void gdb_disconnect(void);
+
+static void
+gdb_write(const char *buf, size_t len)
+{
+    struct pollfd pfd;
+    ssize_t ret;
+
+    while (len && gdb.client.fd != -1) {
+        ret = send(gdb.client.fd, buf, len, MSG_NOSIGNAL);
+        if (ret > 0) {
+            buf += ret;
+            len -= ret;
+            continue;
+        }
+
+        if (ret == -1 && errno == EINTR)
+            continue;
+
+        /* GDB reads everything we send promptly, so just wait for it */
+        if (ret == -1 && errno == EAGAIN) {
+            pfd.fd = gdb.client.fd;
+            pfd.events = POLLOUT;
+            poll(&pfd, 1, -1);
+            continue;
+        }
+
+        gdb_disconnect();
+    }
+}
+
+/* 'type' is '$' for packets and '%' for notifications */
+static void
+gdb_send(char type, const char *data, size_t len)
+{
+    uint8_t csum = 0;
+    size_t i;
+
+    gdb.wire[0] = type;
+    for (i = 0; i < len; i++) {
+        csum += (uint8_t)data[i];
+        gdb.wire[i + 1] = data[i];
+    }
+    gdb.wire[len + 1] = '#';
+    gdb.wire[len + 2] = gdb_hex[csum >> 4];
+    gdb.wire[len + 3] = gdb_hex[csum & 0xF];
+
+    gdb_write(gdb.wire, len + 4);
+}
+
+static void
+gdb_reply(const char *s)
+{
+    gdb_send('$', s, strlen(s));
+}
+
+static void
+gdb_reply_out(size_t len)
+{
+    gdb_send('$', gdb.out, len);
+}
+
+static void
+gdb_stop_reply(char type, const char *prefix, struct gdb_board *b)
+{
+    static const char *const kinds[] = { "watch", "rwatch", "awatch" };
+    size_t len;
+
+    len = snprintf(gdb.out, sizeof(gdb.out), "%sT%02xthread:%zx;", prefix,
+            b->signal & 0xFF, b->index + 1);
+    if (b->stop_watch)
+        len += snprintf(gdb.out + len, sizeof(gdb.out) - len, "%s:%lx;",
+                kinds[b->stop_watch_type - GDB_WATCH_WRITE], b->stop_watch);
+    if (b->stop_begin)
+        len += snprintf(gdb.out + len, sizeof(gdb.out) - len,
+                "replaylog:begin;");
+    gdb_send(type, gdb.out, len);
+}
+
+static uint8_t
+gdb_sreg(avr_t *avr)
+{
+    uint8_t v = 0;
+    int i;
+
+    for (i = 0; i < 8; i++)
+        if (avr->sreg[i])
+            v |= 1 << i;
+
+    return v;
+}
+
+static void
+gdb_set_sreg(avr_t *avr, uint8_t v)
+{
+    int i;
+
+    for (i = 0; i < 8; i++)
+        avr->sreg[i] = (v >> i) & 1;
+    avr->data[R_SREG] = v;
+}
+
+static void
+gdb_read_regs(avr_t *avr, uint8_t regs[GDB_REGS_LEN])
+{
+    memcpy(regs, avr->data, 32);
+    regs[32] = gdb_sreg(avr);
+    regs[33] = avr->data[R_SPL];
+    regs[34] = avr->data[R_SPH];
+    regs[35] = avr->pc;
+    regs[36] = avr->pc >> 8;
+    regs[37] = avr->pc >> 16;
+    regs[38] = 0;
+}
+
+static void
+gdb_write_regs(avr_t *avr, const uint8_t regs[GDB_REGS_LEN])
+{
+    memcpy(avr->data, regs, 32);
+    gdb_set_sreg(avr, regs[32]);
+    avr->data[R_SPL] = regs[33];
+    avr->data[R_SPH] = regs[34];
+    avr->pc = regs[35] | regs[36] << 8 | regs[37] << 16;
+}
+
+/* Where register 'reg' starts in the 'g' layout and how long it is */
+static int
+gdb_reg_span(unsigned long reg, size_t *off, size_t *len)
+{
+    if (reg < GDB_REG_SREG + 1) {
+        *off = reg;
+        *len = 1;
+    } else if (reg == GDB_REG_SP) {
+        *off = 33;
+        *len = 2;
+    } else if (reg == GDB_REG_PC) {
+        *off = 35;
+        *len = 4;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Maps a GDB address onto one of the core's address spaces, trimming
+ * 'len' to what's there. Returns NULL if nothing is.
+ */
+static uint8_t *
+gdb_mem(avr_t *avr, unsigned long addr, size_t *len, int *eeprom)
+{
+    unsigned long end;
+    uint8_t *base;
+
+    *eeprom = 0;
+
+    if (addr < GDB_SRAM_BASE) {
+        base = avr->flash;
+        end = avr->flashend + 1;
+    } else if (addr < GDB_EEPROM_BASE) {
+        addr -= GDB_SRAM_BASE;
+        base = avr->data;
+        end = avr->ramend + 1;
+    } else if (addr < GDB_EEPROM_END) {
+        /* Goes through the EEPROM's ioctls, this is just the offset */
+        addr -= GDB_EEPROM_BASE;
+        base = NULL;
+        end = avr->e2end + 1;
+        *eeprom = 1;
+    } else {
+        return NULL;
+    }
+
+    if (addr >= end)
+        return NULL;
+
+    if (*len > end - addr)
+        *len = end - addr;
+
+    return base ? base + addr : (uint8_t *)(uintptr_t)addr;
+}
+
+static size_t
+gdb_mem_read(avr_t *avr, unsigned long addr, uint8_t *buf, size_t len)
+{
+    avr_eeprom_desc_t desc;
+    uint8_t *src;
+    int eeprom;
+
+    src = gdb_mem(avr, addr, &len, &eeprom);
+    if (!src || !len)
+        return 0;
+
+    if (eeprom) {
+        desc.ee = buf;
+        desc.offset = (uintptr_t)src;
+        desc.size = len;
+        if (avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &desc))
+            return 0;
+        return len;
+    }
+
+    memcpy(buf, src, len);
+
+    return len;
+}
+
+static int
+gdb_mem_write(avr_t *avr, unsigned long addr, uint8_t *buf, size_t len)
+{
+    avr_eeprom_desc_t desc;
+    size_t want = len;
+    uint8_t *dst;
+    int eeprom;
+
+    if (!len)
+        return 0;
+
+    dst = gdb_mem(avr, addr, &len, &eeprom);
+    if (!dst || len != want)
+        return -1;
+
+    if (eeprom) {
+        desc.ee = buf;
+        desc.offset = (uintptr_t)dst;
+        desc.size = len;
+        return avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &desc) ? -1 : 0;
+    }
+
+    memcpy(dst, buf, len);
+
+    return 0;
+}
+
+static int
+gdb_bp_test(avr_flashaddr_t pc)
+{
+    size_t word = pc >> 1;
+
+    return word < gdb.bp_words && (gdb.bp[word >> 3] & (1 << (word & 7)));
+}
+
+static void
+gdb_watch_read(avr_t *avr, uint8_t val[GDB_MAX_WATCH][GDB_WATCH_LEN])
+{
+    int i;
+
+    for (i = 0; i < GDB_MAX_WATCH; i++)
+        if (gdb.watch[i].len)
+            memcpy(val[i], avr->data + gdb.watch[i].addr, gdb.watch[i].len);
+}
+
+/* Returns the GDB address of the first write watchpoint whose value
+ * changed since 'val' was filled in, or 0. Either way 'val' is brought
+ * up to date.
+ */
+static unsigned long
+gdb_watch_changed(avr_t *avr, uint8_t val[GDB_MAX_WATCH][GDB_WATCH_LEN])
+{
+    unsigned long hit = 0;
+    const uint8_t *cur;
+    int i;
+
+    for (i = 0; i < GDB_MAX_WATCH; i++) {
+        if (!gdb.watch[i].len || gdb.watch[i].type != GDB_WATCH_WRITE)
+            continue;
+
+        cur = avr->data + gdb.watch[i].addr;
+        if (!memcmp(val[i], cur, gdb.watch[i].len))
+            continue;
+
+        memcpy(val[i], cur, gdb.watch[i].len);
+        if (!hit)
+            hit = GDB_SRAM_BASE + gdb.watch[i].addr;
+    }
+
+    return hit;
+}
+
+/* Loads only ever show up here, an access watchpoint sees both */
+static void
+gdb_mem_hook(avr_t *avr, avr_flashaddr_t pc, avr_io_addr_t addr, int store,
+        void *opaque)
+{
+    struct gdb_board *b = opaque;
+    int i;
+
+    (void)avr;
+    (void)pc;
+
+    if (b->mem_hit)
+        return;
+
+    for (i = 0; i < GDB_MAX_WATCH; i++) {
+        if (!gdb.watch[i].len || addr < gdb.watch[i].addr ||
+                addr >= gdb.watch[i].addr + gdb.watch[i].len)
+            continue;
+
+        if (gdb.watch[i].type == GDB_WATCH_ACCESS ||
+                (gdb.watch[i].type == GDB_WATCH_READ && !store)) {
+            b->mem_hit = GDB_SRAM_BASE + gdb.watch[i].addr;
+            b->mem_hit_type = gdb.watch[i].type;
+            return;
+        }
+    }
+}
+
+static void
+gdb_checkpoint_drop_oldest(struct gdb_board *b)
+{
+    b->history -= df_snapshot_free(b->ckpt[0]);
+    memmove(b->ckpt, b->ckpt + 1, --b->ckpt_len * sizeof(*b->ckpt));
+}
+
+static void
+gdb_checkpoint(struct gdb_board *b)
+{
+    struct df_snapshot **ckpt;
+    struct df_snapshot *snap;
+
+    if (b->ckpt_len == b->ckpt_alloc) {
+        ckpt = realloc(b->ckpt, (b->ckpt_alloc * 2 + 16) * sizeof(*ckpt));
+        if (!ckpt)
+            return;
+        b->ckpt = ckpt;
+        b->ckpt_alloc = b->ckpt_alloc * 2 + 16;
+    }
+
+    snap = df_snapshot_take_delta(b->avr,
+            b->ckpt_len ? b->ckpt[b->ckpt_len - 1] : NULL);
+    if (!snap)
+        return;
+
+    /* Replaying from here has to actually run */
+    if (b->stopped)
+        snap->state = b->resume_state;
+
+    b->ckpt[b->ckpt_len++] = snap;
+    b->history += snap->bytes;
+
+    while (b->history > gdb.history_max && b->ckpt_len > 1)
+        gdb_checkpoint_drop_oldest(b);
+}
+
+static void
+gdb_checkpoint_due(avr_t *avr, uint64_t when, void *opaque)
+{
+    struct gdb_board *b = opaque;
+
+    /* Taken from the run loop, where the core is between instructions.
+     * Going back over old ground there's nothing new to keep, but the
+     * event still runs to time so the board sleeps as it did before.
+     */
+    if (!gdb.replaying) {
+        b->ckpt_due = 1;
+        df_gdb_pending = 1;
+    }
+
+    df_clock_schedule_at(df_clock_get(avr), &b->ckpt_ev,
+            when + gdb.ckpt_interval);
+}
+
+/* Going forwards from somewhere in the past makes a new future, so the
+ * checkpoints of the old one are no use.
+ */
+static void
+gdb_checkpoint_truncate(struct gdb_board *b)
+{
+    avr_t *avr = b->avr;
+    size_t len = b->ckpt_len;
+
+    while (b->ckpt_len && b->ckpt[b->ckpt_len - 1]->cycle > avr->cycle)
+        b->history -= df_snapshot_free(b->ckpt[--b->ckpt_len]);
+
+    if (b->ckpt_len == len || !b->ckpt_len)
+        return;
+
+    df_clock_schedule_at(df_clock_get(avr), &b->ckpt_ev,
+            b->ckpt[b->ckpt_len - 1]->cycle + gdb.ckpt_interval);
+}
+
+static void
+gdb_halt(struct gdb_board *b, int signal, int report)
+{
+    avr_t *avr = b->avr;
+
+    if (b->stopped || avr->state == cpu_Done || avr->state == cpu_Crashed)
+        return;
+
+    b->stopped = 1;
+    b->step = 0;
+    b->resume_state = avr->state == cpu_Sleeping ? cpu_Sleeping :
+        cpu_Running;
+    avr->state = cpu_Stopped;
+
+    if (report) {
+        b->pending = 1;
+        b->signal = signal;
+        df_gdb_pending = 1;
+    }
+}
+
+static void
+gdb_resume(struct gdb_board *b, int step)
+{
+    if (!b->stopped)
+        return;
+
+    b->stopped = 0;
+    b->pending = 0;
+    b->step = step;
+    b->stop_watch = 0;
+    b->stop_begin = 0;
+    gdb_checkpoint_truncate(b);
+    b->avr->state = b->resume_state;
+}
+
+/* Killed boards stay dead, even once the debugger goes away */
+static void
+gdb_kill(void)
+{
+    size_t i;
+
+    for (i = 0; i < gdb.len; i++) {
+        gdb.b[i].stopped = 0;
+        gdb.b[i].pending = 0;
+        gdb.b[i].avr->state = cpu_Done;
+    }
+}
+
+static void
+gdb_insn_hook(avr_t *avr, avr_flashaddr_t pc, avr_flashaddr_t new_pc,
+        void *opaque)
+{
+    struct gdb_board *b = opaque;
+    unsigned long watch = 0;
+    int type = GDB_WATCH_WRITE;
+
+    (void)pc;
+
+    /* Replays stop where they're told to, not on breakpoints, and
+     * gdb_replay_find() picks up the loads itself.
+     */
+    if (gdb.replaying)
+        return;
+
+    if (gdb.watch_count)
+        watch = gdb_watch_changed(avr, b->watch_val);
+    if (!watch && b->mem_hit) {
+        watch = b->mem_hit;
+        type = b->mem_hit_type;
+    }
+    b->mem_hit = 0;
+
+    if (watch || b->step || gdb_bp_test(new_pc)) {
+        gdb_halt(b, GDB_SIGTRAP, 1);
+        b->stop_watch = watch;
+        b->stop_watch_type = type;
+    }
+}
+
+/* Only boards being stepped or looking for breakpoints pay for a hook,
+ * and it can't be changed from inside one so we catch up afterwards.
+ */
+static void
+gdb_update_hooks(void)
+{
+    int need = gdb.bp_count > 0 || gdb.watch_count > 0;
+    int mem = gdb.access_count > 0;
+    size_t i;
+
+    for (i = 0; i < gdb.len && !need; i++)
+        need = gdb.b[i].step;
+
+    for (i = 0; i < gdb.len && mem != gdb.mem_hooked; i++) {
+        gdb.b[i].mem_hit = 0;
+        if (!mem) {
+            df_hook_mem_del(gdb.b[i].avr, gdb_mem_hook, &gdb.b[i]);
+        } else if (df_hook_mem_add(gdb.b[i].avr, gdb_mem_hook,
+                    &gdb.b[i])) {
+            df_log_msg(DF_LOG_ERR, "Unable to watch board %zu for "
+                    "reads\n", i);
+        }
+    }
+    gdb.mem_hooked = mem;
+
+    if (need == gdb.hooked)
+        return;
+
+    for (i = 0; i < gdb.len; i++) {
+        if (!need) {
+            df_hook_insn_del(gdb.b[i].avr, gdb_insn_hook, &gdb.b[i]);
+        } else if (df_hook_insn_add(gdb.b[i].avr, gdb_insn_hook,
+                    &gdb.b[i])) {
+            df_log_msg(DF_LOG_ERR, "Unable to watch board %zu for "
+                    "breakpoints\n", i);
+        }
+    }
+
+    gdb.hooked = need;
+}
+
+static struct gdb_board *
+gdb_next_pending(void)
+{
+    size_t i;
+
+    for (i = 0; i < gdb.len; i++)
+        if (gdb.b[i].pending)
+            return &gdb.b[i];
+
+    return NULL;
+}
+
+/* Tells GDB about boards that stopped on their own */
+static void
+gdb_report(void)
+{
+    struct gdb_board *b;
+    size_t i;
+
+    if (gdb.client.fd == -1)
+        return;
+
+    b = gdb_next_pending();
+    if (!b)
+        return;
+
+    if (gdb.non_stop) {
+        if (gdb.notified)
+            return;
+        b->pending = 0;
+        gdb.notified = 1;
+        gdb_stop_reply('%', "Stop:", b);
+        return;
+    }
+
+    if (!gdb.resumed)
+        return;
+
+    /* In all-stop mode everyone stops when one board does */
+    for (i = 0; i < gdb.len; i++) {
+        gdb_halt(&gdb.b[i], 0, 0);
+        gdb.b[i].pending = 0;
+    }
+
+    gdb.resumed = 0;
+    gdb.g_thread = gdb.c_thread = b->index;
+    gdb_stop_reply('$', "", b);
+}
+
+static void
+gdb_vstopped(void)
+{
+    struct gdb_board *b = gdb_next_pending();
+
+    if (!b) {
+        gdb.notified = 0;
+        gdb_reply("OK");
+        return;
+    }
+
+    b->pending = 0;
+    gdb_stop_reply('$', "", b);
+}
+
+static void
+gdb_status(void)
+{
+    struct gdb_board *b = &gdb.b[gdb.g_thread];
+    size_t i;
+
+    if (gdb.non_stop) {
+        /* Every stopped board is reported, the rest through vStopped */
+        for (i = 0; i < gdb.len; i++) {
+            if (gdb.b[i].stopped && !gdb.b[i].pending) {
+                gdb.b[i].pending = 1;
+                gdb.b[i].signal = 0;
+            }
+        }
+        gdb.notified = 1;
+        gdb_vstopped();
+        return;
+    }
+
+    if (!b->signal)
+        b->signal = GDB_SIGTRAP;
+    gdb_stop_reply('$', "", b);
+}
+
+static void
+gdb_interrupt(void)
+{
+    struct gdb_board *b = &gdb.b[gdb.c_thread];
+    size_t i;
+
+    /* Non-stop GDB stops threads with vCont;t */
+    if (gdb.non_stop)
+        return;
+
+    for (i = 0; i < gdb.len; i++)
+        gdb_halt(&gdb.b[i], 0, 0);
+
+    b->pending = 1;
+    b->signal = GDB_SIGINT;
+}
+
+static void
+gdb_resume_all_stop(int step)
+{
+    size_t i;
+
+    if (step) {
+        gdb_resume(&gdb.b[gdb.c_thread], 1);
+    } else {
+        for (i = 0; i < gdb.len; i++)
+            gdb_resume(&gdb.b[i], 0);
+    }
+
+    gdb.resumed = 1;
+}
+
+static int
+gdb_replay_step(avr_t *avr)
+{
+    int state = avr_run(avr);
+
+    return state == cpu_Running || state == cpu_Sleeping;
+}
+
+/* Replays board 'b' from checkpoint 'k' up to cycle 'end', looking for
+ * the last instruction boundary before 'end' that a reverse step or
+ * continue would stop at. Returns 1 with '*at' set if there was one.
+ */
+static int
+gdb_replay_find(struct gdb_board *b, size_t k, uint64_t end, int step,
+        uint64_t *at, unsigned long *watch, int *type)
+{
+    uint8_t val[GDB_MAX_WATCH][GDB_WATCH_LEN];
+    avr_t *avr = b->avr;
+    unsigned long hit;
+    uint64_t prev;
+    int found = 0;
+    int kind;
+    int more;
+
+    df_snapshot_restore(avr, b->ckpt[k]);
+    gdb_watch_read(avr, val);
+
+    do {
+        if (step || gdb_bp_test(avr->pc)) {
+            *at = avr->cycle;
+            *watch = 0;
+            found = 1;
+        }
+
+        prev = avr->cycle;
+        more = gdb_replay_step(avr);
+
+        /* Backwards, a watchpoint stops before the access that hit it */
+        hit = gdb.watch_count ? gdb_watch_changed(avr, val) : 0;
+        kind = GDB_WATCH_WRITE;
+        if (!hit && b->mem_hit) {
+            hit = b->mem_hit;
+            kind = b->mem_hit_type;
+        }
+        b->mem_hit = 0;
+        if (hit && !step) {
+            *at = prev;
+            *watch = hit;
+            *type = kind;
+            found = 1;
+        }
+    } while (more && avr->cycle < end);
+
+    return found;
+}
+
+static void
+gdb_replay_to(struct gdb_board *b, size_t k, uint64_t at)
+{
+    avr_t *avr = b->avr;
+
+    df_snapshot_restore(avr, b->ckpt[k]);
+    while (avr->cycle < at && gdb_replay_step(avr))
+        ;
+}
+
+/* There's no running backwards, so the board goes back to the newest
+ * checkpoint behind it and runs forwards to just before where it was.
+ * Anything it hears from outside since the checkpoint, like UART input
+ * or radio frames, isn't heard again and output is sent again. Nor is
+ * peripheral state beyond their registers and scheduled events brought
+ * back. If either sends the replay somewhere the board never was, the
+ * board stays put and GDB gets an error.
+ */
+static void
+gdb_reverse(int step)
+{
+    struct gdb_board *b = &gdb.b[gdb.c_thread];
+    const struct df_snapshot *goal;
+    struct df_snapshot *now;
+    struct df_clock *clk;
+    avr_t *avr = b->avr;
+    uint64_t end = avr->cycle;
+    unsigned long watch = 0;
+    int type = GDB_WATCH_WRITE;
+    uint64_t at = 0;
+    uint64_t due;
+    int pending;
+    int diverged = 0;
+    int found;
+    size_t k;
+
+    if (!gdb.ckpt_interval) {
+        gdb_reply("");
+        return;
+    }
+
+    if (gdb.non_stop || !b->stopped || !b->ckpt_len) {
+        gdb_reply("E01");
+        return;
+    }
+
+    /* Where we are, to check each replay against and to come back to */
+    now = df_snapshot_take_delta(avr, b->ckpt[b->ckpt_len - 1]);
+    if (!now) {
+        gdb_reply("E01");
+        return;
+    }
+    now->state = b->resume_state;
+    goal = now;
+
+    clk = df_clock_get(avr);
+    due = b->ckpt_ev.when;
+    pending = df_clock_pending(&b->ckpt_ev);
+
+    gdb.replaying = 1;
+    df_board_get(avr)->replaying = 1;
+
+    for (k = b->ckpt_len; k > 0; k--) {
+        if (b->ckpt[k - 1]->cycle >= end)
+            continue;
+
+        found = gdb_replay_find(b, k - 1, end, step, &at, &watch, &type);
+        if (!df_snapshot_matches(avr, goal)) {
+            diverged = 1;
+            break;
+        }
+        if (found)
+            break;
+
+        goal = b->ckpt[k - 1];
+        end = goal->cycle;
+    }
+
+    if (diverged)
+        df_snapshot_restore(avr, now);
+    else if (k)
+        gdb_replay_to(b, k - 1, at);
+    else
+        df_snapshot_restore(avr, b->ckpt[0]);
+
+    gdb.replaying = 0;
+    df_board_get(avr)->replaying = 0;
+    b->mem_hit = 0;
+    df_snapshot_free(now);
+
+    /* Checkpoints carry on as if we'd never been back */
+    if (pending)
+        df_clock_schedule_at(clk, &b->ckpt_ev, due);
+    else
+        df_clock_cancel(clk, &b->ckpt_ev);
+
+    /* Still held by us, just somewhere else in time */
+    if (avr->state != cpu_Done && avr->state != cpu_Crashed) {
+        b->resume_state = avr->state == cpu_Sleeping ? cpu_Sleeping :
+            cpu_Running;
+        avr->state = cpu_Stopped;
+    }
+    gdb_watch_read(avr, b->watch_val);
+
+    if (diverged) {
+        df_log_msg(DF_LOG_WARN, "Replaying board %zu went somewhere it "
+                "never was, staying at cycle %llu\n", b->index,
+                (unsigned long long)avr->cycle);
+        gdb_reply("E01");
+        return;
+    }
+
+    b->signal = GDB_SIGTRAP;
+    b->stop_watch = watch;
+    b->stop_watch_type = type;
+    b->stop_begin = !k;
+    gdb.g_thread = b->index;
+    gdb_stop_reply('$', "", b);
+}
+
+static void
+gdb_vcont(const char *p)
+{
+    struct gdb_board *b;
+    char *act;
+    const char *end;
+    char type;
+    long tid;
+    size_t i;
+
+    act = calloc(gdb.len, 1);
+    if (!act) {
+        gdb_reply("E01");
+        return;
+    }
+
+    /* The first action naming a board, or without a thread, wins */
+    while (*p == ';') {
+        type = p[1];
+        p += 2;
+        if (type == 'C' || type == 'S')
+            gdb_parse_hex(p, &p);
+
+        tid = -1;
+        if (*p == ':')
+            tid = gdb_parse_tid(p + 1, &end), p = end;
+
+        if (tid > 0) {
+            b = gdb_board_of(tid);
+            if (b && !act[b->index])
+                act[b->index] = type;
+        } else {
+            for (i = 0; i < gdb.len; i++)
+                if (!act[i])
+                    act[i] = type;
+        }
+    }
+
+    for (i = 0; i < gdb.len; i++) {
+        switch (act[i]) {
+            case 'c':
+            case 'C':
+                gdb_resume(&gdb.b[i], 0);
+                break;
+            case 's':
+            case 'S':
+                gdb_resume(&gdb.b[i], 1);
+                gdb.c_thread = i;
+                break;
+            case 't':
+                gdb_halt(&gdb.b[i], 0, gdb.non_stop);
+                break;
+        }
+    }
+
+    free(act);
+
+    if (gdb.non_stop)
+        gdb_reply("OK");
+    else
+        gdb.resumed = 1;
+}
+
+static void
+gdb_thread_info(void)
+{
+    size_t len = 0;
+    size_t n;
+
+    if (gdb.thread_info >= gdb.len) {
+        gdb_reply("l");
+        return;
+    }
+
+    gdb.out[len++] = 'm';
+    for (n = 0; n < GDB_THREADS_PER_REPLY && gdb.thread_info < gdb.len;
+            n++) {
+        len += snprintf(gdb.out + len, sizeof(gdb.out) - len, "%s%zx",
+                n ? "," : "", ++gdb.thread_info);
+    }
+
+    gdb_reply_out(len);
+}
+
+static void
+gdb_thread_extra(const char *p)
+{
+    static const char *states[] = {
+        [cpu_Limbo] = "limbo",
+        [cpu_Stopped] = "stopped",
+        [cpu_Running] = "running",
+        [cpu_Sleeping] = "sleeping",
+        [cpu_Step] = "step",
+        [cpu_StepDone] = "stepped",
+        [cpu_Done] = "done",
+        [cpu_Crashed] = "crashed",
+    };
+    struct gdb_board *b;
+    const char *end;
+    char text[128];
+    int state;
+
+    b = gdb_board_of(gdb_parse_tid(p, &end));
+    if (!b) {
+        gdb_reply("E01");
+        return;
+    }
+
+    state = b->avr->state;
+    snprintf(text, sizeof(text), "board %zu, %s at 0x%05x", b->index,
+            b->stopped ? "stopped" : states[state], b->avr->pc);
+
+    gdb_reply_out(gdb_tohex(gdb.out, (const uint8_t *)text, strlen(text)));
+}
+
+static void
+gdb_query(char *p)
+{
+    size_t len;
+
+    if (!strncmp(p, "qSupported", 10)) {
+        len = snprintf(gdb.out, sizeof(gdb.out), "PacketSize=%x;"
+                "QStartNoAckMode+;QNonStop+;vContSupported+;"
+                "binary-upload+%s", GDB_MAX_PACKET, gdb.ckpt_interval ?
+                ";ReverseStep+;ReverseContinue+" : "");
+        gdb_reply_out(len);
+    } else if (!strcmp(p, "QStartNoAckMode")) {
+        gdb_reply("OK");
+        gdb.no_ack = 1;
+    } else if (!strncmp(p, "QNonStop:", 9)) {
+        gdb.non_stop = p[9] == '1';
+        gdb.notified = 0;
+        gdb.resumed = 0;
+        gdb_reply("OK");
+    } else if (!strcmp(p, "qC")) {
+        len = snprintf(gdb.out, sizeof(gdb.out), "QC%zx", gdb.g_thread + 1);
+        gdb_reply_out(len);
+    } else if (!strcmp(p, "qfThreadInfo")) {
+        gdb.thread_info = 0;
+        gdb_thread_info();
+    } else if (!strcmp(p, "qsThreadInfo")) {
+        gdb_thread_info();
+    } else if (!strncmp(p, "qThreadExtraInfo,", 17)) {
+        gdb_thread_extra(p + 17);
+    } else if (!strcmp(p, "qAttached")) {
+        gdb_reply("1");
+    } else if (!strncmp(p, "qSymbol", 7)) {
+        gdb_reply("OK");
+    } else {
+        gdb_reply("");
+    }
+}
+
+static void
+gdb_v(char *p)
+{
+    if (!strcmp(p, "vCont?")) {
+        gdb_reply("vCont;c;C;s;S;t");
+    } else if (!strncmp(p, "vCont", 5)) {
+        gdb_vcont(p + 5);
+    } else if (!strcmp(p, "vStopped")) {
+        gdb_vstopped();
+    } else if (!strncmp(p, "vKill", 5)) {
+        gdb_kill();
+        gdb_reply("OK");
+    } else {
+        gdb_reply("");
+    }
+}
+
+static void
+gdb_watchpoint(int set, int type, unsigned long addr, unsigned long len)
+{
+    size_t i;
+    int slot = -1;
+    int w;
+
+    addr -= GDB_SRAM_BASE;
+    if (addr > gdb.b[0].avr->ramend || !len || len > GDB_WATCH_LEN ||
+            len > gdb.b[0].avr->ramend + 1 - addr) {
+        gdb_reply("E01");
+        return;
+    }
+
+    for (w = 0; w < GDB_MAX_WATCH; w++) {
+        if (gdb.watch[w].len == len && gdb.watch[w].addr == addr &&
+                gdb.watch[w].type == type)
+            break;
+        if (!gdb.watch[w].len && slot < 0)
+            slot = w;
+    }
+
+    if (!set) {
+        if (w < GDB_MAX_WATCH) {
+            gdb.watch[w].len = 0;
+            gdb.watch_count--;
+            if (type != GDB_WATCH_WRITE)
+                gdb.access_count--;
+        }
+        gdb_reply("OK");
+        return;
+    }
+
+    if (w < GDB_MAX_WATCH) {
+        gdb_reply("OK");
+        return;
+    }
+
+    if (slot < 0) {
+        gdb_reply("E02");
+        return;
+    }
+
+    gdb.watch[slot].addr = addr;
+    gdb.watch[slot].len = len;
+    gdb.watch[slot].type = type;
+    gdb.watch_count++;
+    if (type != GDB_WATCH_WRITE)
+        gdb.access_count++;
+    for (i = 0; i < gdb.len; i++)
+        gdb_watch_read(gdb.b[i].avr, gdb.b[i].watch_val);
+
+    gdb_reply("OK");
+}
+
+static void
+gdb_breakpoint(char *p)
+{
+    unsigned long addr;
+    const char *end;
+    size_t word;
+    int set = p[0] == 'Z';
+
+    /* Software and hardware breakpoints, and write, read and access
+     * watchpoints in SRAM.
+     */
+    if (p[1] < '0' || p[1] > '4' || p[2] != ',') {
+        gdb_reply("");
+        return;
+    }
+
+    if (p[1] >= '2') {
+        addr = gdb_parse_hex(p + 3, &end);
+        if (*end != ',') {
+            gdb_reply("E01");
+            return;
+        }
+        gdb_watchpoint(set, p[1] - '0', addr,
+                gdb_parse_hex(end + 1, &end));
+        return;
+    }
+
+    addr = gdb_parse_hex(p + 3, &end);
+    word = addr >> 1;
+    if (*end != ',' || word >= gdb.bp_words) {
+        gdb_reply("E01");
+        return;
+    }
+
+    if (set && !gdb_bp_test(addr)) {
+        gdb.bp[word >> 3] |= 1 << (word & 7);
+        gdb.bp_count++;
+    } else if (!set && gdb_bp_test(addr)) {
+        gdb.bp[word >> 3] &= ~(1 << (word & 7));
+        gdb.bp_count--;
+    }
+
+    gdb_reply("OK");
+}
+
+/* Binary data escapes '#', '$', '}' and '*' as '}' and the byte ^ 0x20 */
+static size_t
+gdb_unescape(uint8_t *dst, const char *src, size_t len)
+{
+    size_t out = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (src[i] == '}' && i + 1 < len)
+            dst[out++] = src[++i] ^ 0x20;
+        else
+            dst[out++] = src[i];
+    }
+
+    return out;
+}
+
+static size_t
+gdb_escape(char *dst, const uint8_t *src, size_t len)
+{
+    size_t out = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (src[i] == '#' || src[i] == '$' || src[i] == '}' ||
+                src[i] == '*') {
+            dst[out++] = '}';
+            dst[out++] = src[i] ^ 0x20;
+        } else {
+            dst[out++] = src[i];
+        }
+    }
+
+    return out;
+}
+
+static void
+gdb_memory(char *p, size_t pkt_len)
+{
+    static uint8_t buf[GDB_MAX_PACKET];
+    avr_t *avr = gdb.b[gdb.g_thread].avr;
+    unsigned long addr;
+    unsigned long len;
+    const char *end;
+    char type = p[0];
+    size_t got;
+
+    addr = gdb_parse_hex(p + 1, &end);
+    if (*end != ',') {
+        gdb_reply("E01");
+        return;
+    }
+    len = gdb_parse_hex(end + 1, &end);
+    if (len > sizeof(buf))
+        len = sizeof(buf);
+
+    switch (type) {
+        case 'm':
+        case 'x':
+            got = gdb_mem_read(avr, addr, buf, len);
+            if (!got && len) {
+                gdb_reply("E01");
+            } else if (type == 'm') {
+                gdb_reply_out(gdb_tohex(gdb.out, buf, got));
+            } else {
+                gdb.out[0] = 'b';
+                gdb_reply_out(1 + gdb_escape(gdb.out + 1, buf, got));
+            }
+            break;
+
+        case 'M':
+        case 'X':
+            if (*end != ':') {
+                gdb_reply("E01");
+                return;
+            }
+            end++;
+
+            if (type == 'M')
+                got = gdb_fromhex(buf, end, len);
+            else
+                got = gdb_unescape(buf, end, pkt_len - (end - p));
+
+            if (got != len || gdb_mem_write(avr, addr, buf, len)) {
+                gdb_reply("E01");
+                break;
+            }
+
+            /* The debugger changing a value isn't the firmware's doing */
+            gdb_watch_read(avr, gdb.b[gdb.g_thread].watch_val);
+            gdb_reply("OK");
+            break;
+    }
+}
+
+static void
+gdb_registers(char *p)
+{
+    uint8_t regs[GDB_REGS_LEN];
+    avr_t *avr = gdb.b[gdb.g_thread].avr;
+    unsigned long reg;
+    const char *end;
+    size_t off;
+    size_t len;
+
+    gdb_read_regs(avr, regs);
+
+    switch (p[0]) {
+        case 'g':
+            gdb_reply_out(gdb_tohex(gdb.out, regs, sizeof(regs)));
+            return;
+
+        case 'G':
+            if (gdb_fromhex(regs, p + 1, sizeof(regs)) != sizeof(regs)) {
+                gdb_reply("E01");
+                return;
+            }
+            break;
+
+        case 'p':
+        case 'P':
+            reg = gdb_parse_hex(p + 1, &end);
+            if (gdb_reg_span(reg, &off, &len)) {
+                gdb_reply("E01");
+                return;
+            }
+
+            if (p[0] == 'p') {
+                gdb_reply_out(gdb_tohex(gdb.out, regs + off, len));
+                return;
+            }
+
+            if (*end != '=' || gdb_fromhex(regs + off, end + 1, len) != len) {
+                gdb_reply("E01");
+                return;
+            }
+            break;
+    }
+
+    gdb_write_regs(avr, regs);
+    gdb_reply("OK");
+}
+
+static void
+gdb_set_thread(char *p)
+{
+    struct gdb_board *b;
+    const char *end;
+    long tid;
+
+    tid = gdb_parse_tid(p + 2, &end);
+
+    /* Any or all leaves things as they are */
+    if (tid > 0) {
+        b = gdb_board_of(tid);
+        if (!b) {
+            gdb_reply("E01");
+            return;
+        }
+
+        if (p[1] == 'g')
+            gdb.g_thread = b->index;
+        else
+            gdb.c_thread = b->index;
+    }
+
+    gdb_reply("OK");
+}
+
+static void
+gdb_packet(char *p, size_t len)
+{
+    const char *end;
+
+    switch (p[0]) {
+        case '?':
+            gdb_status();
+            break;
+        case 'g':
+        case 'G':
+        case 'p':
+        case 'P':
+            gdb_registers(p);
+            break;
+        case 'm':
+        case 'M':
+        case 'x':
+        case 'X':
+            gdb_memory(p, len);
+            break;
+        case 'H':
+            gdb_set_thread(p);
+            break;
+        case 'T':
+            gdb_reply(gdb_board_of(gdb_parse_tid(p + 1, &end)) ? "OK" :
+                    "E01");
+            break;
+        case 'c':
+        case 's':
+            gdb_resume_all_stop(p[0] == 's');
+            break;
+        case 'b':
+            if (p[1] == 'c' || p[1] == 's')
+                gdb_reverse(p[1] == 's');
+            else
+                gdb_reply("");
+            break;
+        case 'q':
+        case 'Q':
+            gdb_query(p);
+            break;
+        case 'v':
+            gdb_v(p);
+            break;
+        case 'Z':
+        case 'z':
+            gdb_breakpoint(p);
+            break;
+        case 'D':
+            gdb_reply("OK");
+            gdb_disconnect();
+            break;
+        case 'k':
+            gdb_kill();
+            gdb_disconnect();
+            break;
+        default:
+            gdb_reply("");
+            break;
+    }
+}
+
+/* Pulls complete packets out of what we've read so far */
+static void
+gdb_parse(void)
+{
+    char *hash;
+    size_t len;
+    size_t used;
+    uint8_t csum;
+    size_t i;
+
+    while (gdb.in_len && gdb.client.fd != -1) {
+        used = 1;
+
+        if (gdb.in[0] == 0x03) {
+            gdb_interrupt();
+        } else if (gdb.in[0] == '$') {
+            hash = memchr(gdb.in, '#', gdb.in_len);
+            if (!hash || hash + 3 > gdb.in + gdb.in_len) {
+                /* Nothing that long is coming, start over */
+                if (gdb.in_len == sizeof(gdb.in))
+                    gdb.in_len = 0;
+                return;
+            }
+
+            len = hash - gdb.in - 1;
+            used = len + 4;
+
+            csum = 0;
+            for (i = 0; i < len; i++)
+                csum += (uint8_t)gdb.in[i + 1];
+
+            if (gdb_unhex(hash[1]) << 4 != (csum & 0xF0) ||
+                    gdb_unhex(hash[2]) != (csum & 0xF)) {
+                if (!gdb.no_ack)
+                    gdb_write("-", 1);
+            } else {
+                if (!gdb.no_ack)
+                    gdb_write("+", 1);
+
+                memcpy(gdb.pkt, gdb.in + 1, len);
+                gdb.pkt[len] = '\0';
+                gdb_packet(gdb.pkt, len);
+            }
+        }
+
+        /* Acks and anything else we don't understand are dropped */
+        memmove(gdb.in, gdb.in + used, gdb.in_len - used);
+        gdb.in_len -= used;
+    }
+}
+
+static void
+gdb_input(void)
+{
+    ssize_t len;
+
+    while (gdb.client.fd != -1) {
+        len = recv(gdb.client.fd, gdb.in + gdb.in_len,
+                sizeof(gdb.in) - gdb.in_len, 0);
+        if (len > 0) {
+            gdb.in_len += len;
+            gdb_parse();
+            continue;
+        }
+
+        if (len == -1 && (errno == EAGAIN || errno == EINTR)) {
+            if (errno == EAGAIN)
+                break;
+            continue;
+        }
+
+        df_log_msg(DF_LOG_INFO, "GDB disconnected\n");
+        gdb_disconnect();
+    }
+}
+
+static void
+gdb_event(struct df_reactor_src *src, uint32_t revents)
+{
+    pthread_mutex_lock(&gdb.lock);
+
+    if (revents & DF_REACTOR_KICK) {
+        df_reactor_set_events(src, EPOLLIN);
+    } else {
+        /* The run loop reads for itself and kicks us once it's done */
+        df_reactor_set_events(src, 0);
+        gdb.ready = 1;
+        df_gdb_pending = 1;
+        pthread_cond_signal(&gdb.cond);
+    }
+
+    pthread_mutex_unlock(&gdb.lock);
+}
+
+static void
+gdb_accept(void)
+{
+    int one = 1;
+    int fd;
+
+    fd = accept4(gdb.listen.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1)
+        return;
+
+    /* One debugger at a time */
+    if (gdb.client.fd != -1) {
+        close(fd);
+        return;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    memset(&gdb.client, 0, sizeof(gdb.client));
+    gdb.client.fd = fd;
+    gdb.client.events = EPOLLIN;
+    gdb.client.cb = gdb_event;
+    if (df_reactor_add(&gdb.client)) {
+        df_log_msg(DF_LOG_ERR, "Failed to hook up GDB to the I/O reactor\n");
+        close(fd);
+        gdb.client.fd = -1;
+        return;
+    }
+
+    gdb.in_len = 0;
+    gdb.no_ack = 0;
+    gdb.non_stop = 0;
+    gdb.resumed = 0;
+    gdb.notified = 0;
+
+    df_log_msg(DF_LOG_INFO, "GDB connected\n");
+}
+
+static void
+gdb_disconnect(void)
+{
+    size_t i;
+
+    if (gdb.client.fd == -1)
+        return;
+
+    df_reactor_del(&gdb.client);
+    close(gdb.client.fd);
+    gdb.client.fd = -1;
+
+    /* Nobody's left to hold the boards, so let them all go */
+    memset(gdb.bp, 0, (gdb.bp_words + 7) / 8);
+    gdb.bp_count = 0;
+    memset(gdb.watch, 0, sizeof(gdb.watch));
+    gdb.watch_count = 0;
+    gdb.access_count = 0;
+    for (i = 0; i < gdb.len; i++)
+        gdb_resume(&gdb.b[i], 0);
+}
+
+int
+df_gdb_init(const struct drumfish_cfg *config, struct df_board **boards,
+        size_t len)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    size_t i;
+    int fd;
+
+    if (!config->gdb)
+        return 0;
+
+    gdb.b = calloc(len, sizeof(*gdb.b));
+    gdb.bp_words = (boards[0]->avr->flashend + 1) / 2;
+    gdb.bp = calloc((gdb.bp_words + 7) / 8, 1);
+    if (!gdb.b || !gdb.bp) {
+        fprintf(stderr, "Failed to allocate memory for the GDB server.\n");
+        return -1;
+    }
+    gdb.len = len;
+    gdb.ckpt_interval = config->gdb_checkpoint;
+    gdb.history_max = ((size_t)config->gdb_history << 20) / len;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        fprintf(stderr, "Unable to create GDB socket: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)config->gdb);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 1)) {
+        fprintf(stderr, "Unable to listen for GDB on port %d: %s\n",
+                (uint16_t)config->gdb, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    gdb.listen.fd = fd;
+    gdb.listen.events = EPOLLIN;
+    gdb.listen.cb = gdb_event;
+    if (df_reactor_add(&gdb.listen)) {
+        fprintf(stderr, "Failed to hook up the GDB server to the I/O "
+                "reactor\n");
+        close(fd);
+        gdb.listen.fd = -1;
+        return -1;
+    }
+
+    /* Everyone waits for the debugger to show up */
+    for (i = 0; i < len; i++) {
+        gdb.b[i].avr = boards[i]->avr;
+        gdb.b[i].index = i;
+        gdb_halt(&gdb.b[i], GDB_SIGTRAP, 0);
+        gdb.b[i].signal = GDB_SIGTRAP;
+
+        /* History starts where the debugger first sees the board */
+        if (!gdb.ckpt_interval)
+            continue;
+        gdb_checkpoint(&gdb.b[i]);
+        df_clock_event_init(&gdb.b[i].ckpt_ev, gdb_checkpoint_due,
+                &gdb.b[i]);
+        df_clock_schedule(df_clock_get(gdb.b[i].avr), &gdb.b[i].ckpt_ev,
+                gdb.ckpt_interval);
+    }
+
+    printf("GDB server on localhost:%d, boards are threads 1-%zu\n",
+            (uint16_t)config->gdb, len);
+
+    return 0;
+}
+
+void
+df_gdb_process(void)
+{
+    size_t i;
+    int ready;
+
+    df_gdb_pending = 0;
+
+    if (gdb.listen.fd == -1)
+        return;
+
+    pthread_mutex_lock(&gdb.lock);
+    ready = gdb.ready;
+    gdb.ready = 0;
+    pthread_mutex_unlock(&gdb.lock);
+
+    if (ready) {
+        gdb_accept();
+        gdb_input();
+
+        df_reactor_kick(&gdb.listen);
+        if (gdb.client.fd != -1)
+            df_reactor_kick(&gdb.client);
+    }
+
+    for (i = 0; i < gdb.len; i++) {
+        if (gdb.b[i].ckpt_due) {
+            gdb.b[i].ckpt_due = 0;
+            gdb_checkpoint(&gdb.b[i]);
+        }
+    }
+
+    gdb_report();
+    gdb_update_hooks();
+}
+
+int
+df_gdb_halted(void)
+{
+    size_t i;
+
+    if (gdb.listen.fd == -1)
+        return 0;
+
+    /* Boards that died have nothing left to run either */
+    for (i = 0; i < gdb.len; i++)
+        if (!gdb.b[i].stopped && gdb.b[i].avr->state != cpu_Done &&
+                gdb.b[i].avr->state != cpu_Crashed)
+            return 0;
+
+    return 1;
+}
+
+void
+df_gdb_crashed(avr_t *avr)
+{
+    struct gdb_board *b;
+    size_t i;
+
+    /* Without a debugger it dies like it would have anyway */
+    if (gdb.client.fd == -1)
+        return;
+
+    for (i = 0; i < gdb.len; i++) {
+        b = &gdb.b[i];
+        if (b->avr != avr)
+            continue;
+
+        /* Held where it died so it can be looked at, and dead for good
+         * once it's let go.
+         */
+        b->stopped = 1;
+        b->step = 0;
+        b->resume_state = cpu_Crashed;
+        avr->state = cpu_Stopped;
+
+        b->pending = 1;
+        b->signal = GDB_SIGSEGV;
+        b->stop_watch = 0;
+        b->stop_begin = 0;
+        df_gdb_pending = 1;
+        return;
+    }
+}
+
+void
+df_gdb_wait(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += GDB_WAIT_MSEC * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&gdb.lock);
+    if (!gdb.ready)
+        pthread_cond_timedwait(&gdb.cond, &gdb.lock, &ts);
+    pthread_mutex_unlock(&gdb.lock);
+}
+
+void
+df_gdb_stop(void)
+{
+    size_t i;
+
+    if (gdb.listen.fd == -1)
+        return;
+
+    gdb_disconnect();
+    gdb_update_hooks();
+
+    df_reactor_del(&gdb.listen);
+    close(gdb.listen.fd);
+    gdb.listen.fd = -1;
+
+    for (i = 0; i < gdb.len; i++) {
+        df_clock_cancel(df_clock_get(gdb.b[i].avr), &gdb.b[i].ckpt_ev);
+        while (gdb.b[i].ckpt_len)
+            gdb_checkpoint_drop_oldest(&gdb.b[i]);
+        free(gdb.b[i].ckpt);
+    }
+
+    free(gdb.b);
+    free(gdb.bp);
+    gdb.b = NULL;
+    gdb.bp = NULL;
+    gdb.len = 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * df_gdb.h
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_GDB_H__
+#define __DF_GDB_H__
+
+#include <signal.h>
+#include <stddef.h>
+
+/* A GDB remote protocol server for every board in the process. Each
+ * board shows up as a thread and breakpoints apply to all of them.
+ * Supports all-stop and non-stop mode, binary x/X transfers, write,
+ * read and access watchpoints and, in all-stop mode, reverse step and
+ * continue.
+ */
+
+/* Going backwards restores the newest checkpoint behind the board and
+ * runs forwards again. Checkpoints are taken every so many cycles and
+ * the oldest go once a board's history outgrows its share of the
+ * budget.
+ */
+#define DF_GDB_CHECKPOINT_DEFAULT 1000000
+#define DF_GDB_HISTORY_DEFAULT 64 /* MiB */
+
+struct avr_t;
+struct df_board;
+struct drumfish_cfg;
+
+extern volatile sig_atomic_t df_gdb_pending;
+
+/* Listens on '-g port'. The boards start out stopped */
+int df_gdb_init(const struct drumfish_cfg *config, struct df_board **boards,
+        size_t len);
+
+/* Must be called from the thread running the boards */
+void df_gdb_process(void);
+
+/* Nothing will run until the debugger lets a board go */
+int df_gdb_halted(void);
+
+/* The board crashed while running. A connected debugger hears about it
+ * as a SIGSEGV and holds the board until it's let go.
+ */
+void df_gdb_crashed(struct avr_t *avr);
+
+/* Blocks until the debugger has something for us, or a little while
+ * has passed so the rest of the run loop gets a look in.
+ */
+void df_gdb_wait(void);
+
+void df_gdb_stop(void);
+
+#endif /* __DF_GDB_H__ */
@@ -0,0 +1,288 @@
+/*
+ * df_hook.c
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sim_avr.h>
+
+#include "df_board.h"
+#include "df_hook.h"
+
+/* Where an access through X, Y or Z went, from the pointers as they
+ * were before the instruction ran. A load may well have replaced them.
+ */
+static avr_io_addr_t
+hook_ptr(const uint8_t *xyz, int reg, int mode)
+{
+    avr_io_addr_t ptr = xyz[reg - R_XL] | xyz[reg - R_XL + 1] << 8;
+
+    /* Pre-decrement, the access is below where the pointer started */
+    return mode == 2 ? ptr - 1 : ptr;
+}
+
+/* Works out which data address the instruction at 'pc' loaded from or
+ * stored to, given X, Y and Z from before it ran. Returns 1 for a store,
+ * 0 for a load and -1 if it didn't touch data space. The stack, flash
+ * and the XMEGA-only ops don't count.
+ */
+static int
+hook_decode(avr_t *avr, avr_flashaddr_t pc, const uint8_t *xyz,
+        avr_io_addr_t *addr)
+{
+    uint16_t op = avr->flash[pc] | avr->flash[pc + 1] << 8;
+
+    if ((op & 0xf000) == 0xb000) {
+        /* IN Rd, A and OUT A, Rr */
+        *addr = AVR_IO_TO_DATA((op & 0xf) | (op >> 5 & 0x30));
+        return !!(op & 0x0800);
+    }
+
+    if ((op & 0xfc00) == 0x9800) {
+        /* CBI/SBI A, b store, SBIC/SBIS A, b only look */
+        *addr = AVR_IO_TO_DATA(op >> 3 & 0x1f);
+        return !(op & 0x0100);
+    }
+
+    if ((op & 0xfc00) == 0x9000) {
+        /* LDS/STS k, and LD/ST through X, or Y or Z with pre-decrement
+         * or post-increment.
+         */
+        switch (op & 0xf) {
+            case 0x0:
+                *addr = avr->flash[pc + 2] | avr->flash[pc + 3] << 8;
+                break;
+            case 0x1:
+            case 0x2:
+                *addr = hook_ptr(xyz, R_ZL, op & 3);
+                break;
+            case 0x9:
+            case 0xa:
+                *addr = hook_ptr(xyz, R_YL, op & 3);
+                break;
+            case 0xc:
+            case 0xd:
+            case 0xe:
+                *addr = hook_ptr(xyz, R_XL, op & 3);
+                break;
+            default:
+                /* LPM, ELPM, PUSH, POP and the XMEGA-only ops */
+                return -1;
+        }
+        return !!(op & 0x0200);
+    }
+
+    if ((op & 0xd000) == 0x8000) {
+        /* LD/ST Y/Z and LDD/STD Y+q/Z+q */
+        *addr = hook_ptr(xyz, op & 8 ? R_YL : R_ZL, 0) + ((op & 7) |
+                (op >> 7 & 0x18) | (op >> 8 & 0x20));
+        return !!(op & 0x0200);
+    }
+
+    return -1;
+}
+
+/* Anything stored is still in its source register afterwards, so IO
+ * write hooks see what the firmware wrote even where a peripheral keeps
+ * something else.
+ */
+static void
+hook_access(avr_t *avr, struct df_hooks *hooks, avr_flashaddr_t pc,
+        const uint8_t *xyz)
+{
+    uint16_t op = avr->flash[pc] | avr->flash[pc + 1] << 8;
+    avr_io_addr_t addr;
+    uint8_t v;
+    int store;
+    int i;
+
+    store = hook_decode(avr, pc, xyz, &addr);
+    if (store < 0)
+        return;
+
+    for (i = 0; i < hooks->mem_count; i++)
+        hooks->mem[i].fn(avr, pc, addr, store, hooks->mem[i].opaque);
+
+    if (!store || !hooks->iow_count || addr < AVR_IO_TO_DATA(0) ||
+            addr > avr->ioend || addr == R_SPL || addr == R_SPH ||
+            addr == R_SREG)
+        return;
+
+    /* CBI/SBI, what the register holds now */
+    if ((op & 0xfd00) == 0x9800)
+        v = avr->data[addr];
+    else
+        v = avr->data[op >> 4 & 0x1f];
+
+    for (i = 0; i < hooks->iow_count; i++)
+        hooks->iow[i].fn(avr, pc, addr, v, hooks->iow[i].opaque);
+}
+
+static void
+hook_run(avr_t *avr)
+{
+    struct df_hooks *hooks = &df_board_get(avr)->hooks;
+    avr_flashaddr_t pc = avr->pc;
+    int state = avr->state;
+    int access = hooks->iow_count || hooks->mem_count;
+    uint8_t xyz[6];
+    int i;
+
+    if (access)
+        memcpy(xyz, avr->data + R_XL, sizeof(xyz));
+
+    hooks->run(avr);
+
+    /* Stopped or sleeping and nothing woke us up */
+    if (state != cpu_Running && pc == avr->pc)
+        return;
+
+    /* Woken from sleep, nothing ran */
+    if (access && (state == cpu_Running || state == cpu_Step))
+        hook_access(avr, hooks, pc, xyz);
+
+    for (i = 0; i < hooks->count; i++)
+        hooks->insn[i].fn(avr, pc, avr->pc, hooks->insn[i].opaque);
+}
+
+/* Wraps the core in hook_run() while there's anything to call */
+static void
+hook_update(avr_t *avr, struct df_hooks *hooks)
+{
+    int need = hooks->count || hooks->iow_count || hooks->mem_count;
+
+    if (need && avr->run != hook_run) {
+        hooks->run = avr->run;
+        avr->run = hook_run;
+    } else if (!need && avr->run == hook_run) {
+        avr->run = hooks->run;
+    }
+}
+
+int
+df_hook_insn_add(avr_t *avr, df_hook_insn_t fn, void *opaque)
+{
+    struct df_hooks *hooks = &df_board_get(avr)->hooks;
+
+    if (hooks->count == DF_HOOK_MAX_INSN) {
+        fprintf(stderr, "Too many instruction hooks registered.\n");
+        return -1;
+    }
+
+    hooks->insn[hooks->count].fn = fn;
+    hooks->insn[hooks->count].opaque = opaque;
+    hooks->count++;
+    hook_update(avr, hooks);
+
+    return 0;
+}
+
+void
+df_hook_insn_del(avr_t *avr, df_hook_insn_t fn, void *opaque)
+{
+    struct df_hooks *hooks = &df_board_get(avr)->hooks;
+    int i;
+
+    for (i = 0; i < hooks->count; i++) {
+        if (hooks->insn[i].fn != fn || hooks->insn[i].opaque != opaque)
+            continue;
+
+        hooks->count--;
+        hooks->insn[i] = hooks->insn[hooks->count];
+        break;
+    }
+
+    /* Back to running the core untouched */
+    hook_update(avr, hooks);
+}
+
+int
+df_hook_iow_add(avr_t *avr, df_hook_iow_t fn, void *opaque)
+{
+    struct df_hooks *hooks = &df_board_get(avr)->hooks;
+
+    if (hooks->iow_count == DF_HOOK_MAX_IOW) {
+        fprintf(stderr, "Too many IO write hooks registered.\n");
+        return -1;
+    }
+
+    hooks->iow[hooks->iow_count].fn = fn;
+    hooks->iow[hooks->iow_count].opaque = opaque;
+    hooks->iow_count++;
+    hook_update(avr, hooks);
+
+    return 0;
+}
+
+void
+df_hook_iow_del(avr_t *avr, df_hook_iow_t fn, void *opaque)
+{
+    struct df_hooks *hooks = &df_board_get(avr)->hooks;
+    int i;
+
+    for (i = 0; i < hooks->iow_count; i++) {
+        if (hooks->iow[i].fn != fn || hooks->iow[i].opaque != opaque)
+            continue;
+
+        hooks->iow_count--;
+        hooks->iow[i] = hooks->iow[hooks->iow_count];
+        break;
+    }
+
+    hook_update(avr, hooks);
+}
+
+int
+df_hook_mem_add(avr_t *avr, df_hook_mem_t fn, void *opaque)
+{
+    struct df_hooks *hooks = &df_board_get(avr)->hooks;
+
+    if (hooks->mem_count == DF_HOOK_MAX_MEM) {
+        fprintf(stderr, "Too many data access hooks registered.\n");
+        return -1;
+    }
+
+    hooks->mem[hooks->mem_count].fn = fn;
+    hooks->mem[hooks->mem_count].opaque = opaque;
+    hooks->mem_count++;
+    hook_update(avr, hooks);
+
+    return 0;
+}
+
+void
+df_hook_mem_del(avr_t *avr, df_hook_mem_t fn, void *opaque)
+{
+    struct df_hooks *hooks = &df_board_get(avr)->hooks;
+    int i;
+
+    for (i = 0; i < hooks->mem_count; i++) {
+        if (hooks->mem[i].fn != fn || hooks->mem[i].opaque != opaque)
+            continue;
+
+        hooks->mem_count--;
+        hooks->mem[i] = hooks->mem[hooks->mem_count];
+        break;
+    }
+
+    hook_update(avr, hooks);
+}
@@ -0,0 +1,90 @@
+/*
+ * df_hook.h
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_HOOK_H__
+#define __DF_HOOK_H__
+
+/* Called after every instruction the core executes, and whenever the
+ * PC moves without one (e.g. an interrupt waking the core from sleep).
+ * 'pc' is where the instruction was fetched from and 'new_pc' is where
+ * the core is headed next.
+ */
+typedef void (*df_hook_insn_t)(avr_t *avr, avr_flashaddr_t pc,
+        avr_flashaddr_t new_pc, void *opaque);
+
+/* Called after the instruction at 'pc' stored 'v' to IO register
+ * 'addr' (a data space address). The core's own SPL, SPH and SREG are
+ * left out, they change with every push, call and flag.
+ */
+typedef void (*df_hook_iow_t)(avr_t *avr, avr_flashaddr_t pc,
+        avr_io_addr_t addr, uint8_t v, void *opaque);
+
+/* Called after the instruction at 'pc' loaded from or ('store') stored
+ * to data address 'addr', before the instruction hooks for it. Pushes,
+ * pops and calls aren't seen.
+ */
+typedef void (*df_hook_mem_t)(avr_t *avr, avr_flashaddr_t pc,
+        avr_io_addr_t addr, int store, void *opaque);
+
+#define DF_HOOK_MAX_INSN 8
+#define DF_HOOK_MAX_IOW 4
+#define DF_HOOK_MAX_MEM 2
+
+/* Each board's hooks, kept in its struct df_board */
+struct df_hooks {
+    void (*run)(avr_t *avr);
+    int count;
+    struct {
+        df_hook_insn_t fn;
+        void *opaque;
+    } insn[DF_HOOK_MAX_INSN];
+    int iow_count;
+    struct {
+        df_hook_iow_t fn;
+        void *opaque;
+    } iow[DF_HOOK_MAX_IOW];
+    int mem_count;
+    struct {
+        df_hook_mem_t fn;
+        void *opaque;
+    } mem[DF_HOOK_MAX_MEM];
+};
+
+/* Nothing is wrapped around the core until the first hook is added, so
+ * there is no cost when no instrumentation is in use.
+ */
+int df_hook_insn_add(avr_t *avr, df_hook_insn_t fn, void *opaque);
+
+void df_hook_insn_del(avr_t *avr, df_hook_insn_t fn, void *opaque);
+
+/* Decoded from the instruction that ran rather than hooked on each
+ * register, simavr only lets a few registers have more than one write
+ * handler and its peripherals already have most of them.
+ */
+int df_hook_iow_add(avr_t *avr, df_hook_iow_t fn, void *opaque);
+
+void df_hook_iow_del(avr_t *avr, df_hook_iow_t fn, void *opaque);
+
+int df_hook_mem_add(avr_t *avr, df_hook_mem_t fn, void *opaque);
+
+void df_hook_mem_del(avr_t *avr, df_hook_mem_t fn, void *opaque);
+
+#endif /* __DF_HOOK_H__ */
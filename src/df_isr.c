@@ -0,0 +1,312 @@
+/*
+ * df_isr.c
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sim_avr.h>
+#include <sim_io.h>
+
+#include "drumfish.h"
+#include "df_blackbox.h"
+#include "df_board.h"
+#include "df_isr.h"
+#include "df_log.h"
+#include "df_stats.h"
+
+struct isr_vec {
+    struct df_isr *isr;
+    uint8_t vector;
+    uint8_t pending;
+    uint8_t running;
+    uint64_t pending_at;
+    uint64_t entered_at;
+};
+
+struct df_isr {
+    /* First, so simavr's reset and dealloc hand us back to ourselves */
+    avr_io_t io;
+    avr_t *avr;
+
+    struct isr_vec vec[DF_STATS_ISR_VECTORS];
+    struct df_stats_isr stats[DF_STATS_ISR_VECTORS];
+
+    /* The core moves SP one byte at a time, only look at whole values */
+    int sp_half;
+    uint16_t sp_low;
+    uint16_t sp_alarm;
+    uint32_t sp_alarms;
+};
+
+static inline unsigned int
+isr_bucket(uint64_t cycles)
+{
+    unsigned int b;
+
+    if (cycles < 2)
+        return 0;
+
+    b = 63 - __builtin_clzll(cycles);
+
+    return b < DF_STATS_ISR_BUCKETS ? b : DF_STATS_ISR_BUCKETS - 1;
+}
+
+static void
+isr_pending_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+    struct isr_vec *vec = param;
+
+    (void)irq;
+
+    if (df_board_get(vec->isr->avr)->replaying)
+        return;
+
+    /* Raising an already pending vector doesn't restart its clock */
+    if (value && !vec->pending)
+        vec->pending_at = vec->isr->avr->cycle;
+    vec->pending = !!value;
+}
+
+static void
+isr_running_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+    struct isr_vec *vec = param;
+    struct df_stats_isr *st = &vec->isr->stats[vec->vector];
+    uint64_t now = vec->isr->avr->cycle;
+    uint64_t c;
+
+    (void)irq;
+
+    if (df_board_get(vec->isr->avr)->replaying)
+        return;
+
+    if (value) {
+        st->count++;
+        if (vec->pending) {
+            c = now - vec->pending_at;
+            st->lat_sum += c;
+            st->lat_hist[isr_bucket(c)]++;
+            if (c > st->lat_max)
+                st->lat_max = c;
+        }
+        vec->running = 1;
+        vec->entered_at = now;
+    } else if (vec->running) {
+        c = now - vec->entered_at;
+        st->dur_sum += c;
+        st->dur_hist[isr_bucket(c)]++;
+        if (c > st->dur_max)
+            st->dur_max = c;
+        vec->running = 0;
+    }
+}
+
+static void
+isr_sp_write(avr_t *avr, avr_io_addr_t addr, uint8_t v, void *param)
+{
+    struct df_isr *isr = param;
+    uint16_t sp;
+
+    /* Nobody else handles SP */
+    avr->data[addr] = v;
+
+    if (df_board_get(avr)->replaying)
+        return;
+
+    /* PUSH and CALL write SPL then SPH, firmware writes SPH then SPL.
+     * Either way the first of a pair leaves SP half updated.
+     */
+    isr->sp_half = !isr->sp_half;
+    if (isr->sp_half)
+        return;
+
+    sp = avr->data[R_SPL] | avr->data[R_SPH] << 8;
+    if (sp >= isr->sp_low)
+        return;
+    isr->sp_low = sp;
+
+    if (sp < isr->sp_alarm && !isr->sp_alarms++) {
+        df_log_msg(DF_LOG_WARN, "Stack pointer dropped to 0x%04x, below "
+                "the alarm at 0x%04x, at PC 0x%05x\n", sp, isr->sp_alarm,
+                avr->pc);
+        df_blackbox_dump(avr, "stack alarm");
+    }
+}
+
+static void
+isr_io_reset(avr_io_t *io)
+{
+    struct df_isr *isr = (struct df_isr *)io;
+    int i;
+
+    /* Whatever was pending or running is gone, the totals are kept */
+    for (i = 0; i < DF_STATS_ISR_VECTORS; i++) {
+        isr->vec[i].pending = 0;
+        isr->vec[i].running = 0;
+    }
+    isr->sp_half = 0;
+}
+
+static void
+isr_io_dealloc(avr_io_t *io)
+{
+    free(io);
+}
+
+int
+df_isr_init(const struct drumfish_cfg *config, avr_t *avr)
+{
+    avr_int_vector_t *vector;
+    struct isr_vec *vec;
+    struct df_isr *isr;
+    int i;
+
+    if (!config->isr_stats)
+        return 0;
+
+    isr = calloc(1, sizeof(*isr));
+    if (!isr) {
+        fprintf(stderr, "Failed to allocate memory for ISR timing.\n");
+        return -1;
+    }
+
+    isr->avr = avr;
+    isr->sp_low = avr->data[R_SPL] | avr->data[R_SPH] << 8;
+    isr->sp_alarm = config->stack_alarm;
+
+    isr->io.kind = "isr";
+    isr->io.reset = isr_io_reset;
+    isr->io.dealloc = isr_io_dealloc;
+    avr_register_io(avr, &isr->io);
+    df_board_get(avr)->isr = isr;
+
+    avr_register_io_write(avr, R_SPL, isr_sp_write, isr);
+    avr_register_io_write(avr, R_SPH, isr_sp_write, isr);
+
+    for (i = 0; i < avr->interrupts.vector_count; i++) {
+        vector = avr->interrupts.vector[i];
+        if (vector->vector >= DF_STATS_ISR_VECTORS)
+            continue;
+
+        vec = &isr->vec[vector->vector];
+        vec->isr = isr;
+        vec->vector = vector->vector;
+        avr_irq_register_notify(vector->irq + AVR_INT_IRQ_PENDING,
+                isr_pending_hook, vec);
+        avr_irq_register_notify(vector->irq + AVR_INT_IRQ_RUNNING,
+                isr_running_hook, vec);
+    }
+
+    return 0;
+}
+
+void
+df_isr_counts(avr_t *avr, struct df_stats *stats)
+{
+    struct df_isr *isr = df_board_get(avr)->isr;
+
+    if (!isr)
+        return;
+
+    stats->sp_low = isr->sp_low;
+    stats->sp_alarms = isr->sp_alarms;
+    memcpy(stats->isr, isr->stats, sizeof(stats->isr));
+}
+
+static uint64_t
+isr_total(const uint64_t *hist)
+{
+    uint64_t total = 0;
+    int b;
+
+    for (b = 0; b < DF_STATS_ISR_BUCKETS; b++)
+        total += hist[b];
+
+    return total;
+}
+
+/* Upper bound of the bucket the 99th percentile falls in */
+static uint64_t
+isr_p99(const uint64_t *hist, uint64_t count)
+{
+    uint64_t seen = 0;
+    int b;
+
+    for (b = 0; b < DF_STATS_ISR_BUCKETS - 1; b++) {
+        seen += hist[b];
+        if (seen * 100 >= count * 99)
+            break;
+    }
+
+    return (2ULL << b) - 1;
+}
+
+void
+df_isr_report(avr_t *avr)
+{
+    struct df_board *board = df_board_get(avr);
+    struct df_isr *isr = board->isr;
+    const struct df_stats_isr *st;
+    uint64_t lat_n, dur_n;
+    int i;
+
+    if (!isr)
+        return;
+
+    fprintf(stderr, "Board %d interrupts (cycles):\n", board->index);
+    fprintf(stderr, "  vector       count  lat avg   p99   max  "
+            "dur avg   p99   max\n");
+
+    for (i = 0; i < DF_STATS_ISR_VECTORS; i++) {
+        st = &isr->stats[i];
+        if (!st->count)
+            continue;
+
+        /* Entries never seen going pending have no latency and one
+         * still running at exit has no duration yet.
+         */
+        lat_n = isr_total(st->lat_hist);
+        dur_n = isr_total(st->dur_hist);
+
+        fprintf(stderr, "  %6d %11llu  %7llu %5llu %5llu  %7llu %5llu "
+                "%5llu\n", i, (unsigned long long)st->count,
+                (unsigned long long)(lat_n ? st->lat_sum / lat_n : 0),
+                (unsigned long long)isr_p99(st->lat_hist, lat_n),
+                (unsigned long long)st->lat_max,
+                (unsigned long long)(dur_n ? st->dur_sum / dur_n : 0),
+                (unsigned long long)isr_p99(st->dur_hist, dur_n),
+                (unsigned long long)st->dur_max);
+    }
+
+    fprintf(stderr, "Board %d stack low-water mark 0x%04x", board->index,
+            isr->sp_low);
+    if (isr->sp_alarms)
+        fprintf(stderr, ", below the alarm at 0x%04x", isr->sp_alarm);
+    else if (isr->sp_alarm)
+        fprintf(stderr, ", %d bytes above the alarm at 0x%04x",
+                isr->sp_low - isr->sp_alarm, isr->sp_alarm);
+    fprintf(stderr, "\n");
+}
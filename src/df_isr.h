@@ -0,0 +1,43 @@
+/*
+ * df_isr.h
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_ISR_H__
+#define __DF_ISR_H__
+
+#include <stdint.h>
+
+struct avr_t;
+struct drumfish_cfg;
+struct df_stats;
+
+/* Times every interrupt vector and watches the stack pointer's low-water
+ * mark, warning once when it drops below config->stack_alarm.
+ */
+int df_isr_init(const struct drumfish_cfg *config, struct avr_t *avr);
+
+/* Copies the timings so far into a stats file */
+void df_isr_counts(struct avr_t *avr, struct df_stats *stats);
+
+/* Prints a table of vectors that ran and the stack's low-water mark */
+void df_isr_report(struct avr_t *avr);
+
+#endif /* __DF_ISR_H__ */
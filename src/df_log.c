@@ -21,65 +21,450 @@
 
 #define _GNU_SOURCE
 
-#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sim_avr.h>
 
 #include "drumfish.h"
+#include "df_clock.h"
 #include "df_log.h"
+#include "df_mem.h"
+
+/* Messages waiting for the sink thread, must be a power of 2 */
+#define LOG_QUEUE_LEN 1024
+
+/* Most messages we hand to a single writev() */
+#define LOG_BATCH 64
+
+/* Rotated files kept around as FILE.1 (newest) to FILE.N */
+#define LOG_KEEP 4
+
+/* A bounded lock-free queue in the style of Dmitry Vyukov's. Any thread
+ * may log, only the sink thread takes messages off.
+ */
+struct log_cell {
+    uint64_t seq;
+    char *msg;
+    size_t len;
+};
 
 static enum df_log_lvl verbosity = 0;
-static struct timeval start_time;
+static const struct df_clock *log_clock = NULL;
 
-void
+static struct {
+    struct log_cell cell[LOG_QUEUE_LEN];
+    uint64_t enq_pos;
+    uint64_t deq_pos;
+    uint64_t dropped;
+    int block;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t drained;
+    pthread_t thread;
+    int running;
+    int sleeping;
+    int restart;
+
+    int fd;
+    char *path;
+    unsigned long long rotate;
+    unsigned long long size;
+} sink = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .drained = PTHREAD_COND_INITIALIZER,
+    .fd = STDERR_FILENO,
+};
+
+static void
+log_queue_reset(void)
+{
+    uint64_t i;
+
+    for (i = 0; i < LOG_QUEUE_LEN; i++)
+        sink.cell[i].seq = i;
+    sink.enq_pos = 0;
+    sink.deq_pos = 0;
+}
+
+static int
+log_enqueue(char *msg, size_t len)
+{
+    struct log_cell *cell;
+    uint64_t pos;
+    uint64_t seq;
+    int64_t diff;
+
+    pos = __atomic_load_n(&sink.enq_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        cell = &sink.cell[pos & (LOG_QUEUE_LEN - 1)];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        diff = (int64_t)(seq - pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&sink.enq_pos, &pos, pos + 1, 1,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&sink.enq_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->msg = msg;
+    cell->len = len;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static struct log_cell *
+log_peek(void)
+{
+    struct log_cell *cell = &sink.cell[sink.deq_pos & (LOG_QUEUE_LEN - 1)];
+
+    if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != sink.deq_pos + 1)
+        return NULL;
+
+    return cell;
+}
+
+static void
+log_release(struct log_cell *cell)
+{
+    free(cell->msg);
+    __atomic_store_n(&cell->seq, sink.deq_pos + LOG_QUEUE_LEN,
+            __ATOMIC_RELEASE);
+    sink.deq_pos++;
+}
+
+static void
+log_rotate(void)
+{
+    char from[4096];
+    char to[4096];
+    int fd;
+    int i;
+
+    for (i = LOG_KEEP - 1; i > 0; i--) {
+        snprintf(from, sizeof(from), "%s.%d", sink.path, i);
+        snprintf(to, sizeof(to), "%s.%d", sink.path, i + 1);
+        rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", sink.path);
+    rename(sink.path, to);
+
+    fd = open(sink.path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+            0644);
+    if (fd < 0)
+        return;
+
+    close(sink.fd);
+    sink.fd = fd;
+    sink.size = 0;
+}
+
+static void
+log_write(struct iovec *iov, int iovcnt, size_t len)
+{
+    ssize_t r;
+
+    if (sink.rotate && sink.size && sink.size + len > sink.rotate)
+        log_rotate();
+
+    while (iovcnt) {
+        r = writev(sink.fd, iov, iovcnt);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return;
+
+        sink.size += r;
+
+        /* Pick up where a short write left off */
+        while (iovcnt && (size_t)r >= iov->iov_len) {
+            r -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt) {
+            iov->iov_base = (char *)iov->iov_base + r;
+            iov->iov_len -= r;
+        }
+    }
+}
+
+/* Writes out one batch, returns how many messages it took */
+static int
+log_drain(void)
+{
+    struct log_cell *cells[LOG_BATCH];
+    struct iovec iov[LOG_BATCH + 1];
+    char note[64];
+    uint64_t dropped;
+    size_t len = 0;
+    int iovcnt = 0;
+    int n = 0;
+    int i;
+
+    dropped = __atomic_exchange_n(&sink.dropped, 0, __ATOMIC_RELAXED);
+    if (dropped) {
+        iov[iovcnt].iov_base = note;
+        iov[iovcnt].iov_len = snprintf(note, sizeof(note),
+                "[log] dropped %llu messages\n", (unsigned long long)dropped);
+        len += iov[iovcnt++].iov_len;
+    }
+
+    while (n < LOG_BATCH && (cells[n] = log_peek())) {
+        iov[iovcnt].iov_base = cells[n]->msg;
+        iov[iovcnt].iov_len = cells[n]->len;
+        len += iov[iovcnt++].iov_len;
+
+        /* Peeking further needs this one out of the way */
+        sink.deq_pos++;
+        n++;
+    }
+    sink.deq_pos -= n;
+
+    if (iovcnt)
+        log_write(iov, iovcnt, len);
+
+    for (i = 0; i < n; i++)
+        log_release(cells[i]);
+
+    return n;
+}
+
+static void *
+log_thread(void *param)
+{
+    sigset_t set;
+
+    (void)param;
+
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, NULL);
+
+    pthread_mutex_lock(&sink.lock);
+
+    for (;;) {
+        pthread_mutex_unlock(&sink.lock);
+        while (log_drain())
+            ;
+        pthread_mutex_lock(&sink.lock);
+
+        pthread_cond_broadcast(&sink.drained);
+
+        /* Tell loggers to wake us, then look once more in case one
+         * slipped in before it could see that.
+         */
+        __atomic_store_n(&sink.sleeping, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (log_peek() || __atomic_load_n(&sink.dropped, __ATOMIC_SEQ_CST)) {
+            sink.sleeping = 0;
+            continue;
+        }
+
+        if (!sink.running)
+            break;
+
+        pthread_cond_wait(&sink.wake, &sink.lock);
+        sink.sleeping = 0;
+    }
+
+    pthread_mutex_unlock(&sink.lock);
+
+    return NULL;
+}
+
+static void
+log_atfork_child(void)
+{
+    /* Our sink thread stayed behind with our parent and so do the
+     * messages it hadn't gotten to yet.
+     */
+    pthread_mutex_init(&sink.lock, NULL);
+    pthread_cond_init(&sink.wake, NULL);
+    pthread_cond_init(&sink.drained, NULL);
+    log_queue_reset();
+    sink.sleeping = 0;
+    sink.restart = sink.running;
+    sink.running = 0;
+}
+
+static int
+log_start(void)
+{
+    int ret;
+
+    sink.running = 1;
+    ret = df_mem_thread_create(&sink.thread, log_thread, NULL);
+    if (ret) {
+        fprintf(stderr, "Failed to create log thread: %s\n", strerror(ret));
+        sink.running = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+log_cleanup(void)
+{
+    df_log_stop();
+}
+
+int
 df_log_init(struct drumfish_cfg *config)
 {
+
     verbosity = (enum df_log_lvl) config->verbose;
-    timerclear(&start_time);
+    sink.block = config->log_block;
+    sink.rotate = config->log_rotate;
+
+    if (config->log_file) {
+        sink.path = config->log_file;
+        sink.fd = open(sink.path,
+                O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (sink.fd < 0) {
+            fprintf(stderr, "Unable to open log file '%s': %s\n",
+                    sink.path, strerror(errno));
+            sink.fd = STDERR_FILENO;
+            return -1;
+        }
+        sink.size = lseek(sink.fd, 0, SEEK_END);
+    }
+
+    log_queue_reset();
+    pthread_atfork(NULL, NULL, log_atfork_child);
+
+    if (log_start())
+        return -1;
+
+    atexit(log_cleanup);
+
+    return 0;
 }
 
 void
-df_log_start_time(void)
+df_log_set_clock(const struct df_clock *clk)
 {
-    if (gettimeofday(&start_time, NULL))
-        timerclear(&start_time);
+    log_clock = clk;
+}
+
+void
+df_log_flush(void)
+{
+    pthread_mutex_lock(&sink.lock);
+    while (sink.running && (log_peek() || sink.dropped)) {
+        pthread_cond_signal(&sink.wake);
+        pthread_cond_wait(&sink.drained, &sink.lock);
+    }
+    pthread_mutex_unlock(&sink.lock);
+}
+
+void
+df_log_stop(void)
+{
+    if (!sink.running)
+        return;
+
+    pthread_mutex_lock(&sink.lock);
+    sink.running = 0;
+    pthread_cond_signal(&sink.wake);
+    pthread_mutex_unlock(&sink.lock);
+
+    pthread_join(sink.thread, NULL);
+
+    if (sink.fd != STDERR_FILENO) {
+        close(sink.fd);
+        sink.fd = STDERR_FILENO;
+    }
 }
 
 void
 df_log_msg(enum df_log_lvl level, const char *format, ...)
 {
+    struct timespec ts;
     va_list ap;
-    struct timeval now;
-    struct timeval offset;
+    uint64_t usec = 0;
+    char *text;
     char *msg;
+    int len;
+
+    /* If its a message we will not print, skip it */
+    if (level > verbosity)
+        return;
+
+    /* Stamp it with simulated time, so messages line up with what the
+     * firmware sees no matter how fast we're running. Other threads may
+     * see a slightly stale cycle count, that's fine.
+     */
+    if (log_clock)
+        usec = df_clock_usec(log_clock);
 
+    /* Build the message with the time stamp */
     va_start(ap, format);
+    len = vasprintf(&text, format, ap);
+    va_end(ap);
+    if (len < 0)
+        return;
 
-    /* If its a message we will not print, skip it */
-    if (level <= verbosity) {
-        /* Get our current time for stamping the message */
-        if (gettimeofday(&now, NULL)) {
-            fprintf(stderr, "Failed to get current time: %s\n",
-                    strerror(errno));
-            timerclear(&now);
-        }
+    len = asprintf(&msg, "[%5llu.%06llu] %s",
+            (unsigned long long)(usec / 1000000),
+            (unsigned long long)(usec % 1000000), text);
+    free(text);
+    if (len < 0)
+        return;
 
-        /* Compute time since the CPU started */
-        if (timerisset(&start_time))
-            timersub(&now, &start_time, &offset);
-        else
-            timerclear(&offset);
+    if (__builtin_expect(sink.restart, 0)) {
+        sink.restart = 0;
+        log_start();
+    }
 
-        /* Build the message and print it with the time stamp */
-        vasprintf(&msg, format, ap);
-        fprintf(stderr, "[%5ld.%06ld] %s", offset.tv_sec, offset.tv_usec,
-                msg);
+    /* Not started yet or already gone, do it ourselves */
+    if (!sink.running) {
+        fputs(msg, stderr);
         free(msg);
+        return;
     }
 
-    va_end(ap);
+    while (log_enqueue(msg, len)) {
+        if (!sink.block) {
+            __atomic_fetch_add(&sink.dropped, 1, __ATOMIC_RELAXED);
+            free(msg);
+            return;
+        }
 
+        /* Wait for the sink to make some room */
+        ts.tv_sec = 0;
+        ts.tv_nsec = 1000000;
+        nanosleep(&ts, NULL);
+    }
+
+    /* Only bother the sink if it's gone to sleep. The cell we filled
+     * has to be visible before we look, or the sink could miss it while
+     * we miss that it's going to sleep.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sink.sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&sink.lock);
+        pthread_cond_signal(&sink.wake);
+        pthread_mutex_unlock(&sink.lock);
+    }
 }
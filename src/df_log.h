@@ -31,12 +31,20 @@ enum df_log_lvl {
     DF_LOG_DEBUG
 };
 
-/* Forward declaration */
+/* Forward declarations */
+struct df_clock;
 struct drumfish_cfg;
 
-void df_log_init(struct drumfish_cfg *config);
+/* Starts the sink thread, messages go straight to stderr before this */
+int df_log_init(struct drumfish_cfg *config);
 
-void df_log_start_time(void);
+/* Messages are stamped with the simulated time of 'clk' */
+void df_log_set_clock(const struct df_clock *clk);
+
+/* Waits for everything logged so far to be written out */
+void df_log_flush(void);
+
+void df_log_stop(void);
 
 void df_log_msg(enum df_log_lvl level, const char *format, ...)
     __attribute__ ((format (printf, 2, 3)));
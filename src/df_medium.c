@@ -0,0 +1,209 @@
+/*
+ * df_medium.c
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sim_avr.h>
+
+#include "drumfish.h"
+#include "df_clock.h"
+#include "df_log.h"
+#include "df_medium.h"
+#include "df_radio.h"
+#include "df_reactor.h"
+
+/* Frames that may wait for the run loop, must be a power of 2. Any
+ * more stay in the socket until it catches up.
+ */
+#define MEDIUM_RX_QUEUE 16
+
+volatile sig_atomic_t df_medium_pending = 0;
+
+static struct {
+    struct df_reactor_src src;
+    avr_t *avr;
+
+    /* Written by the reactor, consumed by the run loop */
+    pthread_mutex_t lock;
+    struct df_medium_frame rx[MEDIUM_RX_QUEUE];
+    unsigned int head;
+    unsigned int tail;
+
+    unsigned long long dropped;
+} medium = {
+    .src = { .fd = -1 },
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void
+medium_event(struct df_reactor_src *src, uint32_t revents)
+{
+    struct df_medium_frame *f;
+    ssize_t len;
+
+    pthread_mutex_lock(&medium.lock);
+
+    if (revents & (EPOLLHUP | EPOLLERR)) {
+        df_log_msg(DF_LOG_WARN, "Lost the radio medium.\n");
+        df_reactor_park(src);
+        goto out;
+    }
+
+    while (medium.head - medium.tail < MEDIUM_RX_QUEUE) {
+        f = &medium.rx[medium.head & (MEDIUM_RX_QUEUE - 1)];
+        len = recv(src->fd, f, sizeof(*f), MSG_DONTWAIT);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            break;
+
+        if ((size_t)len < DF_MEDIUM_HDR_LEN ||
+                (size_t)len != DF_MEDIUM_HDR_LEN + f->len)
+            continue;
+
+        medium.head++;
+        df_medium_pending = 1;
+    }
+
+    /* Leave the rest in the socket until the run loop makes room */
+    df_reactor_set_events(src,
+            medium.head - medium.tail < MEDIUM_RX_QUEUE ? EPOLLIN : 0);
+
+out:
+    pthread_mutex_unlock(&medium.lock);
+}
+
+static void
+medium_tx(avr_t *avr, const uint8_t *psdu, uint8_t len, int dbm,
+        void *opaque)
+{
+    struct df_medium_frame f;
+
+    (void)opaque;
+
+    f.usec = df_clock_usec(df_clock_get(avr));
+    f.sender = 0;
+    f.dbm = dbm;
+    f.lqi = 0;
+    f.len = len;
+    memcpy(f.psdu, psdu, len);
+
+    /* A full socket means the medium is behind, the frame is lost in the
+     * air just like it could be for real.
+     */
+    if (send(medium.src.fd, &f, DF_MEDIUM_HDR_LEN + len,
+                MSG_DONTWAIT | MSG_NOSIGNAL) < 0 && errno != EPIPE)
+        medium.dropped++;
+}
+
+int
+df_medium_init(const struct drumfish_cfg *config, avr_t *avr)
+{
+    if (config->medium_fd < 0)
+        return 0;
+
+    /* Asked to join but nothing to join with, better to say so than to
+     * run a node that never hears or sends a thing.
+     */
+    if (df_radio_set_tx_cb(avr, medium_tx, NULL)) {
+        fprintf(stderr, "No radio on this board, unable to join the radio "
+                "medium.\n");
+        return -1;
+    }
+
+    medium.avr = avr;
+    medium.src.fd = config->medium_fd;
+    medium.src.events = EPOLLIN;
+    medium.src.cb = medium_event;
+
+    /* Nobody else needs to know about it */
+    if (fcntl(medium.src.fd, F_SETFD, FD_CLOEXEC)) {
+        fprintf(stderr, "Unable to use radio medium on fd %d: %s\n",
+                medium.src.fd, strerror(errno));
+        medium.src.fd = -1;
+        return -1;
+    }
+
+    if (df_reactor_add(&medium.src)) {
+        fprintf(stderr, "Failed to hook up the radio medium to the "
+                "I/O reactor\n");
+        medium.src.fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+df_medium_process(avr_t *avr)
+{
+    struct df_medium_frame *f;
+    int full;
+
+    df_medium_pending = 0;
+
+    pthread_mutex_lock(&medium.lock);
+    full = medium.head - medium.tail == MEDIUM_RX_QUEUE;
+
+    while (medium.tail != medium.head) {
+        f = &medium.rx[medium.tail & (MEDIUM_RX_QUEUE - 1)];
+
+        /* The frame went out when the sender finished it, we hear it
+         * from here on. If we aren't listening it's gone.
+         */
+        df_radio_rx(avr, f->psdu, f->len, f->lqi, f->dbm);
+        medium.tail++;
+    }
+    pthread_mutex_unlock(&medium.lock);
+
+    /* Let the reactor pick up what it left in the socket */
+    if (full)
+        df_reactor_kick(&medium.src);
+}
+
+void
+df_medium_stop(void)
+{
+    if (medium.src.fd == -1)
+        return;
+
+    df_radio_set_tx_cb(medium.avr, NULL, NULL);
+
+    df_reactor_del(&medium.src);
+    close(medium.src.fd);
+    medium.src.fd = -1;
+
+    if (medium.dropped)
+        df_log_msg(DF_LOG_WARN, "Radio medium fell behind, %llu frames "
+                "were never sent.\n", medium.dropped);
+}
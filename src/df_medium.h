@@ -0,0 +1,64 @@
+/*
+ * df_medium.h
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_MEDIUM_H__
+#define __DF_MEDIUM_H__
+
+#include <signal.h>
+#include <stdint.h>
+
+/* Matches DF_RADIO_MAX_FRAME, the medium itself knows nothing of AVRs */
+#define DF_MEDIUM_MAX_FRAME 127
+
+/* One frame on the link between a node and the radio medium run by
+ * drumfish-fleet, one per SOCK_SEQPACKET message. Only the first 'len'
+ * bytes of 'psdu' are sent.
+ */
+struct df_medium_frame {
+    /* Sender's simulated time when the frame finished */
+    uint64_t usec;
+    /* Filled in by the medium, the sender's place in the manifest */
+    uint16_t sender;
+    /* Transmit power from the sender, received power to the receiver */
+    int8_t dbm;
+    /* Filled in by the medium from the frame's odds of getting through */
+    uint8_t lqi;
+    uint8_t len;
+    uint8_t psdu[DF_MEDIUM_MAX_FRAME];
+} __attribute__((packed));
+
+#define DF_MEDIUM_HDR_LEN (sizeof(struct df_medium_frame) - DF_MEDIUM_MAX_FRAME)
+
+struct avr_t;
+struct drumfish_cfg;
+
+extern volatile sig_atomic_t df_medium_pending;
+
+/* Connects the radio to the medium on '--medium-fd' */
+int df_medium_init(const struct drumfish_cfg *config, struct avr_t *avr);
+
+/* Run loop side, hands frames that came in to the radio */
+void df_medium_process(struct avr_t *avr);
+
+void df_medium_stop(void);
+
+#endif /* __DF_MEDIUM_H__ */
@@ -0,0 +1,344 @@
+/*
+ * df_mem.c
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/mman.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sim_avr.h>
+
+#include "drumfish.h"
+#include "df_board.h"
+#include "df_mem.h"
+
+/* A cache line, so boards never share one */
+#define MEM_ALIGN 64
+#define MEM_HUGE_PAGE (2 * 1024 * 1024)
+
+#define MEM_ROUND(x, to) (((x) + (to) - 1) & ~((size_t)(to) - 1))
+
+static const char *mem_names[DF_MEM_KINDS] = {
+    [DF_MEM_CORE] = "core",
+    [DF_MEM_SRAM] = "sram",
+    [DF_MEM_FLASH] = "flash",
+    [DF_MEM_EEPROM] = "eeprom",
+    [DF_MEM_BOARD] = "board",
+    [DF_MEM_UART] = "uart",
+    [DF_MEM_CLOCK] = "clock",
+    [DF_MEM_RADIO] = "radio",
+    [DF_MEM_AES] = "aes",
+    [DF_MEM_PFLASH] = "pflash",
+    [DF_MEM_ISR] = "isr",
+    [DF_MEM_BLACKBOX] = "blackbox",
+};
+
+/* SRAM and erased flash of a batch, one board after the other */
+static struct {
+    uint8_t *base;
+    size_t len;
+    size_t used;
+} arena;
+
+/* Every board of the batch, side by side */
+static struct {
+    struct df_board *slots;
+    size_t len;
+    size_t used;
+    size_t live;
+    size_t map_len;     /* 0 if the slots are in the arena */
+} pool;
+
+int
+df_mem_thread_create(pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+    pthread_attr_t attr;
+    size_t stack = DF_MEM_THREAD_STACK;
+    int ret;
+
+    if (stack < PTHREAD_STACK_MIN)
+        stack = PTHREAD_STACK_MIN;
+
+    ret = pthread_attr_init(&attr);
+    if (ret)
+        return ret;
+
+    ret = pthread_attr_setstacksize(&attr, stack);
+    if (!ret)
+        ret = pthread_create(thread, &attr, fn, arg);
+
+    pthread_attr_destroy(&attr);
+
+    return ret;
+}
+
+int
+df_mem_arena_init(const struct drumfish_cfg *config, const avr_t *avr)
+{
+    size_t board_len;
+    size_t len;
+    size_t lead;
+    uint8_t *map;
+
+    if (!config->hugepages || arena.base)
+        return 0;
+
+    board_len = MEM_ROUND(avr->ramend + 1, MEM_ALIGN) +
+        MEM_ROUND(avr->flashend + 1, MEM_ALIGN) +
+        MEM_ROUND(avr->e2end + 1, MEM_ALIGN) +
+        MEM_ROUND(sizeof(struct df_board), MEM_ALIGN);
+    len = MEM_ROUND(board_len * config->boards, MEM_HUGE_PAGE);
+
+    /* Boards with a pflash file never touch their share of it, so only
+     * reserve the address space and let pages appear as they're used.
+     * Map a huge page extra to be able to start on a huge page boundary.
+     */
+    map = mmap(NULL, len + MEM_HUGE_PAGE, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to reserve %zu bytes for the board arena: "
+                "%s\n", len, strerror(errno));
+        return -1;
+    }
+
+    lead = -(uintptr_t)map & (MEM_HUGE_PAGE - 1);
+    if (lead)
+        munmap(map, lead);
+    munmap(map + lead + len, MEM_HUGE_PAGE - lead);
+
+    arena.base = map + lead;
+    arena.len = len;
+    arena.used = 0;
+
+    /* Still worth having in one place without them */
+    if (madvise(arena.base, arena.len, MADV_HUGEPAGE))
+        fprintf(stderr, "Transparent huge pages are unavailable, the board "
+                "arena uses normal pages: %s\n", strerror(errno));
+
+    return 0;
+}
+
+void *
+df_mem_arena_alloc(size_t len)
+{
+    void *p;
+
+    len = MEM_ROUND(len, MEM_ALIGN);
+    if (!arena.base || arena.len - arena.used < len)
+        return NULL;
+
+    p = arena.base + arena.used;
+    arena.used += len;
+
+    return p;
+}
+
+int
+df_mem_arena_owns(const void *p)
+{
+    const uint8_t *b = (const uint8_t *)p;
+
+    return arena.base && b >= arena.base && b < arena.base + arena.len;
+}
+
+static int
+mem_pool_init(const struct drumfish_cfg *config)
+{
+    size_t len = config->boards * sizeof(*pool.slots);
+    void *map;
+
+    pool.len = config->boards;
+    pool.used = 0;
+    pool.live = 0;
+    pool.map_len = 0;
+
+    pool.slots = df_mem_arena_alloc(len);
+    if (pool.slots)
+        return 0;
+
+    /* Off the heap, so --mem-audit doesn't charge the batch to board 0 */
+    map = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+            -1, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to allocate memory for %ld boards: %s\n",
+                config->boards, strerror(errno));
+        return -1;
+    }
+
+    pool.slots = map;
+    pool.map_len = len;
+
+    return 0;
+}
+
+struct df_board *
+df_mem_board_new(const struct drumfish_cfg *config)
+{
+    struct df_board *board;
+
+    if (!pool.slots && mem_pool_init(config))
+        return NULL;
+
+    /* More boards than the batch was sized for */
+    if (pool.used == pool.len)
+        board = calloc(1, sizeof(*board));
+    else
+        board = &pool.slots[pool.used++];
+
+    if (!board) {
+        fprintf(stderr, "Failed to allocate memory for the board.\n");
+        return NULL;
+    }
+
+    if (board >= pool.slots && board < pool.slots + pool.len)
+        pool.live++;
+
+    board->mem[DF_MEM_BOARD] = sizeof(*board) - sizeof(board->uart);
+    board->mem[DF_MEM_UART] = sizeof(board->uart);
+
+    return board;
+}
+
+void
+df_mem_board_free(struct df_board *board)
+{
+    if (board < pool.slots || board >= pool.slots + pool.len) {
+        free(board);
+        return;
+    }
+
+    /* Slots aren't reused, the pool goes once the batch has */
+    if (--pool.live)
+        return;
+
+    if (pool.map_len)
+        munmap(pool.slots, pool.map_len);
+    pool.slots = NULL;
+    pool.len = 0;
+}
+
+static size_t
+mem_heap(void)
+{
+#if defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    /* mallinfo2() hands its answer back by value */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+    struct mallinfo2 mi = mallinfo2();
+#pragma GCC diagnostic pop
+
+    return mi.uordblks + mi.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+size_t
+df_mem_mark(const struct drumfish_cfg *config)
+{
+    if (!config->mem_audit)
+        return 0;
+
+    return mem_heap();
+}
+
+void
+df_mem_count(struct df_board *board, enum df_mem_kind kind, size_t *mark)
+{
+    size_t now;
+
+    if (!board->config->mem_audit)
+        return;
+
+    /* Setting up can free more than it takes, simavr's EEPROM for one */
+    now = mem_heap();
+    if (now > *mark)
+        board->mem[kind] += now - *mark;
+    *mark = now;
+}
+
+/* Resident set size, from /proc */
+static size_t
+mem_rss(void)
+{
+    unsigned long size, rss;
+    FILE *f;
+    int n;
+
+    f = fopen("/proc/self/statm", "r");
+    if (!f)
+        return 0;
+
+    n = fscanf(f, "%lu %lu", &size, &rss);
+    fclose(f);
+    if (n != 2)
+        return 0;
+
+    return rss * sysconf(_SC_PAGESIZE);
+}
+
+void
+df_mem_report(struct df_board **boards, size_t len)
+{
+    size_t total[DF_MEM_KINDS] = { 0 };
+    size_t first = 0;
+    size_t all = 0;
+    size_t rss;
+    size_t i;
+    int k;
+
+    if (!len)
+        return;
+
+    for (i = 0; i < len; i++)
+        for (k = 0; k < DF_MEM_KINDS; k++)
+            total[k] += boards[i]->mem[k];
+
+    fprintf(stderr, "Memory by component (bytes):\n");
+    fprintf(stderr, "  component        board 0   all %5zu boards\n", len);
+
+    for (k = 0; k < DF_MEM_KINDS; k++) {
+        fprintf(stderr, "  %-10s %13zu %18zu\n", mem_names[k],
+                boards[0]->mem[k], total[k]);
+        first += boards[0]->mem[k];
+        all += total[k];
+    }
+    fprintf(stderr, "  %-10s %13zu %18zu\n", "total", first, all);
+
+    /* Mapped flash and EEPROM only count once they're touched, and
+     * file-backed images are shared through the page cache.
+     */
+    rss = mem_rss();
+    if (rss)
+        fprintf(stderr, "Resident: %zu bytes, %zu per board\n", rss,
+                rss / len);
+
+    if (arena.base)
+        fprintf(stderr, "Huge page arena: %zu of %zu bytes handed out\n",
+                arena.used, arena.len);
+}
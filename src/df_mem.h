@@ -0,0 +1,86 @@
+/*
+ * df_mem.h
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_MEM_H__
+#define __DF_MEM_H__
+
+#include <pthread.h>
+#include <stddef.h>
+
+struct avr_t;
+struct drumfish_cfg;
+struct df_board;
+
+/* What --mem-audit breaks a board's memory down into */
+enum df_mem_kind {
+    DF_MEM_CORE,        /* simavr's core, its IO modules and their IRQs */
+    DF_MEM_SRAM,
+    DF_MEM_FLASH,
+    DF_MEM_EEPROM,
+    DF_MEM_BOARD,       /* struct df_board, less its UARTs */
+    DF_MEM_UART,
+    DF_MEM_CLOCK,
+    DF_MEM_RADIO,
+    DF_MEM_AES,
+    DF_MEM_PFLASH,
+    DF_MEM_ISR,
+    DF_MEM_BLACKBOX,
+    DF_MEM_KINDS
+};
+
+/* Stack for the process' helper threads, none of them go deep */
+#define DF_MEM_THREAD_STACK (64 * 1024)
+
+/* pthread_create() on a DF_MEM_THREAD_STACK stack */
+int df_mem_thread_create(pthread_t *thread, void *(*fn)(void *), void *arg);
+
+/* With config->hugepages, reserves one arena for the SRAM and erased
+ * flash of every board in the batch, backed by transparent huge pages.
+ * Sized from 'avr', only the first call does anything.
+ */
+int df_mem_arena_init(const struct drumfish_cfg *config,
+        const struct avr_t *avr);
+
+/* Zeroed memory from the arena, or NULL if there's none or it's used up.
+ * It's never handed back, it goes when we do.
+ */
+void *df_mem_arena_alloc(size_t len);
+
+int df_mem_arena_owns(const void *p);
+
+/* A zeroed board out of a pool sized for the whole batch */
+struct df_board *df_mem_board_new(const struct drumfish_cfg *config);
+
+void df_mem_board_free(struct df_board *board);
+
+/* Heap in use right now when auditing, 0 otherwise. Pass it to
+ * df_mem_count() after setting up a component to charge it with what
+ * it allocated.
+ */
+size_t df_mem_mark(const struct drumfish_cfg *config);
+
+void df_mem_count(struct df_board *board, enum df_mem_kind kind,
+        size_t *mark);
+
+/* Prints what each component takes for the first board and the batch */
+void df_mem_report(struct df_board **boards, size_t len);
+
+#endif /* __DF_MEM_H__ */
@@ -0,0 +1,261 @@
+/*
+ * df_pcap.c
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "df_chunkq.h"
+#include "df_log.h"
+#include "df_pcap.h"
+
+#define PCAP_CHUNK_SIZE (64 * 1024)
+#define PCAP_CHUNKS 8
+
+/* Hand over what we have at least this often (in simulated ns) while
+ * frames keep coming, so a live Wireshark isn't left waiting.
+ */
+#define PCAP_FLUSH_NS 100000000ULL
+
+/* Largest interface description or packet block we ever build */
+#define PCAP_MAX_BLOCK 512
+
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BOM 0x1a2b3c4d
+
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_IF_NAME 2
+#define PCAPNG_OPT_IF_TSRESOL 9
+#define PCAPNG_OPT_EPB_FLAGS 2
+
+struct df_pcap {
+    int fd;
+    char *path;
+    struct df_chunkq *q;
+    struct df_chunkq_buf *cur;
+    uint64_t flushed_ns;
+    int ifs;
+};
+
+static int
+pcap_write_chunk(void *opaque, const uint8_t *data, size_t len)
+{
+    struct df_pcap *pc = opaque;
+    ssize_t r;
+
+    while (len) {
+        r = write(pc->fd, data, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0) {
+            df_log_msg(DF_LOG_ERR, "Failed to write capture '%s', "
+                    "stopping: %s\n", pc->path, strerror(errno));
+            return -1;
+        }
+        data += r;
+        len -= r;
+    }
+
+    return 0;
+}
+
+static uint8_t *
+pcap_put_u16(uint8_t *p, uint16_t v)
+{
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+static uint8_t *
+pcap_put_u32(uint8_t *p, uint32_t v)
+{
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+static uint8_t *
+pcap_put_opt(uint8_t *p, uint16_t code, const void *val, uint16_t len)
+{
+    p = pcap_put_u16(p, code);
+    p = pcap_put_u16(p, len);
+    if (len)
+        memcpy(p, val, len);
+    memset(p + len, 0, -len & 3);
+
+    return p + ((len + 3) & ~3);
+}
+
+/* Fills in the block's total length at both ends and queues it */
+static void
+pcap_put_block(struct df_pcap *pc, uint8_t *start, uint8_t *p)
+{
+    uint32_t len = p - start + sizeof(uint32_t);
+
+    pcap_put_u32(start + sizeof(uint32_t), len);
+    pcap_put_u32(p, len);
+    pc->cur->len += len;
+}
+
+static uint8_t *
+pcap_reserve(struct df_pcap *pc)
+{
+    if (pc->cur->len + PCAP_MAX_BLOCK > PCAP_CHUNK_SIZE) {
+        df_chunkq_put(pc->q, pc->cur);
+        pc->cur = df_chunkq_get(pc->q);
+    }
+
+    return pc->cur->data + pc->cur->len;
+}
+
+struct df_pcap *
+df_pcap_open(const char *path)
+{
+    struct df_pcap *pc;
+    uint8_t *start;
+    uint8_t *p;
+    uint64_t section = UINT64_MAX;
+
+    pc = calloc(1, sizeof(*pc));
+    if (!pc) {
+        fprintf(stderr, "Failed to allocate memory for capture.\n");
+        return NULL;
+    }
+
+    pc->path = strdup(path);
+    if (!pc->path) {
+        fprintf(stderr, "Failed to allocate memory for capture.\n");
+        goto err;
+    }
+
+    pc->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (pc->fd < 0) {
+        fprintf(stderr, "Unable to create capture '%s': %s\n", path,
+                strerror(errno));
+        goto err;
+    }
+
+    pc->q = df_chunkq_new(PCAP_CHUNK_SIZE, PCAP_CHUNKS, pcap_write_chunk, pc);
+    if (!pc->q)
+        goto err_close;
+
+    pc->cur = df_chunkq_get(pc->q);
+
+    /* Section header, in our own byte order */
+    start = p = pcap_reserve(pc);
+    p = pcap_put_u32(p, PCAPNG_SHB);
+    p = pcap_put_u32(p, 0);
+    p = pcap_put_u32(p, PCAPNG_BOM);
+    p = pcap_put_u16(p, 1);
+    p = pcap_put_u16(p, 0);
+    memcpy(p, &section, sizeof(section));
+    p += sizeof(section);
+    pcap_put_block(pc, start, p);
+
+    return pc;
+
+err_close:
+    close(pc->fd);
+err:
+    free(pc->path);
+    free(pc);
+    return NULL;
+}
+
+int
+df_pcap_add_if(struct df_pcap *pc, const char *name)
+{
+    uint8_t tsresol = 9;
+    uint8_t *start;
+    uint8_t *p;
+    size_t len;
+
+    len = strlen(name);
+    if (len > 255)
+        len = 255;
+
+    start = p = pcap_reserve(pc);
+    p = pcap_put_u32(p, PCAPNG_IDB);
+    p = pcap_put_u32(p, 0);
+    p = pcap_put_u16(p, DF_PCAP_LINKTYPE_802154);
+    p = pcap_put_u16(p, 0);
+    p = pcap_put_u32(p, 127);
+    p = pcap_put_opt(p, PCAPNG_OPT_IF_NAME, name, len);
+    /* Our timestamps are in nanoseconds */
+    p = pcap_put_opt(p, PCAPNG_OPT_IF_TSRESOL, &tsresol, sizeof(tsresol));
+    p = pcap_put_opt(p, PCAPNG_OPT_END, NULL, 0);
+    pcap_put_block(pc, start, p);
+
+    return pc->ifs++;
+}
+
+void
+df_pcap_frame(struct df_pcap *pc, int ifid, uint64_t ns, int dir,
+        const uint8_t *frame, size_t len)
+{
+    uint32_t flags = dir;
+    uint8_t *start;
+    uint8_t *p;
+
+    if (len > 127)
+        len = 127;
+
+    start = p = pcap_reserve(pc);
+    p = pcap_put_u32(p, PCAPNG_EPB);
+    p = pcap_put_u32(p, 0);
+    p = pcap_put_u32(p, ifid);
+    p = pcap_put_u32(p, ns >> 32);
+    p = pcap_put_u32(p, ns);
+    p = pcap_put_u32(p, len);
+    p = pcap_put_u32(p, len);
+    memcpy(p, frame, len);
+    memset(p + len, 0, -len & 3);
+    p += (len + 3) & ~3;
+    p = pcap_put_opt(p, PCAPNG_OPT_EPB_FLAGS, &flags, sizeof(flags));
+    p = pcap_put_opt(p, PCAPNG_OPT_END, NULL, 0);
+    pcap_put_block(pc, start, p);
+
+    if (ns - pc->flushed_ns >= PCAP_FLUSH_NS) {
+        df_chunkq_put(pc->q, pc->cur);
+        pc->cur = df_chunkq_get(pc->q);
+        pc->flushed_ns = ns;
+    }
+}
+
+void
+df_pcap_close(struct df_pcap *pc)
+{
+    if (!pc)
+        return;
+
+    df_chunkq_put(pc->q, pc->cur);
+    df_chunkq_free(pc->q);
+
+    close(pc->fd);
+    free(pc->path);
+    free(pc);
+}
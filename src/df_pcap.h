@@ -0,0 +1,52 @@
+/*
+ * df_pcap.h
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_PCAP_H__
+#define __DF_PCAP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* IEEE 802.15.4 frames, the last two bytes being the FCS */
+#define DF_PCAP_LINKTYPE_802154 195
+
+#define DF_PCAP_IN 1
+#define DF_PCAP_OUT 2
+
+/* A pcapng capture that is written out by a background thread. Only
+ * one thread may add interfaces and frames to it.
+ */
+struct df_pcap;
+
+struct df_pcap *df_pcap_open(const char *path);
+
+/* Returns the interface's id for df_pcap_frame() or -1 */
+int df_pcap_add_if(struct df_pcap *pc, const char *name);
+
+/* 'ns' is the simulated time the frame finished at */
+void df_pcap_frame(struct df_pcap *pc, int ifid, uint64_t ns, int dir,
+        const uint8_t *frame, size_t len);
+
+/* Writes out whatever is left and closes the file */
+void df_pcap_close(struct df_pcap *pc);
+
+#endif /* __DF_PCAP_H__ */
@@ -0,0 +1,361 @@
+/*
+ * df_pflash.c
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sim_avr.h>
+#include <avr_flash.h>
+
+#include "drumfish.h"
+#include "flash.h"
+#include "df_board.h"
+#include "df_clock.h"
+#include "df_log.h"
+#include "df_pflash.h"
+
+#define PFLASH_BITS (sizeof(uint64_t) * 8)
+
+struct df_pflash {
+    avr_flash_t *io;
+    int (*ioctl)(struct avr_io_t *io, uint32_t ctl, void *io_param);
+
+    int policy;
+    uint64_t period_usec;
+    struct df_clock *clk;
+    struct df_clock_event sync_ev;
+
+    /* msync() is pointless once we no longer map the pflash file */
+    int file_backed;
+
+    uint32_t page_size;
+    uint32_t pages;
+    uint64_t *dirty;
+
+    struct df_pflash_wear *wear;
+    size_t wear_len;
+    int wear_mapped;
+
+    uint64_t erases;
+    uint64_t writes;
+    uint64_t syncs;
+};
+
+static void
+pflash_sync(struct df_pflash *pf, avr_t *avr)
+{
+    size_t sys_page = sysconf(_SC_PAGESIZE);
+    uint32_t first;
+    uint32_t last;
+    size_t start;
+    size_t end;
+    size_t i;
+
+    if (!pf->file_backed)
+        return;
+
+    /* Flush each run of dirty flash pages in one go */
+    for (i = 0; i < pf->pages; i++) {
+        if (!(pf->dirty[i / PFLASH_BITS] & (1ULL << (i % PFLASH_BITS))))
+            continue;
+
+        first = i;
+        while (i < pf->pages &&
+                (pf->dirty[i / PFLASH_BITS] & (1ULL << (i % PFLASH_BITS)))) {
+            pf->dirty[i / PFLASH_BITS] &= ~(1ULL << (i % PFLASH_BITS));
+            i++;
+        }
+        last = i;
+
+        start = (size_t)first * pf->page_size & ~(sys_page - 1);
+        end = (size_t)last * pf->page_size;
+        if (msync(avr->flash + start, end - start, MS_SYNC)) {
+            df_log_msg(DF_LOG_WARN, "Unable to sync pflash: %s\n",
+                    strerror(errno));
+            return;
+        }
+        pf->syncs++;
+    }
+}
+
+static void
+pflash_tick(avr_t *avr, uint64_t when, void *opaque)
+{
+    struct df_pflash *pf = opaque;
+
+    pflash_sync(pf, avr);
+
+    df_clock_schedule_at(pf->clk, &pf->sync_ev,
+            when + df_clock_usec_to_cycles(pf->clk, pf->period_usec));
+}
+
+static void
+pflash_account(struct df_pflash *pf, avr_t *avr, uint32_t page, int erase)
+{
+    if (page >= pf->pages)
+        return;
+
+    pf->dirty[page / PFLASH_BITS] |= 1ULL << (page % PFLASH_BITS);
+
+    if (erase) {
+        pf->erases++;
+        if (++pf->wear->page[page].erases == DF_PFLASH_ENDURANCE)
+            df_log_msg(DF_LOG_WARN, "pflash page %u at 0x%05x has been "
+                    "erased %u times, real flash may be worn out\n",
+                    page, page * pf->page_size, DF_PFLASH_ENDURANCE);
+
+        if (pf->policy == DF_PFLASH_SYNC_ERASE)
+            pflash_sync(pf, avr);
+    } else {
+        pf->writes++;
+        pf->wear->page[page].writes++;
+    }
+}
+
+/* Every page erase and write goes through the flash module's ioctl, so
+ * we sit in front of it. The SPM command bits and Z are sampled first
+ * as the flash module clears them.
+ */
+static int
+pflash_ioctl(struct avr_io_t *io, uint32_t ctl, void *io_param)
+{
+    avr_t *avr = io->avr;
+    struct df_pflash *pf = df_board_get(avr)->pflash;
+    uint32_t z;
+    int erase;
+    int write;
+    int ret;
+
+    if (ctl != AVR_IOCTL_FLASH_SPM)
+        return pf->ioctl(io, ctl, io_param);
+
+    erase = avr_regbit_get(avr, pf->io->pgers);
+    write = avr_regbit_get(avr, pf->io->pgwrt);
+
+    z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
+    if (avr->rampz)
+        z |= avr->data[avr->rampz] << 16;
+
+    ret = pf->ioctl(io, ctl, io_param);
+
+    if (erase || write)
+        pflash_account(pf, avr, z / pf->page_size, erase);
+
+    return ret;
+}
+
+static int
+pflash_open_wear(struct df_pflash *pf, const char *path)
+{
+    struct stat st;
+    int fd;
+
+    pf->wear_len = sizeof(*pf->wear) + pf->pages * sizeof(pf->wear->page[0]);
+
+    if (!path) {
+        pf->wear = calloc(1, pf->wear_len);
+        if (!pf->wear) {
+            fprintf(stderr, "Failed to allocate memory for pflash wear "
+                    "counters.\n");
+            return -1;
+        }
+        goto init;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+    if (fd == -1) {
+        fprintf(stderr, "Unable to open wear file '%s': %s\n",
+                path, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) || (st.st_size != (off_t)pf->wear_len &&
+                ftruncate(fd, pf->wear_len))) {
+        fprintf(stderr, "Unable to size wear file '%s': %s\n",
+                path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    pf->wear = mmap(NULL, pf->wear_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0);
+    close(fd);
+    if (pf->wear == MAP_FAILED) {
+        fprintf(stderr, "Failed to map wear file '%s': %s\n",
+                path, strerror(errno));
+        pf->wear = NULL;
+        return -1;
+    }
+    pf->wear_mapped = 1;
+
+    /* Pick up where the last run left off */
+    if (st.st_size == (off_t)pf->wear_len &&
+            pf->wear->magic == DF_PFLASH_WEAR_MAGIC) {
+        if (pf->wear->version == DF_PFLASH_WEAR_VERSION &&
+                pf->wear->page_size == pf->page_size &&
+                pf->wear->pages == pf->pages)
+            return 0;
+
+        fprintf(stderr, "Wear file '%s' is for a different flash layout.\n",
+                path);
+        return -1;
+    }
+
+    memset(pf->wear, 0, pf->wear_len);
+
+init:
+    pf->wear->version = DF_PFLASH_WEAR_VERSION;
+    pf->wear->page_size = pf->page_size;
+    pf->wear->pages = pf->pages;
+    pf->wear->magic = DF_PFLASH_WEAR_MAGIC;
+
+    return 0;
+}
+
+int
+df_pflash_init(const struct drumfish_cfg *config, avr_t *avr)
+{
+    struct df_pflash *pf;
+    avr_io_t *io;
+
+    for (io = avr->io_port; io; io = io->next)
+        if (!strcmp(io->kind, "flash"))
+            break;
+
+    if (!io) {
+        fprintf(stderr, "No flash controller to track pflash writes "
+                "with.\n");
+        return -1;
+    }
+
+    pf = calloc(1, sizeof(*pf));
+    if (!pf) {
+        fprintf(stderr, "Failed to allocate memory for pflash tracking.\n");
+        return -1;
+    }
+    df_board_get(avr)->pflash = pf;
+
+    pf->io = (avr_flash_t *)io;
+    pf->ioctl = io->ioctl;
+    pf->policy = config->pflash_sync;
+    pf->period_usec = config->pflash_sync_ms * 1000ULL;
+    pf->clk = df_clock_get(avr);
+    pf->file_backed = config->pflash && !config->pflash_cow;
+    pf->page_size = pf->io->spm_pagesize;
+    pf->pages = (avr->flashend + 1) / pf->page_size;
+
+    pf->dirty = calloc((pf->pages + PFLASH_BITS - 1) / PFLASH_BITS,
+            sizeof(*pf->dirty));
+    if (!pf->dirty) {
+        fprintf(stderr, "Failed to allocate memory for pflash tracking.\n");
+        return -1;
+    }
+
+    if (pflash_open_wear(pf, config->pflash_wear))
+        return -1;
+
+    io->ioctl = pflash_ioctl;
+
+    if (pf->policy == DF_PFLASH_SYNC_PERIODIC) {
+        df_clock_event_init(&pf->sync_ev, pflash_tick, pf);
+        df_clock_schedule_usec(pf->clk, &pf->sync_ev, pf->period_usec);
+    }
+
+    return 0;
+}
+
+int
+df_pflash_make_private(avr_t *avr)
+{
+    struct df_pflash *pf = df_board_get(avr)->pflash;
+    uint8_t *wear;
+
+    pf->file_backed = 0;
+
+    if (!pf->wear_mapped)
+        return 0;
+
+    wear = flash_make_private((uint8_t *)pf->wear, pf->wear_len);
+    if (!wear)
+        return -1;
+    pf->wear = (struct df_pflash_wear *)wear;
+
+    return 0;
+}
+
+void
+df_pflash_counts(avr_t *avr, uint64_t *erases, uint64_t *writes,
+        uint64_t *syncs)
+{
+    struct df_pflash *pf = df_board_get(avr)->pflash;
+
+    *erases = pf->erases;
+    *writes = pf->writes;
+    *syncs = pf->syncs;
+}
+
+void
+df_pflash_stop(avr_t *avr)
+{
+    struct df_pflash *pf = df_board_get(avr)->pflash;
+    uint32_t worst = 0;
+    uint32_t i;
+
+    if (!pf)
+        return;
+
+    df_clock_cancel(pf->clk, &pf->sync_ev);
+    pf->io->io.ioctl = pf->ioctl;
+
+    if (pf->policy != DF_PFLASH_SYNC_NEVER)
+        pflash_sync(pf, avr);
+
+    for (i = 1; i < pf->pages; i++)
+        if (pf->wear->page[i].erases > pf->wear->page[worst].erases)
+            worst = i;
+
+    if (pf->erases || pf->writes)
+        df_log_msg(DF_LOG_INFO, "pflash: %llu page erases, %llu page "
+                "writes, %llu syncs. Most erased page %u at 0x%05x "
+                "(%u erases)\n", (unsigned long long)pf->erases,
+                (unsigned long long)pf->writes,
+                (unsigned long long)pf->syncs, worst, worst * pf->page_size,
+                pf->wear->page[worst].erases);
+
+    if (pf->wear_mapped)
+        munmap(pf->wear, pf->wear_len);
+    else
+        free(pf->wear);
+    free(pf->dirty);
+    free(pf);
+
+    df_board_get(avr)->pflash = NULL;
+}
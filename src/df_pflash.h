@@ -0,0 +1,72 @@
+/*
+ * df_pflash.h
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_PFLASH_H__
+#define __DF_PFLASH_H__
+
+#include <stdint.h>
+
+/* When SPM writes to pflash are pushed out to its file */
+enum {
+    DF_PFLASH_SYNC_NEVER = 0,   /* whenever the kernel gets to it */
+    DF_PFLASH_SYNC_ERASE,       /* as each page is erased */
+    DF_PFLASH_SYNC_PERIODIC,    /* every pflash_sync_ms of emulated time */
+};
+
+#define DF_PFLASH_WEAR_MAGIC 0x52574644 /* "DFWR" */
+#define DF_PFLASH_WEAR_VERSION 1
+
+/* The datasheet's guaranteed flash write/erase endurance */
+#define DF_PFLASH_ENDURANCE 10000
+
+/* Layout of the file given with '--pflash-wear'. Counters accumulate
+ * across runs for as long as the file is kept alongside its pflash.
+ */
+struct df_pflash_wear {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t pages;
+    struct {
+        uint32_t erases;
+        uint32_t writes;
+    } page[];
+};
+
+/* Forward declarations, so tools can read the file without simavr */
+struct avr_t;
+struct drumfish_cfg;
+
+int df_pflash_init(const struct drumfish_cfg *config, struct avr_t *avr);
+
+/* Our pflash stopped being file backed, so stop syncing it and keep
+ * the wear counters to ourselves.
+ */
+int df_pflash_make_private(struct avr_t *avr);
+
+/* Totals for this run */
+void df_pflash_counts(struct avr_t *avr, uint64_t *erases, uint64_t *writes,
+        uint64_t *syncs);
+
+void df_pflash_stop(struct avr_t *avr);
+
+#endif /* __DF_PFLASH_H__ */
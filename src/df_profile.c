@@ -0,0 +1,537 @@
+/*
+ * df_profile.c
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sim_avr.h>
+
+#include "drumfish.h"
+#include "df_board.h"
+#include "df_hook.h"
+#include "df_log.h"
+#include "df_profile.h"
+
+/* Deeper than any real AVR firmware nests, deeper calls aren't timed */
+#define PROFILE_DEPTH 256
+
+/* Past this many calls a function keeps a random sample of them */
+#define PROFILE_SAMPLES (1 << 20)
+
+struct profile_func {
+    char *name;
+    uint32_t addr;
+
+    uint64_t calls;
+    uint32_t *incl;
+    uint32_t *excl;
+    size_t len;
+    size_t alloc;
+};
+
+struct profile_frame {
+    /* NULL for an interrupt, timed only to keep it out of its parent */
+    struct profile_func *func;
+    uint16_t sp;
+    uint64_t entry;
+    /* Cycles spent in profiled functions called from this one */
+    uint64_t child;
+};
+
+static struct {
+    struct profile_func *funcs;
+    size_t len;
+    const char *out;
+
+    /* One bit per flash word that starts a profiled function */
+    uint8_t *entry;
+    size_t entry_words;
+
+    /* Past the last interrupt vector, in bytes like the PC */
+    avr_flashaddr_t vectors_end;
+
+    struct profile_frame stack[PROFILE_DEPTH];
+    unsigned int depth;
+
+    uint64_t rng;
+} prof;
+
+static inline uint16_t
+profile_sp(const avr_t *avr)
+{
+    return avr->data[R_SPL] | avr->data[R_SPH] << 8;
+}
+
+static struct profile_func *
+profile_lookup(uint32_t addr)
+{
+    size_t lo = 0;
+    size_t hi = prof.len;
+    size_t mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (prof.funcs[mid].addr == addr)
+            return &prof.funcs[mid];
+        if (prof.funcs[mid].addr < addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return NULL;
+}
+
+static void
+profile_sample(struct profile_func *f, uint64_t incl, uint64_t excl)
+{
+    uint32_t *p;
+    size_t alloc;
+    size_t slot;
+
+    f->calls++;
+
+    if (f->len == f->alloc && f->alloc < PROFILE_SAMPLES) {
+        alloc = f->alloc ? f->alloc * 2 : 64;
+        p = realloc(f->incl, alloc * sizeof(*p));
+        if (p) {
+            f->incl = p;
+            p = realloc(f->excl, alloc * sizeof(*p));
+            if (p) {
+                f->excl = p;
+                f->alloc = alloc;
+            }
+        }
+    }
+
+    if (f->len < f->alloc) {
+        slot = f->len++;
+    } else {
+        /* Reservoir sampling, seeded the same every run */
+        prof.rng ^= prof.rng << 13;
+        prof.rng ^= prof.rng >> 7;
+        prof.rng ^= prof.rng << 17;
+        slot = prof.rng % f->calls;
+        if (slot >= f->len)
+            return;
+    }
+
+    f->incl[slot] = incl > UINT32_MAX ? UINT32_MAX : incl;
+    f->excl[slot] = excl > UINT32_MAX ? UINT32_MAX : excl;
+}
+
+static void
+profile_insn_hook(avr_t *avr, avr_flashaddr_t pc, avr_flashaddr_t new_pc,
+        void *opaque)
+{
+    struct profile_frame *fr;
+    struct profile_func *f;
+    uint16_t sp = profile_sp(avr);
+    uint64_t incl;
+    size_t word;
+
+    (void)opaque;
+
+    if (df_board_get(avr)->replaying)
+        return;
+
+    /* A function has returned once SP is back above where it was when
+     * it started, which also unwinds tail calls and longjmp()s.
+     */
+    while (prof.depth && sp > prof.stack[prof.depth - 1].sp) {
+        fr = &prof.stack[--prof.depth];
+        incl = avr->cycle - fr->entry;
+        if (fr->func)
+            profile_sample(fr->func, incl, incl - fr->child);
+        if (prof.depth)
+            prof.stack[prof.depth - 1].child += incl;
+    }
+
+    /* The core jumped into the vector table from outside it, so an
+     * interrupt was taken. Whatever it interrupted doesn't get the time
+     * until RETI, whether or not the handler is profiled itself.
+     */
+    if (new_pc < prof.vectors_end && pc >= prof.vectors_end &&
+            prof.depth && prof.depth < PROFILE_DEPTH) {
+        fr = &prof.stack[prof.depth++];
+        fr->func = NULL;
+        fr->sp = sp;
+        fr->entry = avr->cycle;
+        fr->child = 0;
+        return;
+    }
+
+    word = new_pc >> 1;
+    if (word >= prof.entry_words ||
+            !(prof.entry[word >> 3] & (1 << (word & 7))))
+        return;
+
+    f = profile_lookup(new_pc);
+    if (!f)
+        return;
+
+    /* Looping back to its first instruction doesn't make a new call */
+    fr = prof.depth ? &prof.stack[prof.depth - 1] : NULL;
+    if (fr && fr->func == f && fr->sp == sp)
+        return;
+
+    if (prof.depth == PROFILE_DEPTH)
+        return;
+
+    fr = &prof.stack[prof.depth++];
+    fr->func = f;
+    fr->sp = sp;
+    fr->entry = avr->cycle;
+    fr->child = 0;
+}
+
+static int
+profile_cmp_addr(const void *a, const void *b)
+{
+    const struct profile_func *fa = a;
+    const struct profile_func *fb = b;
+
+    if (fa->addr != fb->addr)
+        return fa->addr < fb->addr ? -1 : 1;
+
+    return strcmp(fa->name, fb->name);
+}
+
+static int
+profile_cmp_name(const void *a, const void *b)
+{
+    const struct profile_func *fa = a;
+    const struct profile_func *fb = b;
+    int r = strcmp(fa->name, fb->name);
+
+    if (r)
+        return r;
+
+    return fa->addr < fb->addr ? -1 : fa->addr > fb->addr;
+}
+
+static int
+profile_cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int
+profile_wanted(const struct drumfish_cfg *config, const char *name,
+        char *found)
+{
+    int want = 0;
+    int i;
+
+    for (i = 0; i < config->profile_len; i++) {
+        if (!strcmp(config->profile[i], DF_PROFILE_ALL)) {
+            want = 1;
+        } else if (!strcmp(config->profile[i], name)) {
+            found[i] = 1;
+            want = 1;
+        }
+    }
+
+    return want;
+}
+
+/* Picks the functions asked for out of the ELF's symbol table */
+static int
+profile_load_elf(const struct drumfish_cfg *config)
+{
+    const Elf32_Ehdr *eh;
+    const Elf32_Shdr *sh;
+    const Elf32_Shdr *strtab;
+    const Elf32_Sym *sym;
+    uint8_t *map;
+    const char *name;
+    struct stat st;
+    size_t count;
+    size_t alloc = 0;
+    size_t i;
+    char *found;
+    void *p;
+    int ret = -1;
+    int fd;
+
+    found = calloc(config->profile_len, 1);
+    if (!found) {
+        fprintf(stderr, "Failed to allocate memory for the profile.\n");
+        return -1;
+    }
+
+    fd = open(config->profile_elf, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open '%s': %s\n", config->profile_elf,
+                strerror(errno));
+        free(found);
+        return -1;
+    }
+
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*eh)) {
+        fprintf(stderr, "'%s' is not an ELF file.\n", config->profile_elf);
+        close(fd);
+        free(found);
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Unable to map '%s': %s\n", config->profile_elf,
+                strerror(errno));
+        free(found);
+        return -1;
+    }
+
+    eh = (const Elf32_Ehdr *)map;
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) ||
+            eh->e_ident[EI_CLASS] != ELFCLASS32 ||
+            eh->e_ident[EI_DATA] != ELFDATA2LSB || eh->e_machine != EM_AVR ||
+            eh->e_shentsize != sizeof(*sh) ||
+            eh->e_shoff + (size_t)eh->e_shnum * sizeof(*sh) >
+            (size_t)st.st_size) {
+        fprintf(stderr, "'%s' is not an AVR ELF file.\n",
+                config->profile_elf);
+        goto out;
+    }
+
+    for (i = 0; i < eh->e_shnum; i++) {
+        sh = (const Elf32_Shdr *)(map + eh->e_shoff) + i;
+        if (sh->sh_type == SHT_SYMTAB)
+            break;
+    }
+
+    if (i == eh->e_shnum || sh->sh_link >= eh->e_shnum) {
+        fprintf(stderr, "'%s' has no symbols, was it stripped?\n",
+                config->profile_elf);
+        goto out;
+    }
+
+    strtab = (const Elf32_Shdr *)(map + eh->e_shoff) + sh->sh_link;
+    if (sh->sh_offset + (size_t)sh->sh_size > (size_t)st.st_size ||
+            strtab->sh_offset + (size_t)strtab->sh_size >
+            (size_t)st.st_size) {
+        fprintf(stderr, "'%s' is corrupt.\n", config->profile_elf);
+        goto out;
+    }
+
+    count = sh->sh_size / sizeof(*sym);
+    for (i = 0; i < count; i++) {
+        sym = (const Elf32_Sym *)(map + sh->sh_offset) + i;
+        if (ELF32_ST_TYPE(sym->st_info) != STT_FUNC ||
+                sym->st_name >= strtab->sh_size)
+            continue;
+
+        name = (const char *)map + strtab->sh_offset + sym->st_name;
+        if (!memchr(name, '\0', strtab->sh_size - sym->st_name) ||
+                !profile_wanted(config, name, found))
+            continue;
+
+        if (prof.len == alloc) {
+            alloc = alloc ? alloc * 2 : 64;
+            p = realloc(prof.funcs, alloc * sizeof(*prof.funcs));
+            if (!p)
+                goto nomem;
+            prof.funcs = p;
+        }
+
+        memset(&prof.funcs[prof.len], 0, sizeof(*prof.funcs));
+        prof.funcs[prof.len].addr = sym->st_value;
+        prof.funcs[prof.len].name = strdup(name);
+        if (!prof.funcs[prof.len].name)
+            goto nomem;
+        prof.len++;
+    }
+
+    for (i = 0; i < (size_t)config->profile_len; i++) {
+        if (!found[i] && strcmp(config->profile[i], DF_PROFILE_ALL)) {
+            fprintf(stderr, "No function '%s' in '%s'.\n",
+                    config->profile[i], config->profile_elf);
+            goto out;
+        }
+    }
+
+    ret = 0;
+    goto out;
+
+nomem:
+    fprintf(stderr, "Failed to allocate memory for the profile.\n");
+out:
+    munmap(map, st.st_size);
+    free(found);
+
+    return ret;
+}
+
+int
+df_profile_init(const struct drumfish_cfg *config, avr_t *avr)
+{
+    size_t i, j;
+    size_t word;
+
+    if (!config->profile_len)
+        return 0;
+
+    prof.out = config->profile_out;
+    prof.rng = 0x2545f4914f6cdd1dULL;
+
+    if (profile_load_elf(config))
+        goto err;
+
+    /* Aliases share an address, only the first name gets the time */
+    qsort(prof.funcs, prof.len, sizeof(*prof.funcs), profile_cmp_addr);
+    for (i = j = 0; i < prof.len; i++) {
+        if (j && prof.funcs[j - 1].addr == prof.funcs[i].addr) {
+            free(prof.funcs[i].name);
+            continue;
+        }
+        prof.funcs[j++] = prof.funcs[i];
+    }
+    prof.len = j;
+
+    for (i = 0; i < avr->interrupts.vector_count; i++) {
+        word = (avr->interrupts.vector[i]->vector + 1) * avr->vector_size;
+        if (word > prof.vectors_end)
+            prof.vectors_end = word;
+    }
+
+    prof.entry_words = (avr->flashend + 1) / 2;
+    prof.entry = calloc((prof.entry_words + 7) / 8, 1);
+    if (!prof.entry) {
+        fprintf(stderr, "Failed to allocate memory for the profile.\n");
+        goto err;
+    }
+
+    for (i = 0; i < prof.len; i++) {
+        word = prof.funcs[i].addr >> 1;
+        if (word < prof.entry_words)
+            prof.entry[word >> 3] |= 1 << (word & 7);
+    }
+
+    if (df_hook_insn_add(avr, profile_insn_hook, NULL))
+        goto err;
+
+    return 0;
+
+err:
+    for (i = 0; i < prof.len; i++)
+        free(prof.funcs[i].name);
+    free(prof.funcs);
+    free(prof.entry);
+    memset(&prof, 0, sizeof(prof));
+    return -1;
+}
+
+static void
+profile_write(FILE *f)
+{
+    struct profile_func *fn;
+    unsigned int dup = 0;
+    char name[256];
+    size_t i;
+
+    fprintf(f, "%s\n", DF_PROFILE_HEADER);
+    fprintf(f, "# function calls incl_min incl_median incl_max excl_min "
+            "excl_median excl_max\n");
+
+    for (i = 0; i < prof.len; i++) {
+        fn = &prof.funcs[i];
+
+        /* Statics from different files can share a name, number them
+         * in address order so they still line up between builds.
+         */
+        if (i && !strcmp(fn->name, prof.funcs[i - 1].name))
+            dup++;
+        else
+            dup = 0;
+        if (dup)
+            snprintf(name, sizeof(name), "%s#%u", fn->name, dup + 1);
+        else
+            snprintf(name, sizeof(name), "%s", fn->name);
+
+        if (!fn->len) {
+            fprintf(f, "%s 0 0 0 0 0 0 0\n", name);
+            continue;
+        }
+
+        qsort(fn->incl, fn->len, sizeof(*fn->incl), profile_cmp_u32);
+        qsort(fn->excl, fn->len, sizeof(*fn->excl), profile_cmp_u32);
+        fprintf(f, "%s %llu %u %u %u %u %u %u\n", name,
+                (unsigned long long)fn->calls, fn->incl[0],
+                fn->incl[fn->len / 2], fn->incl[fn->len - 1], fn->excl[0],
+                fn->excl[fn->len / 2], fn->excl[fn->len - 1]);
+    }
+}
+
+void
+df_profile_stop(avr_t *avr)
+{
+    FILE *f = stderr;
+    size_t i;
+
+    if (!prof.len)
+        return;
+
+    df_hook_insn_del(avr, profile_insn_hook, NULL);
+
+    /* Calls still running at exit never finished, so don't count */
+    prof.depth = 0;
+
+    qsort(prof.funcs, prof.len, sizeof(*prof.funcs), profile_cmp_name);
+
+    if (prof.out) {
+        f = fopen(prof.out, "w");
+        if (!f)
+            df_log_msg(DF_LOG_ERR, "Unable to write profile '%s': %s\n",
+                    prof.out, strerror(errno));
+    }
+
+    if (f) {
+        profile_write(f);
+        if (f != stderr && fclose(f))
+            df_log_msg(DF_LOG_ERR, "Unable to write profile '%s': %s\n",
+                    prof.out, strerror(errno));
+    }
+
+    for (i = 0; i < prof.len; i++) {
+        free(prof.funcs[i].name);
+        free(prof.funcs[i].incl);
+        free(prof.funcs[i].excl);
+    }
+    free(prof.funcs);
+    free(prof.entry);
+    memset(&prof, 0, sizeof(prof));
+}
@@ -0,0 +1,49 @@
+/*
+ * df_profile.h
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_PROFILE_H__
+#define __DF_PROFILE_H__
+
+/* First line of a profile. After it come comment lines starting with
+ * '#' and then one line per function, sorted by name:
+ *
+ *   name calls incl_min incl_median incl_max excl_min excl_median excl_max
+ *
+ * All times are in CPU cycles from the first instruction of the
+ * function until it returns. Exclusive times leave out the time spent
+ * in other profiled functions it called, or that interrupted it.
+ */
+#define DF_PROFILE_HEADER "# drumfish-profile 1"
+
+/* Every function in the ELF instead of a list of names */
+#define DF_PROFILE_ALL "*"
+
+/* Forward declarations, so tools can read the file without simavr */
+struct avr_t;
+struct drumfish_cfg;
+
+int df_profile_init(const struct drumfish_cfg *config, struct avr_t *avr);
+
+/* Writes out the profile */
+void df_profile_stop(struct avr_t *avr);
+
+#endif /* __DF_PROFILE_H__ */
@@ -0,0 +1,653 @@
+/*
+ * df_r->c
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sim_avr.h>
+#include <sim_interrupts.h>
+#include <sim_io.h>
+#include <sim_regbit.h>
+
+#include "drumfish.h"
+#include "df_board.h"
+#include "df_clock.h"
+#include "df_log.h"
+#include "df_pcap.h"
+#include "df_radio.h"
+
+/* Transceiver registers, as data addresses */
+#define TRXPR 0x139
+#define TRX_STATUS 0x141
+#define TRX_STATE 0x142
+#define TRX_CTRL_1 0x144
+#define PHY_TX_PWR 0x145
+#define PHY_RSSI 0x146
+#define PHY_ED_LEVEL 0x147
+#define IRQ_MASK 0x14E
+#define IRQ_STATUS 0x14F
+#define TST_RX_LENGTH 0x17B
+#define TRXFBST 0x180
+
+/* TRXPR */
+#define TRXRST 0
+#define SLPTR 1
+
+/* TRX_STATUS values and TRX_STATE commands share their encoding */
+#define TRX_NOP 0x00
+#define TRX_BUSY_RX 0x01
+#define TRX_BUSY_TX 0x02
+#define TRX_TX_START 0x02
+#define TRX_FORCE_TRX_OFF 0x03
+#define TRX_FORCE_PLL_ON 0x04
+#define TRX_RX_ON 0x06
+#define TRX_OFF 0x08
+#define TRX_PLL_ON 0x09
+#define TRX_SLEEP 0x0F
+#define TRX_BUSY_RX_AACK 0x11
+#define TRX_BUSY_TX_ARET 0x12
+#define TRX_RX_AACK_ON 0x16
+#define TRX_TX_ARET_ON 0x19
+
+#define TRX_CMD_MASK 0x1F
+#define TRAC_STATUS_SHIFT 5
+#define TRAC_SUCCESS 0
+
+/* TRX_CTRL_1 */
+#define TX_AUTO_CRC_ON 5
+
+#define TX_PWR_MASK 0x0F
+#define RSSI_MASK 0x1F
+
+/* PHY_RSSI */
+#define RX_CRC_VALID 7
+
+/* RSSI and ED readings start here, in 3dB and 1dB steps */
+#define RSSI_BASE_VAL -90
+#define ED_MAX 0x54
+
+/* IRQ_STATUS and IRQ_MASK bits, in vector order */
+enum {
+    IRQ_PLL_LOCK = 0,
+    IRQ_PLL_UNLOCK,
+    IRQ_RX_START,
+    IRQ_RX_END,
+    IRQ_CCA_ED_DONE,
+    IRQ_AMI,
+    IRQ_TX_END,
+    IRQ_AWAKE,
+    IRQ_COUNT
+};
+
+static const char *const radio_irq_names[IRQ_COUNT] = {
+    "pll_lock", "pll_unlock", "rx_start", "rx_end", "cca_ed_done", "ami",
+    "tx_end", "awake",
+};
+
+/* TRX24_PLL_LOCK_vect */
+#define TRX24_VECTOR_BASE 57
+
+/* 250kbit/s O-QPSK, 32us per octet */
+#define RADIO_OCTET_USEC 32
+
+/* Preamble, SFD and PHR go out ahead of the PSDU */
+#define RADIO_SHR_PHR_OCTETS 6
+
+struct df_radio {
+    /* First, so simavr's reset and dealloc hand us back to ourselves */
+    avr_io_t io;
+    avr_t *avr;
+    struct drumfish_cfg *config;
+    struct df_clock *clk;
+    avr_int_vector_t vec[IRQ_COUNT];
+
+    uint8_t state;
+    /* Command given while busy, carried out once the frame is done */
+    uint8_t deferred;
+    uint8_t trac;
+    struct df_clock_event done_ev;
+
+    df_radio_tx_cb tx_cb;
+    void *tx_opaque;
+
+    struct df_pcap *pcap;
+    int pcap_if;
+    /* Before any ".<pid>" of a fork, to tell if our MAC changed */
+    char *pcap_path;
+};
+
+static void
+radio_set_state(struct df_radio *r, uint8_t state)
+{
+    r->state = state;
+    r->avr->data[TRX_STATUS] = state;
+    r->avr->data[TRX_STATE] = r->trac << TRAC_STATUS_SHIFT;
+}
+
+static void
+radio_raise(struct df_radio *r, int irq)
+{
+    avr_raise_interrupt(r->avr, &r->vec[irq]);
+}
+
+/* Output power in tenths of a dBm for each PHY_TX_PWR setting */
+static const int16_t radio_tx_pwr[16] = {
+    35, 33, 28, 23, 18, 12, 5, -5, -15, -25, -35, -45, -65, -85, -115, -165,
+};
+
+/* CRC-16/KERMIT, the 802.15.4 FCS, a byte at a time */
+static uint16_t radio_crc_table[256];
+
+static void
+radio_crc_init(void)
+{
+    uint16_t crc;
+    int i;
+    int bit;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ 0x8408 : crc >> 1;
+        radio_crc_table[i] = crc;
+    }
+}
+
+static uint16_t
+radio_crc(const uint8_t *buf, size_t len)
+{
+    uint16_t crc = 0;
+
+    while (len--)
+        crc = (crc >> 8) ^ radio_crc_table[(crc ^ *buf++) & 0xFF];
+
+    return crc;
+}
+
+static uint64_t
+radio_ns(struct df_radio *r)
+{
+    return (unsigned __int128)r->avr->cycle * 1000000000ULL /
+        r->avr->frequency;
+}
+
+static void
+radio_capture(struct df_radio *r, int dir, const uint8_t *psdu,
+        uint8_t len)
+{
+    if (r->pcap)
+        df_pcap_frame(r->pcap, r->pcap_if, radio_ns(r), dir, psdu, len);
+}
+
+static void
+radio_command(struct df_radio *r, uint8_t cmd)
+{
+    uint8_t prev = r->state;
+
+    switch (cmd) {
+        case TRX_FORCE_TRX_OFF:
+            df_clock_cancel(r->clk, &r->done_ev);
+            r->deferred = TRX_NOP;
+            radio_set_state(r, TRX_OFF);
+            return;
+
+        case TRX_FORCE_PLL_ON:
+            df_clock_cancel(r->clk, &r->done_ev);
+            r->deferred = TRX_NOP;
+            radio_set_state(r, TRX_PLL_ON);
+            break;
+
+        case TRX_TX_START:
+            /* Handled by the caller, the frame buffer needs reading */
+            return;
+
+        case TRX_OFF:
+        case TRX_PLL_ON:
+        case TRX_RX_ON:
+        case TRX_RX_AACK_ON:
+        case TRX_TX_ARET_ON:
+            if (df_clock_pending(&r->done_ev)) {
+                r->deferred = cmd;
+                return;
+            }
+            if (r->state == TRX_SLEEP)
+                return;
+            radio_set_state(r, cmd);
+            break;
+
+        default:
+            return;
+    }
+
+    /* We lock instantly but firmware may be waiting to hear about it */
+    if ((prev == TRX_OFF || prev == TRX_SLEEP) && r->state != TRX_OFF)
+        radio_raise(r, IRQ_PLL_LOCK);
+}
+
+static void
+radio_done(avr_t *avr, uint64_t when, void *opaque)
+{
+    struct df_radio *r = opaque;
+    uint8_t len;
+
+    (void)avr;
+    (void)when;
+
+    switch (r->state) {
+        case TRX_BUSY_TX:
+        case TRX_BUSY_TX_ARET:
+            len = r->avr->data[TRXFBST] & 0x7F;
+            radio_capture(r, DF_PCAP_OUT, &r->avr->data[TRXFBST + 1], len);
+            if (r->tx_cb)
+                r->tx_cb(r->avr, &r->avr->data[TRXFBST + 1], len,
+                        radio_tx_pwr[r->avr->data[PHY_TX_PWR] &
+                        TX_PWR_MASK] / 10, r->tx_opaque);
+
+            /* Nobody's out there to ACK us, so every attempt succeeds */
+            r->trac = TRAC_SUCCESS;
+            radio_set_state(r, r->state == TRX_BUSY_TX ?
+                    TRX_PLL_ON : TRX_TX_ARET_ON);
+            radio_raise(r, IRQ_TX_END);
+            break;
+
+        case TRX_BUSY_RX:
+        case TRX_BUSY_RX_AACK:
+            len = r->avr->data[TST_RX_LENGTH];
+            radio_capture(r, DF_PCAP_IN, &r->avr->data[TRXFBST], len);
+
+            radio_set_state(r, r->state == TRX_BUSY_RX ?
+                    TRX_RX_ON : TRX_RX_AACK_ON);
+            radio_raise(r, IRQ_RX_END);
+            break;
+    }
+
+    if (r->deferred != TRX_NOP) {
+        radio_command(r, r->deferred);
+        r->deferred = TRX_NOP;
+    }
+}
+
+static uint64_t
+radio_airtime(struct df_radio *r, uint8_t len)
+{
+    return df_clock_usec_to_cycles(r->clk,
+            (RADIO_SHR_PHR_OCTETS + len) * RADIO_OCTET_USEC);
+}
+
+static void
+radio_tx_start(struct df_radio *r)
+{
+    uint8_t *psdu = &r->avr->data[TRXFBST + 1];
+    uint16_t crc;
+    uint8_t len;
+
+    if (r->state == TRX_PLL_ON)
+        radio_set_state(r, TRX_BUSY_TX);
+    else if (r->state == TRX_TX_ARET_ON)
+        radio_set_state(r, TRX_BUSY_TX_ARET);
+    else
+        return;
+
+    len = r->avr->data[TRXFBST] & 0x7F;
+
+    /* The last two octets of the PSDU are the FCS, filled in for
+     * firmware unless it asked to do that itself.
+     */
+    if ((r->avr->data[TRX_CTRL_1] & (1 << TX_AUTO_CRC_ON)) && len >= 2) {
+        crc = radio_crc(psdu, len - 2);
+        psdu[len - 2] = crc;
+        psdu[len - 1] = crc >> 8;
+    }
+
+    df_clock_schedule(r->clk, &r->done_ev, radio_airtime(r, len));
+}
+
+static void
+radio_reset_state(struct df_radio *r)
+{
+    df_clock_cancel(r->clk, &r->done_ev);
+    r->deferred = TRX_NOP;
+    r->trac = TRAC_SUCCESS;
+    radio_set_state(r, TRX_OFF);
+}
+
+static void
+radio_trx_state_write(struct avr_t *avr, avr_io_addr_t addr, uint8_t v,
+        void *param)
+{
+    struct df_radio *r = param;
+    uint8_t cmd = v & TRX_CMD_MASK;
+
+    (void)avr;
+    (void)addr;
+
+    if (cmd == TRX_TX_START)
+        radio_tx_start(r);
+    else
+        radio_command(r, cmd);
+
+    /* TRAC_STATUS is ours and TRX_CMD always reads back as NOP */
+    r->avr->data[TRX_STATE] = r->trac << TRAC_STATUS_SHIFT;
+}
+
+static void
+radio_trxpr_write(struct avr_t *avr, avr_io_addr_t addr, uint8_t v,
+        void *param)
+{
+    struct df_radio *r = param;
+    uint8_t old = avr->data[addr];
+
+    if (v & (1 << TRXRST)) {
+        radio_reset_state(r);
+        v &= ~(1 << TRXRST);
+    }
+
+    avr->data[addr] = v;
+
+    if (!(old & (1 << SLPTR)) && (v & (1 << SLPTR))) {
+        /* A rising edge sends the frame or puts us to sleep */
+        if (r->state == TRX_OFF)
+            radio_set_state(r, TRX_SLEEP);
+        else
+            radio_tx_start(r);
+    } else if ((old & (1 << SLPTR)) && !(v & (1 << SLPTR))) {
+        if (r->state == TRX_SLEEP) {
+            radio_set_state(r, TRX_OFF);
+            radio_raise(r, IRQ_AWAKE);
+        }
+    }
+}
+
+static void
+radio_irq_status_write(struct avr_t *avr, avr_io_addr_t addr, uint8_t v,
+        void *param)
+{
+    struct df_radio *r = param;
+    int i;
+
+    (void)addr;
+
+    /* Flags are cleared by writing a one to them */
+    for (i = 0; i < IRQ_COUNT; i++)
+        if (v & (1 << i))
+            avr_clear_interrupt(avr, &r->vec[i]);
+}
+
+static void
+radio_irq_mask_write(struct avr_t *avr, avr_io_addr_t addr, uint8_t v,
+        void *param)
+{
+    struct df_radio *r = param;
+    uint8_t enabled = v & ~avr->data[addr];
+    int i;
+
+    avr->data[addr] = v;
+
+    /* Something that happened while masked goes off once unmasked */
+    for (i = 0; i < IRQ_COUNT; i++)
+        if ((enabled & (1 << i)) && avr_regbit_get(avr, r->vec[i].raised))
+            avr_raise_interrupt(avr, &r->vec[i]);
+}
+
+static void
+radio_io_reset(avr_io_t *io)
+{
+    struct df_radio *r = (struct df_radio *)io;
+
+    r->avr->data[TRX_CTRL_1] = 1 << TX_AUTO_CRC_ON;
+    radio_reset_state(r);
+}
+
+static void
+radio_io_dealloc(avr_io_t *io)
+{
+    struct df_radio *r = (struct df_radio *)io;
+
+    free(r->pcap_path);
+    free(r);
+}
+
+static int
+radio_capture_open(struct df_radio *r)
+{
+    const struct drumfish_cfg *config = r->config;
+    const char *mac = config->mac ? config->mac : "unknown";
+    const char *s;
+    char path[PATH_MAX];
+    size_t len = 0;
+    int same;
+
+    /* "%m" is replaced by our MAC so every node gets its own file */
+    for (s = config->pcap; *s && len < sizeof(path) - 1; s++) {
+        if (s[0] == '%' && s[1] == 'm') {
+            const char *m;
+
+            for (m = mac; *m && len < sizeof(path) - 1; m++)
+                if (*m != ':')
+                    path[len++] = *m;
+            s++;
+            continue;
+        }
+        path[len++] = *s;
+    }
+    path[len] = '\0';
+
+    /* A forked node can't share its parent's file, which it would if
+     * it kept the parent's MAC.
+     */
+    same = r->pcap_path && !strcmp(path, r->pcap_path);
+
+    free(r->pcap_path);
+    r->pcap_path = strdup(path);
+    if (!r->pcap_path) {
+        fprintf(stderr, "Failed to allocate memory for capture.\n");
+        return -1;
+    }
+
+    if (same)
+        snprintf(path + len, sizeof(path) - len, ".%d", getpid());
+
+    r->pcap = df_pcap_open(path);
+    if (!r->pcap)
+        return -1;
+
+    r->pcap_if = df_pcap_add_if(r->pcap, mac);
+
+    return 0;
+}
+
+int
+df_radio_init(struct drumfish_cfg *config, avr_t *avr)
+{
+    struct df_radio *r;
+    int i;
+
+    /* The frame buffer is plain data space, only the registers we hook
+     * need a slot in simavr's IO table, and stock builds stop short.
+     */
+    if (AVR_DATA_TO_IO(IRQ_STATUS) >= MAX_IOs) {
+        if (config->pcap || config->medium_fd >= 0) {
+            fprintf(stderr, "simavr is unable to reach the transceiver's "
+                    "registers (MAX_IOs is %d), so there is nothing to "
+                    "capture or connect to the medium.\n", MAX_IOs);
+            return -1;
+        }
+        fprintf(stderr, "simavr is unable to reach the transceiver's "
+                "registers (MAX_IOs is %d), running without a radio.\n",
+                MAX_IOs);
+        return 0;
+    }
+
+    r = calloc(1, sizeof(*r));
+    if (!r) {
+        fprintf(stderr, "Failed to allocate memory for the radio.\n");
+        return -1;
+    }
+    df_board_get(avr)->radio = r;
+
+    r->avr = avr;
+    r->config = config;
+    r->clk = df_clock_get(avr);
+
+    df_clock_event_init(&r->done_ev, radio_done, r);
+
+    radio_crc_init();
+
+    r->io.kind = "trx24";
+    r->io.reset = radio_io_reset;
+    r->io.dealloc = radio_io_dealloc;
+    avr_register_io(avr, &r->io);
+
+    for (i = 0; i < IRQ_COUNT; i++) {
+        r->vec[i].vector = TRX24_VECTOR_BASE + i;
+        r->vec[i].enable = (avr_regbit_t)AVR_IO_REGBIT(IRQ_MASK, i);
+        r->vec[i].raised = (avr_regbit_t)AVR_IO_REGBIT(IRQ_STATUS, i);
+        avr_register_vector(avr, &r->vec[i]);
+    }
+
+    avr_register_io_write(avr, TRXPR, radio_trxpr_write, r);
+    avr_register_io_write(avr, TRX_STATE, radio_trx_state_write, r);
+    avr_register_io_write(avr, IRQ_STATUS, radio_irq_status_write, r);
+    avr_register_io_write(avr, IRQ_MASK, radio_irq_mask_write, r);
+
+    radio_io_reset(&r->io);
+
+    if (config->pcap && radio_capture_open(r))
+        return -1;
+
+    return 0;
+}
+
+void
+df_radio_stop(avr_t *avr)
+{
+    struct df_radio *r = df_board_get(avr)->radio;
+
+    if (!r)
+        return;
+
+    df_clock_cancel(r->clk, &r->done_ev);
+
+    df_pcap_close(r->pcap);
+    r->pcap = NULL;
+}
+
+int
+df_radio_after_fork(avr_t *avr)
+{
+    struct df_radio *r = df_board_get(avr)->radio;
+
+    if (!r || !r->pcap)
+        return 0;
+
+    /* The writer thread stayed with our parent, so the file is theirs.
+     * We can't shut down what we inherited and simply leave it be.
+     */
+    return radio_capture_open(r);
+}
+
+struct avr_irq_t *
+df_radio_get_irq(avr_t *avr, int i, const char **name)
+{
+    struct df_radio *r = df_board_get(avr)->radio;
+
+    if (!r || i < 0 || i >= IRQ_COUNT)
+        return NULL;
+
+    *name = radio_irq_names[i];
+
+    return r->vec[i].irq;
+}
+
+int
+df_radio_set_tx_cb(avr_t *avr, df_radio_tx_cb cb, void *opaque)
+{
+    struct df_radio *r = df_board_get(avr)->radio;
+
+    if (!r)
+        return -1;
+
+    r->tx_cb = cb;
+    r->tx_opaque = opaque;
+
+    return 0;
+}
+
+static void
+radio_measure(struct df_radio *r, int dbm)
+{
+    uint8_t *rssi = &r->avr->data[PHY_RSSI];
+    int steps = dbm - RSSI_BASE_VAL;
+    int val;
+
+    if (steps < 0)
+        steps = 0;
+
+    /* 0 means below sensitivity, both top out around -10dBm */
+    val = steps ? steps / 3 + 1 : 0;
+    if (val > 28)
+        val = 28;
+
+    *rssi = (*rssi & ~RSSI_MASK) | val;
+    r->avr->data[PHY_ED_LEVEL] = steps > ED_MAX ? ED_MAX : steps;
+}
+
+int
+df_radio_rx(avr_t *avr, const uint8_t *psdu, uint8_t len, uint8_t lqi,
+        int dbm)
+{
+    struct df_radio *r = df_board_get(avr)->radio;
+
+    if (!r || len > DF_RADIO_MAX_FRAME)
+        return -1;
+
+    if (r->state == TRX_RX_ON)
+        radio_set_state(r, TRX_BUSY_RX);
+    else if (r->state == TRX_RX_AACK_ON)
+        radio_set_state(r, TRX_BUSY_RX_AACK);
+    else
+        return -1;
+
+    /* The LQI sits right after the PSDU in the frame buffer */
+    memcpy(&r->avr->data[TRXFBST], psdu, len);
+    r->avr->data[TRXFBST + len] = lqi;
+    r->avr->data[TST_RX_LENGTH] = len;
+
+    /* Both are measured over the start of the frame */
+    radio_measure(r, dbm);
+
+    /* A good FCS leaves a CRC of zero over the whole PSDU */
+    if (len >= 2 && !radio_crc(psdu, len))
+        r->avr->data[PHY_RSSI] |= 1 << RX_CRC_VALID;
+    else
+        r->avr->data[PHY_RSSI] &= ~(1 << RX_CRC_VALID);
+
+    radio_raise(r, IRQ_RX_START);
+    df_clock_schedule(r->clk, &r->done_ev, radio_airtime(r, len));
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * df_radio.h
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_RADIO_H__
+#define __DF_RADIO_H__
+
+#include <stdint.h>
+
+struct avr_irq_t;
+struct drumfish_cfg;
+
+/* The largest PSDU the transceiver handles, FCS included */
+#define DF_RADIO_MAX_FRAME 127
+
+/* The 2.4GHz transceiver built into the atmega128rfa1. This covers the
+ * state machine, frame buffer and interrupts that firmware needs to
+ * send and receive frames but nothing of the RF side. There is no
+ * address filtering or automatic acknowledgement yet.
+ *
+ * A simavr built without room for the transceiver's registers leaves
+ * the board without a radio rather than failing it, unless a capture
+ * or the medium needs one.
+ */
+int df_radio_init(struct drumfish_cfg *config, avr_t *avr);
+
+void df_radio_stop(avr_t *avr);
+
+int df_radio_after_fork(avr_t *avr);
+
+/* The line behind the transceiver's interrupt 'i', in IRQ_STATUS bit
+ * order, raised while it's pending. Returns NULL past the last one or
+ * if there is no radio.
+ */
+struct avr_irq_t *df_radio_get_irq(avr_t *avr, int i, const char **name);
+
+/* Called with every frame the transceiver finishes sending, 'dbm' being
+ * the output power firmware picked in PHY_TX_PWR.
+ */
+typedef void (*df_radio_tx_cb)(avr_t *avr, const uint8_t *psdu, uint8_t len,
+        int dbm, void *opaque);
+
+/* Returns -1 if the board has no radio */
+int df_radio_set_tx_cb(avr_t *avr, df_radio_tx_cb cb, void *opaque);
+
+/* Hands the transceiver a frame off the air which starts now, received
+ * at 'dbm'. Returns -1 if it isn't listening, is busy with another
+ * frame or there is no radio.
+ */
+int df_radio_rx(avr_t *avr, const uint8_t *psdu, uint8_t len, uint8_t lqi,
+        int dbm);
+
+#endif /* __DF_RADIO_H__ */
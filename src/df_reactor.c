@@ -0,0 +1,437 @@
+/*
+ * df_reactor.c
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "df_log.h"
+#include "df_mem.h"
+#include "df_reactor.h"
+
+/* How many events we pull out of the kernel per round */
+#define REACTOR_MAX_EVENTS 64
+
+/* How often (in ms) we check if a parked fd has become usable again */
+#define REACTOR_PARK_MS 50
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int running;
+    /* Told to stop, but the thread and its fds aren't gone yet */
+    int stopping;
+    int epfd;
+    int evfd;
+    unsigned long round;
+    unsigned int count;
+    struct df_reactor_src *parked;
+    struct df_reactor_src *kick_head;
+} reactor = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .epfd = -1,
+    .evfd = -1,
+};
+
+static void
+reactor_wake(void)
+{
+    eventfd_write(reactor.evfd, 1);
+}
+
+static void
+reactor_unpark(void)
+{
+    struct df_reactor_src **link = &reactor.parked;
+    struct df_reactor_src *src;
+    struct pollfd pfd;
+    struct epoll_event ev;
+
+    while ((src = *link)) {
+        pfd.fd = src->fd;
+        pfd.events = 0;
+        pfd.revents = 0;
+
+        /* Still nobody on the other end, leave it be */
+        if (poll(&pfd, 1, 0) < 0 || pfd.revents & (POLLHUP | POLLERR)) {
+            link = &src->next;
+            continue;
+        }
+
+        *link = src->next;
+        src->next = NULL;
+        src->parked = 0;
+
+        ev.events = src->events;
+        ev.data.ptr = src;
+        if (epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, src->fd, &ev))
+            df_log_msg(DF_LOG_ERR, "Failed to resume watching fd %d: %s\n",
+                    src->fd, strerror(errno));
+    }
+}
+
+static void
+reactor_dispatch_kicks(void)
+{
+    struct df_reactor_src *src;
+    struct df_reactor_src *next;
+
+    src = __atomic_exchange_n(&reactor.kick_head, NULL, __ATOMIC_ACQUIRE);
+
+    for (; src; src = next) {
+        next = src->kick_next;
+
+        /* Clear this before running the callback so that anything
+         * queued while it runs will kick us again.
+         */
+        __atomic_store_n(&src->kicked, 0, __ATOMIC_SEQ_CST);
+
+        if (src->live)
+            src->cb(src, DF_REACTOR_KICK);
+    }
+}
+
+static void *
+reactor_thread(void *param)
+{
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    struct df_reactor_src *src;
+    eventfd_t val;
+    sigset_t set;
+    int timeout;
+    int n;
+    int i;
+
+    (void)param;
+
+    sigfillset(&set);
+    sigprocmask(SIG_SETMASK, &set, NULL);
+
+    pthread_mutex_lock(&reactor.lock);
+
+    while (reactor.running) {
+        timeout = reactor.parked ? REACTOR_PARK_MS : -1;
+
+        pthread_mutex_unlock(&reactor.lock);
+        n = epoll_wait(reactor.epfd, events, REACTOR_MAX_EVENTS, timeout);
+        pthread_mutex_lock(&reactor.lock);
+
+        if (n < 0 && errno != EINTR) {
+            df_log_msg(DF_LOG_ERR, "I/O reactor failed: %s\n",
+                    strerror(errno));
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            src = events[i].data.ptr;
+
+            /* Our own wakeup */
+            if (!src) {
+                eventfd_read(reactor.evfd, &val);
+                continue;
+            }
+
+            /* Removed or parked since epoll_wait() returned */
+            if (!src->live || src->parked)
+                continue;
+
+            src->cb(src, events[i].events);
+        }
+
+        reactor_dispatch_kicks();
+
+        if (reactor.parked)
+            reactor_unpark();
+
+        reactor.round++;
+        pthread_cond_broadcast(&reactor.cond);
+    }
+
+    pthread_mutex_unlock(&reactor.lock);
+
+    return NULL;
+}
+
+static void
+reactor_atfork_prepare(void)
+{
+    pthread_mutex_lock(&reactor.lock);
+}
+
+static void
+reactor_atfork_parent(void)
+{
+    pthread_mutex_unlock(&reactor.lock);
+}
+
+static void
+reactor_atfork_child(void)
+{
+    /* Only the forking thread survives into the child and our epoll set
+     * is shared with the parent, so it must be dropped rather than
+     * modified. Owners have to add their sources again.
+     */
+    if (reactor.evfd != -1)
+        close(reactor.evfd);
+    if (reactor.epfd != -1)
+        close(reactor.epfd);
+
+    reactor.evfd = -1;
+    reactor.epfd = -1;
+    reactor.running = 0;
+    reactor.stopping = 0;
+    reactor.round = 0;
+    reactor.count = 0;
+    reactor.parked = NULL;
+    reactor.kick_head = NULL;
+
+    pthread_cond_init(&reactor.cond, NULL);
+    pthread_mutex_unlock(&reactor.lock);
+}
+
+static int
+reactor_start(void)
+{
+    static int atfork = 0;
+    struct epoll_event ev;
+    int ret;
+
+    if (!atfork) {
+        pthread_atfork(reactor_atfork_prepare, reactor_atfork_parent,
+                reactor_atfork_child);
+        atfork = 1;
+    }
+
+    reactor.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor.epfd == -1) {
+        fprintf(stderr, "Unable to create I/O reactor: %s\n", strerror(errno));
+        return -1;
+    }
+
+    reactor.evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (reactor.evfd == -1) {
+        fprintf(stderr, "Unable to create I/O reactor wakeup: %s\n",
+                strerror(errno));
+        goto err;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, reactor.evfd, &ev)) {
+        fprintf(stderr, "Unable to watch I/O reactor wakeup: %s\n",
+                strerror(errno));
+        goto err;
+    }
+
+    reactor.running = 1;
+
+    ret = df_mem_thread_create(&reactor.thread, reactor_thread, NULL);
+    if (ret) {
+        fprintf(stderr, "Failed to create I/O reactor thread: %s\n",
+                strerror(ret));
+        reactor.running = 0;
+        goto err;
+    }
+
+    return 0;
+
+err:
+    if (reactor.evfd != -1)
+        close(reactor.evfd);
+    close(reactor.epfd);
+    reactor.evfd = -1;
+    reactor.epfd = -1;
+
+    return -1;
+}
+
+int
+df_reactor_add(struct df_reactor_src *src)
+{
+    struct epoll_event ev;
+    int ret = -1;
+
+    pthread_mutex_lock(&reactor.lock);
+
+    /* The last source just went, let the old thread finish going too */
+    while (reactor.stopping)
+        pthread_cond_wait(&reactor.cond, &reactor.lock);
+
+    if (!reactor.running && reactor_start())
+        goto out;
+
+    src->live = 1;
+    src->parked = 0;
+    src->kicked = 0;
+    src->kick_next = NULL;
+    src->next = NULL;
+
+    ev.events = src->events;
+    ev.data.ptr = src;
+    if (epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, src->fd, &ev)) {
+        fprintf(stderr, "Unable to watch fd %d: %s\n", src->fd,
+                strerror(errno));
+        src->live = 0;
+        goto out;
+    }
+
+    reactor.count++;
+    ret = 0;
+
+out:
+    pthread_mutex_unlock(&reactor.lock);
+
+    return ret;
+}
+
+void
+df_reactor_del(struct df_reactor_src *src)
+{
+    struct df_reactor_src **link;
+    unsigned long target;
+    int stop = 0;
+
+    pthread_mutex_lock(&reactor.lock);
+
+    if (!src->live) {
+        pthread_mutex_unlock(&reactor.lock);
+        return;
+    }
+
+    if (src->parked) {
+        for (link = &reactor.parked; *link; link = &(*link)->next) {
+            if (*link == src) {
+                *link = src->next;
+                break;
+            }
+        }
+        src->parked = 0;
+    } else {
+        epoll_ctl(reactor.epfd, EPOLL_CTL_DEL, src->fd, NULL);
+    }
+
+    src->live = 0;
+
+    /* The reactor may be holding events for this source from an
+     * epoll_wait() that raced with us. Wait for that round to finish
+     * so the caller is free to release the source once we return.
+     */
+    if (reactor.running && !pthread_equal(pthread_self(), reactor.thread)) {
+        target = reactor.round + 1;
+        reactor_wake();
+        while (reactor.running && reactor.round < target)
+            pthread_cond_wait(&reactor.cond, &reactor.lock);
+    }
+
+    if (--reactor.count == 0 && reactor.running &&
+            !pthread_equal(pthread_self(), reactor.thread)) {
+        reactor.running = 0;
+        reactor.stopping = 1;
+        reactor_wake();
+        stop = 1;
+    }
+
+    pthread_mutex_unlock(&reactor.lock);
+
+    if (!stop)
+        return;
+
+    /* Nobody can start another reactor until this one is torn down */
+    pthread_join(reactor.thread, NULL);
+
+    pthread_mutex_lock(&reactor.lock);
+    close(reactor.evfd);
+    close(reactor.epfd);
+    reactor.evfd = -1;
+    reactor.epfd = -1;
+    reactor.stopping = 0;
+    pthread_cond_broadcast(&reactor.cond);
+    pthread_mutex_unlock(&reactor.lock);
+}
+
+void
+df_reactor_set_events(struct df_reactor_src *src, uint32_t events)
+{
+    struct epoll_event ev;
+
+    if (src->events == events)
+        return;
+
+    src->events = events;
+
+    /* Picked up when the source is unparked */
+    if (src->parked)
+        return;
+
+    ev.events = events;
+    ev.data.ptr = src;
+    if (epoll_ctl(reactor.epfd, EPOLL_CTL_MOD, src->fd, &ev))
+        df_log_msg(DF_LOG_ERR, "Failed to update events for fd %d: %s\n",
+                src->fd, strerror(errno));
+}
+
+void
+df_reactor_park(struct df_reactor_src *src)
+{
+    /* epoll will report HUP over and over again regardless of the events
+     * we ask for, so take the fd out of the set entirely and check on it
+     * every so often instead.
+     */
+    if (src->parked)
+        return;
+
+    epoll_ctl(reactor.epfd, EPOLL_CTL_DEL, src->fd, NULL);
+
+    src->parked = 1;
+    src->next = reactor.parked;
+    reactor.parked = src;
+}
+
+void
+df_reactor_kick(struct df_reactor_src *src)
+{
+    struct df_reactor_src *head;
+
+    if (__atomic_exchange_n(&src->kicked, 1, __ATOMIC_SEQ_CST))
+        return;
+
+    head = __atomic_load_n(&reactor.kick_head, __ATOMIC_RELAXED);
+    do {
+        src->kick_next = head;
+    } while (!__atomic_compare_exchange_n(&reactor.kick_head, &head, src, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    /* Only the first kick since the reactor last looked needs to wake it */
+    if (!head)
+        reactor_wake();
+}
@@ -0,0 +1,67 @@
+/*
+ * df_reactor.h
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_REACTOR_H__
+#define __DF_REACTOR_H__
+
+#include <stdint.h>
+
+/* Passed to a source's callback instead of epoll events when the
+ * callback runs because of df_reactor_kick().
+ */
+#define DF_REACTOR_KICK (1u << 27)
+
+struct df_reactor_src;
+
+typedef void (*df_reactor_cb)(struct df_reactor_src *src, uint32_t revents);
+
+/* A file descriptor serviced by the process wide I/O reactor thread.
+ * The owner fills in fd, events, cb and opaque before calling
+ * df_reactor_add(). Everything else belongs to the reactor.
+ */
+struct df_reactor_src {
+    int fd;
+    uint32_t events;
+    df_reactor_cb cb;
+    void *opaque;
+
+    int live;
+    int parked;
+    int kicked;
+    struct df_reactor_src *kick_next;
+    struct df_reactor_src *next;
+};
+
+int df_reactor_add(struct df_reactor_src *src);
+
+void df_reactor_del(struct df_reactor_src *src);
+
+/* The following may only be called from a source's own callback */
+void df_reactor_set_events(struct df_reactor_src *src, uint32_t events);
+
+void df_reactor_park(struct df_reactor_src *src);
+
+/* Safe to call from any thread, including the emulation thread. Cheap
+ * when the source is already waiting to be serviced.
+ */
+void df_reactor_kick(struct df_reactor_src *src);
+
+#endif /* __DF_REACTOR_H__ */
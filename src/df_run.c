@@ -0,0 +1,331 @@
+/*
+ * df_run.c
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <regex.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sim_avr.h>
+#include <avr_uart.h>
+
+#include "drumfish.h"
+#include "uart_pty.h"
+#include "df_clock.h"
+#include "df_cores.h"
+#include "df_run.h"
+
+/* Longer lines are matched a piece at a time */
+#define RUN_LINE_MAX 1024
+
+volatile sig_atomic_t df_run_done = 0;
+
+static struct {
+    int enabled;
+    char uart;
+
+    /* Expected lines, matched in order */
+    regex_t *expect;
+    int expect_len;
+    int matched;
+
+    regex_t fail;
+    int has_fail;
+
+    char line[RUN_LINE_MAX + 1];
+    size_t line_len;
+
+    uint8_t *input;
+    size_t input_len;
+
+    struct df_clock_event budget_ev;
+
+    int result;
+    const char *why;
+    uint64_t cycle;
+} run;
+
+static void
+run_finish(avr_t *avr, int result, const char *why)
+{
+    if (df_run_done)
+        return;
+
+    run.result = result;
+    run.why = why;
+    run.cycle = avr->cycle;
+    df_run_done = 1;
+}
+
+static void
+run_line(avr_t *avr)
+{
+    run.line[run.line_len] = '\0';
+    run.line_len = 0;
+
+    if (run.has_fail && !regexec(&run.fail, run.line, 0, NULL, 0)) {
+        run_finish(avr, DF_RUN_FAIL, "failure pattern matched");
+        return;
+    }
+
+    while (run.matched < run.expect_len &&
+            !regexec(&run.expect[run.matched], run.line, 0, NULL, 0))
+        run.matched++;
+
+    if (run.expect_len && run.matched == run.expect_len)
+        run_finish(avr, DF_RUN_PASS, "output matched");
+}
+
+static void
+run_uart_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+    avr_t *avr = (avr_t *)param;
+    uint8_t c = value;
+
+    (void)irq;
+
+    putchar(c);
+
+    if (df_run_done)
+        return;
+
+    if (c == '\n') {
+        run_line(avr);
+        return;
+    }
+
+    if (run.line_len == RUN_LINE_MAX)
+        run_line(avr);
+
+    /* Line endings and NULs would only get in the way of the patterns */
+    if (c && c != '\r')
+        run.line[run.line_len++] = c;
+}
+
+static void
+run_budget_tick(avr_t *avr, uint64_t when, void *opaque)
+{
+    (void)when;
+    (void)opaque;
+
+    /* Running out of time is how a run without expectations ends */
+    if (run.matched == run.expect_len)
+        run_finish(avr, DF_RUN_PASS, "budget reached");
+    else
+        run_finish(avr, DF_RUN_TIMEOUT, "budget ran out");
+}
+
+static int
+run_compile(regex_t *re, const char *pattern)
+{
+    char err[256];
+    int ret;
+
+    ret = regcomp(re, pattern, REG_EXTENDED | REG_NOSUB);
+    if (ret) {
+        regerror(ret, re, err, sizeof(err));
+        fprintf(stderr, "Invalid pattern '%s': %s\n", pattern, err);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+run_load_input(const char *file)
+{
+    struct stat st;
+    void *buf;
+    int fd;
+
+    fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Unable to open '%s': %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st)) {
+        fprintf(stderr, "Unable to get file info for '%s': %s\n",
+                file, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    /* Nothing to send */
+    if (!st.st_size) {
+        close(fd);
+        return 0;
+    }
+
+    buf = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+        fprintf(stderr, "Failed to map '%s': %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    run.input = buf;
+    run.input_len = st.st_size;
+
+    return 0;
+}
+
+int
+df_run_init(const struct drumfish_cfg *config, avr_t *avr)
+{
+    struct df_clock *clk = df_clock_get(avr);
+    uint64_t budget = 0;
+    uint64_t cycles;
+    avr_irq_t *irq;
+    int i;
+
+    if (!config->run)
+        return 0;
+
+    run.enabled = 1;
+    run.uart = config->run_uart;
+
+    if (config->run_expect_len) {
+        run.expect = calloc(config->run_expect_len, sizeof(*run.expect));
+        if (!run.expect) {
+            fprintf(stderr, "Failed to allocate memory for expected "
+                    "output.\n");
+            return -1;
+        }
+
+        for (i = 0; i < config->run_expect_len; i++) {
+            if (run_compile(&run.expect[i], config->run_expect[i]))
+                return -1;
+            run.expect_len++;
+        }
+    }
+
+    if (config->run_fail) {
+        if (run_compile(&run.fail, config->run_fail))
+            return -1;
+        run.has_fail = 1;
+    }
+
+    irq = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ(run.uart),
+            UART_IRQ_OUTPUT);
+    if (!irq) {
+        fprintf(stderr, "No UART%c to watch.\n", run.uart);
+        return -1;
+    }
+    avr_irq_register_notify(irq, run_uart_hook, avr);
+
+    /* Whichever budget runs out first */
+    if (config->run_cycles)
+        budget = config->run_cycles;
+    if (config->run_ms) {
+        cycles = df_clock_usec_to_cycles(clk, config->run_ms * 1000ULL);
+        if (!budget || cycles < budget)
+            budget = cycles;
+    }
+
+    if (budget) {
+        df_clock_event_init(&run.budget_ev, run_budget_tick, NULL);
+        df_clock_schedule_at(clk, &run.budget_ev, budget);
+    }
+
+    if (config->run_input) {
+        if (run_load_input(config->run_input))
+            return -1;
+
+        if (run.input_len)
+            uart_pty_feed(m128rfa1_uart(avr, run.uart), run.input,
+                    run.input_len);
+    }
+
+    return 0;
+}
+
+int
+df_run_result(avr_t *avr, int state)
+{
+    static const char *results[] = {
+        [DF_RUN_PASS] = "passed",
+        [DF_RUN_ERROR] = "errored",
+        [DF_RUN_FAIL] = "failed",
+        [DF_RUN_TIMEOUT] = "timed out",
+        [DF_RUN_CRASH] = "crashed",
+    };
+
+    if (!run.enabled)
+        return DF_RUN_PASS;
+
+    if (!df_run_done) {
+        /* Whatever it printed last may not have had a newline */
+        if (run.line_len)
+            run_line(avr);
+
+        if (state == cpu_Crashed)
+            run_finish(avr, DF_RUN_CRASH, "CPU crashed");
+        else if (run.matched == run.expect_len)
+            run_finish(avr, DF_RUN_PASS, "CPU stopped");
+        else
+            run_finish(avr, DF_RUN_FAIL, "CPU stopped");
+    }
+
+    fflush(stdout);
+    fprintf(stderr, "Run %s (%s) at cycle %llu, %d of %d expected lines "
+            "seen\n", results[run.result], run.why,
+            (unsigned long long)run.cycle, run.matched, run.expect_len);
+
+    return run.result;
+}
+
+void
+df_run_stop(void)
+{
+    int i;
+
+    if (!run.enabled)
+        return;
+
+    fflush(stdout);
+
+    for (i = 0; i < run.expect_len; i++)
+        regfree(&run.expect[i]);
+    free(run.expect);
+    run.expect = NULL;
+    run.expect_len = 0;
+
+    if (run.has_fail)
+        regfree(&run.fail);
+    run.has_fail = 0;
+
+    if (run.input)
+        munmap(run.input, run.input_len);
+    run.input = NULL;
+
+    run.enabled = 0;
+}
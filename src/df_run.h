@@ -0,0 +1,51 @@
+/*
+ * df_run.h
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_RUN_H__
+#define __DF_RUN_H__
+
+#include <signal.h>
+
+/* How a headless run ended, as its exit status. drumfish-runner reads
+ * these too, so only ever add to them.
+ */
+#define DF_RUN_PASS 0
+#define DF_RUN_ERROR 1
+#define DF_RUN_FAIL 2
+#define DF_RUN_TIMEOUT 3
+#define DF_RUN_CRASH 4
+
+/* Forward declarations, so tools can use the codes without simavr */
+struct avr_t;
+struct drumfish_cfg;
+
+/* Set once the run has its result, the run loop stops on it */
+extern volatile sig_atomic_t df_run_done;
+
+int df_run_init(const struct drumfish_cfg *config, struct avr_t *avr);
+
+/* The exit status for a run the core left in 'state' */
+int df_run_result(struct avr_t *avr, int state);
+
+void df_run_stop(void);
+
+#endif /* __DF_RUN_H__ */
@@ -0,0 +1,227 @@
+/*
+ * df_snapshot.c
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sim_avr.h>
+
+#include "df_clock.h"
+#include "df_snapshot.h"
+
+/* Shares the base's page if nothing changed, copies it otherwise */
+static int
+snapshot_pages(struct df_snapshot_page **pages, size_t count,
+        struct df_snapshot_page *const *base, const uint8_t *mem,
+        size_t len, size_t *bytes)
+{
+    struct df_snapshot_page *page;
+    size_t off;
+    size_t n;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        off = i * DF_SNAPSHOT_PAGE;
+        n = len - off < DF_SNAPSHOT_PAGE ? len - off : DF_SNAPSHOT_PAGE;
+
+        if (base && !memcmp(base[i]->data, mem + off, n)) {
+            page = base[i];
+            page->refs++;
+        } else {
+            page = malloc(sizeof(*page));
+            if (!page)
+                return -1;
+            page->refs = 1;
+            memcpy(page->data, mem + off, n);
+            *bytes += sizeof(*page);
+        }
+
+        pages[i] = page;
+    }
+
+    return 0;
+}
+
+static void
+snapshot_restore_pages(struct df_snapshot_page *const *pages, size_t count,
+        uint8_t *mem, size_t len)
+{
+    size_t off;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        off = i * DF_SNAPSHOT_PAGE;
+        memcpy(mem + off, pages[i]->data,
+                len - off < DF_SNAPSHOT_PAGE ? len - off : DF_SNAPSHOT_PAGE);
+    }
+}
+
+static int
+snapshot_same_pages(struct df_snapshot_page *const *pages, size_t count,
+        const uint8_t *mem, size_t len)
+{
+    size_t off;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        off = i * DF_SNAPSHOT_PAGE;
+        if (memcmp(mem + off, pages[i]->data, len - off < DF_SNAPSHOT_PAGE ?
+                    len - off : DF_SNAPSHOT_PAGE))
+            return 0;
+    }
+
+    return 1;
+}
+
+static size_t
+snapshot_free_pages(struct df_snapshot_page **pages, size_t count)
+{
+    size_t bytes = 0;
+    size_t i;
+
+    if (!pages)
+        return 0;
+
+    /* A snapshot that failed halfway has NULLs past what it got to */
+    for (i = 0; i < count && pages[i]; i++) {
+        if (--pages[i]->refs)
+            continue;
+        free(pages[i]);
+        bytes += sizeof(*pages[i]);
+    }
+
+    free(pages);
+
+    return bytes + count * sizeof(*pages);
+}
+
+struct df_snapshot *
+df_snapshot_take(avr_t *avr)
+{
+    return df_snapshot_take_delta(avr, NULL);
+}
+
+struct df_snapshot *
+df_snapshot_take_delta(avr_t *avr, const struct df_snapshot *base)
+{
+    struct df_clock *clk = df_clock_get(avr);
+    struct df_snapshot *snap;
+
+    snap = calloc(1, sizeof(*snap));
+    if (!snap)
+        goto err;
+
+    snap->data_pages = (avr->ramend + DF_SNAPSHOT_PAGE) / DF_SNAPSHOT_PAGE;
+    snap->flash_pages = (avr->flashend + DF_SNAPSHOT_PAGE) / DF_SNAPSHOT_PAGE;
+    snap->data = calloc(snap->data_pages, sizeof(*snap->data));
+    snap->flash = calloc(snap->flash_pages, sizeof(*snap->flash));
+    if (!snap->data || !snap->flash)
+        goto err;
+    snap->bytes = sizeof(*snap) + (snap->data_pages + snap->flash_pages) *
+        sizeof(*snap->data);
+
+    if (snapshot_pages(snap->data, snap->data_pages,
+                base ? base->data : NULL, avr->data, avr->ramend + 1,
+                &snap->bytes) ||
+            snapshot_pages(snap->flash, snap->flash_pages,
+                base ? base->flash : NULL, avr->flash, avr->flashend + 1,
+                &snap->bytes))
+        goto err;
+
+    snap->pc = avr->pc;
+    snap->cycle = avr->cycle;
+    snap->state = avr->state;
+    memcpy(snap->sreg, avr->sreg, sizeof(snap->sreg));
+    snap->interrupts = avr->interrupts;
+    snap->cycle_timers = avr->cycle_timers;
+
+    if (clk && df_clock_save(clk, &snap->events, &snap->events_len))
+        goto err;
+    snap->bytes += snap->events_len * sizeof(*snap->events);
+
+    return snap;
+
+err:
+    fprintf(stderr, "Failed to allocate memory for snapshot.\n");
+    df_snapshot_free(snap);
+    return NULL;
+}
+
+void
+df_snapshot_restore(avr_t *avr, const struct df_snapshot *snap)
+{
+    struct df_clock *clk;
+    avr_io_t *io;
+
+    /* Peripherals keep state outside of their registers. We can't save
+     * it, but the UARTs must at least forget bytes queued up since the
+     * snapshot. Their registers come back with the data space below.
+     */
+    for (io = avr->io_port; io; io = io->next)
+        if (io->reset && !strcmp(io->kind, "uart"))
+            io->reset(io);
+
+    avr->pc = snap->pc;
+    avr->cycle = snap->cycle;
+    avr->state = snap->state;
+    memcpy(avr->sreg, snap->sreg, sizeof(snap->sreg));
+    snapshot_restore_pages(snap->data, snap->data_pages, avr->data,
+            avr->ramend + 1);
+    snapshot_restore_pages(snap->flash, snap->flash_pages, avr->flash,
+            avr->flashend + 1);
+    avr->interrupts = snap->interrupts;
+    avr->cycle_timers = snap->cycle_timers;
+
+    clk = df_clock_get(avr);
+    if (clk)
+        df_clock_restore(clk, snap->events, snap->events_len);
+}
+
+int
+df_snapshot_matches(avr_t *avr, const struct df_snapshot *snap)
+{
+    return avr->cycle == snap->cycle && avr->pc == snap->pc &&
+        !memcmp(avr->sreg, snap->sreg, sizeof(snap->sreg)) &&
+        snapshot_same_pages(snap->data, snap->data_pages, avr->data,
+                avr->ramend + 1) &&
+        snapshot_same_pages(snap->flash, snap->flash_pages, avr->flash,
+                avr->flashend + 1);
+}
+
+size_t
+df_snapshot_free(struct df_snapshot *snap)
+{
+    size_t bytes;
+
+    if (!snap)
+        return 0;
+
+    bytes = sizeof(*snap);
+    bytes += snapshot_free_pages(snap->data, snap->data_pages);
+    bytes += snapshot_free_pages(snap->flash, snap->flash_pages);
+    bytes += snap->events_len * sizeof(*snap->events);
+    free(snap->events);
+    free(snap);
+
+    return bytes;
+}
@@ -0,0 +1,82 @@
+/*
+ * df_snapshot.h
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_SNAPSHOT_H__
+#define __DF_SNAPSHOT_H__
+
+/* Snapshots are kept in pages, and one taken against a 'base' shares
+ * every page that hasn't changed since, so a series of them costs
+ * little more than what was written in between.
+ */
+#define DF_SNAPSHOT_PAGE 256
+
+struct df_clock_saved;
+
+struct df_snapshot_page {
+    unsigned int refs;
+    uint8_t data[DF_SNAPSHOT_PAGE];
+};
+
+/* An in-process copy of the core's state. It can only be restored into
+ * the same avr_t it was taken from since the interrupt and cycle timer
+ * tables are copied as-is, pointers and all. The same goes for what was
+ * pending on the board's df_clock, which comes back scheduled as it was.
+ * Peripherals' state outside of their registers isn't kept.
+ */
+struct df_snapshot {
+    avr_flashaddr_t pc;
+    avr_cycle_count_t cycle;
+    int state;
+    uint8_t sreg[8];
+    struct df_snapshot_page **data;
+    struct df_snapshot_page **flash;
+    size_t data_pages;
+    size_t flash_pages;
+    avr_int_table_t interrupts;
+    avr_cycle_timer_pool_t cycle_timers;
+    struct df_clock_saved *events;
+    size_t events_len;
+
+    /* Memory this snapshot added on top of its base */
+    size_t bytes;
+};
+
+struct df_snapshot *df_snapshot_take(avr_t *avr);
+
+/* Same as df_snapshot_take() but shares unchanged pages with 'base',
+ * which must have been taken from the same avr_t.
+ */
+struct df_snapshot *df_snapshot_take_delta(avr_t *avr,
+        const struct df_snapshot *base);
+
+void df_snapshot_restore(avr_t *avr, const struct df_snapshot *snap);
+
+/* Whether the core is at the same cycle and PC, with the same flags and
+ * memories, as when 'snap' was taken.
+ */
+int df_snapshot_matches(avr_t *avr, const struct df_snapshot *snap);
+
+/* Returns how much memory was given back, pages still shared with
+ * other snapshots aren't.
+ */
+size_t df_snapshot_free(struct df_snapshot *snap);
+
+#endif /* __DF_SNAPSHOT_H__ */
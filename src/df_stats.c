@@ -0,0 +1,180 @@
+/*
+ * df_stats.c
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sim_avr.h>
+
+#include "drumfish.h"
+#include "df_clock.h"
+#include "df_isr.h"
+#include "df_pflash.h"
+#include "df_stats.h"
+
+/* Publish our counters every 100ms of emulated time */
+#define STATS_INTERVAL_USEC 100000
+
+static struct df_stats *stats = NULL;
+static const char *stats_path = NULL;
+static struct timespec start;
+static struct df_clock_event stats_ev;
+
+static void
+stats_tick(avr_t *avr, uint64_t when, void *opaque)
+{
+    struct df_clock *clk = opaque;
+
+    df_stats_update(avr);
+
+    df_clock_schedule_at(clk, &stats_ev,
+            when + df_clock_usec_to_cycles(clk, STATS_INTERVAL_USEC));
+}
+
+static int
+stats_open(const char *path, avr_t *avr)
+{
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+    if (fd == -1) {
+        fprintf(stderr, "Unable to open stats file '%s': %s\n",
+                path, strerror(errno));
+        return -1;
+    }
+
+    if (ftruncate(fd, sizeof(*stats))) {
+        fprintf(stderr, "Unable to size stats file '%s': %s\n",
+                path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    stats = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0);
+    close(fd);
+    if (stats == MAP_FAILED) {
+        fprintf(stderr, "Failed to map stats file '%s': %s\n",
+                path, strerror(errno));
+        stats = NULL;
+        return -1;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    stats->version = DF_STATS_VERSION;
+    stats->pid = getpid();
+    stats->frequency = avr->frequency;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* Readers check this last, so set it once everything else is sane */
+    __atomic_store_n(&stats->magic, DF_STATS_MAGIC, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+int
+df_stats_init(const struct drumfish_cfg *config, avr_t *avr)
+{
+    struct df_clock *clk;
+
+    if (!config->stats)
+        return 0;
+
+    stats_path = config->stats;
+
+    if (stats_open(stats_path, avr))
+        return -1;
+
+    clk = df_clock_get(avr);
+    df_clock_event_init(&stats_ev, stats_tick, clk);
+    df_clock_schedule_usec(clk, &stats_ev, STATS_INTERVAL_USEC);
+
+    return 0;
+}
+
+int
+df_stats_after_fork(avr_t *avr)
+{
+    char path[PATH_MAX];
+
+    if (!stats)
+        return 0;
+
+    /* Our parent still owns its file, we get one named after us */
+    munmap(stats, sizeof(*stats));
+    stats = NULL;
+
+    snprintf(path, sizeof(path), "%s.%d", stats_path, getpid());
+
+    return stats_open(path, avr);
+}
+
+void
+df_stats_set_startup(uint64_t usec)
+{
+    if (!stats)
+        return;
+
+    stats->startup_usec = usec;
+}
+
+void
+df_stats_update(avr_t *avr)
+{
+    struct timespec now;
+
+    if (!stats)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    stats->state = avr->state;
+    df_pflash_counts(avr, &stats->flash_erases, &stats->flash_writes,
+            &stats->flash_syncs);
+    df_isr_counts(avr, stats);
+    stats->run_usec = (now.tv_sec - start.tv_sec) * 1000000ULL +
+        (now.tv_nsec - start.tv_nsec) / 1000;
+    __atomic_store_n(&stats->cycles, avr->cycle, __ATOMIC_RELEASE);
+}
+
+void
+df_stats_stop(avr_t *avr)
+{
+    if (!stats)
+        return;
+
+    df_clock_cancel(df_clock_get(avr), &stats_ev);
+    df_stats_update(avr);
+
+    munmap(stats, sizeof(*stats));
+    stats = NULL;
+}
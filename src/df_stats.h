@@ -0,0 +1,91 @@
+/*
+ * df_stats.h
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_STATS_H__
+#define __DF_STATS_H__
+
+#include <stdint.h>
+
+#define DF_STATS_MAGIC 0x54534644 /* "DFST" */
+#define DF_STATS_VERSION 4
+
+/* Enough for every vector the atmega128rfa1 has */
+#define DF_STATS_ISR_VECTORS 72
+#define DF_STATS_ISR_BUCKETS 16
+
+/* One interrupt vector's timings, in cycles. Latency runs from the
+ * interrupt going pending to its handler starting, duration from there
+ * to its RETI. Histogram bucket n counts [2^n, 2^(n+1)) cycles, with 0
+ * and 1 in the first and everything too big in the last.
+ */
+struct df_stats_isr {
+    uint64_t count;
+    uint64_t lat_max;
+    uint64_t lat_sum;
+    uint64_t dur_max;
+    uint64_t dur_sum;
+    uint64_t lat_hist[DF_STATS_ISR_BUCKETS];
+    uint64_t dur_hist[DF_STATS_ISR_BUCKETS];
+};
+
+/* Layout of the file given with '-s'. It is mmap'd shared so that
+ * tools like drumfish-fleet can watch a running node without talking
+ * to it. Only ever append fields and bump the version.
+ */
+struct df_stats {
+    uint32_t magic;
+    uint32_t version;
+    int32_t pid;
+    int32_t state;
+    uint32_t frequency;
+    uint32_t pad;
+    uint64_t cycles;
+    uint64_t run_usec;
+    /* Version 2 */
+    uint64_t flash_erases;
+    uint64_t flash_writes;
+    uint64_t flash_syncs;
+    /* Version 3, only filled in with '--isr-stats' */
+    uint32_t sp_low;
+    uint32_t sp_alarms;
+    struct df_stats_isr isr[DF_STATS_ISR_VECTORS];
+    /* Version 4, host time from main() to the first instruction, 0 until
+     * then and in forked children.
+     */
+    uint64_t startup_usec;
+};
+
+/* Forward declarations, so tools can read the file without simavr */
+struct avr_t;
+struct drumfish_cfg;
+
+int df_stats_init(const struct drumfish_cfg *config, struct avr_t *avr);
+
+/* Gives a forked child a stats file of its own, '<stats>.<pid>' */
+int df_stats_after_fork(struct avr_t *avr);
+
+void df_stats_update(struct avr_t *avr);
+
+void df_stats_set_startup(uint64_t usec);
+
+void df_stats_stop(struct avr_t *avr);
+
+#endif /* __DF_STATS_H__ */
@@ -0,0 +1,371 @@
+/*
+ * df_trace.c
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sim_avr.h>
+
+#include "drumfish.h"
+#include "df_board.h"
+#include "df_chunkq.h"
+#include "df_hook.h"
+#include "df_log.h"
+#include "df_trace.h"
+
+#define TRACE_CHUNK_SIZE (256 * 1024)
+#define TRACE_CHUNKS 8
+
+/* Only touched by the emulation thread that owns it. Tracing is single
+ * board, so there's just the one, but nothing in here is shared with
+ * the writer beyond the chunks handed over through the queue.
+ */
+struct trace_thread {
+    struct df_chunkq_buf *cur;
+    uint32_t last_pc;
+    uint64_t last_cycle;
+    unsigned long pc_lo;
+    unsigned long pc_hi;
+    unsigned long data_lo;
+    unsigned long data_hi;
+};
+
+static struct trace_thread trace_main;
+
+static struct {
+    int fd;
+    struct df_chunkq *q;
+
+    /* Only touched by the writer thread */
+    uint64_t offset;
+    struct df_trace_index *index;
+    size_t index_len;
+    size_t index_alloc;
+    int failed;
+} trace = {
+    .fd = -1,
+};
+
+static int
+trace_write(const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    ssize_t r;
+
+    while (len) {
+        r = write(trace.fd, p, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+
+    return 0;
+}
+
+static int
+trace_write_chunk(void *opaque, const uint8_t *data, size_t len)
+{
+    const struct df_trace_chunk *hdr = (const struct df_trace_chunk *)data;
+    struct df_trace_index *index;
+
+    (void)opaque;
+
+    if (trace.index_len == trace.index_alloc) {
+        trace.index_alloc = trace.index_alloc ? trace.index_alloc * 2 : 1024;
+        index = realloc(trace.index,
+                trace.index_alloc * sizeof(*trace.index));
+        if (!index) {
+            df_log_msg(DF_LOG_ERR, "Out of memory for the trace index\n");
+            trace.failed = 1;
+            return -1;
+        }
+        trace.index = index;
+    }
+
+    if (trace_write(data, len)) {
+        df_log_msg(DF_LOG_ERR, "Failed to write trace, stopping: %s\n",
+                strerror(errno));
+        trace.failed = 1;
+        return -1;
+    }
+
+    trace.index[trace.index_len].offset = trace.offset;
+    trace.index[trace.index_len].first_cycle = hdr->first_cycle;
+    trace.index_len++;
+    trace.offset += len;
+
+    return 0;
+}
+
+static struct df_chunkq_buf *
+trace_get_buf(const struct trace_thread *t)
+{
+    struct df_chunkq_buf *buf = df_chunkq_get(trace.q);
+    struct df_trace_chunk *hdr = (struct df_trace_chunk *)buf->data;
+
+    /* The header is filled in as we go and lives in the buffer so the
+     * writer can put out the chunk in one go.
+     */
+    hdr->magic = DF_TRACE_CHUNK_MAGIC;
+    hdr->len = 0;
+    hdr->records = 0;
+    hdr->first_pc = t->last_pc;
+    hdr->first_cycle = t->last_cycle;
+    buf->len = sizeof(*hdr);
+
+    return buf;
+}
+
+static inline uint8_t *
+trace_reserve(struct trace_thread *t)
+{
+    if (TRACE_CHUNK_SIZE - t->cur->len < DF_TRACE_REC_MAX) {
+        df_chunkq_put(trace.q, t->cur);
+        t->cur = trace_get_buf(t);
+    }
+
+    return t->cur->data + t->cur->len;
+}
+
+static inline void
+trace_commit(struct trace_thread *t, const uint8_t *end)
+{
+    struct df_trace_chunk *hdr = (struct df_trace_chunk *)t->cur->data;
+
+    t->cur->len = end - t->cur->data;
+    hdr->len = t->cur->len - sizeof(*hdr);
+    hdr->records++;
+}
+
+static void
+trace_insn_hook(avr_t *avr, avr_flashaddr_t pc, avr_flashaddr_t new_pc,
+        void *opaque)
+{
+    struct trace_thread *t = opaque;
+    uint64_t cycles = avr->cycle - t->last_cycle;
+    int64_t words = ((int64_t)pc - (int64_t)t->last_pc) / 2;
+    uint8_t pcd;
+    uint8_t cyd;
+    uint8_t *p;
+
+    (void)new_pc;
+
+    if (!t->cur || pc < t->pc_lo || pc > t->pc_hi ||
+            df_board_get(avr)->replaying)
+        return;
+
+    p = trace_reserve(t);
+
+    pcd = (words >= 1 && words <= DF_TRACE_ESCAPE) ? words - 1 :
+        DF_TRACE_ESCAPE;
+    cyd = cycles < DF_TRACE_ESCAPE ? cycles : DF_TRACE_ESCAPE;
+    *p++ = pcd << 5 | cyd << 2 | DF_TRACE_INSN;
+
+    if (pcd == DF_TRACE_ESCAPE)
+        p = df_trace_put_varint(p, df_trace_zigzag(words));
+    if (cyd == DF_TRACE_ESCAPE)
+        p = df_trace_put_varint(p, cycles);
+
+    trace_commit(t, p);
+
+    t->last_pc = pc;
+    t->last_cycle = avr->cycle;
+}
+
+static void
+trace_iow_hook(avr_t *avr, avr_flashaddr_t pc, avr_io_addr_t addr,
+        uint8_t v, void *opaque)
+{
+    struct trace_thread *t = opaque;
+    uint8_t *p;
+
+    (void)pc;
+
+    if (!t->cur || df_board_get(avr)->replaying)
+        return;
+
+    p = trace_reserve(t);
+    *p++ = DF_TRACE_IOW;
+    p = df_trace_put_varint(p, avr->cycle - t->last_cycle);
+    p = df_trace_put_varint(p, addr);
+    *p++ = v;
+    trace_commit(t, p);
+
+    t->last_cycle = avr->cycle;
+}
+
+static void
+trace_mem_hook(avr_t *avr, avr_flashaddr_t pc, avr_io_addr_t addr,
+        int store, void *opaque)
+{
+    struct trace_thread *t = opaque;
+    uint8_t *p;
+
+    if (!t->cur || pc < t->pc_lo || pc > t->pc_hi || addr < t->data_lo ||
+            addr > t->data_hi || addr > avr->ramend ||
+            df_board_get(avr)->replaying)
+        return;
+
+    /* trace_iow_hook() has those */
+    if (store && addr >= AVR_IO_TO_DATA(0) && addr <= avr->ioend)
+        return;
+
+    p = trace_reserve(t);
+    *p++ = (store ? DF_TRACE_MEM_STORE : 0) | DF_TRACE_MEM;
+    p = df_trace_put_varint(p, avr->cycle - t->last_cycle);
+    p = df_trace_put_varint(p, addr);
+    *p++ = avr->data[addr];
+    trace_commit(t, p);
+
+    t->last_cycle = avr->cycle;
+}
+
+static void
+trace_cleanup(void)
+{
+    df_trace_stop();
+}
+
+int
+df_trace_init(const struct drumfish_cfg *config, avr_t *avr)
+{
+    struct trace_thread *t = &trace_main;
+    struct df_trace_hdr hdr;
+
+    if (!config->trace)
+        return 0;
+
+    trace.fd = open(config->trace, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+            0644);
+    if (trace.fd < 0) {
+        fprintf(stderr, "Unable to create trace '%s': %s\n", config->trace,
+                strerror(errno));
+        return -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = DF_TRACE_MAGIC;
+    hdr.version = DF_TRACE_VERSION;
+    hdr.flags = config->trace_io_only ? DF_TRACE_FLAG_IO_ONLY : 0;
+    hdr.frequency = avr->frequency;
+    hdr.chunk_size = TRACE_CHUNK_SIZE;
+    if (trace_write(&hdr, sizeof(hdr))) {
+        fprintf(stderr, "Unable to write trace '%s': %s\n", config->trace,
+                strerror(errno));
+        goto err;
+    }
+    trace.offset = sizeof(hdr);
+
+    trace.q = df_chunkq_new(TRACE_CHUNK_SIZE, TRACE_CHUNKS,
+            trace_write_chunk, NULL);
+    if (!trace.q)
+        goto err;
+
+    t->last_pc = avr->pc;
+    t->last_cycle = avr->cycle;
+    t->pc_lo = config->trace_pc_lo;
+    t->pc_hi = config->trace_pc_hi;
+    t->data_lo = config->trace_data_lo;
+    t->data_hi = config->trace_data_hi;
+    t->cur = trace_get_buf(t);
+
+    /* IO writes and data accesses come decoded from the instruction
+     * rather than from simavr's per-register callbacks, which only have
+     * room for a few listeners in total and don't cover plain SRAM.
+     */
+    if ((!config->trace_io_only &&
+                (df_hook_insn_add(avr, trace_insn_hook, t) ||
+                 df_hook_mem_add(avr, trace_mem_hook, t))) ||
+            df_hook_iow_add(avr, trace_iow_hook, t)) {
+        df_trace_stop();
+        return -1;
+    }
+
+    atexit(trace_cleanup);
+
+    return 0;
+
+err:
+    close(trace.fd);
+    trace.fd = -1;
+
+    return -1;
+}
+
+void
+df_trace_stop(void)
+{
+    struct trace_thread *t = &trace_main;
+    struct df_trace_footer footer;
+
+    if (trace.fd == -1)
+        return;
+
+    /* Anything the emulation thread hasn't handed over yet */
+    if (t->cur->len > sizeof(struct df_trace_chunk))
+        df_chunkq_put(trace.q, t->cur);
+    t->cur = NULL;
+
+    df_chunkq_free(trace.q);
+    trace.q = NULL;
+
+    /* An index after a failed chunk would point at the chunks that never
+     * made it. Cut the file back to the last whole chunk and leave the
+     * index off, drumfish-trace walks the chunks when there isn't one.
+     */
+    if (trace.failed) {
+        if (ftruncate(trace.fd, trace.offset))
+            df_log_msg(DF_LOG_ERR, "Failed to truncate trace: %s\n",
+                    strerror(errno));
+        df_log_msg(DF_LOG_WARN, "Trace cut short after %zu chunks, no "
+                "index written\n", trace.index_len);
+    } else {
+        footer.index_offset = trace.offset;
+        footer.count = trace.index_len;
+        footer.magic = DF_TRACE_INDEX_MAGIC;
+
+        if (trace_write(trace.index,
+                    trace.index_len * sizeof(*trace.index)) ||
+                trace_write(&footer, sizeof(footer)))
+            df_log_msg(DF_LOG_ERR, "Failed to write trace index: %s\n",
+                    strerror(errno));
+
+        df_log_msg(DF_LOG_INFO, "Trace closed after %zu chunks\n",
+                trace.index_len);
+    }
+
+    close(trace.fd);
+    trace.fd = -1;
+
+    free(trace.index);
+    trace.index = NULL;
+}
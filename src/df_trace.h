@@ -0,0 +1,143 @@
+/*
+ * df_trace.h
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_TRACE_H__
+#define __DF_TRACE_H__
+
+#include <stdint.h>
+
+#define DF_TRACE_MAGIC 0x52544644 /* "DFTR" */
+#define DF_TRACE_CHUNK_MAGIC 0x43544644 /* "DFTC" */
+#define DF_TRACE_INDEX_MAGIC 0x49544644 /* "DFTI" */
+/* Version 1 traces are the same without MEM records */
+#define DF_TRACE_VERSION 2
+
+#define DF_TRACE_FLAG_IO_ONLY 0x1
+
+/* A trace file is a header, then chunks, then an index of the chunks
+ * and a footer pointing at the index. A trace cut short by a crash has
+ * no index, but the chunks can still be walked one after another.
+ */
+struct df_trace_hdr {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint32_t frequency;
+    uint32_t chunk_size;
+};
+
+/* Records in a chunk are deltas from the previous record, starting
+ * from first_pc and first_cycle, so each chunk decodes on its own.
+ */
+struct df_trace_chunk {
+    uint32_t magic;
+    uint32_t len;
+    uint32_t records;
+    uint32_t first_pc;
+    uint64_t first_cycle;
+};
+
+struct df_trace_index {
+    uint64_t offset;
+    uint64_t first_cycle;
+};
+
+struct df_trace_footer {
+    uint64_t index_offset;
+    uint32_t count;
+    uint32_t magic;
+};
+
+/* The low 2 bits of a record's first byte are its type.
+ *
+ * INSN: bits 7-5 are the PC delta in words minus 1, with 7 meaning a
+ * zigzag varint of the delta follows. Bits 4-2 are the cycle delta,
+ * with 7 meaning a varint follows. Straight line code costs a byte per
+ * instruction.
+ *
+ * IOW: followed by varints of the cycle delta and the data address, then
+ * the byte written. They come before the INSN record of the instruction
+ * that did the write.
+ *
+ * MEM: a load, or a store with bit 2 set, laid out like IOW with the
+ * byte loaded or stored. They come before any IOW record of the same
+ * instruction, stores to IO registers are only written as IOW records.
+ */
+#define DF_TRACE_INSN 0
+#define DF_TRACE_IOW 1
+#define DF_TRACE_MEM 2
+#define DF_TRACE_MEM_STORE 0x4
+#define DF_TRACE_TYPE(b) ((b) & 0x3)
+#define DF_TRACE_ESCAPE 7
+
+/* Largest record we ever write */
+#define DF_TRACE_REC_MAX 32
+
+static inline uint8_t *
+df_trace_put_varint(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+
+    return p;
+}
+
+static inline const uint8_t *
+df_trace_get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+    unsigned int shift = 0;
+
+    *v = 0;
+    while (p < end && shift < 64) {
+        *v |= (uint64_t)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80))
+            return p;
+        shift += 7;
+    }
+
+    return NULL;
+}
+
+static inline uint64_t
+df_trace_zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t
+df_trace_unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/* Forward declarations, so tools can read the file without simavr */
+struct avr_t;
+struct drumfish_cfg;
+
+int df_trace_init(const struct drumfish_cfg *config, struct avr_t *avr);
+
+/* Flushes everything buffered and writes the index */
+void df_trace_stop(void);
+
+#endif /* __DF_TRACE_H__ */
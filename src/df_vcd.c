@@ -0,0 +1,312 @@
+/*
+ * df_vcd.c
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sim_avr.h>
+#include <avr_ioport.h>
+#include <avr_uart.h>
+
+#include "drumfish.h"
+#include "df_board.h"
+#include "df_chunkq.h"
+#include "df_log.h"
+#include "df_radio.h"
+#include "df_vcd.h"
+
+#define VCD_CHUNK_SIZE (64 * 1024)
+#define VCD_CHUNKS 8
+#define VCD_MAX_SIGNALS 64
+
+/* What the emulation thread hands the writer for each change */
+struct vcd_rec {
+    uint64_t cycle;
+    uint32_t value;
+    uint32_t sig;
+};
+
+struct vcd_sig {
+    char name[32];
+    char id[4];
+    int bits;
+    uint32_t index;
+};
+
+static struct {
+    FILE *f;
+    struct df_chunkq *q;
+    avr_t *avr;
+    int started;
+    struct vcd_sig sig[VCD_MAX_SIGNALS];
+    uint32_t sig_len;
+
+    /* Only touched by the emulation thread */
+    struct df_chunkq_buf *cur;
+
+    /* Only touched by the writer thread */
+    uint64_t last_time;
+    int have_time;
+} vcd;
+
+static uint64_t
+vcd_time(uint64_t cycle)
+{
+    /* Picoseconds so that any sane clock lands on a whole number */
+    return (unsigned __int128)cycle * 1000000000000ULL / vcd.avr->frequency;
+}
+
+static void
+vcd_put_value(const struct vcd_sig *s, uint32_t value)
+{
+    char bin[33];
+    int i;
+
+    if (s->bits == 1) {
+        fprintf(vcd.f, "%c%s\n", value ? '1' : '0', s->id);
+        return;
+    }
+
+    for (i = 0; i < s->bits; i++)
+        bin[i] = (value >> (s->bits - 1 - i)) & 1 ? '1' : '0';
+    bin[i] = '\0';
+
+    fprintf(vcd.f, "b%s %s\n", bin, s->id);
+}
+
+static int
+vcd_write_chunk(void *opaque, const uint8_t *data, size_t len)
+{
+    const struct vcd_rec *rec = (const struct vcd_rec *)data;
+    size_t n = len / sizeof(*rec);
+    uint64_t t;
+    size_t i;
+
+    (void)opaque;
+
+    for (i = 0; i < n; i++) {
+        t = vcd_time(rec[i].cycle);
+        if (!vcd.have_time || t != vcd.last_time) {
+            fprintf(vcd.f, "#%llu\n", (unsigned long long)t);
+            vcd.last_time = t;
+            vcd.have_time = 1;
+        }
+
+        vcd_put_value(&vcd.sig[rec[i].sig], rec[i].value);
+    }
+
+    if (ferror(vcd.f)) {
+        df_log_msg(DF_LOG_ERR, "Failed to write VCD, stopping: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+vcd_irq_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+    const struct vcd_sig *s = param;
+    struct vcd_rec *rec;
+
+    (void)irq;
+
+    if (!vcd.cur || df_board_get(vcd.avr)->replaying)
+        return;
+
+    if (vcd.cur->len + sizeof(*rec) > VCD_CHUNK_SIZE) {
+        df_chunkq_put(vcd.q, vcd.cur);
+        vcd.cur = df_chunkq_get(vcd.q);
+    }
+
+    rec = (struct vcd_rec *)(vcd.cur->data + vcd.cur->len);
+    rec->cycle = vcd.avr->cycle;
+    rec->value = value;
+    rec->sig = s->index;
+    vcd.cur->len += sizeof(*rec);
+}
+
+int
+df_vcd_add_irq(struct avr_irq_t *irq, const char *name, int bits)
+{
+    struct vcd_sig *s;
+    uint32_t n;
+    int i;
+
+    if (!vcd.f || !irq)
+        return 0;
+
+    if (vcd.started || vcd.sig_len == VCD_MAX_SIGNALS) {
+        fprintf(stderr, "Unable to add '%s' to the VCD capture.\n", name);
+        return -1;
+    }
+
+    s = &vcd.sig[vcd.sig_len];
+    snprintf(s->name, sizeof(s->name), "%s", name);
+    s->bits = bits;
+    s->index = vcd.sig_len++;
+
+    /* Identifiers are printable characters, '!' through '~' */
+    n = s->index;
+    i = 0;
+    do {
+        s->id[i++] = '!' + n % 94;
+        n /= 94;
+    } while (n && i < (int)sizeof(s->id) - 1);
+    s->id[i] = '\0';
+
+    avr_irq_register_notify(irq, vcd_irq_hook, s);
+
+    return 0;
+}
+
+int
+df_vcd_init(const struct drumfish_cfg *config, avr_t *avr)
+{
+    struct avr_irq_t *irq;
+    const char *trx;
+    char name[32];
+    char port;
+    char uart;
+    int i;
+
+    if (!config->vcd)
+        return 0;
+
+    vcd.f = fopen(config->vcd, "we");
+    if (!vcd.f) {
+        fprintf(stderr, "Unable to create VCD '%s': %s\n", config->vcd,
+                strerror(errno));
+        return -1;
+    }
+
+    /* Only the writer thread touches this */
+    setvbuf(vcd.f, NULL, _IOFBF, 1024 * 1024);
+
+    vcd.avr = avr;
+
+    for (port = 'A'; port <= 'G'; port++) {
+        snprintf(name, sizeof(name), "port%c", port);
+        if (df_vcd_add_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(port),
+                        IOPORT_IRQ_PIN_ALL), name, 8))
+            return -1;
+
+        snprintf(name, sizeof(name), "ddr%c", port);
+        if (df_vcd_add_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(port),
+                        IOPORT_IRQ_DIRECTION_ALL), name, 8))
+            return -1;
+    }
+
+    for (uart = '0'; uart <= '1'; uart++) {
+        snprintf(name, sizeof(name), "uart%c_tx", uart);
+        if (df_vcd_add_irq(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ(uart),
+                        UART_IRQ_OUTPUT), name, 8))
+            return -1;
+
+        snprintf(name, sizeof(name), "uart%c_rx", uart);
+        if (df_vcd_add_irq(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ(uart),
+                        UART_IRQ_INPUT), name, 8))
+            return -1;
+    }
+
+    /* The radio registered its interrupts with the board, long before
+     * there was a capture to put them in.
+     */
+    for (i = 0; (irq = df_radio_get_irq(avr, i, &trx)); i++) {
+        snprintf(name, sizeof(name), "trx_%s", trx);
+        if (df_vcd_add_irq(irq, name, 1))
+            return -1;
+    }
+
+    return 0;
+}
+
+static void
+vcd_cleanup(void)
+{
+    df_vcd_stop();
+}
+
+int
+df_vcd_start(avr_t *avr)
+{
+    char date[64];
+    time_t now;
+    uint32_t i;
+
+    if (!vcd.f)
+        return 0;
+
+    now = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&now));
+
+    fprintf(vcd.f, "$date %s $end\n", date);
+    fprintf(vcd.f, "$version drumfish $end\n");
+    fprintf(vcd.f, "$timescale 1ps $end\n");
+    fprintf(vcd.f, "$scope module %s $end\n", avr->mmcu);
+    for (i = 0; i < vcd.sig_len; i++)
+        fprintf(vcd.f, "$var wire %d %s %s $end\n", vcd.sig[i].bits,
+                vcd.sig[i].id, vcd.sig[i].name);
+    fprintf(vcd.f, "$upscope $end\n");
+    fprintf(vcd.f, "$enddefinitions $end\n");
+
+    /* Nothing is known until the first change */
+    fprintf(vcd.f, "#%llu\n$dumpvars\n",
+            (unsigned long long)vcd_time(avr->cycle));
+    for (i = 0; i < vcd.sig_len; i++)
+        fprintf(vcd.f, "%s%s\n", vcd.sig[i].bits == 1 ? "x" : "bx ",
+                vcd.sig[i].id);
+    fprintf(vcd.f, "$end\n");
+
+    vcd.q = df_chunkq_new(VCD_CHUNK_SIZE, VCD_CHUNKS, vcd_write_chunk, NULL);
+    if (!vcd.q)
+        return -1;
+
+    vcd.started = 1;
+    vcd.cur = df_chunkq_get(vcd.q);
+
+    atexit(vcd_cleanup);
+
+    return 0;
+}
+
+void
+df_vcd_stop(void)
+{
+    if (!vcd.f)
+        return;
+
+    if (vcd.cur)
+        df_chunkq_put(vcd.q, vcd.cur);
+    vcd.cur = NULL;
+
+    df_chunkq_free(vcd.q);
+    vcd.q = NULL;
+
+    fclose(vcd.f);
+    vcd.f = NULL;
+}
@@ -0,0 +1,44 @@
+/*
+ * df_vcd.h
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_VCD_H__
+#define __DF_VCD_H__
+
+struct avr_irq_t;
+struct drumfish_cfg;
+
+/* Adds the GPIO ports, the UARTs and the transceiver's interrupts when
+ * '--vcd' was given.
+ */
+int df_vcd_init(const struct drumfish_cfg *config, avr_t *avr);
+
+/* Lets other components put their own lines in the capture. Only
+ * possible until the capture starts, returns 0 without a capture.
+ */
+int df_vcd_add_irq(struct avr_irq_t *irq, const char *name, int bits);
+
+/* Writes the header and starts recording changes */
+int df_vcd_start(avr_t *avr);
+
+void df_vcd_stop(void);
+
+#endif /* __DF_VCD_H__ */
@@ -24,41 +24,181 @@
 #include <sys/types.h>
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sim_avr.h>
-#include <sim_gdb.h>
 
 #include "drumfish.h"
 #include "flash.h"
+#include "df_blackbox.h"
+#include "df_board.h"
+#include "df_clock.h"
 #include "df_cores.h"
+#include "df_ctl.h"
+#include "df_fork.h"
+#include "df_fuzz.h"
+#include "df_gdb.h"
+#include "df_isr.h"
 #include "df_log.h"
+#include "df_medium.h"
+#include "df_mem.h"
+#include "df_pflash.h"
+#include "df_profile.h"
+#include "df_run.h"
+#include "df_stats.h"
+#include "df_trace.h"
+#include "df_vcd.h"
 
 #define DEFAULT_PFLASH_PATH "/.drumfish/pflash.dat"
+#define DEFAULT_EEPROM_PATH "/.drumfish/eeprom.dat"
 #define MAX_FLASH_FILES 1024
+#define MAX_BOARDS 1024
+#define MAX_EXPECT 1024
+#define MAX_PROFILE 1024
+
+/* Options that only have a long form */
+enum {
+    OPT_FORK_CYCLE = 256,
+    OPT_FORK_MARKER,
+    OPT_FUZZ,
+    OPT_FUZZ_CYCLES,
+    OPT_FUZZ_UART,
+    OPT_FUZZ_INPUT,
+    OPT_TRACE,
+    OPT_TRACE_PC,
+    OPT_TRACE_DATA,
+    OPT_TRACE_IO_ONLY,
+    OPT_VCD,
+    OPT_LOG_FILE,
+    OPT_LOG_ROTATE,
+    OPT_LOG_BLOCK,
+    OPT_PCAP,
+    OPT_MEDIUM_FD,
+    OPT_EEPROM,
+    OPT_EEPROM_BASE,
+    OPT_ERASE_EEPROM,
+    OPT_PFLASH_SYNC,
+    OPT_PFLASH_WEAR,
+    OPT_BOARDS,
+    OPT_RUN,
+    OPT_RUN_UART,
+    OPT_RUN_INPUT,
+    OPT_EXPECT,
+    OPT_FAIL_ON,
+    OPT_MAX_CYCLES,
+    OPT_MAX_TIME,
+    OPT_BLACKBOX,
+    OPT_BLACKBOX_DIR,
+    OPT_ISR_STATS,
+    OPT_STACK_ALARM,
+    OPT_GDB_CHECKPOINT,
+    OPT_GDB_HISTORY,
+    OPT_PROFILE,
+    OPT_PROFILE_ELF,
+    OPT_PROFILE_OUT,
+    OPT_MEM_AUDIT,
+    OPT_HUGEPAGES,
+};
+
+static const struct option long_options[] = {
+    { "fork-at-cycle", required_argument, NULL, OPT_FORK_CYCLE },
+    { "fork-at-marker", required_argument, NULL, OPT_FORK_MARKER },
+    { "fuzz", no_argument, NULL, OPT_FUZZ },
+    { "fuzz-cycles", required_argument, NULL, OPT_FUZZ_CYCLES },
+    { "fuzz-uart", required_argument, NULL, OPT_FUZZ_UART },
+    { "fuzz-input", required_argument, NULL, OPT_FUZZ_INPUT },
+    { "trace", required_argument, NULL, OPT_TRACE },
+    { "trace-pc", required_argument, NULL, OPT_TRACE_PC },
+    { "trace-data", required_argument, NULL, OPT_TRACE_DATA },
+    { "trace-io-only", no_argument, NULL, OPT_TRACE_IO_ONLY },
+    { "vcd", required_argument, NULL, OPT_VCD },
+    { "log-file", required_argument, NULL, OPT_LOG_FILE },
+    { "log-rotate", required_argument, NULL, OPT_LOG_ROTATE },
+    { "log-block", no_argument, NULL, OPT_LOG_BLOCK },
+    { "pcap", required_argument, NULL, OPT_PCAP },
+    { "medium-fd", required_argument, NULL, OPT_MEDIUM_FD },
+    { "eeprom", required_argument, NULL, OPT_EEPROM },
+    { "eeprom-base", required_argument, NULL, OPT_EEPROM_BASE },
+    { "erase-eeprom", no_argument, NULL, OPT_ERASE_EEPROM },
+    { "pflash-sync", required_argument, NULL, OPT_PFLASH_SYNC },
+    { "pflash-wear", required_argument, NULL, OPT_PFLASH_WEAR },
+    { "boards", required_argument, NULL, OPT_BOARDS },
+    { "run", no_argument, NULL, OPT_RUN },
+    { "run-uart", required_argument, NULL, OPT_RUN_UART },
+    { "run-input", required_argument, NULL, OPT_RUN_INPUT },
+    { "expect", required_argument, NULL, OPT_EXPECT },
+    { "fail-on", required_argument, NULL, OPT_FAIL_ON },
+    { "max-cycles", required_argument, NULL, OPT_MAX_CYCLES },
+    { "max-time", required_argument, NULL, OPT_MAX_TIME },
+    { "blackbox", required_argument, NULL, OPT_BLACKBOX },
+    { "blackbox-dir", required_argument, NULL, OPT_BLACKBOX_DIR },
+    { "isr-stats", no_argument, NULL, OPT_ISR_STATS },
+    { "stack-alarm", required_argument, NULL, OPT_STACK_ALARM },
+    { "gdb-checkpoint", required_argument, NULL, OPT_GDB_CHECKPOINT },
+    { "gdb-history", required_argument, NULL, OPT_GDB_HISTORY },
+    { "profile", required_argument, NULL, OPT_PROFILE },
+    { "profile-elf", required_argument, NULL, OPT_PROFILE_ELF },
+    { "profile-out", required_argument, NULL, OPT_PROFILE_OUT },
+    { "mem-audit", no_argument, NULL, OPT_MEM_AUDIT },
+    { "hugepages", no_argument, NULL, OPT_HUGEPAGES },
+    { NULL, 0, NULL, 0 },
+};
 
 /* We have 1 emulated board and here's the handle to
  * the AVR core.
  */
 avr_t *avr = NULL;
 
+/* Every board when running a batch of them, the first one is 'avr' */
+static struct df_board **boards = NULL;
+static size_t boards_len = 0;
+
+/* Host time since 'since', to see how long getting going took */
+static uint64_t
+startup_usec(const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - since->tv_sec) * 1000000ULL +
+        (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+static void
+terminate(void)
+{
+    size_t i;
+
+    for (i = boards_len; i > 0; i--)
+        avr_terminate(boards[i - 1]->avr);
+}
+
 static void
 handler(int sig)
 {
     switch (sig) {
         case SIGINT:
         case SIGTERM:
-            avr_terminate(avr);
+            terminate();
             exit(EXIT_FAILURE);
             break;
 
         case SIGHUP:
-            avr_reset(avr);
+            /* The reset itself happens from the run loop */
+            df_ctl_request_reset();
+            break;
+
+        case SIGUSR1:
+            /* Dumped from the run loop, between instructions */
+            df_blackbox_pending = 1;
             break;
     }
 }
@@ -70,14 +210,133 @@ usage(const char *argv0)
 "Usage: %s [-v] [-p pflash] [-f firmware.hex] [-g port] [-m MAC]\n"
 "\n"
 "  -p pflash    - Path to device's progammable flash storage\n"
+"  -c           - Map pflash copy-on-write, changes are never saved\n"
 "  -f ihex      - Load the requested 'ihex' file into the device's flash\n"
 "  -e           - Erase all of progammable flash prior to loading any data\n"
-"  -g port      - Runs the AVR CPU under gdbserver on 'port'\n"
+"  -g port      - Runs the AVR CPU under gdbserver on 'port', with\n"
+"                 --boards each board is a thread\n"
 "  -v           - Increase verbosity of messages\n"
 "  -m           - Radio MAC address\n"
+"  -s stats     - Publish run statistics to the 'stats' file\n"
+"\n"
+"Batches:\n"
+"  --boards N             - Run N identical boards in lock-step in this\n"
+"                           process. Board i > 0 adds '.i' to its pflash,\n"
+"                           EEPROM, wear and capture files (unless -c),\n"
+"                           and i to its MAC, and links its UARTs at\n"
+"                           /tmp/drumfish-<pid>-i-uartN. Control commands\n"
+"                           go to board 0\n"
+"\n"
+"Reverse debugging (with -g):\n"
+"  --gdb-checkpoint N     - Checkpoint each board every N cycles so GDB can\n"
+"                           reverse-step and reverse-continue (default %d,\n"
+"                           0 turns it off)\n"
+"  --gdb-history MB       - Memory all the checkpoints may use, the oldest\n"
+"                           are dropped past it (default %d)\n"
+"\n"
+"Headless runs (for CI, see drumfish-runner):\n"
+"  --run                  - No ptys or control socket, the run's UART\n"
+"                           output goes to stdout and the exit status\n"
+"                           says how it went: 0 pass, 2 fail, 3 timeout,\n"
+"                           4 crash. Without -p the pflash and EEPROM\n"
+"                           start erased and are thrown away\n"
+"  --run-uart N           - UART the run talks to (default 0)\n"
+"  --run-input FILE       - Send FILE to the UART once the CPU starts\n"
+"  --expect RE            - Pass once a line of output matches the\n"
+"                           extended regex RE. Repeat to expect lines in\n"
+"                           order\n"
+"  --fail-on RE           - Fail as soon as a line matches RE\n"
+"  --max-cycles N         - Stop after N CPU cycles\n"
+"  --max-time MS          - Stop after MS ms of emulated time\n"
+"\n"
+"pflash writes:\n"
+"  --pflash-sync POLICY   - When SPM writes reach the pflash file: 'never'\n"
+"                           leaves it to the kernel (default), 'erase'\n"
+"                           syncs on every page erase and a number syncs\n"
+"                           every that many ms of emulated time\n"
+"  --pflash-wear FILE     - Keep per-page erase/write counts in FILE\n"
+"                           across runs\n"
+"\n"
+"Post-mortem:\n"
+"  --blackbox N           - Remember the last N jumps, IRQs and IO writes\n"
+"                           (a power of 2, default %d, 0 turns it off)\n"
+"                           and dump them with SRAM on a crash, an\n"
+"                           unexpected reset or SIGUSR1\n"
+"  --blackbox-dir DIR     - Where dumps are written (default /tmp)\n"
+"\n"
+"Interrupts and stack:\n"
+"  --isr-stats            - Time every interrupt from pending to entry and\n"
+"                           entry to RETI, and track the stack pointer's\n"
+"                           low-water mark. Printed at exit and published\n"
+"                           with -s\n"
+"  --stack-alarm ADDR     - Warn and dump the post-mortem ring once SP\n"
+"                           drops below ADDR (implies --isr-stats)\n"
+"\n"
+"Function timing (compare runs with drumfish-profcmp):\n"
+"  --profile FUNC         - Time every call to FUNC in cycles, inclusive\n"
+"                           and exclusive of other profiled functions\n"
+"                           and interrupts. Repeat for more, '*' times\n"
+"                           them all\n"
+"  --profile-elf FILE     - ELF file of the firmware to find FUNC in\n"
+"  --profile-out FILE     - Write min/median/max per function to FILE at\n"
+"                           exit instead of stderr\n"
+"\n"
+"Memory:\n"
+"  --mem-audit            - Print what each part of a board takes once\n"
+"                           they're all set up\n"
+"  --hugepages            - Keep every board's SRAM and erased flash in\n"
+"                           one arena backed by transparent huge pages\n"
+"\n"
+"EEPROM:\n"
+"  --eeprom FILE          - Path to the device's EEPROM storage\n"
+"  --eeprom-base FILE     - Start a new EEPROM file off as a copy of FILE\n"
+"  --erase-eeprom         - Erase the EEPROM before starting the CPU\n"
+"\n"
+"Fork server:\n"
+"  --fork-at-cycle N      - Boot for N cycles, then fork nodes on request\n"
+"  --fork-at-marker TEXT  - Boot until a UART prints TEXT, then fork nodes\n"
+"                           on request\n"
+"\n"
+"Fuzzing (needs a fork server boot point):\n"
+"  --fuzz                 - Once booted, run test cases from afl-fuzz, or a\n"
+"                           single one when run by hand\n"
+"  --fuzz-cycles N        - Cycles each test case runs for (default %llu)\n"
+"  --fuzz-uart N          - UART test cases are received on (default 0)\n"
+"  --fuzz-input FILE      - Read test cases from FILE instead of stdin\n"
+"\n"
+"Tracing (decode with drumfish-trace):\n"
+"  --trace FILE           - Write a binary execution trace to FILE\n"
+"  --trace-pc LO-HI       - Only trace instructions between flash byte\n"
+"                           addresses LO and HI, and only their loads\n"
+"                           and stores\n"
+"  --trace-data LO-HI     - Only trace loads and stores between data\n"
+"                           addresses LO and HI\n"
+"  --trace-io-only        - Only trace writes to IO registers\n"
+"  --vcd FILE             - Capture GPIO, UART and radio interrupt\n"
+"                           activity as a VCD waveform in FILE\n"
+"  --pcap FILE            - Capture radio frames to FILE (pcapng), any %%m\n"
+"                           is replaced by the node's MAC\n"
+"  --medium-fd N          - Exchange radio frames with drumfish-fleet's\n"
+"                           radio medium over fd N\n"
+"\n"
+"Logging:\n"
+"  --log-file FILE        - Write messages to FILE instead of stderr\n"
+"  --log-rotate BYTES     - Start a new log file once it reaches BYTES\n"
+"  --log-block            - Wait for the log writer when it falls behind\n"
+"                           instead of dropping messages\n"
 "\n"
 "Defaults:\n"
 "  Programmable Flash Storage: $HOME/.drumfish/pflash.dat\n"
+"  EEPROM Storage: $HOME/.drumfish/eeprom.dat, or pflash.eeprom next to\n"
+"                  a pflash given with -p\n"
+"\n"
+"Runtime control:\n"
+"  Datagrams sent to /tmp/drumfish-<pid>-ctl are run as commands:\n"
+"    reset                - Warm reset the CPU (same as SIGHUP)\n"
+"    erase                - Erase all of programmable flash\n"
+"    load ihex|elf ...    - Load firmware into flash and warm reset\n"
+"    fork [MAC]           - Fork server only: start a copy of the booted\n"
+"                           node, replying with its pid\n"
 "\n"
 "Examples:\n"
 "  %s -g 1234 -m 00:11:22:00:9E:35\n"
@@ -86,8 +345,12 @@ usage(const char *argv0)
 "    Loads the 'bootloader.hex' blob into flash before starting the CPU\n"
 "\n"
 "  %s -f bootloader.hex -f payload.hex\n"
-"    Would load 2 firmware blobs into flash before starting the CPU\n",
-argv0, argv0, argv0, argv0);
+"    Would load 2 firmware blobs into flash before starting the CPU\n"
+"\n"
+"  afl-fuzz -i in -o out -- %s -c -f fw.hex --fork-at-marker READY --fuzz\n"
+"    Fuzzes the firmware's UART0 input once it prints 'READY'\n",
+argv0, DF_GDB_CHECKPOINT_DEFAULT, DF_GDB_HISTORY_DEFAULT,
+DF_BLACKBOX_DEFAULT, DF_FUZZ_DEFAULT_CYCLES, argv0, argv0, argv0, argv0);
 
 }
 
@@ -95,14 +358,23 @@ int
 main(int argc, char *argv[])
 {
     const char *argv0 = argv[0];
-    char *env;
+    char *env = NULL;
+    char *end;
     struct drumfish_cfg config;
     struct sigaction act;
+    struct timespec started;
+    uint64_t boards_usec;
+    uint64_t ptys_usec;
+    uint64_t first_usec;
     int state = cpu_Limbo;
+    int status;
     int opt;
     char **flash_file = NULL;
     size_t flash_file_len = 0;
     long  port;
+    long  fd;
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
 
     config.mac = NULL;
     config.pflash = NULL;
@@ -110,9 +382,403 @@ main(int argc, char *argv[])
     config.verbose = 0;
     config.gdb = 0;
     config.erase_pflash = 0;
+    config.pflash_cow = 0;
+    config.stats = NULL;
+    config.fork_cycle = 0;
+    config.fork_marker = NULL;
+    config.fuzz = 0;
+    config.fuzz_cycles = DF_FUZZ_DEFAULT_CYCLES;
+    config.fuzz_uart = '0';
+    config.fuzz_input = NULL;
+    config.trace = NULL;
+    config.trace_pc_lo = 0;
+    config.trace_pc_hi = ULONG_MAX;
+    config.trace_data_lo = 0;
+    config.trace_data_hi = ULONG_MAX;
+    config.trace_io_only = 0;
+    config.vcd = NULL;
+    config.log_file = NULL;
+    config.log_rotate = 0;
+    config.log_block = 0;
+    config.pcap = NULL;
+    config.medium_fd = -1;
+    config.eeprom = NULL;
+    config.eeprom_base = NULL;
+    config.erase_eeprom = 0;
+    config.pflash_sync = DF_PFLASH_SYNC_NEVER;
+    config.pflash_sync_ms = 0;
+    config.pflash_wear = NULL;
+    config.boards = 1;
+    config.run = 0;
+    config.run_uart = '0';
+    config.run_input = NULL;
+    config.run_expect = NULL;
+    config.run_expect_len = 0;
+    config.run_fail = NULL;
+    config.run_cycles = 0;
+    config.run_ms = 0;
+    config.blackbox = DF_BLACKBOX_DEFAULT;
+    config.blackbox_dir = NULL;
+    config.isr_stats = 0;
+    config.stack_alarm = 0;
+    config.gdb_checkpoint = DF_GDB_CHECKPOINT_DEFAULT;
+    config.gdb_history = DF_GDB_HISTORY_DEFAULT;
+    config.profile = NULL;
+    config.profile_len = 0;
+    config.profile_elf = NULL;
+    config.profile_out = NULL;
+    config.mem_audit = 0;
+    config.hugepages = 0;
 
-    while ((opt = getopt(argc, argv, "ef:p:m:vg:h")) != -1) {
+    while ((opt = getopt_long(argc, argv, "cef:p:m:s:vg:h", long_options,
+                    NULL)) != -1) {
         switch (opt) {
+            case OPT_FORK_CYCLE:
+                errno = 0;
+                config.fork_cycle = strtoull(optarg, NULL, 10);
+                if (errno != 0 || !config.fork_cycle) {
+                    fprintf(stderr, "Invalid fork cycle count '%s'\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_FORK_MARKER:
+                if (!optarg[0]) {
+                    fprintf(stderr, "The fork marker can't be empty.\n");
+                    exit(EXIT_FAILURE);
+                }
+                config.fork_marker = strdup(optarg);
+                if (!config.fork_marker) {
+                    fprintf(stderr, "Failed to allocate memory for "
+                            "fork marker.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_FUZZ:
+                config.fuzz = 1;
+                break;
+            case OPT_FUZZ_CYCLES:
+                errno = 0;
+                config.fuzz_cycles = strtoull(optarg, NULL, 10);
+                if (errno != 0 || !config.fuzz_cycles) {
+                    fprintf(stderr, "Invalid fuzz cycle budget '%s'\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_FUZZ_UART:
+                if ((optarg[0] != '0' && optarg[0] != '1') || optarg[1]) {
+                    fprintf(stderr, "Invalid UART '%s', must be 0 or 1\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+                config.fuzz_uart = optarg[0];
+                break;
+            case OPT_FUZZ_INPUT:
+                config.fuzz_input = strdup(optarg);
+                if (!config.fuzz_input) {
+                    fprintf(stderr, "Failed to allocate memory for "
+                            "fuzz input.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_TRACE:
+                config.trace = strdup(optarg);
+                if (!config.trace) {
+                    fprintf(stderr, "Failed to allocate memory for "
+                            "trace file.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_TRACE_PC:
+                errno = 0;
+                config.trace_pc_lo = strtoul(optarg, &end, 0);
+                if (errno == 0 && *end == '-')
+                    config.trace_pc_hi = strtoul(end + 1, &end, 0);
+                if (errno != 0 || *end ||
+                        config.trace_pc_lo > config.trace_pc_hi) {
+                    fprintf(stderr, "Invalid trace PC range '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_TRACE_DATA:
+                errno = 0;
+                config.trace_data_lo = strtoul(optarg, &end, 0);
+                if (errno == 0 && *end == '-')
+                    config.trace_data_hi = strtoul(end + 1, &end, 0);
+                if (errno != 0 || *end ||
+                        config.trace_data_lo > config.trace_data_hi) {
+                    fprintf(stderr, "Invalid trace data range '%s'\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_TRACE_IO_ONLY:
+                config.trace_io_only = 1;
+                break;
+            case OPT_VCD:
+                config.vcd = strdup(optarg);
+                if (!config.vcd) {
+                    fprintf(stderr, "Failed to allocate memory for "
+                            "VCD file.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_LOG_FILE:
+                config.log_file = strdup(optarg);
+                if (!config.log_file) {
+                    fprintf(stderr, "Failed to allocate memory for "
+                            "log file.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_LOG_ROTATE:
+                errno = 0;
+                config.log_rotate = strtoull(optarg, &end, 0);
+                if (errno != 0 || *end || !config.log_rotate) {
+                    fprintf(stderr, "Invalid log rotation size '%s'\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_LOG_BLOCK:
+                config.log_block = 1;
+                break;
+            case OPT_MEDIUM_FD:
+                errno = 0;
+                fd = strtol(optarg, &end, 10);
+                if (errno != 0 || *end || fd < 0 || fd > INT_MAX) {
+                    fprintf(stderr, "Invalid medium fd '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                config.medium_fd = fd;
+                break;
+            case OPT_EEPROM:
+                config.eeprom = strdup(optarg);
+                if (!config.eeprom) {
+                    fprintf(stderr, "Failed to allocate memory for "
+                            "EEPROM.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_EEPROM_BASE:
+                config.eeprom_base = strdup(optarg);
+                if (!config.eeprom_base) {
+                    fprintf(stderr, "Failed to allocate memory for "
+                            "EEPROM base.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_ERASE_EEPROM:
+                config.erase_eeprom = 1;
+                break;
+            case OPT_PFLASH_SYNC:
+                if (!strcmp(optarg, "never")) {
+                    config.pflash_sync = DF_PFLASH_SYNC_NEVER;
+                } else if (!strcmp(optarg, "erase")) {
+                    config.pflash_sync = DF_PFLASH_SYNC_ERASE;
+                } else {
+                    errno = 0;
+                    config.pflash_sync_ms = strtoul(optarg, &end, 10);
+                    if (errno != 0 || *end || !config.pflash_sync_ms) {
+                        fprintf(stderr, "Invalid pflash sync policy '%s'\n",
+                                optarg);
+                        exit(EXIT_FAILURE);
+                    }
+                    config.pflash_sync = DF_PFLASH_SYNC_PERIODIC;
+                }
+                break;
+            case OPT_PFLASH_WEAR:
+                config.pflash_wear = strdup(optarg);
+                if (!config.pflash_wear) {
+                    fprintf(stderr, "Failed to allocate memory for "
+                            "wear file.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_BOARDS:
+                errno = 0;
+                config.boards = strtol(optarg, &end, 10);
+                if (errno != 0 || *end || config.boards < 1 ||
+                        config.boards > MAX_BOARDS) {
+                    fprintf(stderr, "Invalid board count '%s', must be "
+                            "1 to %d\n", optarg, MAX_BOARDS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_RUN:
+                config.run = 1;
+                break;
+            case OPT_RUN_UART:
+                if ((optarg[0] != '0' && optarg[0] != '1') || optarg[1]) {
+                    fprintf(stderr, "Invalid UART '%s', must be 0 or 1\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+                config.run_uart = optarg[0];
+                break;
+            case OPT_RUN_INPUT:
+                config.run_input = strdup(optarg);
+                if (!config.run_input) {
+                    fprintf(stderr, "Failed to allocate memory for "
+                            "run input.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_EXPECT:
+                if (config.run_expect_len == MAX_EXPECT) {
+                    fprintf(stderr, "Unable to expect more than %d "
+                            "lines.\n", MAX_EXPECT);
+                    exit(EXIT_FAILURE);
+                }
+
+                config.run_expect = realloc(config.run_expect,
+                        sizeof(char *) * (config.run_expect_len + 1));
+                if (!config.run_expect) {
+                    fprintf(stderr, "Failed to allocate memory for "
+                            "expected output.\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                config.run_expect[config.run_expect_len] = strdup(optarg);
+                if (!config.run_expect[config.run_expect_len]) {
+                    fprintf(stderr, "Failed to allocate memory for "
+                            "expected output.\n");
+                    exit(EXIT_FAILURE);
+                }
+                config.run_expect_len++;
+                break;
+            case OPT_FAIL_ON:
+                config.run_fail = strdup(optarg);
+                if (!config.run_fail) {
+                    fprintf(stderr, "Failed to allocate memory for "
+                            "failure pattern.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_MAX_CYCLES:
+                errno = 0;
+                config.run_cycles = strtoull(optarg, &end, 10);
+                if (errno != 0 || *end || !config.run_cycles) {
+                    fprintf(stderr, "Invalid cycle budget '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_MAX_TIME:
+                errno = 0;
+                config.run_ms = strtoul(optarg, &end, 10);
+                if (errno != 0 || *end || !config.run_ms) {
+                    fprintf(stderr, "Invalid time budget '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_BLACKBOX:
+                errno = 0;
+                config.blackbox = strtoul(optarg, &end, 10);
+                if (errno != 0 || *end ||
+                        (config.blackbox & (config.blackbox - 1)) ||
+                        config.blackbox > (1UL << 24)) {
+                    fprintf(stderr, "Invalid post-mortem ring size '%s', "
+                            "must be a power of 2 up to %lu\n", optarg,
+                            1UL << 24);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_BLACKBOX_DIR:
+                config.blackbox_dir = strdup(optarg);
+                if (!config.blackbox_dir) {
+                    fprintf(stderr, "Failed to allocate memory for "
+                            "post-mortem directory.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_ISR_STATS:
+                config.isr_stats = 1;
+                break;
+            case OPT_STACK_ALARM:
+                errno = 0;
+                config.stack_alarm = strtoul(optarg, &end, 0);
+                if (errno != 0 || *end || !config.stack_alarm ||
+                        config.stack_alarm > 0xffff) {
+                    fprintf(stderr, "Invalid stack alarm address '%s'\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+                config.isr_stats = 1;
+                break;
+            case OPT_GDB_CHECKPOINT:
+                errno = 0;
+                config.gdb_checkpoint = strtoull(optarg, &end, 10);
+                if (errno != 0 || *end) {
+                    fprintf(stderr, "Invalid checkpoint interval '%s'\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_GDB_HISTORY:
+                errno = 0;
+                config.gdb_history = strtoul(optarg, &end, 10);
+                if (errno != 0 || *end || !config.gdb_history) {
+                    fprintf(stderr, "Invalid history budget '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_PROFILE:
+                if (config.profile_len == MAX_PROFILE) {
+                    fprintf(stderr, "Unable to profile more than %d "
+                            "functions.\n", MAX_PROFILE);
+                    exit(EXIT_FAILURE);
+                }
+
+                config.profile = realloc(config.profile,
+                        sizeof(char *) * (config.profile_len + 1));
+                if (!config.profile) {
+                    fprintf(stderr, "Failed to allocate memory for "
+                            "profiled functions.\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                config.profile[config.profile_len] = strdup(optarg);
+                if (!config.profile[config.profile_len]) {
+                    fprintf(stderr, "Failed to allocate memory for "
+                            "profiled functions.\n");
+                    exit(EXIT_FAILURE);
+                }
+                config.profile_len++;
+                break;
+            case OPT_PROFILE_ELF:
+                config.profile_elf = strdup(optarg);
+                if (!config.profile_elf) {
+                    fprintf(stderr, "Failed to allocate memory for "
+                            "profile ELF file.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_PROFILE_OUT:
+                config.profile_out = strdup(optarg);
+                if (!config.profile_out) {
+                    fprintf(stderr, "Failed to allocate memory for "
+                            "profile file.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_MEM_AUDIT:
+                config.mem_audit = 1;
+                break;
+            case OPT_HUGEPAGES:
+                config.hugepages = 1;
+                break;
+            case OPT_PCAP:
+                config.pcap = strdup(optarg);
+                if (!config.pcap) {
+                    fprintf(stderr, "Failed to allocate memory for "
+                            "capture file.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                config.pflash_cow = 1;
+                break;
             case 'e':
                 config.erase_pflash = 1;
                 break;
@@ -161,6 +827,14 @@ main(int argc, char *argv[])
                     exit(EXIT_FAILURE);
                 }
                 break;
+            case 's':
+                config.stats = strdup(optarg);
+                if (!config.stats) {
+                    fprintf(stderr, "Failed to allocate memory for "
+                            "stats file.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case 'v':
                config.verbose++;
                break;
@@ -194,24 +868,108 @@ main(int argc, char *argv[])
         }
     }
 
+    if (config.log_rotate && !config.log_file) {
+        fprintf(stderr, "--log-rotate needs --log-file\n");
+        exit(EXIT_FAILURE);
+    }
+
     /* Initialize our logging support */
-    df_log_init(&config);
+    if (df_log_init(&config))
+        exit(EXIT_FAILURE);
 
-    /* If the user did not override the default location of the
-     * programmable flash storage, then set the default
-     */
-    env = getenv("HOME");
-    if (!env || !env[0]) {
-        fprintf(stderr, "Unable to determine your HOME.\n");
+    if (!config.run && (config.run_input || config.run_expect_len ||
+                config.run_fail || config.run_cycles || config.run_ms)) {
+        fprintf(stderr, "--run-input, --expect, --fail-on, --max-cycles and "
+                "--max-time need --run\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!config.profile_len != !config.profile_elf ||
+            (config.profile_out && !config.profile_len)) {
+        fprintf(stderr, "--profile needs --profile-elf, and both are "
+                "needed by --profile-out\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.boards > 1 && (config.fork_cycle ||
+                config.fork_marker || config.trace || config.vcd ||
+                config.medium_fd >= 0 || config.stats)) {
+        fprintf(stderr, "--boards can't be combined with a fork server, "
+                "tracing, a radio medium or stats.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.run && (config.boards > 1 || config.gdb ||
+                config.fork_cycle || config.fork_marker)) {
+        fprintf(stderr, "--run can't be combined with --boards, gdbserver "
+                "or a fork server.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.gdb && (config.fork_cycle || config.fork_marker)) {
+        fprintf(stderr, "A fork server can't be run under gdbserver.\n");
         exit(EXIT_FAILURE);
     }
 
-    if (asprintf(&config.pflash, "%s%s", env, DEFAULT_PFLASH_PATH) < 0) {
-        fprintf(stderr, "Failed to allocate memory for pflash filename.\n");
+    if (config.fuzz && !config.fork_cycle && !config.fork_marker) {
+        fprintf(stderr, "Fuzzing needs --fork-at-cycle or --fork-at-marker "
+                "to know when the node has booted.\n");
         exit(EXIT_FAILURE);
     }
 
-    printf("Programmable Flash Storage: %s\n", config.pflash);
+    if ((config.trace || config.vcd) &&
+            (config.fork_cycle || config.fork_marker)) {
+        fprintf(stderr, "Tracing can't be combined with a fork server.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Forked nodes would all end up on the same link */
+    if (config.medium_fd >= 0 && (config.fork_cycle || config.fork_marker)) {
+        fprintf(stderr, "A radio medium can't be shared with a fork "
+                "server.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* If the user did not override the default location of the
+     * programmable flash storage, then set the default. Headless runs
+     * get a throwaway one so any number of them can run at once.
+     */
+    if (!config.pflash && !config.run) {
+        env = getenv("HOME");
+        if (!env || !env[0]) {
+            fprintf(stderr, "Unable to determine your HOME.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (asprintf(&config.pflash, "%s%s", env, DEFAULT_PFLASH_PATH) < 0) {
+            fprintf(stderr, "Failed to allocate memory for pflash "
+                    "filename.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* The EEPROM lives next to the pflash it belongs to */
+    if (!config.eeprom && config.pflash) {
+        if (env) {
+            if (asprintf(&config.eeprom, "%s%s", env,
+                        DEFAULT_EEPROM_PATH) < 0)
+                config.eeprom = NULL;
+        } else if (asprintf(&config.eeprom, "%s.eeprom",
+                    config.pflash) < 0) {
+            config.eeprom = NULL;
+        }
+
+        if (!config.eeprom) {
+            fprintf(stderr, "Failed to allocate memory for EEPROM "
+                    "filename.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (config.pflash) {
+        printf("Programmable Flash Storage: %s\n", config.pflash);
+        printf("EEPROM Storage: %s\n", config.eeprom);
+    }
 
     /* Handle the bare minimum signals */
     /* Yes I should use sigset_t here and use sigemptyset() */
@@ -230,23 +988,49 @@ main(int argc, char *argv[])
         fprintf(stderr, "Failed to install SIGTERM handler\n");
         exit(EXIT_FAILURE);
     }
+    if (sigaction(SIGUSR1, &act, NULL) < 0) {
+        fprintf(stderr, "Failed to install SIGUSR1 handler\n");
+        exit(EXIT_FAILURE);
+    }
 
-    avr = m128rfa1_create(&config);
-    if (!avr) {
-        fprintf(stderr, "Unable to initialize requested board.\n");
+    boards = calloc(config.boards, sizeof(*boards));
+    if (!boards) {
+        fprintf(stderr, "Failed to allocate memory for boards.\n");
         exit(EXIT_FAILURE);
     }
 
-    /* Flash in any requested firmware, while cleaning up our memory */
-    for (size_t i = 0; i < flash_file_len; i++) {
-        if (flash_load(flash_file[i], avr->flash, avr->flashend + 1)) {
-            fprintf(stderr, "Failed to load '%s' into flash.\n", flash_file[i]);
+    for (int b = 0; b < config.boards; b++) {
+        struct drumfish_cfg *cfg = &config;
+        avr_t *board_avr;
+
+        /* The first board is the one we were asked for */
+        if (b) {
+            cfg = df_board_config(&config, b);
+            if (!cfg)
+                exit(EXIT_FAILURE);
+            printf("Board %d: pflash %s, EEPROM %s\n", b, cfg->pflash,
+                    cfg->eeprom);
+        }
+
+        board_avr = m128rfa1_create(cfg, b);
+        if (!board_avr) {
+            fprintf(stderr, "Unable to initialize requested board.\n");
             exit(EXIT_FAILURE);
         }
-        /* Don't need this memory anymore */
-        free(flash_file[i]);
+        boards[boards_len++] = df_board_get(board_avr);
+
+        /* Flash in any requested firmware */
+        for (size_t i = 0; i < flash_file_len; i++) {
+            if (flash_load(flash_file[i], board_avr->flash,
+                        board_avr->flashend + 1)) {
+                fprintf(stderr, "Failed to load '%s' into flash.\n",
+                        flash_file[i]);
+                exit(EXIT_FAILURE);
+            }
+        }
     }
-    free(flash_file);
+    avr = boards[0]->avr;
+    boards_usec = startup_usec(&started);
 
     /* Ensure the instruction we're about to execute is legit */
     if (avr->flash[avr->pc] == 0xff) {
@@ -256,32 +1040,173 @@ main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    /* If the user wants to run the core with GDB server enabled,
-     * set that up.
+    if (df_board_start_uarts(&config, boards, boards_len)) {
+        fprintf(stderr, "Unable to start the UARTs.\n");
+        exit(EXIT_FAILURE);
+    }
+    ptys_usec = startup_usec(&started) - boards_usec;
+
+    if (config.mem_audit)
+        df_mem_report(boards, boards_len);
+
+    /* Don't need this memory anymore */
+    for (size_t i = 0; i < flash_file_len; i++)
+        free(flash_file[i]);
+    free(flash_file);
+
+    /* Every board waits for the debugger */
+    if (df_gdb_init(&config, boards, boards_len)) {
+        fprintf(stderr, "Unable to start the GDB server.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Nobody drives a headless run by hand, and the runner killing one
+     * that timed out would leave the socket behind.
      */
-    if (config.gdb) {
-        avr->gdb_port = config.gdb;
-        /* Normally starting the CPU should be in limbo, but the
-         * GDB code of simavr wants it to be stopped.
-         */
-        state = cpu_Stopped;
+    if (!config.run && df_ctl_init()) {
+        fprintf(stderr, "Unable to set up the control channel.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (df_stats_init(&config, avr)) {
+        fprintf(stderr, "Unable to set up run statistics.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (df_fork_init(&config, avr)) {
+        fprintf(stderr, "Unable to set up the fork server.\n");
+        exit(EXIT_FAILURE);
+    }
 
-        avr_gdb_init(avr);
+    if (df_trace_init(&config, avr)) {
+        fprintf(stderr, "Unable to set up tracing.\n");
+        exit(EXIT_FAILURE);
     }
 
-    /* Capture the current time to be used as when our CPU started */
-    df_log_start_time();
+    if (df_vcd_init(&config, avr)) {
+        fprintf(stderr, "Unable to set up VCD capture.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (df_medium_init(&config, avr)) {
+        fprintf(stderr, "Unable to connect to the radio medium.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (df_run_init(&config, avr)) {
+        fprintf(stderr, "Unable to set up the headless run.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (df_profile_init(&config, avr)) {
+        fprintf(stderr, "Unable to set up function timing.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Log messages are stamped with the time the CPU sees */
+    df_log_set_clock(df_clock_get(avr));
 
     df_log_msg(DF_LOG_INFO, "Booting CPU from 0x%x.\n", avr->pc);
 
+    first_usec = startup_usec(&started);
+    df_stats_set_startup(first_usec);
+    df_log_msg(DF_LOG_INFO, "First instruction %llu us after starting: "
+            "%llu us bringing up %zu boards, %llu us opening ptys\n",
+            (unsigned long long)first_usec,
+            (unsigned long long)boards_usec, boards_len,
+            (unsigned long long)ptys_usec);
+
+    if (df_vcd_start(avr)) {
+        fprintf(stderr, "Unable to start VCD capture.\n");
+        exit(EXIT_FAILURE);
+    }
+
     /* Our main event loop */
     for (;;) {
-        state = avr_run(avr);
-        if (state == cpu_Done || state == cpu_Crashed)
+        if (boards_len > 1 || config.gdb) {
+            state = df_board_run(boards, boards_len);
+            if (state == cpu_Done)
+                break;
+        } else {
+            state = avr_run(avr);
+            if (state == cpu_Done || state == cpu_Crashed)
+                break;
+        }
+
+        if (df_run_done)
             break;
+
+        if (df_ctl_pending)
+            df_ctl_process(avr);
+
+        if (df_medium_pending)
+            df_medium_process(avr);
+
+        if (df_gdb_pending)
+            df_gdb_process();
+
+        if (df_blackbox_pending) {
+            df_blackbox_pending = 0;
+            for (size_t i = 0; i < boards_len; i++)
+                df_blackbox_dump(boards[i]->avr, "SIGUSR1");
+        }
+
+        /* Nothing to run until the debugger lets go of something */
+        if (df_gdb_halted())
+            df_gdb_wait();
     }
 
+    /* Leave something behind to work out what went wrong */
+    for (size_t i = 0; i < boards_len; i++)
+        if (boards[i]->avr->state == cpu_Crashed)
+            df_blackbox_dump(boards[i]->avr, "crash");
+
+    for (size_t i = 0; i < boards_len; i++)
+        df_isr_report(boards[i]->avr);
+
+    status = df_run_result(avr, state);
+
+    df_run_stop();
+    df_profile_stop(avr);
+    df_gdb_stop();
+    df_medium_stop();
+    df_vcd_stop();
+    df_trace_stop();
+    df_stats_stop(avr);
+    df_ctl_stop();
+    df_log_set_clock(NULL);
+    for (size_t i = boards_len; i > 1; i--) {
+        struct drumfish_cfg *cfg = boards[i - 1]->config;
+
+        avr_terminate(boards[i - 1]->avr);
+        df_board_config_free(cfg);
+    }
     avr_terminate(avr);
+    free(boards);
+    df_log_stop();
 
     free(config.pflash);
+    free(config.eeprom);
+    free(config.eeprom_base);
+    free(config.pflash_wear);
+    free(config.blackbox_dir);
+    free(config.stats);
+    free(config.fork_marker);
+    free(config.fuzz_input);
+    free(config.trace);
+    free(config.vcd);
+    free(config.log_file);
+    free(config.pcap);
+    free(config.run_input);
+    for (int i = 0; i < config.run_expect_len; i++)
+        free(config.run_expect[i]);
+    free(config.run_expect);
+    free(config.run_fail);
+    for (int i = 0; i < config.profile_len; i++)
+        free(config.profile[i]);
+    free(config.profile);
+    free(config.profile_elf);
+    free(config.profile_out);
+
+    return status;
 }
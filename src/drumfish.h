@@ -30,6 +30,53 @@ struct drumfish_cfg {
     int verbose;
     short gdb;
     int erase_pflash;
+    int pflash_cow;
+    char *stats;
+    unsigned long long fork_cycle;
+    char *fork_marker;
+    int fuzz;
+    unsigned long long fuzz_cycles;
+    char fuzz_uart;
+    char *fuzz_input;
+    char *trace;
+    unsigned long trace_pc_lo;
+    unsigned long trace_pc_hi;
+    unsigned long trace_data_lo;
+    unsigned long trace_data_hi;
+    int trace_io_only;
+    char *vcd;
+    char *log_file;
+    unsigned long long log_rotate;
+    int log_block;
+    char *pcap;
+    int medium_fd;
+    char *eeprom;
+    char *eeprom_base;
+    int erase_eeprom;
+    int pflash_sync;
+    unsigned long pflash_sync_ms;
+    char *pflash_wear;
+    long boards;
+    int run;
+    char run_uart;
+    char *run_input;
+    char **run_expect;
+    int run_expect_len;
+    char *run_fail;
+    unsigned long long run_cycles;
+    unsigned long run_ms;
+    unsigned long blackbox;
+    char *blackbox_dir;
+    int isr_stats;
+    unsigned long stack_alarm;
+    unsigned long long gdb_checkpoint;
+    unsigned long gdb_history;
+    char **profile;
+    int profile_len;
+    char *profile_elf;
+    char *profile_out;
+    int mem_audit;
+    int hugepages;
 };
 
 #endif /* __DRUMFISH_H__ */
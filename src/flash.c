@@ -19,24 +19,41 @@
  *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <linux/fs.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <sim_elf.h>
 #include <sim_hex.h>
 
 #include "drumfish.h"
+#include "df_mem.h"
 #include "flash.h"
 
+/* One erased image that every node's fresh flash and EEPROM is mapped
+ * copy-on-write from, so nobody writes 0xFF over pages they may never
+ * touch and untouched ones are only in memory once.
+ */
+static struct {
+    int fd;
+    off_t len;
+} erased = {
+    .fd = -1,
+};
+
 static int
 flash_create_dir(const char *path)
 {
@@ -72,15 +89,124 @@ try_again:
     return 0;
 }
 
-uint8_t *
-flash_open_or_create(const struct drumfish_cfg *config, off_t len)
+/* Grows the erased image to at least 'len' bytes */
+static int
+flash_erased_fd(off_t len)
+{
+    uint8_t ones[4096];
+    off_t off;
+    size_t n;
+
+    if (erased.len >= len)
+        return erased.fd;
+
+    if (erased.fd == -1) {
+        erased.fd = memfd_create("drumfish-erased", MFD_CLOEXEC);
+        if (erased.fd == -1)
+            return -1;
+    }
+
+    if (ftruncate(erased.fd, len))
+        return -1;
+
+    memset(ones, 0xFF, sizeof(ones));
+    for (off = erased.len; off < len; off += n) {
+        n = len - off < (off_t)sizeof(ones) ? (size_t)(len - off) :
+            sizeof(ones);
+        if (pwrite(erased.fd, ones, n, off) != (ssize_t)n)
+            return -1;
+    }
+    erased.len = len;
+
+    return erased.fd;
+}
+
+/* Erased memory that only lives as long as we do */
+static uint8_t *
+flash_open_anon(off_t len)
+{
+    uint8_t *buf;
+    int fd;
+
+    /* Next to the rest of the board with --hugepages, where it has to
+     * be erased by hand.
+     */
+    buf = df_mem_arena_alloc(len);
+    if (buf) {
+        memset(buf, 0xFF, len);
+        return buf;
+    }
+
+    fd = flash_erased_fd(len);
+    if (fd != -1) {
+        buf = mmap(0, len, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (buf != MAP_FAILED)
+            return buf;
+    }
+
+    buf = mmap(0, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        fprintf(stderr, "Failed to allocate %zu bytes of flash: %s\n",
+                len, strerror(errno));
+        return NULL;
+    }
+    memset(buf, 0xFF, len);
+
+    return buf;
+}
+
+static uint8_t *
+flash_open_cow(const char *file, off_t len, int erase)
+{
+    int fd;
+    struct stat st;
+    uint8_t *buf;
+
+    fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Unable to open '%s': %s\n", file, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st)) {
+        fprintf(stderr, "Unable to get file info for '%s': %s\n",
+                file, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    /* We can't grow a file we aren't allowed to write */
+    if (st.st_size < len) {
+        fprintf(stderr, "The flash image '%s' is smaller than the "
+                "required %zu bytes.\n", file, len);
+        close(fd);
+        return NULL;
+    }
+
+    /* Nothing of the image would survive */
+    if (erase) {
+        close(fd);
+        return flash_open_anon(len);
+    }
+
+    buf = mmap(0, len, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+        fprintf(stderr, "Failed to map '%s': %s\n", file, strerror(errno));
+        return NULL;
+    }
+
+    return buf;
+}
+
+static uint8_t *
+flash_open_file(const char *file, off_t len, int erase)
 {
     int fd = -1;
     struct stat st;
     int ret;
-    int must_ff = config->erase_pflash;
+    int must_ff = erase;
     uint8_t *buf;
-    const char *file = config->pflash;
 
 try_again:
     fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
@@ -149,6 +275,154 @@ err:
     return NULL;
 }
 
+uint8_t *
+flash_open_or_create(const struct drumfish_cfg *config, off_t len)
+{
+    if (!config->pflash)
+        return flash_open_anon(len);
+
+    /* A copy-on-write pflash is a shared, read-only image. Every node
+     * mapping it shares the page cache and nothing is ever written back.
+     */
+    if (config->pflash_cow)
+        return flash_open_cow(config->pflash, len, config->erase_pflash);
+
+    return flash_open_file(config->pflash, len, config->erase_pflash);
+}
+
+/* Starts a node's EEPROM off as a copy of 'base', sharing its blocks
+ * where the file system allows it.
+ */
+static int
+flash_clone(const char *base, const char *file)
+{
+    char buf[4096];
+    ssize_t len;
+    int in;
+    int out;
+
+    in = open(base, O_RDONLY | O_CLOEXEC);
+    if (in == -1) {
+        fprintf(stderr, "Unable to open '%s': %s\n", base, strerror(errno));
+        return -1;
+    }
+
+    out = open(file, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+            S_IRUSR | S_IWUSR | S_IRGRP);
+    if (out == -1 && errno == ENOENT && !flash_create_dir(file))
+        out = open(file, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                S_IRUSR | S_IWUSR | S_IRGRP);
+    if (out == -1) {
+        fprintf(stderr, "Unable to create '%s': %s\n", file, strerror(errno));
+        close(in);
+        return -1;
+    }
+
+    if (ioctl(out, FICLONE, in)) {
+        while ((len = read(in, buf, sizeof(buf))) > 0) {
+            if (write(out, buf, len) != len) {
+                len = -1;
+                break;
+            }
+        }
+
+        if (len < 0) {
+            fprintf(stderr, "Unable to copy '%s' to '%s': %s\n",
+                    base, file, strerror(errno));
+            close(in);
+            close(out);
+            unlink(file);
+            return -1;
+        }
+    }
+
+    close(in);
+    close(out);
+
+    return 0;
+}
+
+uint8_t *
+flash_open_eeprom(const struct drumfish_cfg *config, off_t len)
+{
+    const char *file = config->eeprom;
+
+    /* Nowhere to keep it, but it can still start off as a copy */
+    if (!file) {
+        if (config->eeprom_base)
+            return flash_open_cow(config->eeprom_base, len,
+                    config->erase_eeprom);
+        return flash_open_anon(len);
+    }
+
+    if (config->eeprom_base && access(file, F_OK) &&
+            flash_clone(config->eeprom_base, file))
+        return NULL;
+
+    /* Nodes sharing a pflash image would share its EEPROM as well */
+    if (config->pflash_cow) {
+        if (!access(file, F_OK))
+            return flash_open_cow(file, len, config->erase_eeprom);
+
+        return flash_open_anon(len);
+    }
+
+    return flash_open_file(file, len, config->erase_eeprom);
+}
+
+static int
+flash_is_elf(const char *file)
+{
+    FILE *f;
+    char magic[4];
+    int ret = 0;
+
+    f = fopen(file, "rb");
+    if (!f)
+        return 0;
+
+    if (fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+            !memcmp(magic, "\177ELF", sizeof(magic)))
+        ret = 1;
+
+    fclose(f);
+
+    return ret;
+}
+
+static int
+flash_load_elf(const char *file, uint8_t *start, size_t len)
+{
+    elf_firmware_t fw;
+    int retval = -1;
+
+    memset(&fw, 0, sizeof(fw));
+
+    if (elf_read_firmware(file, &fw)) {
+        fprintf(stderr, "Unable to read ELF firmware '%s'\n", file);
+        return -1;
+    }
+
+    if (fw.flashbase + fw.flashsize > len) {
+        fprintf(stderr, "Firmware file would exceed max size of flash. "
+                "Max size: %zu. Firmware baseaddr: %04x, size: %u\n",
+                len, fw.flashbase, fw.flashsize);
+        goto cleanup;
+    }
+
+    memcpy(start + fw.flashbase, fw.flash, fw.flashsize);
+    printf("Loading '%s' into flash at %04x, size %u\n",
+            file, fw.flashbase, fw.flashsize);
+
+    retval = 0;
+
+cleanup:
+    free(fw.flash);
+    free(fw.eeprom);
+
+    return retval;
+}
+
 int
 flash_load(const char *file, uint8_t *start, size_t len)
 {
@@ -157,7 +431,14 @@ flash_load(const char *file, uint8_t *start, size_t len)
     int i;
     int retval = -1;
 
+    if (flash_is_elf(file))
+        return flash_load_elf(file, start, len);
+
     items = read_ihex_chunks(file, &chunks);
+    if (items < 0) {
+        fprintf(stderr, "Unable to read firmware '%s'\n", file);
+        return -1;
+    }
 
     for (i = 0; i < items; i++) {
         if (chunks[i].baseaddr + chunks[i].size > len) {
@@ -184,12 +465,34 @@ cleanup:
 }
 
 
+uint8_t *
+flash_make_private(uint8_t *flash, size_t len)
+{
+    uint8_t *buf;
+
+    buf = mmap(0, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        fprintf(stderr, "Failed to allocate private flash: %s\n",
+                strerror(errno));
+        return NULL;
+    }
+
+    memcpy(buf, flash, len);
+    flash_close(flash, len);
+
+    return buf;
+}
+
 int
 flash_close(uint8_t *flash, size_t len)
 {
     if (!flash)
         return -1;
 
+    /* The arena goes when we do */
+    if (df_mem_arena_owns(flash))
+        return 0;
+
     if (munmap(flash, len)) {
         fprintf(stderr, "Unable to cleanly close flash memory.\n");
         return -1;
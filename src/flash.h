@@ -26,8 +26,14 @@ struct drumfish_cfg;
 
 uint8_t * flash_open_or_create(const struct drumfish_cfg *config, off_t len);
 
+/* The EEPROM's backing file, mapped just like pflash */
+uint8_t *flash_open_eeprom(const struct drumfish_cfg *config, off_t len);
+
 int flash_load(const char *file, uint8_t *start, size_t len);
 
+/* Swaps a flash mapping for an anonymous private copy of it */
+uint8_t *flash_make_private(uint8_t *flash, size_t len);
+
 int flash_close(uint8_t *flash, size_t len);
 
 #endif /* __FLASH_H__ */
@@ -0,0 +1,1505 @@
+/*
+ * fleet.c
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "df_medium.h"
+#include "df_stats.h"
+
+#define DEFAULT_STAGGER_MS 10
+#define DEFAULT_INTERVAL 5
+
+/* Log-distance path loss at 2.4GHz, positions being in metres */
+#define MEDIUM_PL0_DB 40.0
+#define MEDIUM_PL_EXP 3.0
+#define MEDIUM_SHADOW_DB 4.0
+#define MEDIUM_NOISE_DBM -100.0
+
+/* How many of the latest transmissions may interfere with a new one */
+#define MEDIUM_RECENT 64
+
+/* 250kbit/s O-QPSK, with 6 octets of preamble, SFD and PHR */
+#define MEDIUM_OCTET_USEC 32
+#define MEDIUM_SHR_PHR_OCTETS 6
+
+/* Bit error rates are looked up from -10dB to 10dB SINR in 0.1dB steps */
+#define MEDIUM_BER_MIN_DB -10
+#define MEDIUM_BER_STEPS 201
+
+static double medium_ber[MEDIUM_BER_STEPS];
+
+struct fleet_node {
+    char *name;
+    char *mac;
+    char *pflash;
+    char **firmware;
+    size_t firmware_len;
+    int cow;
+    int cpu;
+
+    double pos[3];
+
+    pid_t pid;
+    int exited;
+    struct df_stats *stats;
+    uint64_t last_cycles;
+
+    /* Our end of the node's link to the radio medium */
+    int medium_fd;
+
+    /* Where we are in the medium's grid */
+    int32_t cell[3];
+    uint32_t cell_next;
+
+    /* Every node within radio range of us, kept up to date as nodes
+     * move so a transmission never has to look at the whole fleet.
+     * Alongside each is the link's gain, path loss and shadowing as a
+     * plain factor, kept as arrays of their own so the per frame loops
+     * run straight through them.
+     */
+    uint32_t *nbr;
+    float *nbr_gain;
+    uint32_t nbr_len;
+    uint32_t nbr_cap;
+};
+
+/* A recent transmission, as seen by its sender's clock */
+struct medium_tx {
+    uint64_t start;
+    uint64_t end;
+    uint32_t sender;
+    float mw;
+};
+
+/* Nodes are hashed into cubes one radio range wide, so everybody in
+ * range of a node is in its own cube or one of the 26 around it.
+ */
+struct fleet_medium {
+    double range;
+    uint32_t *bucket;
+    uint32_t bucket_mask;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int running;
+    int epfd;
+
+    /* Only touched by the medium thread */
+    struct medium_tx recent[MEDIUM_RECENT];
+    unsigned int recent_pos;
+    float *interf;
+    float *sinr;
+    uint32_t sinr_cap;
+    uint64_t rand;
+
+    unsigned long long frames;
+    unsigned long long delivered;
+    unsigned long long lost;
+    unsigned long long dropped;
+};
+
+struct fleet {
+    char *drumfish;
+    char *rundir;
+    long stagger_ms;
+    long interval;
+
+    struct fleet_node *node;
+    size_t node_len;
+
+    char **extra;
+    int extra_len;
+
+    int *cpus;
+    int cpus_len;
+
+    struct fleet_medium medium;
+
+    /* Commands read from stdin, only while there is a medium */
+    int cmd_fd;
+    char cmd[256];
+    size_t cmd_len;
+};
+
+static volatile sig_atomic_t stop = 0;
+
+/* execv() wants mutable strings */
+static char opt_pflash[] = "-p";
+static char opt_cow[] = "-c";
+static char opt_mac[] = "-m";
+static char opt_firmware[] = "-f";
+static char opt_stats[] = "-s";
+
+#define NODE_NONE UINT32_MAX
+
+static void
+handler(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static void
+usage(const char *argv0)
+{
+    fprintf(stderr,
+"Usage: %s [-b drumfish] [-d rundir] [-s ms] [-i secs] [-r range] "
+"manifest [-- drumfish args]\n"
+"\n"
+"  -b drumfish  - drumfish binary to run for each node\n"
+"  -d rundir    - Directory for each node's log and stats files\n"
+"  -s ms        - Delay between starting each node (default: %d)\n"
+"  -i secs      - How often to report fleet statistics (default: %d)\n"
+"  -r range     - Connect the nodes' radios, frames can reach every node\n"
+"                 within 'range' metres of the sender\n"
+"\n"
+"Each non-empty line of the manifest that isn't a '#' comment is one\n"
+"node: a name followed by any of these key=value settings.\n"
+"\n"
+"  mac=MAC        - Radio MAC address\n"
+"  pflash=FILE    - Programmable flash storage for the node\n"
+"  firmware=FILE  - Load FILE into flash, may be a comma separated list\n"
+"  cow=1          - Map pflash copy-on-write so nodes can share one image\n"
+"  cpu=N          - Pin the node to CPU N instead of picking one\n"
+"  pos=X,Y[,Z]    - Where the node's radio is, in metres\n"
+"\n"
+"With '-r', nodes can be moved by writing 'move NAME X,Y[,Z]' to stdin.\n"
+"\n"
+"Example:\n"
+"  node0 mac=00:11:22:00:9E:35 pflash=/srv/fw.dat cow=1\n"
+"  node1 mac=00:11:22:00:9E:36 pflash=/srv/fw.dat cow=1 cpu=3 pos=10,5\n",
+argv0, DEFAULT_STAGGER_MS, DEFAULT_INTERVAL);
+}
+
+static int
+fleet_add_firmware(struct fleet_node *n, const char *list)
+{
+    char *copy;
+    char *save = NULL;
+    char *file;
+    char **tmp;
+
+    copy = strdup(list);
+    if (!copy)
+        return -1;
+
+    for (file = strtok_r(copy, ",", &save); file;
+            file = strtok_r(NULL, ",", &save)) {
+        tmp = realloc(n->firmware, sizeof(char *) * (n->firmware_len + 1));
+        if (!tmp)
+            goto err;
+        n->firmware = tmp;
+
+        n->firmware[n->firmware_len] = strdup(file);
+        if (!n->firmware[n->firmware_len])
+            goto err;
+        n->firmware_len++;
+    }
+
+    free(copy);
+    return 0;
+
+err:
+    free(copy);
+    return -1;
+}
+
+static int
+fleet_parse_pos(double pos[3], const char *val)
+{
+    char *end;
+    int i;
+
+    pos[2] = 0;
+
+    for (i = 0; i < 3; i++) {
+        errno = 0;
+        pos[i] = strtod(val, &end);
+        if (errno || end == val || !isfinite(pos[i]))
+            return -1;
+
+        if (!*end)
+            return i ? 0 : -1;
+        if (*end != ',')
+            return -1;
+        val = end + 1;
+    }
+
+    return -1;
+}
+
+static int
+fleet_parse_node(struct fleet_node *n, char *line, const char *file,
+        int lineno)
+{
+    char *save = NULL;
+    char *tok;
+    char *val;
+    char *end;
+
+    memset(n, 0, sizeof(*n));
+    n->cpu = -1;
+    n->medium_fd = -1;
+
+    tok = strtok_r(line, " \t", &save);
+    n->name = strdup(tok);
+    if (!n->name)
+        return -1;
+
+    while ((tok = strtok_r(NULL, " \t", &save))) {
+        val = strchr(tok, '=');
+        if (!val) {
+            fprintf(stderr, "%s:%d: expected key=value, got '%s'\n",
+                    file, lineno, tok);
+            return -1;
+        }
+        *val++ = '\0';
+
+        if (!strcmp(tok, "mac")) {
+            n->mac = strdup(val);
+            if (!n->mac)
+                return -1;
+        } else if (!strcmp(tok, "pflash")) {
+            n->pflash = strdup(val);
+            if (!n->pflash)
+                return -1;
+        } else if (!strcmp(tok, "firmware")) {
+            if (fleet_add_firmware(n, val))
+                return -1;
+        } else if (!strcmp(tok, "cow")) {
+            n->cow = !!strtol(val, NULL, 10);
+        } else if (!strcmp(tok, "cpu")) {
+            errno = 0;
+            n->cpu = strtol(val, &end, 10);
+            if (errno || *end || n->cpu < 0 || n->cpu >= CPU_SETSIZE) {
+                fprintf(stderr, "%s:%d: invalid cpu '%s'\n",
+                        file, lineno, val);
+                return -1;
+            }
+        } else if (!strcmp(tok, "pos")) {
+            if (fleet_parse_pos(n->pos, val)) {
+                fprintf(stderr, "%s:%d: invalid pos '%s'\n",
+                        file, lineno, val);
+                return -1;
+            }
+        } else {
+            fprintf(stderr, "%s:%d: unknown setting '%s'\n",
+                    file, lineno, tok);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+fleet_parse(struct fleet *f, const char *file)
+{
+    FILE *fp;
+    char *line = NULL;
+    size_t line_sz = 0;
+    struct fleet_node *tmp;
+    char *p;
+    int lineno = 0;
+    int ret = -1;
+
+    fp = fopen(file, "r");
+    if (!fp) {
+        fprintf(stderr, "Unable to open manifest '%s': %s\n",
+                file, strerror(errno));
+        return -1;
+    }
+
+    while (getline(&line, &line_sz, fp) != -1) {
+        lineno++;
+
+        p = line + strspn(line, " \t");
+        p[strcspn(p, "#\r\n")] = '\0';
+        if (!p[strspn(p, " \t")])
+            continue;
+
+        tmp = realloc(f->node, sizeof(*tmp) * (f->node_len + 1));
+        if (!tmp) {
+            fprintf(stderr, "Failed to allocate memory for node list.\n");
+            goto cleanup;
+        }
+        f->node = tmp;
+
+        if (fleet_parse_node(&f->node[f->node_len], p, file, lineno))
+            goto cleanup;
+        f->node_len++;
+    }
+
+    if (!f->node_len) {
+        fprintf(stderr, "Manifest '%s' has no nodes in it.\n", file);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    free(line);
+    fclose(fp);
+
+    return ret;
+}
+
+static int
+fleet_get_cpus(struct fleet *f)
+{
+    cpu_set_t set;
+    int i;
+
+    if (sched_getaffinity(0, sizeof(set), &set)) {
+        fprintf(stderr, "Unable to get our CPU affinity: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    f->cpus = calloc(CPU_COUNT(&set), sizeof(int));
+    if (!f->cpus)
+        return -1;
+
+    for (i = 0; i < CPU_SETSIZE; i++)
+        if (CPU_ISSET(i, &set))
+            f->cpus[f->cpus_len++] = i;
+
+    return 0;
+}
+
+static struct df_stats *
+fleet_map_stats(const char *path)
+{
+    int fd;
+    struct df_stats *stats;
+
+    /* Create it up front so we can map it before the node starts */
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+            S_IRUSR | S_IWUSR | S_IRGRP);
+    if (fd == -1) {
+        fprintf(stderr, "Unable to create '%s': %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    if (ftruncate(fd, sizeof(*stats))) {
+        fprintf(stderr, "Unable to size '%s': %s\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    stats = mmap(NULL, sizeof(*stats), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (stats == MAP_FAILED) {
+        fprintf(stderr, "Failed to map '%s': %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    return stats;
+}
+
+static void
+medium_cell_of(const struct fleet *f, const double pos[3], int32_t cell[3])
+{
+    double c;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        c = floor(pos[i] / f->medium.range);
+        cell[i] = c;
+    }
+}
+
+static uint32_t *
+medium_bucket(const struct fleet *f, const int32_t cell[3])
+{
+    uint32_t h;
+
+    h = (uint32_t)cell[0] * 73856093u ^ (uint32_t)cell[1] * 19349663u ^
+        (uint32_t)cell[2] * 83492791u;
+
+    return &f->medium.bucket[h & f->medium.bucket_mask];
+}
+
+static void
+medium_grid_add(struct fleet *f, uint32_t idx)
+{
+    struct fleet_node *n = &f->node[idx];
+    uint32_t *head;
+
+    medium_cell_of(f, n->pos, n->cell);
+    head = medium_bucket(f, n->cell);
+    n->cell_next = *head;
+    *head = idx;
+}
+
+static void
+medium_grid_del(struct fleet *f, uint32_t idx)
+{
+    uint32_t *link = medium_bucket(f, f->node[idx].cell);
+
+    while (*link != idx)
+        link = &f->node[*link].cell_next;
+    *link = f->node[idx].cell_next;
+}
+
+static int
+medium_nbr_add(struct fleet_node *n, uint32_t idx, float gain)
+{
+    uint32_t *tmp;
+    float *tmp_gain;
+    uint32_t cap;
+
+    if (n->nbr_len == n->nbr_cap) {
+        cap = n->nbr_cap ? n->nbr_cap * 2 : 8;
+        tmp = realloc(n->nbr, sizeof(*tmp) * cap);
+        if (!tmp)
+            return -1;
+        n->nbr = tmp;
+
+        tmp_gain = realloc(n->nbr_gain, sizeof(*tmp_gain) * cap);
+        if (!tmp_gain)
+            return -1;
+        n->nbr_gain = tmp_gain;
+
+        n->nbr_cap = cap;
+    }
+
+    n->nbr[n->nbr_len] = idx;
+    n->nbr_gain[n->nbr_len] = gain;
+    n->nbr_len++;
+
+    return 0;
+}
+
+static void
+medium_nbr_del(struct fleet_node *n, uint32_t idx)
+{
+    uint32_t i;
+
+    for (i = 0; i < n->nbr_len; i++) {
+        if (n->nbr[i] == idx) {
+            n->nbr_len--;
+            n->nbr[i] = n->nbr[n->nbr_len];
+            n->nbr_gain[i] = n->nbr_gain[n->nbr_len];
+            return;
+        }
+    }
+}
+
+static uint64_t
+medium_mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+
+    return x;
+}
+
+/* The shadowing between two nodes, the same both ways and for as long
+ * as the fleet runs.
+ */
+static double
+medium_shadow(uint32_t a, uint32_t b)
+{
+    uint64_t h;
+    double u1;
+    double u2;
+
+    if (a > b) {
+        h = a;
+        a = b;
+        b = h;
+    }
+
+    h = medium_mix(((uint64_t)a << 32) | b);
+    u1 = ((h >> 11) + 1.0) / 9007199254740993.0;
+    u2 = (medium_mix(h) >> 11) / 9007199254740992.0;
+
+    return MEDIUM_SHADOW_DB * sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+static float
+medium_link_gain(uint32_t a, uint32_t b, double d2)
+{
+    double loss;
+
+    /* Nothing is gained by being closer than a metre */
+    loss = MEDIUM_PL0_DB + medium_shadow(a, b);
+    if (d2 > 1.0)
+        loss += 5.0 * MEDIUM_PL_EXP * log10(d2);
+
+    return pow(10.0, -loss / 10.0);
+}
+
+/* Finds everybody in range of 'idx'. With 'both' set they learn about
+ * us too, otherwise they are expected to find us on their own scan.
+ */
+static int
+medium_scan(struct fleet *f, uint32_t idx, int both)
+{
+    struct fleet_node *n = &f->node[idx];
+    struct fleet_node *o;
+    double r2 = f->medium.range * f->medium.range;
+    double d2;
+    double d;
+    float gain;
+    int32_t cell[3];
+    uint32_t j;
+    int dx, dy, dz;
+    int i;
+
+    for (dx = -1; dx <= 1; dx++)
+    for (dy = -1; dy <= 1; dy++)
+    for (dz = -1; dz <= 1; dz++) {
+        cell[0] = n->cell[0] + dx;
+        cell[1] = n->cell[1] + dy;
+        cell[2] = n->cell[2] + dz;
+
+        for (j = *medium_bucket(f, cell); j != NODE_NONE; j = o->cell_next) {
+            o = &f->node[j];
+            if (j == idx || memcmp(o->cell, cell, sizeof(cell)))
+                continue;
+
+            d2 = 0;
+            for (i = 0; i < 3; i++) {
+                d = o->pos[i] - n->pos[i];
+                d2 += d * d;
+            }
+            if (d2 > r2)
+                continue;
+
+            gain = medium_link_gain(idx, j, d2);
+            if (medium_nbr_add(n, j, gain) ||
+                    (both && medium_nbr_add(o, idx, gain)))
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+medium_build(struct fleet *f)
+{
+    unsigned long long links = 0;
+    uint32_t size = 16;
+    uint32_t i;
+
+    if (f->node_len >= NODE_NONE) {
+        fprintf(stderr, "Too many nodes for the radio medium.\n");
+        return -1;
+    }
+
+    while (size < f->node_len * 2)
+        size *= 2;
+
+    f->medium.bucket = malloc(sizeof(uint32_t) * size);
+    if (!f->medium.bucket) {
+        fprintf(stderr, "Failed to allocate memory for the radio medium.\n");
+        return -1;
+    }
+    memset(f->medium.bucket, 0xFF, sizeof(uint32_t) * size);
+    f->medium.bucket_mask = size - 1;
+
+    f->medium.interf = calloc(f->node_len, sizeof(float));
+    if (!f->medium.interf) {
+        fprintf(stderr, "Failed to allocate memory for the radio medium.\n");
+        return -1;
+    }
+
+    for (i = 0; i < f->node_len; i++)
+        medium_grid_add(f, i);
+
+    for (i = 0; i < f->node_len; i++) {
+        if (medium_scan(f, i, 0)) {
+            fprintf(stderr, "Failed to allocate memory for the radio "
+                    "medium.\n");
+            return -1;
+        }
+        links += f->node[i].nbr_len;
+    }
+
+    printf("Radio medium has %llu links between %zu nodes\n",
+            links / 2, f->node_len);
+
+    return 0;
+}
+
+/* Only the links of the node that moved and its old and new neighbors
+ * are touched.
+ */
+static int
+medium_move(struct fleet *f, uint32_t idx, const double pos[3])
+{
+    struct fleet_node *n = &f->node[idx];
+    uint32_t i;
+    int ret;
+
+    pthread_mutex_lock(&f->medium.lock);
+
+    for (i = 0; i < n->nbr_len; i++)
+        medium_nbr_del(&f->node[n->nbr[i]], idx);
+    n->nbr_len = 0;
+
+    medium_grid_del(f, idx);
+    memcpy(n->pos, pos, sizeof(n->pos));
+    medium_grid_add(f, idx);
+
+    ret = medium_scan(f, idx, 1);
+
+    pthread_mutex_unlock(&f->medium.lock);
+
+    return ret;
+}
+
+/* IEEE 802.15.4 O-QPSK bit error rate for each SINR step */
+static void
+medium_ber_init(void)
+{
+    double sinr;
+    double sum;
+    double binom;
+    int step;
+    int k;
+
+    for (step = 0; step < MEDIUM_BER_STEPS; step++) {
+        sinr = pow(10.0, (MEDIUM_BER_MIN_DB + step / 10.0) / 10.0);
+
+        sum = 0;
+        binom = 16;
+        for (k = 2; k <= 16; k++) {
+            binom = binom * (16 - k + 1) / k;
+            sum += (k & 1 ? -1 : 1) * binom *
+                exp(20.0 * sinr * (1.0 / k - 1.0));
+        }
+
+        medium_ber[step] = sum * 8.0 / 15.0 / 16.0;
+        if (medium_ber[step] < 0)
+            medium_ber[step] = 0;
+    }
+}
+
+static double
+medium_per(float sinr, uint8_t len)
+{
+    double db;
+    int step;
+
+    if (!(sinr > 0))
+        return 1.0;
+
+    db = 10.0 * log10(sinr);
+    if (db < MEDIUM_BER_MIN_DB)
+        return 1.0;
+
+    step = (db - MEDIUM_BER_MIN_DB) * 10.0;
+    if (step >= MEDIUM_BER_STEPS)
+        step = MEDIUM_BER_STEPS - 1;
+
+    /* The PHR and PSDU have to make it through */
+    return 1.0 - pow(1.0 - medium_ber[step], 8.0 * (len + 1));
+}
+
+static double
+medium_random(struct fleet_medium *m)
+{
+    m->rand ^= m->rand << 13;
+    m->rand ^= m->rand >> 7;
+    m->rand ^= m->rand << 17;
+
+    return (m->rand >> 11) / 9007199254740992.0;
+}
+
+/* Spreads a transmission's power over the nodes that hear it. Its
+ * sender is busy sending and hears nothing else at all.
+ */
+static void
+medium_interfere(struct fleet *f, const struct medium_tx *tx)
+{
+    const struct fleet_node *n = &f->node[tx->sender];
+    float *interf = f->medium.interf;
+    uint32_t i;
+
+    for (i = 0; i < n->nbr_len; i++)
+        interf[n->nbr[i]] += tx->mw * n->nbr_gain[i];
+    interf[tx->sender] = INFINITY;
+}
+
+static void
+medium_interfere_clear(struct fleet *f, const struct medium_tx *tx)
+{
+    const struct fleet_node *n = &f->node[tx->sender];
+    float *interf = f->medium.interf;
+    uint32_t i;
+
+    for (i = 0; i < n->nbr_len; i++)
+        interf[n->nbr[i]] = 0;
+    interf[tx->sender] = 0;
+}
+
+/* SINR at every neighbor of a sender. This is the hot loop of a dense
+ * mesh, so after gathering the interference it works on 8 links at a
+ * time with GCC's vector extensions, which become SSE or AVX as the
+ * target allows.
+ */
+typedef float medium_v8sf __attribute__((vector_size(32)));
+
+static void
+medium_sinr(float *restrict sinr, const uint32_t *restrict nbr,
+        const float *restrict gain, const float *restrict interf,
+        uint32_t len, float mw, float noise)
+{
+    medium_v8sf vmw = { mw, mw, mw, mw, mw, mw, mw, mw };
+    medium_v8sf vnoise = { noise, noise, noise, noise,
+        noise, noise, noise, noise };
+    medium_v8sf vgain;
+    medium_v8sf vsinr;
+    uint32_t i;
+
+    for (i = 0; i < len; i++)
+        sinr[i] = interf[nbr[i]];
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&vgain, gain + i, sizeof(vgain));
+        memcpy(&vsinr, sinr + i, sizeof(vsinr));
+        vsinr = vmw * vgain / (vnoise + vsinr);
+        memcpy(sinr + i, &vsinr, sizeof(vsinr));
+    }
+
+    for (; i < len; i++)
+        sinr[i] = mw * gain[i] / (noise + sinr[i]);
+}
+
+static int
+medium_deliver(struct fleet *f, uint32_t idx, struct df_medium_frame *frame,
+        size_t len)
+{
+    struct fleet_medium *m = &f->medium;
+    struct fleet_node *n = &f->node[idx];
+    struct fleet_node *o;
+    struct medium_tx *tx;
+    float noise = pow(10.0, MEDIUM_NOISE_DBM / 10.0);
+    float *tmp;
+    double per;
+    uint64_t airtime;
+    uint32_t overlap[MEDIUM_RECENT];
+    uint32_t overlap_len = 0;
+    uint32_t i;
+
+    if (n->nbr_len > m->sinr_cap) {
+        tmp = realloc(m->sinr, sizeof(*tmp) * n->nbr_len);
+        if (!tmp)
+            return -1;
+        m->sinr = tmp;
+        m->sinr_cap = n->nbr_len;
+    }
+
+    airtime = (MEDIUM_SHR_PHR_OCTETS + frame->len) * MEDIUM_OCTET_USEC;
+
+    tx = &m->recent[m->recent_pos++ % MEDIUM_RECENT];
+    tx->end = frame->usec;
+    tx->start = tx->end > airtime ? tx->end - airtime : 0;
+    tx->sender = idx;
+    tx->mw = pow(10.0, frame->dbm / 10.0);
+
+    /* Nodes don't share a clock, but they all started together and run
+     * at close to the same speed, so theirs will have to do.
+     */
+    for (i = 0; i < MEDIUM_RECENT; i++) {
+        if (&m->recent[i] == tx || !m->recent[i].end ||
+                m->recent[i].sender == idx ||
+                m->recent[i].end <= tx->start ||
+                m->recent[i].start >= tx->end)
+            continue;
+        medium_interfere(f, &m->recent[i]);
+        overlap[overlap_len++] = i;
+    }
+
+    medium_sinr(m->sinr, n->nbr, n->nbr_gain, m->interf, n->nbr_len,
+            tx->mw, noise);
+
+    for (i = 0; i < n->nbr_len; i++) {
+        o = &f->node[n->nbr[i]];
+        if (o->medium_fd < 0)
+            continue;
+
+        per = medium_per(m->sinr[i], frame->len);
+        if (medium_random(m) < per) {
+            m->lost++;
+            continue;
+        }
+
+        /* What the receiver's RSSI sees is everything on the air */
+        frame->dbm = lrint(10.0 * log10(tx->mw * n->nbr_gain[i] +
+                    m->interf[n->nbr[i]] + noise));
+        frame->lqi = lrint((1.0 - per) * 255.0);
+
+        /* A node that can't keep up misses the frame */
+        if (send(o->medium_fd, frame, len, MSG_DONTWAIT | MSG_NOSIGNAL) ==
+                (ssize_t)len)
+            m->delivered++;
+        else
+            m->dropped++;
+    }
+
+    /* Only what was added, clearing all of them costs more than SINR */
+    for (i = 0; i < overlap_len; i++)
+        medium_interfere_clear(f, &m->recent[overlap[i]]);
+
+    return 0;
+}
+
+static void
+medium_forward(struct fleet *f, uint32_t idx)
+{
+    struct df_medium_frame frame;
+    struct fleet_node *n = &f->node[idx];
+    ssize_t len;
+
+    for (;;) {
+        len = recv(n->medium_fd, &frame, sizeof(frame), MSG_DONTWAIT);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            return;
+
+        if ((size_t)len < DF_MEDIUM_HDR_LEN ||
+                (size_t)len != DF_MEDIUM_HDR_LEN + frame.len)
+            continue;
+
+        frame.sender = idx;
+
+        pthread_mutex_lock(&f->medium.lock);
+
+        f->medium.frames++;
+        if (medium_deliver(f, idx, &frame, len))
+            f->medium.dropped += n->nbr_len;
+
+        pthread_mutex_unlock(&f->medium.lock);
+    }
+}
+
+static void *
+medium_thread(void *param)
+{
+    struct fleet *f = param;
+    struct epoll_event ev[64];
+    struct fleet_node *n;
+    int count;
+    int i;
+
+    while (__atomic_load_n(&f->medium.running, __ATOMIC_RELAXED)) {
+        count = epoll_wait(f->medium.epfd, ev, 64, 100);
+
+        for (i = 0; i < count; i++) {
+            n = &f->node[ev[i].data.u32];
+
+            if (ev[i].events & EPOLLIN)
+                medium_forward(f, ev[i].data.u32);
+
+            if (ev[i].events & (EPOLLHUP | EPOLLERR)) {
+                pthread_mutex_lock(&f->medium.lock);
+                epoll_ctl(f->medium.epfd, EPOLL_CTL_DEL, n->medium_fd, NULL);
+                close(n->medium_fd);
+                n->medium_fd = -1;
+                pthread_mutex_unlock(&f->medium.lock);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static int
+medium_start(struct fleet *f)
+{
+    struct rlimit rl;
+    int ret;
+
+    if (medium_build(f))
+        return -1;
+
+    medium_ber_init();
+    f->medium.rand = 0x9e3779b97f4a7c15ULL;
+
+    /* Every node costs us a descriptor */
+    if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    f->medium.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (f->medium.epfd == -1) {
+        fprintf(stderr, "Unable to create the radio medium: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    pthread_mutex_init(&f->medium.lock, NULL);
+    f->medium.running = 1;
+
+    ret = pthread_create(&f->medium.thread, NULL, medium_thread, f);
+    if (ret) {
+        fprintf(stderr, "Failed to create radio medium thread: %s\n",
+                strerror(ret));
+        f->medium.running = 0;
+        close(f->medium.epfd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+medium_stop(struct fleet *f)
+{
+    if (!f->medium.running)
+        return;
+
+    __atomic_store_n(&f->medium.running, 0, __ATOMIC_RELAXED);
+    pthread_join(f->medium.thread, NULL);
+    close(f->medium.epfd);
+}
+
+/* Returns the node's end of its new link, or -1 */
+static int
+medium_connect(struct fleet *f, uint32_t idx)
+{
+    struct epoll_event ev;
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) {
+        fprintf(stderr, "Unable to create radio link for node '%s': %s\n",
+                f->node[idx].name, strerror(errno));
+        return -1;
+    }
+
+    pthread_mutex_lock(&f->medium.lock);
+    f->node[idx].medium_fd = sv[0];
+    pthread_mutex_unlock(&f->medium.lock);
+
+    ev.events = EPOLLIN;
+    ev.data.u32 = idx;
+    if (epoll_ctl(f->medium.epfd, EPOLL_CTL_ADD, sv[0], &ev)) {
+        fprintf(stderr, "Unable to watch radio link for node '%s': %s\n",
+                f->node[idx].name, strerror(errno));
+        pthread_mutex_lock(&f->medium.lock);
+        f->node[idx].medium_fd = -1;
+        pthread_mutex_unlock(&f->medium.lock);
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+
+    return sv[1];
+}
+
+static int
+fleet_spawn(struct fleet *f, struct fleet_node *n, size_t idx)
+{
+    char **argv;
+    char *stats_path = NULL;
+    char *log_path = NULL;
+    char *medium_arg = NULL;
+    cpu_set_t set;
+    size_t argc = 0;
+    size_t i;
+    int link_fd = -1;
+    int fd;
+    int ret = -1;
+
+    if (n->cpu < 0)
+        n->cpu = f->cpus[idx % f->cpus_len];
+
+    if (asprintf(&stats_path, "%s/%s.stats", f->rundir, n->name) < 0 ||
+            asprintf(&log_path, "%s/%s.log", f->rundir, n->name) < 0) {
+        fprintf(stderr, "Failed to allocate memory for node paths.\n");
+        goto cleanup;
+    }
+
+    n->stats = fleet_map_stats(stats_path);
+    if (!n->stats)
+        goto cleanup;
+
+    if (f->medium.running) {
+        link_fd = medium_connect(f, idx);
+        if (link_fd < 0)
+            goto cleanup;
+
+        if (asprintf(&medium_arg, "--medium-fd=%d", link_fd) < 0) {
+            fprintf(stderr, "Failed to allocate memory for node args.\n");
+            goto cleanup;
+        }
+    }
+
+    argv = calloc(11 + n->firmware_len * 2 + f->extra_len, sizeof(char *));
+    if (!argv)
+        goto cleanup;
+
+    argv[argc++] = f->drumfish;
+    if (n->pflash) {
+        argv[argc++] = opt_pflash;
+        argv[argc++] = n->pflash;
+    }
+    if (n->cow)
+        argv[argc++] = opt_cow;
+    if (n->mac) {
+        argv[argc++] = opt_mac;
+        argv[argc++] = n->mac;
+    }
+    for (i = 0; i < n->firmware_len; i++) {
+        argv[argc++] = opt_firmware;
+        argv[argc++] = n->firmware[i];
+    }
+    argv[argc++] = opt_stats;
+    argv[argc++] = stats_path;
+    if (medium_arg)
+        argv[argc++] = medium_arg;
+    for (i = 0; i < (size_t)f->extra_len; i++)
+        argv[argc++] = f->extra[i];
+    argv[argc] = NULL;
+
+    n->pid = fork();
+    if (n->pid == -1) {
+        fprintf(stderr, "Unable to start node '%s': %s\n",
+                n->name, strerror(errno));
+        free(argv);
+        goto cleanup;
+    }
+
+    if (n->pid == 0) {
+        /* Every thread the node creates inherits this */
+        CPU_ZERO(&set);
+        CPU_SET(n->cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set))
+            fprintf(stderr, "Unable to pin node '%s' to CPU %d: %s\n",
+                    n->name, n->cpu, strerror(errno));
+
+        fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (fd != -1) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+
+        /* The one descriptor the node is meant to keep */
+        if (link_fd != -1)
+            fcntl(link_fd, F_SETFD, 0);
+
+        execv(f->drumfish, argv);
+        fprintf(stderr, "Unable to run '%s': %s\n",
+                f->drumfish, strerror(errno));
+        _exit(127);
+    }
+
+    free(argv);
+    printf("Started node '%s' as pid %d on CPU %d\n", n->name, n->pid, n->cpu);
+    ret = 0;
+
+cleanup:
+    if (link_fd != -1)
+        close(link_fd);
+    free(stats_path);
+    free(log_path);
+    free(medium_arg);
+
+    return ret;
+}
+
+static void
+fleet_reap(struct fleet *f, int options)
+{
+    pid_t pid;
+    int status;
+    size_t i;
+
+    while ((pid = waitpid(-1, &status, options)) > 0) {
+        for (i = 0; i < f->node_len; i++) {
+            if (f->node[i].pid != pid)
+                continue;
+
+            f->node[i].exited = 1;
+            if (WIFEXITED(status))
+                printf("Node '%s' exited with status %d\n",
+                        f->node[i].name, WEXITSTATUS(status));
+            else if (WIFSIGNALED(status))
+                printf("Node '%s' killed by signal %d\n",
+                        f->node[i].name, WTERMSIG(status));
+        }
+    }
+}
+
+static size_t
+fleet_running(const struct fleet *f)
+{
+    size_t i;
+    size_t running = 0;
+
+    for (i = 0; i < f->node_len; i++)
+        if (f->node[i].pid > 0 && !f->node[i].exited)
+            running++;
+
+    return running;
+}
+
+static uint64_t
+fleet_now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void
+fleet_report(struct fleet *f, uint64_t elapsed_usec)
+{
+    struct fleet_node *n;
+    uint64_t cycles;
+    uint64_t total = 0;
+    uint64_t erases = 0;
+    uint64_t writes = 0;
+    uint64_t syncs = 0;
+    uint64_t startup;
+    uint64_t startup_sum = 0;
+    uint64_t startup_max = 0;
+    size_t started = 0;
+    size_t running;
+    size_t i;
+    double mhz;
+
+    for (i = 0; i < f->node_len; i++) {
+        n = &f->node[i];
+        if (!n->stats ||
+                __atomic_load_n(&n->stats->magic, __ATOMIC_ACQUIRE) !=
+                DF_STATS_MAGIC)
+            continue;
+
+        cycles = __atomic_load_n(&n->stats->cycles, __ATOMIC_ACQUIRE);
+        total += cycles - n->last_cycles;
+        n->last_cycles = cycles;
+
+        if (n->stats->version >= 2) {
+            erases += n->stats->flash_erases;
+            writes += n->stats->flash_writes;
+            syncs += n->stats->flash_syncs;
+        }
+
+        startup = n->stats->version >= 4 ? n->stats->startup_usec : 0;
+        if (startup) {
+            started++;
+            startup_sum += startup;
+            if (startup > startup_max)
+                startup_max = startup;
+        }
+    }
+
+    running = fleet_running(f);
+    mhz = elapsed_usec ? (double)total / elapsed_usec : 0;
+
+    printf("%zu/%zu nodes running, %.2f emulated MHz aggregate "
+            "(%.2f MHz per node)\n", running, f->node_len, mhz,
+            running ? mhz / running : 0);
+
+    if (started)
+        printf("Startup: first instruction %.1f ms in on average, %.1f ms "
+                "at worst (%zu nodes)\n", startup_sum / 1000.0 / started,
+                startup_max / 1000.0, started);
+
+    if (erases || writes)
+        printf("pflash: %llu page erases, %llu page writes, %llu syncs\n",
+                (unsigned long long)erases, (unsigned long long)writes,
+                (unsigned long long)syncs);
+
+    if (f->medium.running) {
+        pthread_mutex_lock(&f->medium.lock);
+        printf("Radio: %llu frames sent, %llu delivered, %llu lost in the "
+                "air, %llu dropped\n", f->medium.frames, f->medium.delivered,
+                f->medium.lost, f->medium.dropped);
+        pthread_mutex_unlock(&f->medium.lock);
+    }
+
+    fflush(stdout);
+}
+
+static void
+fleet_sleep_ms(long ms)
+{
+    struct timespec ts = {
+        .tv_sec = ms / 1000,
+        .tv_nsec = (ms % 1000) * 1000000L,
+    };
+
+    /* Signals cut this short, which is what we want */
+    nanosleep(&ts, NULL);
+}
+
+static void
+fleet_command(struct fleet *f, char *line)
+{
+    double pos[3];
+    char *save = NULL;
+    char *cmd;
+    char *name;
+    char *val;
+    size_t i;
+
+    cmd = strtok_r(line, " \t", &save);
+    if (!cmd)
+        return;
+
+    if (strcmp(cmd, "move")) {
+        printf("Unknown command '%s'\n", cmd);
+        return;
+    }
+
+    name = strtok_r(NULL, " \t", &save);
+    val = strtok_r(NULL, " \t", &save);
+    if (!name || !val || fleet_parse_pos(pos, val)) {
+        printf("Usage: move NAME X,Y[,Z]\n");
+        return;
+    }
+
+    for (i = 0; i < f->node_len; i++) {
+        if (strcmp(f->node[i].name, name))
+            continue;
+
+        if (medium_move(f, i, pos))
+            printf("Failed to move node '%s'\n", name);
+        else
+            printf("Node '%s' now has %u nodes in range\n", name,
+                    f->node[i].nbr_len);
+        return;
+    }
+
+    printf("No node named '%s'\n", name);
+}
+
+/* Sleeps for 'ms', handling any commands that come in meanwhile */
+static void
+fleet_wait(struct fleet *f, long ms)
+{
+    struct pollfd pfd;
+    uint64_t end;
+    uint64_t now;
+    ssize_t len;
+    char *nl;
+
+    if (f->cmd_fd < 0) {
+        fleet_sleep_ms(ms);
+        return;
+    }
+
+    end = fleet_now_usec() + ms * 1000ULL;
+    while (!stop && (now = fleet_now_usec()) < end) {
+        pfd.fd = f->cmd_fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, (end - now + 999) / 1000) <= 0)
+            continue;
+
+        len = read(f->cmd_fd, f->cmd + f->cmd_len,
+                sizeof(f->cmd) - 1 - f->cmd_len);
+        if (len <= 0) {
+            /* Nobody is going to tell us anything anymore */
+            f->cmd_fd = -1;
+            fleet_sleep_ms((end - now) / 1000);
+            return;
+        }
+        f->cmd_len += len;
+        f->cmd[f->cmd_len] = '\0';
+
+        while ((nl = strchr(f->cmd, '\n'))) {
+            *nl = '\0';
+            fleet_command(f, f->cmd);
+            f->cmd_len -= nl + 1 - f->cmd;
+            memmove(f->cmd, nl + 1, f->cmd_len + 1);
+        }
+
+        /* Throw away a line that's too long to ever be a command */
+        if (f->cmd_len == sizeof(f->cmd) - 1)
+            f->cmd_len = 0;
+
+        fflush(stdout);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *argv0 = argv[0];
+    struct fleet f;
+    struct sigaction act;
+    char exe[PATH_MAX];
+    ssize_t len;
+    uint64_t last;
+    uint64_t now;
+    size_t i;
+    int opt;
+
+    memset(&f, 0, sizeof(f));
+    f.stagger_ms = DEFAULT_STAGGER_MS;
+    f.interval = DEFAULT_INTERVAL;
+    f.cmd_fd = -1;
+
+    while ((opt = getopt(argc, argv, "b:d:s:i:r:h")) != -1) {
+        switch (opt) {
+            case 'b':
+                f.drumfish = strdup(optarg);
+                break;
+            case 'd':
+                f.rundir = strdup(optarg);
+                break;
+            case 's':
+                f.stagger_ms = strtol(optarg, NULL, 10);
+                break;
+            case 'i':
+                f.interval = strtol(optarg, NULL, 10);
+                if (f.interval < 1)
+                    f.interval = 1;
+                break;
+            case 'r':
+                f.medium.range = strtod(optarg, NULL);
+                if (!(f.medium.range > 0) || !isfinite(f.medium.range)) {
+                    fprintf(stderr, "Invalid radio range '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'h':
+                usage(argv0);
+                exit(EXIT_SUCCESS);
+                break;
+            default: /* '?' */
+                usage(argv0);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind >= argc) {
+        usage(argv0);
+        exit(EXIT_FAILURE);
+    }
+
+    if (fleet_parse(&f, argv[optind++]))
+        exit(EXIT_FAILURE);
+
+    /* Everything after the manifest goes to every node */
+    f.extra = argv + optind;
+    f.extra_len = argc - optind;
+
+    /* By default run the drumfish sitting next to us */
+    if (!f.drumfish) {
+        len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+        if (len < 0) {
+            fprintf(stderr, "Unable to find drumfish, use '-b'.\n");
+            exit(EXIT_FAILURE);
+        }
+        exe[len] = '\0';
+        if (asprintf(&f.drumfish, "%s/drumfish", dirname(exe)) < 0)
+            exit(EXIT_FAILURE);
+    }
+
+    if (!f.rundir &&
+            asprintf(&f.rundir, "/tmp/drumfish-fleet-%d", getpid()) < 0)
+        exit(EXIT_FAILURE);
+
+    if (mkdir(f.rundir, S_IRWXU | S_IRGRP | S_IXGRP) && errno != EEXIST) {
+        fprintf(stderr, "Unable to create '%s': %s\n",
+                f.rundir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (fleet_get_cpus(&f))
+        exit(EXIT_FAILURE);
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = handler;
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+
+    if (f.medium.range > 0) {
+        if (medium_start(&f))
+            exit(EXIT_FAILURE);
+        f.cmd_fd = STDIN_FILENO;
+    }
+
+    printf("Starting %zu nodes on %d CPUs, logs in %s\n",
+            f.node_len, f.cpus_len, f.rundir);
+
+    /* Stagger the start so thousands of nodes don't all hit the disk
+     * for their flash at the same moment.
+     */
+    for (i = 0; i < f.node_len && !stop; i++) {
+        if (fleet_spawn(&f, &f.node[i], i))
+            break;
+        if (f.stagger_ms > 0 && i + 1 < f.node_len)
+            fleet_sleep_ms(f.stagger_ms);
+    }
+
+    last = fleet_now_usec();
+    while (!stop && fleet_running(&f)) {
+        fleet_wait(&f, f.interval * 1000);
+        fleet_reap(&f, WNOHANG);
+
+        now = fleet_now_usec();
+        fleet_report(&f, now - last);
+        last = now;
+    }
+
+    /* Take everything down with us */
+    for (i = 0; i < f.node_len; i++)
+        if (f.node[i].pid > 0 && !f.node[i].exited)
+            kill(f.node[i].pid, SIGTERM);
+
+    fleet_reap(&f, 0);
+
+    medium_stop(&f);
+
+    return EXIT_SUCCESS;
+}
@@ -28,20 +28,50 @@
 #include <unistd.h>
 
 #include <sim_avr.h>
+#include <avr_eeprom.h>
 #include "uart_pty.h"
 
 #include "drumfish.h"
 #include "flash.h"
+#include "df_clock.h"
+#include "df_aes.h"
+#include "df_blackbox.h"
+#include "df_board.h"
 #include "df_cores.h"
+#include "df_isr.h"
+#include "df_mem.h"
+#include "df_pflash.h"
+#include "df_radio.h"
 
 #define PC_START 0x1f800
 
-uart_pty_t uart_pty[2];
+static avr_eeprom_t *
+m128rfa1_eeprom(avr_t *avr)
+{
+    avr_io_t *io;
+
+    for (io = avr->io_port; io; io = io->next)
+        if (!strcmp(io->kind, "eeprom"))
+            return (avr_eeprom_t *)io;
+
+    return NULL;
+}
 
 static void
 m128rfa1_init(avr_t *avr, void *data)
 {
-    struct drumfish_cfg *config = (struct drumfish_cfg *)data;
+    struct df_board *board = (struct df_board *)data;
+    struct drumfish_cfg *config = board->config;
+    uint8_t *buf;
+
+    /* simavr's SRAM is malloc()'d, with --hugepages it joins the rest
+     * of the board in the arena.
+     */
+    buf = df_mem_arena_alloc(avr->ramend + 1);
+    if (buf) {
+        free(avr->data);
+        avr->data = buf;
+    }
 
     if (avr->flash)
         free(avr->flash);
@@ -49,22 +79,165 @@ m128rfa1_init(avr_t *avr, void *data)
     avr->flash = flash_open_or_create(config, avr->flashend + 1);
 }
 
+/* simavr gives us a malloc()'d EEPROM that forgets everything when we
+ * exit, so swap it for a mapping of our own. The EEPROM only exists
+ * once avr_init() has run the core's own init, after ours.
+ */
+static int
+m128rfa1_open_eeprom(struct drumfish_cfg *config, avr_t *avr)
+{
+    avr_eeprom_t *ee;
+    uint8_t *buf;
+
+    ee = m128rfa1_eeprom(avr);
+    if (!ee) {
+        fprintf(stderr, "The core has no EEPROM to back.\n");
+        return -1;
+    }
+
+    buf = flash_open_eeprom(config, ee->size);
+    if (!buf) {
+        fprintf(stderr, "Failed to initialize EEPROM correctly.\n");
+        return -1;
+    }
+
+    free(ee->eeprom);
+    ee->eeprom = buf;
+
+    return 0;
+}
+
 static void
 m128rfa1_deinit(avr_t *avr, void *data)
 {
-    (void)data;
+    struct df_board *board = (struct df_board *)data;
+    avr_eeprom_t *ee;
+
+    df_pflash_stop(avr);
+    df_aes_stop(avr);
+    df_radio_stop(avr);
+    df_clock_free(df_clock_get(avr));
 
-    uart_pty_stop(&uart_pty[0]);
-    uart_pty_stop(&uart_pty[1]);
+    uart_pty_stop(&board->uart[0]);
+    uart_pty_stop(&board->uart[1]);
 
     flash_close(avr->flash, avr->flashend + 1);
     avr->flash = NULL;
+
+    /* Keep simavr from free()ing our mapping */
+    ee = m128rfa1_eeprom(avr);
+    if (ee) {
+        flash_close(ee->eeprom, ee->size);
+        ee->eeprom = NULL;
+    }
+
+    /* Nor the arena */
+    if (df_mem_arena_owns(avr->data))
+        avr->data = NULL;
+
+    /* simavr frees our peripherals through their dealloc hooks */
+    avr->special_data = NULL;
+    df_mem_board_free(board);
+}
+
+void
+m128rfa1_reset(avr_t *avr)
+{
+    /* Asked for, so nothing worth a post-mortem */
+    df_blackbox_expect_reset(avr);
+    avr_reset(avr);
+
+    /* avr_reset() leaves us at the reset vector but our fuses always
+     * boot us through the bootloader.
+     */
+    avr->pc = PC_START;
+}
+
+int
+m128rfa1_make_private(avr_t *avr)
+{
+    avr_eeprom_t *ee;
+    uint8_t *buf;
+
+    buf = flash_make_private(avr->flash, avr->flashend + 1);
+    if (!buf)
+        return -1;
+    avr->flash = buf;
+
+    if (df_pflash_make_private(avr))
+        return -1;
+
+    ee = m128rfa1_eeprom(avr);
+    if (!ee)
+        return 0;
+
+    buf = flash_make_private(ee->eeprom, ee->size);
+    if (!buf)
+        return -1;
+    ee->eeprom = buf;
+
+    return 0;
+}
+
+int
+m128rfa1_after_fork(avr_t *avr)
+{
+    struct df_board *board = df_board_get(avr);
+
+    if (uart_pty_reopen(&board->uart[0])) {
+        fprintf(stderr, "Unable to restart UART0.\n");
+        return -1;
+    }
+
+    if (uart_pty_reopen(&board->uart[1])) {
+        fprintf(stderr, "Unable to restart UART1.\n");
+        return -1;
+    }
+
+    if (df_radio_after_fork(avr)) {
+        fprintf(stderr, "Unable to restart the radio.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+uart_pty_t *
+m128rfa1_uart(avr_t *avr, char uart)
+{
+    if (uart < '0' || uart > '1')
+        return NULL;
+
+    return &df_board_get(avr)->uart[uart - '0'];
+}
+
+/* The memories are mapped rather than on the heap, they're charged by
+ * size. simavr's SRAM was counted as core unless it moved to the arena.
+ */
+static void
+m128rfa1_count_mem(struct df_board *board)
+{
+    avr_t *avr = board->avr;
+    avr_eeprom_t *ee = m128rfa1_eeprom(avr);
+    size_t sram = avr->ramend + 1;
+
+    board->mem[DF_MEM_SRAM] = sram;
+    if (!df_mem_arena_owns(avr->data))
+        board->mem[DF_MEM_CORE] -= sram < board->mem[DF_MEM_CORE] ?
+            sram : board->mem[DF_MEM_CORE];
+
+    board->mem[DF_MEM_FLASH] = avr->flashend + 1;
+    board->mem[DF_MEM_EEPROM] = ee ? ee->size : 0;
 }
 
 avr_t *
-m128rfa1_create(struct drumfish_cfg *config)
+m128rfa1_create(struct drumfish_cfg *config, int index)
 {
+    struct df_board *board;
     avr_t *avr;
+    size_t mark;
+
+    mark = df_mem_mark(config);
 
     avr = avr_make_mcu_by_name("atmega128rfa1");
     if (!avr) {
@@ -72,10 +245,20 @@ m128rfa1_create(struct drumfish_cfg *config)
         return NULL;
     }
 
+    if (df_mem_arena_init(config, avr))
+        return NULL;
+
+    board = df_mem_board_new(config);
+    if (!board)
+        return NULL;
+    board->avr = avr;
+    board->config = config;
+    board->index = index;
+
     /* Setup any additional init/deinit routines */
     avr->special_init = m128rfa1_init;
     avr->special_deinit = m128rfa1_deinit;
-    avr->special_data = config;
+    avr->special_data = board;
 
     /* Initialize our AVR */
     avr_init(avr);
@@ -89,30 +272,72 @@ m128rfa1_create(struct drumfish_cfg *config)
     avr->fuse[2] = 0xFE; // extended
     //avr->lockbits = 0xEF; // lock bits
 
-    /* Check to see if we initialized our flash */
+    /* Check to see if we initialized our flash, then the EEPROM */
     if (!avr->flash) {
         fprintf(stderr, "Failed to initialize flash correctly.\n");
         return NULL;
     }
 
+    if (m128rfa1_open_eeprom(config, avr))
+        return NULL;
+    df_mem_count(board, DF_MEM_CORE, &mark);
+    m128rfa1_count_mem(board);
+
+    /* Everything on the board keeps time with this */
+    if (!df_clock_new(avr))
+        return NULL;
+    df_mem_count(board, DF_MEM_CLOCK, &mark);
+
     /* Based on fuse values, we'll always want to boot from the bootloader
      * which will always start at 0x1f800.
      */
     avr->pc = PC_START;
     avr->codeend = avr->flashend;
 
-    /* Setup our UARTs */
-    if (uart_pty_init(avr, &uart_pty[0], '0')) {
+    /* Setup our UARTs, their ptys come once the whole batch is here */
+    if (uart_pty_init_headless(avr, &board->uart[0], index, '0')) {
         fprintf(stderr, "Unable to start UART0.\n");
         return NULL;
     }
-    uart_pty_connect(&uart_pty[0]);
+    uart_pty_connect(&board->uart[0]);
 
-    if (uart_pty_init(avr, &uart_pty[1], '1')) {
+    if (uart_pty_init_headless(avr, &board->uart[1], index, '1')) {
         fprintf(stderr, "Unable to start UART1.\n");
         return NULL;
     }
-    uart_pty_connect(&uart_pty[1]);
+    uart_pty_connect(&board->uart[1]);
+    df_mem_count(board, DF_MEM_UART, &mark);
+
+    if (df_radio_init(config, avr)) {
+        fprintf(stderr, "Unable to start the radio.\n");
+        return NULL;
+    }
+    df_mem_count(board, DF_MEM_RADIO, &mark);
+
+    if (df_aes_init(avr)) {
+        fprintf(stderr, "Unable to start the AES engine.\n");
+        return NULL;
+    }
+    df_mem_count(board, DF_MEM_AES, &mark);
+
+    if (df_pflash_init(config, avr)) {
+        fprintf(stderr, "Unable to track pflash writes.\n");
+        return NULL;
+    }
+    df_mem_count(board, DF_MEM_PFLASH, &mark);
+
+    if (df_isr_init(config, avr)) {
+        fprintf(stderr, "Unable to set up interrupt timing.\n");
+        return NULL;
+    }
+    df_mem_count(board, DF_MEM_ISR, &mark);
+
+    /* Last, so every IO register and vector it listens to exists */
+    if (df_blackbox_init(config, avr)) {
+        fprintf(stderr, "Unable to set up the post-mortem ring.\n");
+        return NULL;
+    }
+    df_mem_count(board, DF_MEM_BLACKBOX, &mark);
 
     return avr;
 }
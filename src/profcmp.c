@@ -0,0 +1,266 @@
+/*
+ * profcmp.c
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "df_profile.h"
+
+/* Columns after the name and call count, in file order */
+enum {
+    PROF_INCL_MIN = 0,
+    PROF_INCL_MEDIAN,
+    PROF_INCL_MAX,
+    PROF_EXCL_MIN,
+    PROF_EXCL_MEDIAN,
+    PROF_EXCL_MAX,
+    PROF_METRICS,
+};
+
+/* Exit codes, so CI can tell a slower build from a broken comparison */
+#define PROFCMP_OK 0
+#define PROFCMP_SLOWER 1
+#define PROFCMP_ERROR 2
+
+static const char *metric_names[PROF_METRICS] = {
+    "incl_min", "incl_median", "incl_max",
+    "excl_min", "excl_median", "excl_max",
+};
+
+struct prof_entry {
+    char name[256];
+    unsigned long long calls;
+    unsigned long long v[PROF_METRICS];
+};
+
+struct prof_file {
+    struct prof_entry *e;
+    size_t len;
+};
+
+static void
+usage(const char *argv0)
+{
+    fprintf(stderr,
+"Usage: %s [-m metric] [-t percent] [-c cycles] old new\n"
+"\n"
+"  -m metric    - What to compare: incl_min, incl_median (default),\n"
+"                 incl_max, excl_min, excl_median or excl_max\n"
+"  -t percent   - How much slower a function may get (default 5)\n"
+"  -c cycles    - Ignore changes smaller than this many cycles\n"
+"\n"
+"Compares two profiles written by 'drumfish --profile-out', one line\n"
+"per function. Functions only in one of them, or never called in\n"
+"either, are listed but never fail the comparison.\n"
+"\n"
+"Exits 0 if nothing got slower, 1 if something did and 2 on errors.\n",
+argv0);
+}
+
+static int
+prof_cmp(const void *a, const void *b)
+{
+    const struct prof_entry *ea = a;
+    const struct prof_entry *eb = b;
+
+    return strcmp(ea->name, eb->name);
+}
+
+static int
+prof_read(const char *path, struct prof_file *pf)
+{
+    struct prof_entry e;
+    char line[1024];
+    size_t alloc = 0;
+    int lineno = 1;
+    void *p;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Unable to open '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (!fgets(line, sizeof(line), f) ||
+            strncmp(line, DF_PROFILE_HEADER "\n",
+                sizeof(DF_PROFILE_HEADER))) {
+        fprintf(stderr, "'%s' is not a drumfish profile.\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+
+        if (sscanf(line, "%255s %llu %llu %llu %llu %llu %llu %llu",
+                    e.name, &e.calls, &e.v[0], &e.v[1], &e.v[2], &e.v[3],
+                    &e.v[4], &e.v[5]) != 8) {
+            fprintf(stderr, "%s:%d: malformed line\n", path, lineno);
+            fclose(f);
+            return -1;
+        }
+
+        if (pf->len == alloc) {
+            alloc = alloc ? alloc * 2 : 64;
+            p = realloc(pf->e, alloc * sizeof(*pf->e));
+            if (!p) {
+                fprintf(stderr, "Failed to allocate memory for '%s'.\n",
+                        path);
+                fclose(f);
+                return -1;
+            }
+            pf->e = p;
+        }
+        pf->e[pf->len++] = e;
+    }
+
+    fclose(f);
+
+    qsort(pf->e, pf->len, sizeof(*pf->e), prof_cmp);
+
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *argv0 = argv[0];
+    struct prof_file old = { NULL, 0 };
+    struct prof_file new = { NULL, 0 };
+    const struct prof_entry *o, *n;
+    unsigned long long ov, nv;
+    unsigned long long min_cycles = 0;
+    double percent = 5.0;
+    double delta;
+    int metric = PROF_INCL_MEDIAN;
+    size_t slower = 0;
+    size_t i, j;
+    char *end;
+    int cmp;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:t:c:h")) != -1) {
+        switch (opt) {
+            case 'm':
+                for (metric = 0; metric < PROF_METRICS; metric++)
+                    if (!strcmp(optarg, metric_names[metric]))
+                        break;
+                if (metric == PROF_METRICS) {
+                    fprintf(stderr, "Unknown metric '%s'\n", optarg);
+                    exit(PROFCMP_ERROR);
+                }
+                break;
+            case 't':
+                errno = 0;
+                percent = strtod(optarg, &end);
+                if (errno != 0 || *end || percent < 0) {
+                    fprintf(stderr, "Invalid threshold '%s'\n", optarg);
+                    exit(PROFCMP_ERROR);
+                }
+                break;
+            case 'c':
+                errno = 0;
+                min_cycles = strtoull(optarg, &end, 10);
+                if (errno != 0 || *end) {
+                    fprintf(stderr, "Invalid cycle count '%s'\n", optarg);
+                    exit(PROFCMP_ERROR);
+                }
+                break;
+            case 'h':
+                usage(argv0);
+                exit(PROFCMP_OK);
+                break;
+            default: /* '?' */
+                usage(argv0);
+                exit(PROFCMP_ERROR);
+        }
+    }
+
+    if (optind != argc - 2) {
+        usage(argv0);
+        exit(PROFCMP_ERROR);
+    }
+
+    if (prof_read(argv[optind], &old) || prof_read(argv[optind + 1], &new))
+        exit(PROFCMP_ERROR);
+
+    printf("%-32s %12s %12s %9s\n", metric_names[metric], "old", "new",
+            "change");
+
+    /* Both lists are sorted, so walk them side by side */
+    for (i = j = 0; i < old.len || j < new.len;) {
+        if (i == old.len)
+            cmp = 1;
+        else if (j == new.len)
+            cmp = -1;
+        else
+            cmp = strcmp(old.e[i].name, new.e[j].name);
+
+        if (cmp < 0) {
+            printf("%-32s %12llu %12s %9s\n", old.e[i].name,
+                    old.e[i].v[metric], "-", "gone");
+            i++;
+            continue;
+        } else if (cmp > 0) {
+            printf("%-32s %12s %12llu %9s\n", new.e[j].name, "-",
+                    new.e[j].v[metric], "new");
+            j++;
+            continue;
+        }
+
+        o = &old.e[i++];
+        n = &new.e[j++];
+        ov = o->v[metric];
+        nv = n->v[metric];
+
+        if (!o->calls || !n->calls) {
+            printf("%-32s %12llu %12llu %9s\n", o->name, ov, nv, "not run");
+            continue;
+        }
+
+        delta = ov ? ((double)nv - ov) * 100.0 / ov : (nv ? 100.0 : 0.0);
+        printf("%-32s %12llu %12llu %+8.1f%%", o->name, ov, nv, delta);
+
+        if (nv > ov && nv - ov >= min_cycles && delta > percent) {
+            printf("  SLOWER\n");
+            slower++;
+        } else {
+            printf("\n");
+        }
+    }
+
+    if (slower)
+        printf("%zu function%s got more than %.1f%% slower\n", slower,
+                slower == 1 ? "" : "s", percent);
+
+    free(old.e);
+    free(new.e);
+
+    return slower ? PROFCMP_SLOWER : PROFCMP_OK;
+}
@@ -0,0 +1,529 @@
+/*
+ * runner.c
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "df_run.h"
+
+/* How often we look for jobs that went over their wall clock limit */
+#define RUNNER_POLL_MS 100
+
+struct runner_job {
+    char *name;
+    char **args;
+    int args_len;
+    int lineno;
+
+    pid_t pid;
+    uint64_t start_usec;
+    int killed;
+    int result;
+};
+
+struct runner {
+    char *drumfish;
+    char *rundir;
+    long jobs;
+    long timeout;
+
+    struct runner_job *job;
+    size_t job_len;
+
+    /* Jobs before this one have been started */
+    size_t next;
+    size_t running;
+
+    char **extra;
+    int extra_len;
+
+    /* Finished jobs by their DF_RUN_* result */
+    size_t results[DF_RUN_CRASH + 1];
+};
+
+static volatile sig_atomic_t stop = 0;
+
+/* execv() wants mutable strings */
+static char opt_run[] = "--run";
+
+static const char *result_names[] = {
+    [DF_RUN_PASS] = "PASS",
+    [DF_RUN_ERROR] = "ERROR",
+    [DF_RUN_FAIL] = "FAIL",
+    [DF_RUN_TIMEOUT] = "TIMEOUT",
+    [DF_RUN_CRASH] = "CRASH",
+};
+
+static void
+handler(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static void
+usage(const char *argv0)
+{
+    fprintf(stderr,
+"Usage: %s [-b drumfish] [-d rundir] [-j jobs] [-t secs] "
+"jobfile [-- drumfish args]\n"
+"\n"
+"  -b drumfish  - drumfish binary to run for each job\n"
+"  -d rundir    - Directory for each job's log\n"
+"  -j jobs      - How many jobs run at once (default: one per CPU)\n"
+"  -t secs      - Kill jobs still running after 'secs' of wall clock\n"
+"                 time, they count as timed out\n"
+"\n"
+"Each non-empty line of the jobfile that doesn't start with '#' is one\n"
+"job: a name followed by the arguments to give 'drumfish --run'.\n"
+"Arguments are split on whitespace, use double quotes to keep one\n"
+"together and a backslash to quote the next character.\n"
+"\n"
+"Exits 0 only if every job passed.\n"
+"\n"
+"Example:\n"
+"  boot  -f fw.hex --expect '^READY' --max-time 2000\n"
+"  echo  -f fw.hex --run-input echo.in --expect \"^echo ok\" --fail-on "
+"ASSERT\n",
+argv0);
+}
+
+static uint64_t
+runner_now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Splits 'p' into arguments in place, returning the next one or NULL */
+static char *
+runner_next_arg(char **p)
+{
+    char *in = *p + strspn(*p, " \t");
+    char *out = in;
+    char *arg = in;
+    int quoted = 0;
+
+    if (!*in)
+        return NULL;
+
+    for (; *in; in++) {
+        if (*in == '\\' && in[1]) {
+            *out++ = *++in;
+        } else if (*in == '"') {
+            quoted = !quoted;
+        } else if (!quoted && (*in == ' ' || *in == '\t')) {
+            in++;
+            break;
+        } else {
+            *out++ = *in;
+        }
+    }
+
+    /* 'in' never trails 'out', so there's room for the terminator */
+    *out = '\0';
+    *p = in;
+
+    return arg;
+}
+
+static int
+runner_parse_job(struct runner_job *j, char *line, const char *file,
+        int lineno)
+{
+    char **tmp;
+    char *arg;
+
+    memset(j, 0, sizeof(*j));
+    j->lineno = lineno;
+
+    arg = runner_next_arg(&line);
+    if (!arg || strchr(arg, '/')) {
+        fprintf(stderr, "%s:%d: invalid job name\n", file, lineno);
+        return -1;
+    }
+
+    j->name = strdup(arg);
+    if (!j->name)
+        return -1;
+
+    while ((arg = runner_next_arg(&line))) {
+        tmp = realloc(j->args, sizeof(char *) * (j->args_len + 1));
+        if (!tmp)
+            return -1;
+        j->args = tmp;
+
+        j->args[j->args_len] = strdup(arg);
+        if (!j->args[j->args_len])
+            return -1;
+        j->args_len++;
+    }
+
+    return 0;
+}
+
+static int
+runner_parse(struct runner *r, const char *file)
+{
+    FILE *fp;
+    char *line = NULL;
+    size_t line_sz = 0;
+    struct runner_job *tmp;
+    char *p;
+    int lineno = 0;
+    int ret = -1;
+
+    fp = fopen(file, "r");
+    if (!fp) {
+        fprintf(stderr, "Unable to open jobfile '%s': %s\n",
+                file, strerror(errno));
+        return -1;
+    }
+
+    while (getline(&line, &line_sz, fp) != -1) {
+        lineno++;
+
+        /* Only whole line comments, patterns may well have a '#' */
+        p = line + strspn(line, " \t");
+        p[strcspn(p, "\r\n")] = '\0';
+        if (!*p || *p == '#')
+            continue;
+
+        tmp = realloc(r->job, sizeof(*tmp) * (r->job_len + 1));
+        if (!tmp) {
+            fprintf(stderr, "Failed to allocate memory for job list.\n");
+            goto cleanup;
+        }
+        r->job = tmp;
+
+        if (runner_parse_job(&r->job[r->job_len], p, file, lineno))
+            goto cleanup;
+        r->job_len++;
+    }
+
+    if (!r->job_len) {
+        fprintf(stderr, "Jobfile '%s' has no jobs in it.\n", file);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    free(line);
+    fclose(fp);
+
+    return ret;
+}
+
+static int
+runner_spawn(struct runner *r, struct runner_job *j)
+{
+    char **argv;
+    char *log_path = NULL;
+    sigset_t chld;
+    int argc = 0;
+    int i;
+    int fd;
+
+    if (asprintf(&log_path, "%s/%s.log", r->rundir, j->name) < 0) {
+        fprintf(stderr, "Failed to allocate memory for job paths.\n");
+        return -1;
+    }
+
+    argv = calloc(3 + j->args_len + r->extra_len, sizeof(char *));
+    if (!argv) {
+        free(log_path);
+        return -1;
+    }
+
+    argv[argc++] = r->drumfish;
+    argv[argc++] = opt_run;
+    for (i = 0; i < j->args_len; i++)
+        argv[argc++] = j->args[i];
+    for (i = 0; i < r->extra_len; i++)
+        argv[argc++] = r->extra[i];
+    argv[argc] = NULL;
+
+    j->pid = fork();
+    if (j->pid == -1) {
+        fprintf(stderr, "Unable to start job '%s': %s\n",
+                j->name, strerror(errno));
+        free(argv);
+        free(log_path);
+        return -1;
+    }
+
+    if (j->pid == 0) {
+        sigemptyset(&chld);
+        sigaddset(&chld, SIGCHLD);
+        sigprocmask(SIG_UNBLOCK, &chld, NULL);
+
+        fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (fd != -1) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+
+        fd = open("/dev/null", O_RDONLY);
+        if (fd != -1) {
+            dup2(fd, STDIN_FILENO);
+            close(fd);
+        }
+
+        execv(r->drumfish, argv);
+        fprintf(stderr, "Unable to run '%s': %s\n",
+                r->drumfish, strerror(errno));
+        _exit(DF_RUN_ERROR);
+    }
+
+    free(argv);
+    free(log_path);
+
+    j->start_usec = runner_now_usec();
+    r->running++;
+
+    return 0;
+}
+
+static void
+runner_finished(struct runner *r, struct runner_job *j, int status)
+{
+    uint64_t usec = runner_now_usec() - j->start_usec;
+
+    if (j->killed)
+        j->result = DF_RUN_TIMEOUT;
+    else if (WIFEXITED(status) && WEXITSTATUS(status) <= DF_RUN_CRASH)
+        j->result = WEXITSTATUS(status);
+    else if (WIFSIGNALED(status))
+        j->result = DF_RUN_CRASH;
+    else
+        j->result = DF_RUN_ERROR;
+
+    r->results[j->result]++;
+    r->running--;
+    j->pid = 0;
+
+    printf("%-7s %s (%llu.%03llus)", result_names[j->result], j->name,
+            (unsigned long long)(usec / 1000000),
+            (unsigned long long)(usec / 1000 % 1000));
+    if (j->result != DF_RUN_PASS)
+        printf(", see %s/%s.log", r->rundir, j->name);
+    printf("\n");
+    fflush(stdout);
+}
+
+static void
+runner_reap(struct runner *r, int options)
+{
+    pid_t pid;
+    int status;
+    size_t i;
+
+    while (r->running && (pid = waitpid(-1, &status, options)) > 0) {
+        for (i = 0; i < r->next; i++) {
+            if (r->job[i].pid == pid) {
+                runner_finished(r, &r->job[i], status);
+                break;
+            }
+        }
+    }
+}
+
+static void
+runner_kill_late(struct runner *r)
+{
+    uint64_t limit = r->timeout * 1000000ULL;
+    uint64_t now = runner_now_usec();
+    size_t i;
+
+    for (i = 0; i < r->next; i++) {
+        if (r->job[i].pid <= 0 || r->job[i].killed ||
+                now - r->job[i].start_usec < limit)
+            continue;
+
+        kill(r->job[i].pid, SIGKILL);
+        r->job[i].killed = 1;
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *argv0 = argv[0];
+    struct runner r;
+    struct sigaction act;
+    struct timespec ts = {
+        .tv_sec = RUNNER_POLL_MS / 1000,
+        .tv_nsec = (RUNNER_POLL_MS % 1000) * 1000000L,
+    };
+    sigset_t chld;
+    char exe[PATH_MAX];
+    ssize_t len;
+    uint64_t start;
+    uint64_t usec;
+    size_t i;
+    int opt;
+
+    memset(&r, 0, sizeof(r));
+
+    while ((opt = getopt(argc, argv, "b:d:j:t:h")) != -1) {
+        switch (opt) {
+            case 'b':
+                r.drumfish = strdup(optarg);
+                break;
+            case 'd':
+                r.rundir = strdup(optarg);
+                break;
+            case 'j':
+                r.jobs = strtol(optarg, NULL, 10);
+                if (r.jobs < 1) {
+                    fprintf(stderr, "Invalid job count '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                r.timeout = strtol(optarg, NULL, 10);
+                if (r.timeout < 1) {
+                    fprintf(stderr, "Invalid timeout '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'h':
+                usage(argv0);
+                exit(EXIT_SUCCESS);
+                break;
+            default: /* '?' */
+                usage(argv0);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind >= argc) {
+        usage(argv0);
+        exit(EXIT_FAILURE);
+    }
+
+    if (runner_parse(&r, argv[optind++]))
+        exit(EXIT_FAILURE);
+
+    /* Everything after the jobfile goes to every job */
+    r.extra = argv + optind;
+    r.extra_len = argc - optind;
+
+    /* By default run the drumfish sitting next to us */
+    if (!r.drumfish) {
+        len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+        if (len < 0) {
+            fprintf(stderr, "Unable to find drumfish, use '-b'.\n");
+            exit(EXIT_FAILURE);
+        }
+        exe[len] = '\0';
+        if (asprintf(&r.drumfish, "%s/drumfish", dirname(exe)) < 0)
+            exit(EXIT_FAILURE);
+    }
+
+    if (!r.rundir &&
+            asprintf(&r.rundir, "/tmp/drumfish-runner-%d", getpid()) < 0)
+        exit(EXIT_FAILURE);
+
+    if (mkdir(r.rundir, S_IRWXU | S_IRGRP | S_IXGRP) && errno != EEXIST) {
+        fprintf(stderr, "Unable to create '%s': %s\n",
+                r.rundir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (!r.jobs) {
+        r.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        if (r.jobs < 1)
+            r.jobs = 1;
+    }
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = handler;
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+
+    /* Children finishing wake us up through sigtimedwait() */
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, NULL);
+
+    printf("Running %zu jobs, %ld at a time, logs in %s\n",
+            r.job_len, r.jobs, r.rundir);
+    fflush(stdout);
+
+    start = runner_now_usec();
+    while (!stop && (r.next < r.job_len || r.running)) {
+        while (!stop && r.next < r.job_len && r.running < (size_t)r.jobs) {
+            if (runner_spawn(&r, &r.job[r.next]))
+                stop = 1;
+            else
+                r.next++;
+        }
+
+        sigtimedwait(&chld, NULL, &ts);
+        runner_reap(&r, WNOHANG);
+
+        if (r.timeout)
+            runner_kill_late(&r);
+    }
+
+    /* Take everything down with us */
+    for (i = 0; i < r.next; i++)
+        if (r.job[i].pid > 0)
+            kill(r.job[i].pid, SIGTERM);
+
+    runner_reap(&r, 0);
+
+    usec = runner_now_usec() - start;
+    printf("%zu passed, %zu failed, %zu timed out, %zu crashed, %zu errors"
+            " in %llu.%03llus", r.results[DF_RUN_PASS],
+            r.results[DF_RUN_FAIL], r.results[DF_RUN_TIMEOUT],
+            r.results[DF_RUN_CRASH], r.results[DF_RUN_ERROR],
+            (unsigned long long)(usec / 1000000),
+            (unsigned long long)(usec / 1000 % 1000));
+    if (r.next < r.job_len)
+        printf(", %zu never ran", r.job_len - r.next);
+    printf("\n");
+
+    return r.results[DF_RUN_PASS] == r.job_len ? EXIT_SUCCESS : EXIT_FAILURE;
+}
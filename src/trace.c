@@ -0,0 +1,446 @@
+/*
+ * trace.c
+ *
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "df_blackbox.h"
+#include "df_trace.h"
+
+struct trace_file {
+    uint8_t *map;
+    size_t len;
+    const struct df_trace_hdr *hdr;
+
+    /* Either from the file's index or found by walking the chunks */
+    struct df_trace_index *index;
+    size_t count;
+};
+
+static void
+usage(const char *argv0)
+{
+    fprintf(stderr,
+"Usage: %s [-s] [-f cycle] [-t cycle] trace|dump\n"
+"\n"
+"  -s           - Only print a summary of the trace\n"
+"  -f cycle     - Start decoding at 'cycle'\n"
+"  -t cycle     - Stop decoding after 'cycle'\n"
+"\n"
+"Prints one line per record: the cycle count, then either the flash\n"
+"byte address of the instruction executed, the data address loaded\n"
+"from (LD) or stored to (ST) and the byte, or the IO register written\n"
+"and its new value.\n"
+"\n"
+"Post-mortem dumps (--blackbox) print the same way, with the CPU's\n"
+"registers before and a hexdump of its data space after the records.\n",
+argv0);
+}
+
+static int
+trace_open(struct trace_file *t, const char *path)
+{
+    const struct df_trace_footer *footer;
+    const struct df_trace_chunk *chunk;
+    struct df_trace_index *index;
+    struct stat st;
+    size_t alloc = 0;
+    size_t off;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*t->hdr)) {
+        fprintf(stderr, "'%s' is not a drumfish trace.\n", path);
+        close(fd);
+        return -1;
+    }
+
+    t->len = st.st_size;
+    t->map = mmap(NULL, t->len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (t->map == MAP_FAILED) {
+        fprintf(stderr, "Unable to map '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    /* Post-mortem dumps are read by blackbox_print() instead */
+    if (*(const uint32_t *)t->map == DF_BLACKBOX_MAGIC)
+        return 1;
+
+    t->hdr = (const struct df_trace_hdr *)t->map;
+    if (t->hdr->magic != DF_TRACE_MAGIC ||
+            t->hdr->version < 1 || t->hdr->version > DF_TRACE_VERSION) {
+        fprintf(stderr, "'%s' is not a drumfish trace.\n", path);
+        return -1;
+    }
+
+    /* A cleanly closed trace tells us where all the chunks are */
+    if (t->len >= sizeof(*t->hdr) + sizeof(*footer)) {
+        footer = (const struct df_trace_footer *)(t->map + t->len -
+                sizeof(*footer));
+        if (footer->magic == DF_TRACE_INDEX_MAGIC &&
+                footer->index_offset + footer->count * sizeof(*index) +
+                sizeof(*footer) == t->len) {
+            t->index = malloc(footer->count * sizeof(*index) + 1);
+            if (!t->index)
+                return -1;
+            memcpy(t->index, t->map + footer->index_offset,
+                    footer->count * sizeof(*index));
+            t->count = footer->count;
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "'%s' has no index, it was probably cut short. "
+            "Walking the chunks instead.\n", path);
+
+    for (off = sizeof(*t->hdr); off + sizeof(*chunk) <= t->len;
+            off += sizeof(*chunk) + chunk->len) {
+        chunk = (const struct df_trace_chunk *)(t->map + off);
+        if (chunk->magic != DF_TRACE_CHUNK_MAGIC ||
+                off + sizeof(*chunk) + chunk->len > t->len)
+            break;
+
+        if (t->count == alloc) {
+            alloc = alloc ? alloc * 2 : 1024;
+            index = realloc(t->index, alloc * sizeof(*index));
+            if (!index)
+                return -1;
+            t->index = index;
+        }
+
+        t->index[t->count].offset = off;
+        t->index[t->count].first_cycle = chunk->first_cycle;
+        t->count++;
+    }
+
+    return 0;
+}
+
+static int
+blackbox_print(const struct trace_file *t, uint64_t from, uint64_t to,
+        int summary)
+{
+    static const char sreg_names[] = "CZNVSHTI";
+    const struct df_blackbox_hdr *hdr;
+    const struct df_blackbox_rec *rec;
+    const uint8_t *data;
+    char sreg[9];
+    uint32_t i;
+    int skipped = 0;
+    int j;
+
+    hdr = (const struct df_blackbox_hdr *)t->map;
+    rec = (const struct df_blackbox_rec *)(hdr + 1);
+    if (t->len < sizeof(*hdr) || hdr->version != DF_BLACKBOX_VERSION ||
+            sizeof(*hdr) + (size_t)hdr->records * sizeof(*rec) +
+            hdr->data_len != t->len) {
+        fprintf(stderr, "Post-mortem dump is corrupt.\n");
+        return -1;
+    }
+    data = (const uint8_t *)(rec + hdr->records);
+
+    for (j = 0; j < 8; j++)
+        sreg[7 - j] = hdr->sreg & (1 << j) ? sreg_names[j] : '-';
+    sreg[8] = '\0';
+
+    printf("Reason:      %.*s\n", (int)sizeof(hdr->reason), hdr->reason);
+    printf("Frequency:   %" PRIu32 " Hz\n", hdr->frequency);
+    printf("Cycle:       %" PRIu64 "\n", hdr->cycle);
+    printf("PC:          %05" PRIx32 "\n", hdr->pc);
+    printf("SP:          0x%04x\n", hdr->sp);
+    printf("SREG:        %s\n", sreg);
+    printf("Records:     %" PRIu32 "\n", hdr->records);
+    if (hdr->records)
+        printf("Cycles:      %" PRIu64 " - %" PRIu64 "\n",
+                rec[0].cycle, rec[hdr->records - 1].cycle);
+
+    if (summary)
+        return 0;
+
+    for (j = 0; j < 32 && (uint32_t)j < hdr->data_len; j++)
+        printf("%sr%-2d %02x", j % 8 ? "  " : "\n", j, data[j]);
+    printf("\n\n");
+
+    for (i = 0; i < hdr->records; i++) {
+        if (rec[i].cycle < from)
+            continue;
+        if (rec[i].cycle > to)
+            break;
+
+        switch (rec[i].type) {
+            case DF_BLACKBOX_JUMP:
+                printf("%12" PRIu64 "  %05" PRIx32 " -> %05x\n",
+                        rec[i].cycle, rec[i].pc, rec[i].addr << 1);
+                break;
+            case DF_BLACKBOX_IOW:
+                printf("%12" PRIu64 "  %05" PRIx32 "  IO 0x%03x <- 0x%02x\n",
+                        rec[i].cycle, rec[i].pc, rec[i].addr, rec[i].val);
+                break;
+            case DF_BLACKBOX_IRQ_ENTER:
+                printf("%12" PRIu64 "  %05" PRIx32 "  IRQ %u enter\n",
+                        rec[i].cycle, rec[i].pc, rec[i].val);
+                break;
+            case DF_BLACKBOX_IRQ_EXIT:
+                printf("%12" PRIu64 "  %05" PRIx32 "  IRQ %u exit\n",
+                        rec[i].cycle, rec[i].pc, rec[i].val);
+                break;
+            default:
+                printf("%12" PRIu64 "  %05" PRIx32 "  unknown record %u\n",
+                        rec[i].cycle, rec[i].pc, rec[i].type);
+                break;
+        }
+    }
+
+    /* Runs of zeroes fold into a '*', like hexdump does */
+    printf("\n");
+    for (i = 0; i < hdr->data_len; i += 16) {
+        for (j = 0; j < 16 && i + j < hdr->data_len && !data[i + j]; j++)
+            ;
+        if (j == 16) {
+            if (!skipped)
+                printf("*\n");
+            skipped = 1;
+            continue;
+        }
+        skipped = 0;
+
+        printf("%04" PRIx32 " ", i);
+        for (j = 0; j < 16 && i + j < hdr->data_len; j++)
+            printf(" %02x", data[i + j]);
+        printf("\n");
+    }
+
+    return 0;
+}
+
+/* Returns the number of records decoded or -1 if the chunk is corrupt.
+ * Anything ending past 'to' stops us and sets '*done'.
+ */
+static long
+trace_decode_chunk(const struct trace_file *t, size_t idx, uint64_t from,
+        uint64_t to, int quiet, uint64_t *last_cycle, int *done)
+{
+    const struct df_trace_chunk *chunk;
+    const uint8_t *p;
+    const uint8_t *end;
+    uint64_t cycle;
+    uint64_t v;
+    uint32_t pc;
+    uint32_t pcd;
+    uint32_t cyd;
+    uint64_t addr;
+    int store;
+    long n = 0;
+
+    chunk = (const struct df_trace_chunk *)(t->map + t->index[idx].offset);
+    p = (const uint8_t *)(chunk + 1);
+    end = p + chunk->len;
+    pc = chunk->first_pc;
+    cycle = chunk->first_cycle;
+
+    while (p && p < end) {
+        switch (DF_TRACE_TYPE(*p)) {
+            case DF_TRACE_INSN:
+                pcd = *p >> 5;
+                cyd = (*p >> 2) & 0x7;
+                p++;
+
+                if (pcd == DF_TRACE_ESCAPE) {
+                    p = df_trace_get_varint(p, end, &v);
+                    pc += df_trace_unzigzag(v) * 2;
+                } else {
+                    pc += (pcd + 1) * 2;
+                }
+
+                if (p && cyd == DF_TRACE_ESCAPE) {
+                    p = df_trace_get_varint(p, end, &v);
+                    cycle += v;
+                } else {
+                    cycle += cyd;
+                }
+
+                if (p && !quiet && cycle >= from && cycle <= to)
+                    printf("%12" PRIu64 "  %05x\n", cycle, pc);
+                break;
+
+            case DF_TRACE_MEM:
+                store = *p & DF_TRACE_MEM_STORE;
+                p = df_trace_get_varint(p + 1, end, &v);
+                if (p)
+                    p = df_trace_get_varint(p, end, &addr);
+                if (!p || p >= end) {
+                    p = NULL;
+                    break;
+                }
+                cycle += v;
+
+                if (!quiet && cycle >= from && cycle <= to)
+                    printf("%12" PRIu64 "  %s 0x%04" PRIx64 " %s 0x%02x\n",
+                            cycle, store ? "ST" : "LD", addr,
+                            store ? "<-" : "->", *p);
+                p++;
+                break;
+
+            case DF_TRACE_IOW:
+                p = df_trace_get_varint(p + 1, end, &v);
+                if (p)
+                    p = df_trace_get_varint(p, end, &addr);
+                if (!p || p >= end) {
+                    p = NULL;
+                    break;
+                }
+                cycle += v;
+
+                if (!quiet && cycle >= from && cycle <= to)
+                    printf("%12" PRIu64 "  IO 0x%03" PRIx64 " <- 0x%02x\n",
+                            cycle, addr, *p);
+                p++;
+                break;
+
+            default:
+                p = NULL;
+                break;
+        }
+
+        if (!p)
+            return -1;
+
+        n++;
+        if (cycle > to) {
+            *done = 1;
+            break;
+        }
+    }
+
+    *last_cycle = cycle;
+
+    return n;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *argv0 = argv[0];
+    struct trace_file t;
+    uint64_t from = 0;
+    uint64_t to = UINT64_MAX;
+    uint64_t last_cycle = 0;
+    uint64_t records = 0;
+    size_t lo, hi, mid;
+    size_t i;
+    int summary = 0;
+    int done = 0;
+    long n;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "sf:t:h")) != -1) {
+        switch (opt) {
+            case 's':
+                summary = 1;
+                break;
+            case 'f':
+                from = strtoull(optarg, NULL, 0);
+                break;
+            case 't':
+                to = strtoull(optarg, NULL, 0);
+                break;
+            case 'h':
+                usage(argv0);
+                exit(EXIT_SUCCESS);
+                break;
+            default: /* '?' */
+                usage(argv0);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv0);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&t, 0, sizeof(t));
+    n = trace_open(&t, argv[optind]);
+    if (n < 0)
+        exit(EXIT_FAILURE);
+
+    if (n > 0) {
+        n = blackbox_print(&t, from, to, summary);
+        munmap(t.map, t.len);
+        return n ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    /* Skip straight to the last chunk starting at or before 'from' */
+    lo = 0;
+    hi = t.count;
+    while (!summary && hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (t.index[mid].first_cycle <= from)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    for (i = summary ? 0 : lo; i < t.count && !done; i++) {
+        n = trace_decode_chunk(&t, i, from, to, summary, &last_cycle, &done);
+        if (n < 0) {
+            fprintf(stderr, "Chunk %zu is corrupt, stopping.\n", i);
+            break;
+        }
+        records += n;
+    }
+
+    if (summary) {
+        printf("Frequency:   %" PRIu32 " Hz\n", t.hdr->frequency);
+        printf("Contents:    %s\n", t.hdr->flags & DF_TRACE_FLAG_IO_ONLY ?
+                "IO writes" : "instructions, data accesses and IO writes");
+        printf("Chunks:      %zu\n", t.count);
+        printf("Records:     %" PRIu64 "\n", records);
+        if (t.count)
+            printf("Cycles:      %" PRIu64 " - %" PRIu64 "\n",
+                    t.index[0].first_cycle, last_cycle);
+        if (records)
+            printf("Bytes/rec:   %.2f\n", (double)t.len / records);
+    }
+
+    free(t.index);
+    munmap(t.map, t.len);
+
+    return EXIT_SUCCESS;
+}
@@ -21,15 +21,15 @@
 	along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/epoll.h>
 #include <sys/types.h>
-#include <stdlib.h>
-#include <poll.h>
 #include <pthread.h>
+#include <stdlib.h>
+#include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
-#include <signal.h>
 #ifdef __APPLE__
 #include <util.h>
 #else
@@ -41,6 +41,7 @@
 #include "sim_hex.h"
 
 #include "df_log.h"
+#include "df_mem.h"
 
 DEFINE_FIFO(uint8_t, uart_pty_fifo);
 
@@ -53,6 +54,20 @@ DEFINE_FIFO(uint8_t, uart_pty_fifo);
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 #endif
 
+/* A pty takes the kernel tens of microseconds to set up, which is most
+ * of bringing up a big batch. Past UART_PTY_BATCH of them, open them on
+ * up to UART_PTY_OPENERS threads at once.
+ */
+#define UART_PTY_OPENERS 4
+#define UART_PTY_BATCH 8
+
+struct uart_pty_batch {
+    uart_pty_t **ports;
+    size_t len;
+    size_t next;
+    int failed;
+};
+
 
 /*
  * called when a byte is send via the uart on the AVR
@@ -68,7 +83,13 @@ uart_pty_in_hook(
     uart_pty_t *p = (uart_pty_t*)param;
     df_log_msg(DF_LOG_DEBUG, "AVR UART%c -> out fifo (towards pty) %02x\n",
             p->uart, value);
-    uart_pty_fifo_write(&p->port.in, value);
+
+    /* Headless, whoever wants the output hooks the UART directly */
+    if (!p->port)
+        return;
+
+    uart_pty_fifo_write(&p->port->in, value);
+    df_reactor_kick(&p->port->src);
 }
 
 // try to empty our fifo, the uart_pty_xoff_hook() will be called when
@@ -78,12 +99,27 @@ uart_pty_flush_incoming(uart_pty_t *p)
 {
     uint8_t byte;
 
-    while (p->xon && !uart_pty_fifo_isempty(&p->port.out)) {
-        byte = uart_pty_fifo_read(&p->port.out);
+    while (p->xon && p->port && !uart_pty_fifo_isempty(&p->port->out)) {
+        byte = uart_pty_fifo_read(&p->port->out);
         df_log_msg(DF_LOG_DEBUG, "uart_pty_flush_incoming send r %03d:%02x\n",
-                p->port.out.read, byte);
+                p->port->out.read, byte);
         avr_raise_irq(p->irq + IRQ_UART_PTY_BYTE_OUT, byte);
     }
+
+    while (p->xon && p->feed_len) {
+        p->feed_len--;
+        avr_raise_irq(p->irq + IRQ_UART_PTY_BYTE_OUT, *p->feed++);
+    }
+
+    /* The reactor is sitting on data it couldn't fit, let it know
+     * there's room now.
+     */
+    if (!p->port)
+        return;
+
+    __sync_synchronize();
+    if (p->port->rx_stalled && !uart_pty_fifo_isfull(&p->port->out))
+        df_reactor_kick(&p->port->src);
 }
 
 /*
@@ -122,87 +158,117 @@ uart_pty_xoff_hook(struct avr_irq_t *irq, uint32_t value, void *param)
     p->xon = 0;
 }
 
-static void *
-uart_pty_thread(void *param)
+/*
+ * Push whatever we've read from the pty towards the AVR. Returns 0 if
+ * the 'out' fifo filled up before we could hand everything over.
+ */
+static int
+uart_pty_fill_outgoing(uart_pty_t *p)
 {
-	uart_pty_t *p = (uart_pty_t*)param;
-    int ret;
-    sigset_t set;
+    while (p->port->buffer_done < p->port->buffer_len) {
+        if (uart_pty_fifo_isfull(&p->port->out))
+            return 0;
 
-    /* Setup our poll info. We'll always be checking the tty */
-    struct pollfd pfd = {
-        .fd = p->port.s,
-    };
+        int idx = p->port->buffer_done++;
+        uart_pty_fifo_write(&p->port->out, p->port->buffer[idx]);
 
-    sigfillset(&set);
-    sigprocmask(SIG_SETMASK, &set, NULL);
+        df_log_msg(DF_LOG_DEBUG, "w %3d:%02x\n", p->port->out.write,
+                p->port->buffer[idx]);
+    }
 
-	while (1) {
-        /* Reset the events we care about to just HUP */
-        pfd.events = POLLHUP;
+    return 1;
+}
 
-        // read more only if buffer was empty
-        if (p->port.buffer_len == p->port.buffer_done) {
-            /* listen for if there's data to read */
-            pfd.events |= POLLIN;
+/*
+ * Write out as much of the 'in' fifo as the pty will take without
+ * blocking. Anything it won't take stays staged in 'tx' until the next
+ * EPOLLOUT.
+ */
+static void
+uart_pty_drain_incoming(uart_pty_t *p)
+{
+    ssize_t r;
+
+    for (;;) {
+        if (p->port->tx_done == p->port->tx_len) {
+            p->port->tx_len = 0;
+            p->port->tx_done = 0;
+            while (!uart_pty_fifo_isempty(&p->port->in) &&
+                    p->port->tx_len < sizeof(p->port->tx))
+                p->port->tx[p->port->tx_len++] =
+                    uart_pty_fifo_read(&p->port->in);
+
+            if (!p->port->tx_len)
+                return;
         }
 
-        /* If we have data in our outbound fifo, check that we can write */
-        if (!uart_pty_fifo_isempty(&p->port.in)) {
-            pfd.events |= POLLOUT;
-		}
+        r = write(p->port->s, p->port->tx + p->port->tx_done,
+                p->port->tx_len - p->port->tx_done);
+        if (r <= 0)
+            return;
 
-        /* Something short but not too short */
-        ret = poll(&pfd, 1, 1);
+        TRACE(hdump("pty send", p->port->tx + p->port->tx_done, r);)
+        p->port->tx_done += r;
+    }
+}
+
+/*
+ * Called from the I/O reactor thread whenever the pty is ready or the
+ * emulation side has kicked us.
+ */
+static void
+uart_pty_event(struct df_reactor_src *src, uint32_t revents)
+{
+    uart_pty_t *p = (uart_pty_t *)src->opaque;
+    uint32_t events = 0;
+    ssize_t r;
 
-		if (!ret)
-			continue;
-		if (ret < 0)
-			break;
+    /* If no one is connected to the UART, we don't want to
+     * cache data.
+     */
+    if (revents & (EPOLLHUP | EPOLLERR) || src->parked) {
+        while (!uart_pty_fifo_isempty(&p->port->in))
+            uart_pty_fifo_read(&p->port->in);
+        p->port->tx_len = 0;
+        p->port->tx_done = 0;
+
+        df_reactor_park(src);
+        return;
+    }
 
-        /* If no one is connected to the UART, we don't want to
-         * cache data.
-         */
-        if (pfd.revents & POLLHUP) {
-            uart_pty_fifo_read(&p->port.in);
+    if (revents & EPOLLIN) {
+        r = read(p->port->s, p->port->buffer, sizeof(p->port->buffer) - 1);
+        if (r > 0) {
+            p->port->buffer_len = r;
+            p->port->buffer_done = 0;
+            TRACE(hdump("pty recv", p->port->buffer, r);)
         }
+    }
 
-        if (pfd.revents & POLLIN) {
-            ssize_t r = read(p->port.s, p->port.buffer,
-                    sizeof(p->port.buffer) - 1);
-            p->port.buffer_len = r;
-            p->port.buffer_done = 0;
-            TRACE(hdump("pty recv", p->port.buffer, r);)
-        }
+    // write them in fifo
+    p->port->rx_stalled = 0;
+    if (!uart_pty_fill_outgoing(p)) {
+        p->port->rx_stalled = 1;
+        __sync_synchronize();
+        /* The AVR may have made room before it could see the flag */
+        if (uart_pty_fill_outgoing(p))
+            p->port->rx_stalled = 0;
+    }
 
-        // write them in fifo
-        while (p->port.buffer_done < p->port.buffer_len &&
-                !uart_pty_fifo_isfull(&p->port.out)) {
-            int idx = p->port.buffer_done++;
-            uart_pty_fifo_write(&p->port.out, p->port.buffer[idx]);
+    /* Can we write data to the TTY */
+    if (revents & (EPOLLOUT | DF_REACTOR_KICK))
+        uart_pty_drain_incoming(p);
 
-            df_log_msg(DF_LOG_DEBUG, "w %3d:%02x\n", p->port.out.write,
-                    p->port.buffer[idx]);
-        }
+    // read more only if buffer was empty
+    if (p->port->buffer_len == p->port->buffer_done)
+        events |= EPOLLIN;
 
-        /* Can we write data to the TTY */
-        if (pfd.revents & POLLOUT) {
-            uint8_t buffer[512];
-            // write them in fifo
-            uint8_t *dst = buffer;
-            while (!uart_pty_fifo_isempty(&p->port.in) &&
-                    dst < (buffer + sizeof(buffer)))
-                *dst++ = uart_pty_fifo_read(&p->port.in);
-            size_t len = dst - buffer;
-            TRACE(size_t r =) write(p->port.s, buffer, len);
-            TRACE(hdump("pty send", buffer, r);)
-		}
-		/* DO NOT call this, this create a concurency issue with the
-		 * FIFO that can't be solved cleanly with a memory barrier
-			uart_pty_flush_incoming(p);
-		  */
-	}
-	return NULL;
+    /* If we still have data headed out, wait until we can write */
+    if (p->port->tx_done != p->port->tx_len ||
+            !uart_pty_fifo_isempty(&p->port->in))
+        events |= EPOLLOUT;
+
+    df_reactor_set_events(src, events);
 }
 
 static const char * irq_names[IRQ_UART_PTY_COUNT] = {
@@ -210,28 +276,23 @@ static const char * irq_names[IRQ_UART_PTY_COUNT] = {
 	[IRQ_UART_PTY_BYTE_OUT] = "8>uart_pty.out",
 };
 
-int
-uart_pty_init(struct avr_t *avr, uart_pty_t *p, char uart)
+static int
+uart_pty_open(uart_pty_t *p)
 {
     int m, s;
     struct termios tio;
-    int ret;
-
-    /* Clear our structure */
-	memset(p, 0, sizeof(*p));
-    p->port.s = -1;
 
-    /* Store the 'name' of the UART we are working with */
-    p->uart = uart;
-
-	p->avr = avr;
-	p->irq = avr_alloc_irq(&avr->irq_pool, 0, IRQ_UART_PTY_COUNT, irq_names);
-	avr_irq_register_notify(p->irq + IRQ_UART_PTY_BYTE_IN, uart_pty_in_hook, p);
+    p->port = calloc(1, sizeof(*p->port));
+    if (!p->port) {
+        fprintf(stderr, "Failed to allocate memory for UART%c.\n", p->uart);
+        return -1;
+    }
+    p->port->s = -1;
 
-    if (openpty(&m, &s, p->port.slavename, NULL, NULL) < 0) {
+    if (openpty(&m, &s, p->port->slavename, NULL, NULL) < 0) {
         fprintf(stderr, "Unable to create pty for UART%c: %s\n",
                 p->uart, strerror(errno));
-        return -1;
+        goto err_port;
     }
 
     if (tcgetattr(m, &tio) < 0) {
@@ -249,8 +310,17 @@ uart_pty_init(struct avr_t *avr, uart_pty_t *p, char uart)
         goto err;
     }
 
+    /* The reactor services every UART in the process from one thread,
+     * so it must never block on any of them.
+     */
+    if (fcntl(m, F_SETFL, fcntl(m, F_GETFL) | O_NONBLOCK) < 0) {
+        fprintf(stderr, "Failed to make UART%c non-blocking: %s\n",
+                p->uart, strerror(errno));
+        goto err;
+    }
+
     /* The master is the socket we care about and want to use */
-    p->port.s = m;
+    p->port->s = m;
 
     /* We close the slave side so we can watch when someone connects
      * so that we aren't buffering up the bytes before a connection and
@@ -259,10 +329,13 @@ uart_pty_init(struct avr_t *avr, uart_pty_t *p, char uart)
      */
     close(s);
 
-	ret = pthread_create(&p->thread, NULL, uart_pty_thread, p);
-    if (ret) {
-        fprintf(stderr, "Failed to create thread for UART%c IRQ handling: %s\n",
-                p->uart, strerror(ret));
+    p->port->src.fd = m;
+    p->port->src.events = EPOLLIN;
+    p->port->src.cb = uart_pty_event;
+    p->port->src.opaque = p;
+    if (df_reactor_add(&p->port->src)) {
+        fprintf(stderr, "Failed to hook up UART%c to the I/O reactor\n",
+                p->uart);
         goto err;
     }
 
@@ -270,35 +343,144 @@ uart_pty_init(struct avr_t *avr, uart_pty_t *p, char uart)
 
 err:
     close(m);
+err_port:
+    free(p->port);
+    p->port = NULL;
 
     return -1;
 }
 
+/* Board 0 keeps the name single board runs always had */
+static void
+uart_pty_link_path(const uart_pty_t *p, char *buf, size_t len)
+{
+    if (p->board)
+        snprintf(buf, len, "/tmp/drumfish-%d-%d-uart%c", getpid(),
+                p->board, p->uart);
+    else
+        snprintf(buf, len, "/tmp/drumfish-%d-uart%c", getpid(), p->uart);
+}
+
+static void
+uart_pty_link(uart_pty_t *p)
+{
+    char uart_link[1024];
+
+    /* Build the symlink path for the UART */
+    uart_pty_link_path(p, uart_link, sizeof(uart_link));
+    /* Unconditionally attempt to remove the old one */
+    unlink(uart_link);
+
+    if (symlink(p->port->slavename, uart_link) != 0) {
+        fprintf(stderr, "UART%c: Can't create symlink to %s from %s: %s",
+                p->uart, uart_link, p->port->slavename, strerror(errno));
+    } else {
+        printf("UART%c available at %s\n", p->uart, uart_link);
+    }
+}
+
+int
+uart_pty_init_headless(struct avr_t *avr, uart_pty_t *p, int board,
+        char uart)
+{
+    /* Clear our structure */
+	memset(p, 0, sizeof(*p));
+
+    /* Store the 'name' of the UART we are working with */
+    p->board = board;
+    p->uart = uart;
+
+	p->avr = avr;
+	p->irq = avr_alloc_irq(&avr->irq_pool, 0, IRQ_UART_PTY_COUNT, irq_names);
+	avr_irq_register_notify(p->irq + IRQ_UART_PTY_BYTE_IN, uart_pty_in_hook, p);
+
+    return 0;
+}
+
+static void *
+uart_pty_opener(void *param)
+{
+    struct uart_pty_batch *b = (struct uart_pty_batch *)param;
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->len)
+        if (uart_pty_open(b->ports[i]))
+            __atomic_store_n(&b->failed, 1, __ATOMIC_RELAXED);
+
+    return NULL;
+}
+
+int
+uart_pty_start(uart_pty_t **ports, size_t len)
+{
+    struct uart_pty_batch b = { ports, len, 0, 0 };
+    pthread_t threads[UART_PTY_OPENERS - 1];
+    size_t n;
+    size_t i;
+
+    /* Fewer threads is only slower, so don't give up over them */
+    for (n = 0; n < UART_PTY_OPENERS - 1 && (n + 1) * UART_PTY_BATCH < len;
+            n++)
+        if (df_mem_thread_create(&threads[n], uart_pty_opener, &b))
+            break;
+
+    uart_pty_opener(&b);
+
+    for (i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+
+    if (b.failed)
+        return -1;
+
+    /* Every board has links of its own, but the order they're announced
+     * in is the order of 'ports'.
+     */
+    for (i = 0; i < len; i++)
+        uart_pty_link(ports[i]);
+
+    return 0;
+}
+
+int
+uart_pty_reopen(uart_pty_t *p)
+{
+    /* Headless in our parent, so headless in us */
+    if (!p->port)
+        return 0;
+
+    /* After a fork() this is only our copy of our parent's pty, so
+     * leave the pty itself and its symlink alone.
+     */
+    close(p->port->s);
+    free(p->port);
+    p->port = NULL;
+
+    if (uart_pty_open(p))
+        return -1;
+
+    uart_pty_link(p);
+
+    return 0;
+}
+
 void
 uart_pty_stop(uart_pty_t *p)
 {
-	void *ret;
     char uart_link[1024];
-    int join_status;
 
     df_log_msg(DF_LOG_INFO, "Shutting down UART%c\n", p->uart);
 
+    if (!p->port)
+        return;
+
     /* Remove our symlink, but don't care if its already gone */
-    snprintf(uart_link, sizeof(uart_link), "/tmp/drumfish-%d-uart%c",
-            getpid(), p->uart);
+    uart_pty_link_path(p, uart_link, sizeof(uart_link));
     unlink(uart_link);
 
-	pthread_cancel(p->thread);
-
-    if (p->port.s != -1) {
-        close(p->port.s);
-        p->port.s = -1;
-    }
-
-	if ((join_status = pthread_join(p->thread, &ret))) {
-        df_log_msg(DF_LOG_ERR, "Shutting down UART%c failed: %s\n",
-                p->uart, strerror(join_status));
-    }
+    df_reactor_del(&p->port->src);
+    close(p->port->s);
+    free(p->port);
+    p->port = NULL;
 }
 
 void
@@ -306,7 +488,6 @@ uart_pty_connect(uart_pty_t *p)
 {
 	uint32_t f = 0;
     avr_irq_t *src, *dst, *xon, *xoff;
-    char uart_link[1024];
 
     /* Disable stdio echoing of the UART since we are transmitting
      * binary data. (This feature should really be an opt-in rather
@@ -335,17 +516,26 @@ uart_pty_connect(uart_pty_t *p)
 	if (xoff)
 		avr_irq_register_notify(xoff, uart_pty_xoff_hook, p);
 
-    /* Build the symlink path for the UART */
-    snprintf(uart_link, sizeof(uart_link), "/tmp/drumfish-%d-uart%c",
-            getpid(), p->uart);
-    /* Unconditionally attempt to remove the old one */
-    unlink(uart_link);
+    if (p->port)
+        uart_pty_link(p);
+}
 
-    if (symlink(p->port.slavename, uart_link) != 0) {
-        fprintf(stderr, "UART%c: Can't create symlink to %s from %s: %s",
-                p->uart, uart_link, p->port.slavename, strerror(errno));
-    } else {
-        printf("UART%c available at %s\n", p->uart, uart_link);
-    }
+
+void
+uart_pty_rx_reset(uart_pty_t *p)
+{
+    if (p->port)
+        uart_pty_fifo_reset(&p->port->out);
+    p->feed = NULL;
+    p->feed_len = 0;
+    p->xon = 1;
 }
 
+void
+uart_pty_feed(uart_pty_t *p, const uint8_t *buf, size_t len)
+{
+    p->feed = buf;
+    p->feed_len = len;
+
+    uart_pty_flush_incoming(p);
+}
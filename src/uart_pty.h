@@ -25,10 +25,11 @@
 #ifndef __UART_PTY_H___
 #define __UART_PTY_H___
 
-#include <pthread.h>
 #include "sim_irq.h"
 #include "fifo_declare.h"
 
+#include "df_reactor.h"
+
 enum {
 	IRQ_UART_PTY_BYTE_IN = 0,
 	IRQ_UART_PTY_BYTE_OUT,
@@ -45,23 +46,53 @@ typedef struct uart_pty_port_t {
 	uint8_t		buffer[512];
 	size_t		buffer_len;
     size_t      buffer_done;
+    uint8_t     tx[64];         // bytes popped from 'in' but not yet written
+    size_t      tx_len;
+    size_t      tx_done;
+    volatile int rx_stalled;    // 'out' was full, kick us when it drains
+    struct df_reactor_src src;
 } uart_pty_port_t;
 
 typedef struct uart_pty_t {
 	avr_irq_t *	irq;		// irq list
 	struct avr_t *avr;		// keep it around so we can pause it
 
-	pthread_t	thread;
 	int			xon;
+    int         board;          // which of a --boards batch we belong to
     char        uart;
 
-    uart_pty_port_t port;
+    const uint8_t *feed;        // bytes handed to us by uart_pty_feed()
+    size_t      feed_len;
+
+    /* Only there while we have a pty, headless UARTs go without */
+    uart_pty_port_t *port;
 } uart_pty_t;
 
-int uart_pty_init( struct avr_t *avr, uart_pty_t *b, char uart);
+/* Without a pty, nothing the AVR sends goes anywhere unless someone
+ * hooks the UART's output themselves. uart_pty_start() gives it one.
+ */
+int uart_pty_init_headless(struct avr_t *avr, uart_pty_t *p, int board,
+        char uart);
+
+/* Opens a pty for each of 'ports', several at a time, and links them
+ * under /tmp: /tmp/drumfish-<pid>-uartN for board 0 and
+ * /tmp/drumfish-<pid>-<board>-uartN for the rest of a batch. Boards can
+ * start running once it returns.
+ */
+int uart_pty_start(uart_pty_t **ports, size_t len);
+
+int uart_pty_reopen(uart_pty_t *p);
 
 void uart_pty_stop(uart_pty_t *p);
 
 void uart_pty_connect(uart_pty_t *p);
 
+/* The AVR's receiver was reset, forget anything queued up for it */
+void uart_pty_rx_reset(uart_pty_t *p);
+
+/* Hand 'buf' to the AVR as if it arrived on the pty, behind anything
+ * already queued. 'buf' must stay around until it's been consumed.
+ */
+void uart_pty_feed(uart_pty_t *p, const uint8_t *buf, size_t len);
+
 #endif /* __UART_PTY_H___ */